@@ -0,0 +1,153 @@
+#!/usr/bin/env python3
+#
+# emcdns-replay.py:  Replay a captured query stream against a running EmcDns server.
+#
+# Copyright (c) 2019 The Emercoin developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#
+
+import argparse
+import random
+import select
+import socket
+import struct
+import sys
+import time
+
+QTYPES = {
+    'A': 1, 'NS': 2, 'CNAME': 5, 'SOA': 6, 'PTR': 12, 'MX': 15, 'TXT': 16,
+    'AAAA': 28, 'SRV': 33, 'NAPTR': 35, 'DS': 43, 'TLSA': 52, 'CAA': 257,
+}
+
+RCODES = ['NOERROR', 'FORMERR', 'SERVFAIL', 'NXDOMAIN', 'NOTIMP', 'REFUSED']
+
+def make_query(name, qtype):
+    '''Wire-format query with RD set and a single question; id is patched on send.'''
+    q = struct.pack('>HHHHHH', 0, 0x0100, 1, 0, 0, 0)
+    for label in name.strip('.').split('.'):
+        q += bytes([len(label)]) + label.encode('ascii')
+    return q + b'\0' + struct.pack('>HH', qtype, 1)
+
+def load_text(fname):
+    '''Lines "name [qtype]"; qtype is a mnemonic or number, A by default.'''
+    packets = []
+    with open(fname, encoding='utf8') as f:
+        for line in f:
+            tok = line.split()
+            if not tok or tok[0].startswith('#'):
+                continue
+            qtype = tok[1].upper() if len(tok) > 1 else 'A'
+            qtype = int(qtype) if qtype.isdigit() else QTYPES[qtype]
+            packets.append(make_query(tok[0], qtype))
+    return packets
+
+def load_wire(fname):
+    '''Captured packets, each prefixed with 16-bit big-endian length, as in DNS over TCP.'''
+    packets = []
+    with open(fname, 'rb') as f:
+        data = f.read()
+    pos = 0
+    while pos + 2 <= len(data):
+        plen = struct.unpack_from('>H', data, pos)[0]
+        pos += 2
+        if plen >= 12 and pos + plen <= len(data):
+            packets.append(data[pos:pos + plen])
+        pos += plen
+    return packets
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))]
+
+def replay(packets, args):
+    family = socket.AF_INET6 if ':' in args.host else socket.AF_INET
+    sock = socket.socket(family, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 22)
+    sock.connect((args.host, args.port))
+    sock.setblocking(False)
+
+    inflight = {}   # id -> send time
+    latencies = []
+    rcodes = {}
+    sent = timeouts = 0
+    interval = 1.0 / args.rate if args.rate else 0
+    start = next_send = time.monotonic()
+    total = args.count if args.count else len(packets)
+    if args.shuffle:
+        random.shuffle(packets)
+
+    while sent < total or inflight:
+        now = time.monotonic()
+        # Send while allowed by rate and concurrency limits
+        while sent < total and len(inflight) < args.concurrency and now >= next_send and len(inflight) < 65536:
+            qid = random.randrange(65536)
+            while qid in inflight:
+                qid = random.randrange(65536)
+            pkt = packets[sent % len(packets)]
+            try:
+                sock.send(struct.pack('>H', qid) + pkt[2:])
+            except BlockingIOError:
+                break
+            except ConnectionRefusedError:
+                pass # ICMP unreachable for an earlier packet; this one is lost as well
+            inflight[qid] = now
+            sent += 1
+            next_send = (next_send + interval) if interval else now
+        # Receive answers
+        timeout = max(0.0, min(next_send - now, 0.01)) if sent < total else 0.01
+        if select.select([sock], [], [], timeout)[0]:
+            while True:
+                try:
+                    ans = sock.recv(65535)
+                except (BlockingIOError, ConnectionRefusedError):
+                    break
+                if len(ans) < 12:
+                    continue
+                qid, flags = struct.unpack_from('>HH', ans)
+                t0 = inflight.pop(qid, None)
+                if t0 is None:
+                    continue # late answer to timed out query
+                latencies.append(time.monotonic() - t0)
+                rc = flags & 0xf
+                rcodes[rc] = rcodes.get(rc, 0) + 1
+        # Expire lost queries
+        now = time.monotonic()
+        for qid in [q for q, t0 in inflight.items() if now - t0 > args.timeout]:
+            del inflight[qid]
+            timeouts += 1
+
+    elapsed = time.monotonic() - start
+    latencies.sort()
+    print('sent:       %d in %.3fs' % (sent, elapsed))
+    print('answered:   %d (%.1f qps)' % (len(latencies), len(latencies) / elapsed if elapsed else 0))
+    print('timeouts:   %d' % timeouts)
+    for p in (50, 90, 99, 99.9):
+        print('p%-9s %.3f ms' % (str(p) + ':', percentile(latencies, p) * 1000))
+    if latencies:
+        print('max:        %.3f ms' % (latencies[-1] * 1000))
+    for rc in sorted(rcodes):
+        print('%-11s %d' % ((RCODES[rc] if rc < len(RCODES) else 'RCODE%d' % rc) + ':', rcodes[rc]))
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay DNS queries against emcdns and report throughput and latency.')
+    parser.add_argument('file', help='query list: text "name [qtype]" per line, or length-prefixed wire packets with --wire')
+    parser.add_argument('--wire', action='store_true', help='file contains length-prefixed wire-format packets')
+    parser.add_argument('--host', default='127.0.0.1', help='emcdns address (default: %(default)s)')
+    parser.add_argument('--port', type=int, default=5335, help='emcdns port (default: %(default)s)')
+    parser.add_argument('--rate', type=float, default=0, help='queries per second, 0 = unlimited (default: %(default)s)')
+    parser.add_argument('--concurrency', type=int, default=256, help='max queries in flight (default: %(default)s)')
+    parser.add_argument('--count', type=int, default=0, help='total queries, cycling the file; 0 = file once')
+    parser.add_argument('--timeout', type=float, default=2.0, help='seconds before a query counts as lost (default: %(default)s)')
+    parser.add_argument('--shuffle', action='store_true', help='randomize query order')
+    args = parser.parse_args()
+
+    packets = load_wire(args.file) if args.wire else load_text(args.file)
+    if not packets:
+        print('No queries in %s' % args.file, file=sys.stderr)
+        sys.exit(1)
+    replay(packets, args)
+
+if __name__ == '__main__':
+    main()
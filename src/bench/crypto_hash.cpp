@@ -59,6 +59,30 @@ static void SHA256D64_1024(benchmark::State& state)
     }
 }
 
+// Proof-of-stake kernel: double-SHA256 of 28-byte message, one by one and in batch
+static void SHA256D_28b_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(28 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < 1024; i++)
+            CHash256().Write(in.data() + i * 28, 28).Finalize(out.data() + i * 32);
+    }
+}
+
+static void SHA256D1_1024(benchmark::State& state)
+{
+    std::vector<uint8_t> in(64 * 1024, 0);
+    std::vector<uint8_t> out(32 * 1024);
+    for (int i = 0; i < 1024; i++) {
+        in[i * 64 + 28] = 0x80;
+        in[i * 64 + 63] = 28 * 8;
+    }
+    while (state.KeepRunning()) {
+        SHA256D1(out.data(), in.data(), 1024);
+    }
+}
+
 static void SHA512(benchmark::State& state)
 {
     uint8_t hash[CSHA512::OUTPUT_SIZE];
@@ -100,5 +124,7 @@ BENCHMARK(SHA512, 330);
 BENCHMARK(SHA256_32b, 4700 * 1000);
 BENCHMARK(SipHash_32b, 40 * 1000 * 1000);
 BENCHMARK(SHA256D64_1024, 7400);
+BENCHMARK(SHA256D_28b_1024, 5000);
+BENCHMARK(SHA256D1_1024, 10000);
 BENCHMARK(FastRandom_32bit, 110 * 1000 * 1000);
 BENCHMARK(FastRandom_1bit, 440 * 1000 * 1000);
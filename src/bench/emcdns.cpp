@@ -0,0 +1,167 @@
+// Copyright (c) 2019 The Emercoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <emcdns.h>
+#include <hooks.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// Name store for EmcDns without nameindex
+class BenchNameHooks : public CHooks
+{
+public:
+    std::map<std::string, std::string> names;
+
+    bool IsNameFeeEnough(const CTransactionRef& tx, const CAmount& txFee) override { return true; }
+    bool ConnectBlock(CBlockIndex* pindex, const std::vector<nameCheckResult>& vName) override { return true; }
+    bool ExtractAddress(const CScript& script, std::string& address) override { return false; }
+    bool CheckPendingNames(const CTransactionRef& tx) override { return true; }
+    void AddToPendingNames(const CTransactionRef& tx) override {}
+    bool DumpToTextFile() override { return false; }
+    bool getNameValue(const std::string& sName, std::string& sValue) override
+    {
+        auto it = names.find(sName);
+        if (it == names.end())
+            return false;
+        sValue = it->second;
+        return true;
+    }
+};
+
+// Query in the wire format: header with RD, single question, optional EDNS0 OPT record
+static std::vector<uint8_t> MakeQuery(const std::string& domain, uint16_t qtype, bool edns = true)
+{
+    std::vector<uint8_t> q = {0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, (uint8_t)edns};
+    size_t pos = 0;
+    while (pos <= domain.size()) {
+        size_t dot = domain.find('.', pos);
+        if (dot == std::string::npos)
+            dot = domain.size();
+        q.push_back(dot - pos);
+        q.insert(q.end(), domain.begin() + pos, domain.begin() + dot);
+        pos = dot + 1;
+    }
+    q.push_back(0);
+    q.push_back(qtype >> 8);
+    q.push_back(qtype);
+    q.push_back(0);
+    q.push_back(1); // IN
+    if (edns) {
+        const uint8_t opt[] = {0, 0, 41, 0x10, 0x00, 0, 0, 0, 0, 0, 0}; // 4096 bytes payload
+        q.insert(q.end(), opt, opt + sizeof(opt));
+    }
+    return q;
+}
+
+// Serves queries by a worker without socket, against the mocked name store.
+// Queries are cycled, so a set of distinct names defeats the answer cache.
+static void BenchEmcDns(benchmark::State& state, const std::vector<std::vector<uint8_t> >& queries, uint32_t cachesize = 0)
+{
+    BenchNameHooks bench_hooks;
+    bench_hooks.names["dns:example"] =
+        "A=192.0.2.1,192.0.2.2|AAAA=2001:db8::1|TXT=emercoin bench record|MX=mail.example.coin:10"
+        "|SRV=10:5:sip.example.coin:5060|TLSA=3:1:1:0b9fa5a59eed715c26c1020c711b4f6ec42d58b0015e14337a39dad301c5afc3"
+        "|CAA=0 issue \"letsencrypt.org\"|SD=www|TTL=600";
+    bench_hooks.names["dns:www.example"] = "A=192.0.2.10|TTL=600";
+    // ENUM zone is allowed as no-sig (~), so records are answered without verifiers
+    bench_hooks.names["enum:17771234567:0"] =
+        "E2U+sip=100|10|!^(.*)$!sip:\\1@example.coin!\nE2U+email=100|20|!^(.*)$!mailto:info@example.coin!";
+
+    CHooks* saved_hooks = hooks;
+    hooks = &bench_hooks;
+    {
+        // Port 0 - no sockets and worker threads; DAP is disabled, so repeated queries are not dropped
+        EmcDns dns("", 0, "", ".coin|~enum", "", 0, 0, "", "", 0, 1, false, cachesize, 1);
+        EmcDnsWorker worker(&dns, INVALID_SOCKET);
+        struct sockaddr_storage ss;
+        memset(&ss, 0, sizeof(ss));
+        ss.ss_family = AF_INET;
+
+        size_t i = 0;
+        uint32_t total = 0;
+        while (state.KeepRunning()) {
+            const std::vector<uint8_t>& q = queries[i++ % queries.size()];
+            total += worker.ServePacket(q.data(), q.size(), ss);
+        }
+        assert(total > 0);
+    }
+    hooks = saved_hooks;
+}
+
+static void EmcDnsA(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("example.coin", 1)});
+}
+
+static void EmcDnsACached(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("example.coin", 1)}, EMCDNS_CACHESIZE);
+}
+
+static void EmcDnsAAAA(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("example.coin", 28)});
+}
+
+static void EmcDnsTXT(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("example.coin", 16)});
+}
+
+static void EmcDnsSRV(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("_sip._udp.example.coin", 33)});
+}
+
+static void EmcDnsTLSA(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("_443._tcp.example.coin", 52)});
+}
+
+static void EmcDnsCAA(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("example.coin", 257)});
+}
+
+static void EmcDnsSubdomain(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("www.example.coin", 1, false)});
+}
+
+static void EmcDnsENUM(benchmark::State& state)
+{
+    BenchEmcDns(state, {MakeQuery("7.6.5.4.3.2.1.7.7.7.1.enum", 35)});
+}
+
+// Random-subdomain flood: each query misses in the name store
+static void EmcDnsMiss(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t> > queries;
+    for (int i = 0; i < 1024; i++)
+        queries.push_back(MakeQuery("nx" + std::to_string(i) + ".coin", 1));
+    BenchEmcDns(state, queries);
+}
+
+static void EmcDnsMissCached(benchmark::State& state)
+{
+    std::vector<std::vector<uint8_t> > queries;
+    for (int i = 0; i < 1024; i++)
+        queries.push_back(MakeQuery("nx" + std::to_string(i) + ".coin", 1));
+    BenchEmcDns(state, queries, EMCDNS_CACHESIZE);
+}
+
+BENCHMARK(EmcDnsA, 500 * 1000);
+BENCHMARK(EmcDnsACached, 1000 * 1000);
+BENCHMARK(EmcDnsAAAA, 500 * 1000);
+BENCHMARK(EmcDnsTXT, 500 * 1000);
+BENCHMARK(EmcDnsSRV, 500 * 1000);
+BENCHMARK(EmcDnsTLSA, 500 * 1000);
+BENCHMARK(EmcDnsCAA, 500 * 1000);
+BENCHMARK(EmcDnsSubdomain, 500 * 1000);
+BENCHMARK(EmcDnsENUM, 200 * 1000);
+BENCHMARK(EmcDnsMiss, 500 * 1000);
+BENCHMARK(EmcDnsMissCached, 1000 * 1000);
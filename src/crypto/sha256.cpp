@@ -22,11 +22,13 @@ void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 namespace sha256d64_sse41
 {
 void Transform_4way(unsigned char* out, const unsigned char* in);
+void TransformD1_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
 }
 
 namespace sha256d64_avx2
 {
 void Transform_8way(unsigned char* out, const unsigned char* in);
+void TransformD1_8way(unsigned char* out, const uint32_t* s, const unsigned char* in);
 }
 
 namespace sha256d64_shani
@@ -456,11 +458,48 @@ void TransformD64Wrapper(unsigned char* out, const unsigned char* in)
     WriteBE32(out + 28, s[7]);
 }
 
+typedef void (*TransformD1Type)(unsigned char*, const uint32_t*, const unsigned char*);
+
+template<TransformType tr>
+void TransformD1Wrapper(unsigned char* out, const uint32_t* state, const unsigned char* in)
+{
+    uint32_t s[8];
+    unsigned char buffer2[64] = {
+        0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        0,    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0
+    };
+    std::copy(state, state + 8, s);
+    tr(s, in, 1);
+    WriteBE32(buffer2 + 0, s[0]);
+    WriteBE32(buffer2 + 4, s[1]);
+    WriteBE32(buffer2 + 8, s[2]);
+    WriteBE32(buffer2 + 12, s[3]);
+    WriteBE32(buffer2 + 16, s[4]);
+    WriteBE32(buffer2 + 20, s[5]);
+    WriteBE32(buffer2 + 24, s[6]);
+    WriteBE32(buffer2 + 28, s[7]);
+    sha256::Initialize(s);
+    tr(s, buffer2, 1);
+    WriteBE32(out + 0, s[0]);
+    WriteBE32(out + 4, s[1]);
+    WriteBE32(out + 8, s[2]);
+    WriteBE32(out + 12, s[3]);
+    WriteBE32(out + 16, s[4]);
+    WriteBE32(out + 20, s[5]);
+    WriteBE32(out + 24, s[6]);
+    WriteBE32(out + 28, s[7]);
+}
+
 TransformType Transform = sha256::Transform;
 TransformD64Type TransformD64 = sha256::TransformD64;
 TransformD64Type TransformD64_2way = nullptr;
 TransformD64Type TransformD64_4way = nullptr;
 TransformD64Type TransformD64_8way = nullptr;
+TransformD1Type TransformD1 = TransformD1Wrapper<sha256::Transform>;
+TransformD1Type TransformD1_4way = nullptr;
+TransformD1Type TransformD1_8way = nullptr;
 
 bool SelfTest() {
     // Input state (equal to the initial SHA256 state)
@@ -508,6 +547,44 @@ bool SelfTest() {
         0x6a, 0x46, 0x30, 0xa6, 0x89, 0x86, 0x23, 0xac, 0xf8, 0xa5, 0x15, 0xe9, 0x0a, 0xaa, 0x1e, 0x9a,
         0xd7, 0x93, 0x6b, 0x28, 0xe4, 0x3b, 0xfd, 0x59, 0xc6, 0xed, 0x7c, 0x5f, 0xa5, 0x41, 0xcb, 0x51
     };
+    // Expected output for each of the 8 64-byte blocks, taken as an already padded message, under double SHA256.
+    static const unsigned char result_d1[256] = {
+        0x59, 0x01, 0x44, 0x90, 0xfc, 0xc8, 0xa7, 0xf4, 0x3c, 0xeb, 0x01, 0xf1, 0x08, 0x66, 0x1d, 0xe9,
+        0x2c, 0x5f, 0x8c, 0x47, 0xb7, 0xd6, 0xd1, 0x32, 0x4b, 0x84, 0xc4, 0x30, 0x5f, 0xfd, 0xea, 0x05,
+        0xd8, 0xac, 0xe7, 0x1f, 0x96, 0x34, 0x40, 0x5d, 0xc4, 0xf5, 0xbc, 0x83, 0x50, 0x91, 0xf0, 0xfa,
+        0x34, 0x0b, 0x73, 0xb3, 0x33, 0x3d, 0xe3, 0xd5, 0x89, 0xb7, 0x19, 0x54, 0x2b, 0x64, 0xc4, 0x3e,
+        0xc7, 0x5d, 0x62, 0xf7, 0xb5, 0x2c, 0xa3, 0x36, 0x3d, 0x15, 0x95, 0xdd, 0xca, 0x47, 0xec, 0xc6,
+        0x73, 0xff, 0x1f, 0x73, 0x00, 0x18, 0x03, 0xf6, 0xa1, 0x89, 0x91, 0xcd, 0x9d, 0x51, 0x25, 0x0e,
+        0xaa, 0xe8, 0x97, 0x54, 0x39, 0xa8, 0xa3, 0xd4, 0x1c, 0xcd, 0xf5, 0x7c, 0xc4, 0x04, 0x3e, 0x25,
+        0x73, 0x0b, 0x71, 0xcd, 0x50, 0x2f, 0x6c, 0xc0, 0x53, 0x4e, 0x80, 0xfb, 0x59, 0x13, 0xcb, 0xa9,
+        0xa2, 0x8f, 0x44, 0x4a, 0xc1, 0x7b, 0xf9, 0x36, 0x80, 0x28, 0xbc, 0x01, 0x15, 0xd6, 0x98, 0x11,
+        0xe2, 0x65, 0x1b, 0x25, 0x33, 0x9a, 0xb9, 0x9e, 0xdc, 0x06, 0xf6, 0x20, 0xa3, 0x44, 0xaf, 0xbd,
+        0x40, 0xce, 0x80, 0x31, 0x26, 0xaa, 0xfc, 0x1f, 0x80, 0xbe, 0x45, 0x38, 0x0c, 0xc0, 0x61, 0x5b,
+        0x79, 0x22, 0xd7, 0xa9, 0xed, 0x07, 0x4f, 0x97, 0x7d, 0x62, 0x96, 0x19, 0xbd, 0x83, 0x68, 0xc7,
+        0x62, 0x90, 0xd0, 0xce, 0x08, 0x9a, 0x73, 0x3f, 0xf1, 0x10, 0x36, 0x77, 0x07, 0x45, 0xaf, 0x2c,
+        0x4a, 0xc3, 0x3e, 0x55, 0x11, 0x29, 0xc9, 0x84, 0x4a, 0x5a, 0x2b, 0x69, 0x9b, 0xae, 0x98, 0x81,
+        0x16, 0xd9, 0xc8, 0x2b, 0xb8, 0x25, 0x35, 0x00, 0x3e, 0x1e, 0xeb, 0xa2, 0x48, 0x78, 0xf3, 0xd3,
+        0x27, 0x6c, 0x06, 0xb1, 0xb7, 0x46, 0x62, 0xe0, 0xc9, 0xce, 0xec, 0x4b, 0x2d, 0xad, 0xd5, 0x5d
+    };
+    // Same, with the first hash continued from the state after the first input block instead of the initial one.
+    static const unsigned char result_d1mid[256] = {
+        0xdf, 0x8f, 0xe6, 0x6c, 0x69, 0x06, 0x42, 0x78, 0xc9, 0x98, 0x48, 0x44, 0xdd, 0xf2, 0x78, 0xdd,
+        0xea, 0x23, 0xdd, 0x00, 0xc5, 0xfc, 0xb4, 0x4e, 0xff, 0x44, 0xf4, 0x99, 0x01, 0x97, 0xeb, 0x21,
+        0xd0, 0x4c, 0xd8, 0x99, 0x59, 0x57, 0x54, 0xc5, 0xc7, 0x1d, 0xb3, 0x0a, 0xf3, 0x0f, 0x21, 0x7c,
+        0x2d, 0x96, 0x6b, 0x20, 0xbf, 0xa2, 0x0d, 0x6b, 0xc9, 0xdb, 0x84, 0x42, 0x0e, 0xe4, 0x8a, 0x86,
+        0xa8, 0x55, 0x62, 0x79, 0xb6, 0x50, 0x64, 0xed, 0xbf, 0xbd, 0xf0, 0x69, 0xd1, 0x89, 0xd1, 0xdb,
+        0x24, 0x2d, 0xa3, 0xc6, 0x3a, 0xd5, 0x32, 0x0a, 0x89, 0xf1, 0x3b, 0xea, 0x99, 0x01, 0xcc, 0x0f,
+        0x00, 0x9b, 0xf4, 0xef, 0x7f, 0x22, 0x9e, 0x68, 0x8c, 0x8d, 0x28, 0xd2, 0xd6, 0xa4, 0x6e, 0xf3,
+        0xe1, 0x5f, 0x91, 0xe3, 0x54, 0xfb, 0x0e, 0xef, 0xae, 0xa6, 0x07, 0x55, 0x4d, 0xd2, 0x40, 0x6e,
+        0x8e, 0x63, 0xd5, 0xe5, 0xc8, 0x21, 0xf5, 0x36, 0x82, 0xef, 0x7f, 0x33, 0x1c, 0x28, 0xed, 0x83,
+        0xbd, 0x9d, 0x95, 0xff, 0x6c, 0xc1, 0x0b, 0xe1, 0x9e, 0xa0, 0x32, 0xea, 0x71, 0x96, 0x80, 0xf3,
+        0x33, 0xc4, 0xce, 0x5e, 0xe4, 0x6f, 0x63, 0xd8, 0x27, 0x18, 0x15, 0x64, 0x78, 0xea, 0xee, 0x1b,
+        0x7c, 0x9f, 0xdc, 0x0f, 0x7a, 0xc4, 0xf7, 0x7f, 0x1f, 0x5b, 0xb1, 0xf7, 0x3d, 0x52, 0x82, 0x30,
+        0x44, 0xf0, 0xb0, 0xfa, 0x54, 0x83, 0xaf, 0xba, 0xd3, 0xd1, 0xc1, 0x1a, 0xdd, 0x10, 0x5e, 0x51,
+        0xc1, 0x90, 0xeb, 0x1a, 0xc9, 0x68, 0x22, 0x84, 0xeb, 0x0c, 0x39, 0x21, 0x3d, 0xc2, 0x77, 0xc3,
+        0x44, 0x97, 0x62, 0xf1, 0xbf, 0x56, 0x8e, 0x74, 0x4d, 0xc4, 0x94, 0x90, 0x30, 0x05, 0x6e, 0xa3,
+        0x56, 0x41, 0xff, 0xcf, 0x83, 0xc5, 0xe8, 0x02, 0x50, 0x6d, 0xb2, 0x8b, 0xe9, 0xdf, 0x9e, 0x8f
+    };
 
 
     // Test Transform() for 0 through 8 transformations.
@@ -544,6 +621,30 @@ bool SelfTest() {
         if (!std::equal(out, out + 256, result_d64)) return false;
     }
 
+    // Test TransformD1, from the initial state and from a midstate
+    TransformD1(out, init, data + 1);
+    if (!std::equal(out, out + 32, result_d1)) return false;
+    TransformD1(out, result[1], data + 1);
+    if (!std::equal(out, out + 32, result_d1mid)) return false;
+
+    // Test TransformD1_4way, if available.
+    if (TransformD1_4way) {
+        unsigned char out[128];
+        TransformD1_4way(out, init, data + 1);
+        if (!std::equal(out, out + 128, result_d1)) return false;
+        TransformD1_4way(out, result[1], data + 1);
+        if (!std::equal(out, out + 128, result_d1mid)) return false;
+    }
+
+    // Test TransformD1_8way, if available.
+    if (TransformD1_8way) {
+        unsigned char out[256];
+        TransformD1_8way(out, init, data + 1);
+        if (!std::equal(out, out + 256, result_d1)) return false;
+        TransformD1_8way(out, result[1], data + 1);
+        if (!std::equal(out, out + 256, result_d1mid)) return false;
+    }
+
     return true;
 }
 
@@ -607,6 +708,7 @@ std::string SHA256AutoDetect()
     if (have_shani) {
         Transform = sha256_shani::Transform;
         TransformD64 = TransformD64Wrapper<sha256_shani::Transform>;
+        TransformD1 = TransformD1Wrapper<sha256_shani::Transform>;
         TransformD64_2way = sha256d64_shani::Transform_2way;
         ret = "shani(1way,2way)";
         have_sse4 = false; // Disable SSE4/AVX2;
@@ -618,10 +720,12 @@ std::string SHA256AutoDetect()
 #if defined(__x86_64__) || defined(__amd64__)
         Transform = sha256_sse4::Transform;
         TransformD64 = TransformD64Wrapper<sha256_sse4::Transform>;
+        TransformD1 = TransformD1Wrapper<sha256_sse4::Transform>;
         ret = "sse4(1way)";
 #endif
 #if defined(ENABLE_SSE41) && !defined(BUILD_BITCOIN_INTERNAL)
         TransformD64_4way = sha256d64_sse41::Transform_4way;
+        TransformD1_4way = sha256d64_sse41::TransformD1_4way;
         ret += ",sse41(4way)";
 #endif
     }
@@ -629,6 +733,7 @@ std::string SHA256AutoDetect()
 #if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
     if (have_avx2 && have_avx && enabled_avx) {
         TransformD64_8way = sha256d64_avx2::Transform_8way;
+        TransformD1_8way = sha256d64_avx2::TransformD1_8way;
         ret += ",avx2(8way)";
     }
 #endif
@@ -728,3 +833,42 @@ void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
         --blocks;
     }
 }
+
+void SHA256Midstate(uint32_t* state, const unsigned char* in, size_t blocks)
+{
+    sha256::Initialize(state);
+    Transform(state, in, blocks);
+}
+
+void SHA256D1(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    uint32_t s[8];
+    sha256::Initialize(s);
+    SHA256D1Midstate(out, s, in, blocks);
+}
+
+void SHA256D1Midstate(unsigned char* out, const uint32_t* midstate, const unsigned char* in, size_t blocks)
+{
+    if (TransformD1_8way) {
+        while (blocks >= 8) {
+            TransformD1_8way(out, midstate, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformD1_4way) {
+        while (blocks >= 4) {
+            TransformD1_4way(out, midstate, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        TransformD1(out, midstate, in);
+        out += 32;
+        in += 64;
+        --blocks;
+    }
+}
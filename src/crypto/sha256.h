@@ -38,4 +38,30 @@ std::string SHA256AutoDetect();
  */
 void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
 
+/** Compute multiple double-SHA256's of short messages (up to 55 bytes),
+ *  each already padded by the caller into a single 64-byte block.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256D1(unsigned char* output, const unsigned char* input, size_t blocks);
+
+/** Compute the SHA256 state after the leading 64-byte blocks of a message (midstate).
+ *  state:   pointer to a 8 word output state
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of blocks to hash.
+ */
+void SHA256Midstate(uint32_t* state, const unsigned char* input, size_t blocks);
+
+/** Compute multiple double-SHA256's of messages sharing the leading blocks, such as
+ *  block headers with different nonces. Same as SHA256D1, but the first hash is
+ *  continued from the midstate of the leading blocks; the last block of each message
+ *  is padded by the caller.
+ *  output:   pointer to a blocks*32 byte output buffer
+ *  midstate: state after the leading blocks, see SHA256Midstate
+ *  input:    pointer to a blocks*64 byte buffer of the last blocks
+ *  blocks:   the number of hashes to compute.
+ */
+void SHA256D1Midstate(unsigned char* output, const uint32_t* midstate, const unsigned char* input, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
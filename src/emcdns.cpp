@@ -4,7 +4,10 @@
  * Lookup for names like "dns:some-name" in the local nameindex database.
  * Database is updated from blockchain, and keeps NMC-transactions.
  *
- * Supports standard RFC1034 UDP DNS protocol only
+ * Supports standard RFC1034 DNS protocol over UDP and TCP, with EDNS0 UDP payload size
+ * Queries are served by -emcdnsthreads workers, each with own SO_REUSEPORT socket,
+ * and TCP worker, which multiplexes all TCP connections in one event loop.
+ * On Linux, UDP workers receive and answer packets in batches by recvmmsg/sendmmsg
  *
  * Supported fields: A, AAAA, NS, PTR, MX, TXT, CNAME
  * Does not support: SOA, WKS
@@ -38,6 +41,7 @@
 #endif
 
 #include <ctype.h>
+#include <math.h>
 
 #include <namecoin.h>
 #include <emcdns.h>
@@ -48,6 +52,10 @@
 #include <key_io.h>
 #include <util/validation.h>
 #include <wallet/wallet.h>
+#include <httpserver.h>
+#include <rpc/protocol.h>
+#include <util/time.h>
+#include <crypto/siphash.h>
 
 #ifdef _MSC_VER
     #include <malloc.h>  // for alloca on MSVC
@@ -70,7 +78,10 @@
 /*---------------------------------------------------*/
 
 #define MAX_OUT  512	    // Old DNS restricts UDP to 512 bytes; keep compatible
+#define MAX_EDNS_OUT 4096   // Max UDP answer for EDNS0 clients
+#define MAX_TCP_OUT 0xffff  // TCP message length is 16-bit
 #define BUF_SIZE (2 * MAX_OUT)
+#define IO_SIZE  (BUF_SIZE + MAX_TCP_OUT) // Query and answer
 #define MAX_TOK  64         // Maximal TokenQty in the vsl_list, like A=IP1,..,IPn
 #define MAX_DOM  20         // Maximal domain level; min 10 is needed for NAPTR E164
 #define MAX_ENUM 40         // Maximal ENUM domain levels; min 10 is needed for NAPTR E164
@@ -84,6 +95,8 @@
 
 // HT offset contains it for ENUM SPFUN
 #define ENUM_FLAG	(1 << 14)
+// HT keeps at least one free slot, which ends lookups of absent keys
+#define HT_MAX_QTY	0xff
 #define QTYPE_ADDL      (1 << 15) // Additional with specified qtype
 /*---------------------------------------------------*/
 
@@ -170,98 +183,128 @@ const static char *decodeQtype(uint16_t x) {
 EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
 	  const char *gw_suffix, const char *allowed_suff, const char *local_fname,
 	  uint32_t dapsize, uint32_t daptreshold,
-	  const char *enums, const char *tollfree, uint8_t verbose)
-    : m_status(-1), m_flags(0), m_thread(StatRun, this) {
+	  const char *enums, const char *tollfree, uint8_t verbose, int threads, bool tcp, uint32_t cachesize, int batch)
+    : m_dap_ht(NULL), m_answers(NULL), m_nxanswers(NULL), m_sigs(NULL),
+      m_name_filter(new EmcDnsNameFilter), m_filter_stop(false), m_daprand(0),
+      m_dapmask(0), m_dap_treshold(0), m_verbose(verbose), m_status(-1),
+      m_batch(batch < 1? 1 : batch > EMCDNS_MAXBATCH? EMCDNS_MAXBATCH : batch), m_started(GetTime()),
+      m_tables_gen(0),
+      m_gw_suffix_str(gw_suffix == NULL? "" : gw_suffix),
+      m_allowed_str(allowed_suff == NULL? "" : allowed_suff),
+      m_local_fname(local_fname == NULL? "" : local_fname) {
+
+    if(threads <= 0)
+        threads = GetNumCores();
+    if(threads > EMCDNS_MAXTHREADS)
+        threads = EMCDNS_MAXTHREADS;
+
+    // Suffixes and local names; throws, if cannot allocate
+    m_tables = BuildTables(m_gw_suffix_str, m_allowed_str, m_local_fname);
+
+    // Each worker binds own socket to the same ip:port; SO_REUSEPORT spreads packets among them
+    // TCP listener is the last one.
+    // Port 0 - embedded instance without network and workers; caller serves packets
+    // by own EmcDnsWorker without socket (benchmarks, tests)
+    vector<SOCKET> sockets;
+    try {
+        for(int i = 0; port_no && i < threads; i++)
+            sockets.push_back(OpenSocket(bind_ip, port_no, false));
+        if(port_no && tcp)
+            sockets.push_back(OpenSocket(bind_ip, port_no, true));
+    } catch(...) {
+        for(SOCKET s : sockets)
+            CloseSocket(s);
+        throw;
+    }
 
-    // Clear vars [m_hdr..m_verbose)
-    memset(&m_hdr, 0, &m_verbose - (uint8_t *)&m_hdr); // Clear previous state
-    m_verbose = verbose;
+    // Setup m_daprand
+    uint32_t daprand;
+    GetRandBytes((uint8_t *)&daprand, sizeof(daprand));
 
-    int ret = -1;
-    // If bind IP started with ".", then we will create IPv4 socket
-    // Otherwise, try to open IPv6 in dual mode.
-    // For INADDR_ANY, yous just "." as Bind IP, or ".0.0.0.0"
-    if(bind_ip[0] == '.')
-        bind_ip++; // Skip dot, use "-1" here
-    else
-        ret = socket(PF_INET6, SOCK_DGRAM, 0); // Try to create IPv6 socket
-    if(ret < 0) {
-        // Cannot create IPv46 - try IPv4
-        // Create and bind socket - IPv4 Only
-        ret = socket(PF_INET, SOCK_DGRAM, 0);
-        if(ret < 0)
-            throw runtime_error("EmcDns::EmcDns: Cannot create ipv4 socket");
-        m_sockfd = ret;
+    // Activate DAP only if specidied dapsize
+    // If no memory, DAP is inactive - this is not critical problem
+    if(dapsize) {
+      dapsize += dapsize - 1;
+      do m_dapmask = dapsize; while(dapsize &= dapsize - 1); // compute mask as 2^N
+      m_dap_ht = new (std::nothrow) std::atomic<uint32_t>[m_dapmask](); // DNSAP cells
+      m_dapmask--;
+      daprand |= 1;
+      m_dap_treshold = daptreshold;
+    }
+    m_daprand = daprand;
 
-        struct sockaddr_in sin;
-        const int sinlen = sizeof(struct sockaddr_in);
-        memset(&sin, 0, sinlen);
-        sin.sin_port = htons(port_no);
-        sin.sin_family = AF_INET;
-        int yes = 1;
-#ifdef WIN32
-        if( (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR,  (char *)&yes, sizeof(yes)) < 0)
-         || (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEPORT,  (char *)&yes, sizeof(yes)) < 0))
-#else
-        if( (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR,  (void *)&yes, sizeof(yes)) < 0)
-         || (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEPORT,  (void *)&yes, sizeof(yes)) < 0))
-#endif
-            throw runtime_error("EmcDns::EmcDns: Cannot SO_REUSEADDR|SO_REUSEPORT for IPv4 socket to IPV4 socket");
+    if(enums && *enums) {
+      string enums_str(enums);
+      char *str = &enums_str[0];
+      Verifier empty_ver;
+      while(char *p_tok = strsep(&str, "|,"))
+        if(*p_tok) {
+	  if(m_verbose > 1)
+	  LogPrintf("    EmcDns::EmcDns: enumtrust=%s\n", p_tok);
+          m_verifiers[string(p_tok)] = empty_ver;
+	}
+    } // ENUMs completed
 
-        if(*bind_ip == 0 || inet_pton(AF_INET, bind_ip, &sin.sin_addr) != 1) {
-            sin.sin_addr.s_addr = INADDR_ANY;
-            bind_ip = NULL;
-        }
+    if(m_verbose > 1)
+	 LogPrintf("EmcDns::EmcDns: Created/Attached: [%s]:%u; TLD=%u Local=%u\n",
+		 (bind_ip == NULL)? "INADDR_ANY" : bind_ip,
+		 port_no, m_tables->allowed_qty, m_tables->local_qty);
 
-        char buf[INET6_ADDRSTRLEN];
-	    LogPrintf("EmcDns::EmcDns: Bind to IPv4=%s:%u\n", inet_ntop(AF_INET, &sin.sin_addr.s_addr, buf, INET6_ADDRSTRLEN), port_no);
-        if(::bind(m_sockfd, (struct sockaddr *)&sin, sinlen) < 0) {
-            char buf[80];
-            sprintf(buf, "EmcDns::EmcDns: Cannot bind to IPv4 port %u", port_no);
-            throw runtime_error(buf);
-        }
-    } else {
-        // Setup IPv46 socket
-        m_sockfd = ret;
-        struct sockaddr_in6 sin6;
-        const int sin6len = sizeof(struct sockaddr_in6);
-        memset(&sin6, 0, sin6len);
-        sin6.sin6_port = htons(port_no);
-        sin6.sin6_family = AF_INET6;
+    // Toll-free list can contain NVS records, so it is deferred until IBD completed
 
-        if(*bind_ip == 0 || inet_pton(AF_INET6, bind_ip, &sin6.sin6_addr) != 1) {
-            sin6.sin6_addr = in6addr_any;
-            bind_ip = NULL;
-        }
-        int no  = 0;
-        int yes = 1;
-#ifdef WIN32
-        if( (setsockopt(m_sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&no,  sizeof(no))  < 0)
-         || (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR,  (char *)&yes, sizeof(yes)) < 0)
-         || (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEPORT,  (char *)&yes, sizeof(yes)) < 0))
-#else
-        if( (setsockopt(m_sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no,  sizeof(no))  < 0)
-         || (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR,  (void *)&yes, sizeof(yes)) < 0)
-         || (setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEPORT,  (void *)&yes, sizeof(yes)) < 0))
-#endif
-            throw runtime_error("EmcDns::EmcDns: Cannot switch socket to IPV4 compatibility mode");
+    if(tollfree && *tollfree) {
+      if(m_verbose > 1)
+	LogPrintf("    EmcDns::EmcDns: Setup deferred toll-free=%s\n", tollfree);
+      m_tollfree_list = tollfree;
+    }
 
-        char buf[INET6_ADDRSTRLEN];
-	    LogPrintf("EmcDns::EmcDns: Bind to IPv6=[%s]:%u\n", inet_ntop(AF_INET6, &sin6.sin6_addr, buf, INET6_ADDRSTRLEN), port_no);
-        if(::bind(m_sockfd, (struct sockaddr *)&sin6, sin6len) < 0) {
-            char buf[80];
-            sprintf(buf, "EmcDns::EmcDns: Cannot bind to IPv46 port %u; error: %s", port_no, strerror(errno));
-            throw runtime_error(buf);
-        }
-    } // IPv46
+    m_self_ns = gArgs.GetArg("-selfns", "");
+    if(m_self_ns.size() > 512) {
+	LogPrintf("    EmcDns::EmcDns: too long selfns=%s; ignored\n", m_self_ns.c_str());
+        m_self_ns.clear();
+    }
+
+    if(cachesize) {
+      m_answers   = new EmcDnsAnswerCache((size_t)cachesize << 20);
+      m_nxanswers = new EmcDnsAnswerCache(((size_t)cachesize << 20) / EMCDNS_NXCACHEPART);
+    }
+    if(!m_verifiers.empty())
+      m_sigs = new EmcDnsSigCache(EMCDNS_SIGCACHE);
+    m_name_changed = NotifyNameChanged.connect([this](const CNameVal& name) {
+      string str = stringFromNameVal(name);
+      if(str.compare(0, sizeof(DNS_PREFIX), DNS_PREFIX ":") == 0)
+        m_name_filter->Add(str.data(), str.size());
+      if(m_answers) {
+        m_answers->Invalidate(str);
+        m_nxanswers->Invalidate(str);
+      }
+      if(m_sigs)
+        m_sigs->Invalidate(str);
+    });
+
+    m_status = 1; // Active, and maybe download
+
+    for(size_t i = 0; i < sockets.size(); i++)
+      m_workers.push_back(new EmcDnsWorker(this, sockets[i], (int)i == threads));
+
+    if(m_verbose > 1)
+	 LogPrintf("EmcDns::EmcDns: Started %u worker threads, TCP=%d\n", m_workers.size(), tcp);
+} // EmcDns::EmcDns
+
+/*---------------------------------------------------*/
+// Builds suffixes and local names tables from config values and -emcdnslocalcf file.
+// Called by constructor, and by Reload while workers are serving queries with current tables.
+std::shared_ptr<EmcDnsTables> EmcDns::BuildTables(const string &gw_suffix_str, const string &allowed_str, const string &local_fname) const {
+    std::shared_ptr<EmcDnsTables> t = std::make_shared<EmcDnsTables>();
+    const char *gw_suffix    = gw_suffix_str.c_str();
+    const char *allowed_suff = allowed_str.c_str();
 
     // Upload Local DNS entries
     // Create temporary local buf on stack
-    int local_len = 0;
+    int local_len = 0, local_qty = 0;
     char local_tmp[1 << 15]; // max 32Kb
     FILE *flocal;
-    uint8_t local_qty = 0;
-    if(local_fname != NULL && (flocal = fopen(local_fname, "r")) != NULL) {
+    if(!local_fname.empty() && (flocal = fopen(local_fname.c_str(), "r")) != NULL) {
       char *rd = local_tmp;
       while(rd < local_tmp + sizeof(local_tmp) - 2000 && fgets(rd, 2000, flocal)) {
 	if(*rd < '.' || *rd == ';')
@@ -270,7 +313,7 @@ EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
 	if(p == NULL)
 	  continue;
         if(*rd == '.')
-          m_flags |= FLAG_LOCAL_SD; // Future local search for subdomains, too
+          t->flags |= FLAG_LOCAL_SD; // Future local search for subdomains, too
 	rd = strchr(p, 0);
         while(*--rd < 040)
 	  *rd = 0;
@@ -279,82 +322,51 @@ EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
       } // while rd
       local_len = rd - local_tmp;
       fclose(flocal);
+      if(local_qty > HT_MAX_QTY)
+        throw invalid_argument(strprintf("EmcDns::BuildTables: Too many local names: %d, max %d", local_qty, HT_MAX_QTY));
+      t->local_qty = local_qty;
     }
 
     // Allocate memory
-    int allowed_len = allowed_suff == NULL? 0 : strlen(allowed_suff);
-    int gw_suf_len  = m_gw_suf_len = gw_suffix == NULL? 0 : strlen(gw_suffix);
-
-    // Setup m_daprand
-    GetRandBytes((uint8_t *)&m_daprand, sizeof(m_daprand));
-
-    // Activate DAP only if specidied dapsize
-    // If no memory, DAP is inactive - this is not critical problem
-    if(dapsize) {
-      dapsize += dapsize - 1;
-      do m_dapmask = dapsize; while(dapsize &= dapsize - 1); // compute mask as 2^N
-      m_dap_ht = (DNSAP*)calloc(m_dapmask, sizeof(DNSAP));
-      m_dapmask--;
-      m_daprand |= 1;
-      m_dap_treshold = daptreshold;
-    }
-
-    // Common buffers structure:
-    m_buf = (uint8_t *)malloc(
-              BUF_SIZE // I/O buf,               1K
-            + BUF_SIZE // Sanity check O-buf,    1K
-            + VAL_SIZE // Sanity check outvalue, 20K
-            + VAL_SIZE // Blockchain value,      20K
-            + 2        // ?
-            + gw_suf_len + allowed_len + local_len + 4);
+    int allowed_len = strlen(allowed_suff);
+    int gw_suf_len  = t->gw_suf_len = strlen(gw_suffix);
 
-    if(m_buf == NULL)
-      throw runtime_error("EmcDns::EmcDns: Cannot allocate buffer");
+    // Allowed TLD offsets are positive int16 below ENUM_FLAG
+    if(allowed_len >= ENUM_FLAG)
+      throw invalid_argument(strprintf("EmcDns::BuildTables: Allowed TLD list too long: %d, max %d", allowed_len, ENUM_FLAG - 1));
 
-    // Assign data buffers inside m_value hyper-array
-    m_value = (char *)m_buf + BUF_SIZE + BUF_SIZE + VAL_SIZE;
-    char *varbufs = (char *)m_buf + 2 * (VAL_SIZE + BUF_SIZE) + 2;
-
-    // Temporary use m_value for parse enum-verifiers and toll-free lists, if exist
-
-    if(enums && *enums) {
-      char *str = strcpy(m_value, enums);
-      Verifier empty_ver;
-      while(char *p_tok = strsep(&str, "|,"))
-        if(*p_tok) {
-	  if(m_verbose > 1)
-	  LogPrintf("    EmcDns::EmcDns: enumtrust=%s\n", p_tok);
-          m_verifiers[string(p_tok)] = empty_ver;
-	}
-    } // ENUMs completed
+    // Shared buffer for suffixes and local names; I/O buffers are allocated per worker
+    char *varbufs = t->varbufs = (char *)malloc(gw_suf_len + allowed_len + local_len + 4);
 
+    if(varbufs == NULL)
+      throw runtime_error("EmcDns::BuildTables: Cannot allocate buffer");
 
     if(gw_suf_len) {
       // Copy suffix to local storage
-      m_gw_suffix = strcpy(varbufs, gw_suffix);
+      t->gw_suffix = strcpy(varbufs, gw_suffix);
       // Try to search translation to internal suffix, like ".e164.org|.enum"
-      m_gw_suffix_replace = strchr(m_gw_suffix, '|');
-      if(m_gw_suffix_replace) {
-        m_gw_suf_len = m_gw_suffix_replace - m_gw_suffix; // adjust to a real suffix
-        *m_gw_suffix_replace++ = 0; // set ptr to ".enum"
-        m_gw_suffix_replace_len = strlen(m_gw_suffix_replace);
-        m_gw_suf_dots = -1;
+      t->gw_suffix_replace = strchr(t->gw_suffix, '|');
+      if(t->gw_suffix_replace) {
+        t->gw_suf_len = t->gw_suffix_replace - t->gw_suffix; // adjust to a real suffix
+        *t->gw_suffix_replace++ = 0; // set ptr to ".enum"
+        t->gw_suffix_replace_len = strlen(t->gw_suffix_replace);
+        t->gw_suf_dots = -1;
       } else
-        m_gw_suffix_replace = m_gw_suffix + gw_suf_len; // pointer to \0
+        t->gw_suffix_replace = t->gw_suffix + gw_suf_len; // pointer to \0
       // Compute dots in the gw-suffix
-      for(const char *p = m_gw_suffix; *p; p++)
+      for(const char *p = t->gw_suffix; *p; p++)
         if(*p == '.')
-          m_gw_suf_dots++;
+          t->gw_suf_dots++;
       if(m_verbose > 1)
-	 LogPrintf("EmcDns::EmcDns: Setup translate GW-suffix: [%s:%d]->[%s] Ncut=%d\n",
-                 m_gw_suffix, m_gw_suf_len, m_gw_suffix_replace, m_gw_suf_dots);
+	 LogPrintf("EmcDns::BuildTables: Setup translate GW-suffix: [%s:%d]->[%s] Ncut=%d\n",
+                 t->gw_suffix, t->gw_suf_len, t->gw_suffix_replace, t->gw_suf_dots);
     }
 
     // Create array of allowed TLD-suffixes
     if(allowed_len) {
-      m_allowed_base = strcpy(varbufs + gw_suf_len + 1, allowed_suff);
+      t->allowed_base = strcpy(varbufs + gw_suf_len + 1, allowed_suff);
       uint8_t pos = 0, step = 0; // pos, step for double hashing
-      for(char *p = m_allowed_base + allowed_len; p > m_allowed_base; ) {
+      for(char *p = t->allowed_base + allowed_len; p > t->allowed_base; ) {
 	char c = *--p;
 	if(c ==  '|' || c <= 040) {
 	  *p = pos = step = 0;
@@ -364,11 +376,16 @@ EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
         // emcdnsallowed=40$enum|.coin|~freenum|!rus
 	if(c == '.' || c == '$' || c == '~' || c == '!') {
 	  if(p[1] > 040) { // if allowed domain is not empty - save it into ht
+	    if(t->allowed_qty + t->local_qty >= HT_MAX_QTY)
+	      throw invalid_argument(strprintf("EmcDns::BuildTables: Too many allowed TLDs and local names, max %d", HT_MAX_QTY));
 	    step |= 1;
-	    do
+	    int probes = 0; // odd step visits all slots
+	    do {
+	      if(++probes > 0x100)
+	        throw runtime_error("EmcDns::BuildTables: Hashtable is full");
 	      pos += step;
-            while(m_ht_offset[pos] != 0);
-	    m_ht_offset[pos] = p + 1 - m_allowed_base;
+	    } while(t->ht_offset[pos] != 0);
+	    t->ht_offset[pos] = p + 1 - t->allowed_base;
            const char *dnstype = NULL;
             switch(c) {
               case '.':
@@ -382,22 +399,22 @@ EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
               case '~':
                 dnstype = "ENUM-no-sig";
                 *p = (char)(0200 | MAX_ENUM); // Set flag signature-no-check (sigOK)
-                m_ht_offset[pos] |= ENUM_FLAG;
+                t->ht_offset[pos] |= ENUM_FLAG;
                 break;
               case '$':
                 dnstype = "ENUM-sig";
                 *p = MAX_ENUM;
-                m_ht_offset[pos] |= ENUM_FLAG;
+                t->ht_offset[pos] |= ENUM_FLAG;
                 break;
             } // switch
             // Compute actual subdomain chain length
             char *pp = p; // ref to $/./!/~
-            while(--pp >= m_allowed_base && *pp >= '0' && *pp <= '9');
+            while(--pp >= t->allowed_base && *pp >= '0' && *pp <= '9');
             if(++pp < p)
               *p = (*p & 0200) | atoi(pp);
-            m_allowed_qty++;
+            t->allowed_qty++;
 	    if(m_verbose > 1)
-	      LogPrintf("EmcDns::EmcDns: Insert %s TLD=%s:%u\n", dnstype, p + 1, *p & 0177);
+	      LogPrintf("EmcDns::BuildTables: Insert %s TLD=%s:%u\n", dnstype, p + 1, *p & 0177);
 	  }
 	  pos = step = 0;
 	  continue;
@@ -408,9 +425,9 @@ EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
     } // if(allowed_len)
 
     if(local_len) {
-      char *p = m_local_base = (char*)memcpy(varbufs + gw_suf_len + 1 + allowed_len + 1, local_tmp, local_len) - 1;
+      char *p = t->local_base = (char*)memcpy(varbufs + gw_suf_len + 1 + allowed_len + 1, local_tmp, local_len) - 1;
       // and populate hashtable with offsets
-      while(++p < m_local_base + local_len) {
+      while(++p < t->local_base + local_len) {
 	char *p_eq = strchr(p, '=');
 	if(p_eq == NULL)
 	  break;
@@ -423,37 +440,139 @@ EmcDns::EmcDns(const char *bind_ip, uint16_t port_no,
         } // while
 	step |= 1;
 	if(m_verbose > 1)
-	  LogPrintf("    EmcDns::EmcDns: Insert Local:[%s]->[%s] pos=%u step=%u\n", p, p_eq, pos, step);
-	do
+	  LogPrintf("    EmcDns::BuildTables: Insert Local:[%s]->[%s] pos=%u step=%u\n", p, p_eq, pos, step);
+	int probes = 0; // odd step visits all slots
+	do {
+	  if(++probes > 0x100)
+	    throw runtime_error("EmcDns::BuildTables: Hashtable is full");
 	  pos += step;
-        while(m_ht_offset[pos] != 0);
-	m_ht_offset[pos] = m_local_base - p; // negative value - flag LOCAL
+	} while(t->ht_offset[pos] != 0);
+	t->ht_offset[pos] = t->local_base - p; // negative value - flag LOCAL
 	p = strchr(p_eq, 0); // go to the next local record
       } // while
     } //  if(local_len)
 
+    return t;
+} // EmcDns::BuildTables
+
+/*---------------------------------------------------*/
+// Builds new tables off the hot path and publishes them. Workers pick them up before
+// the next packet; answers cache is dropped, since answers depend on tables.
+std::shared_ptr<const EmcDnsTables> EmcDns::Reload(const string *allowed_suff) {
+    LOCK(cs_tables);
+    const string &allowed = allowed_suff? *allowed_suff : m_allowed_str;
+    std::shared_ptr<const EmcDnsTables> tables = BuildTables(m_gw_suffix_str, allowed, m_local_fname);
+    m_allowed_str = allowed;
+    std::atomic_store(&m_tables, tables);
+    m_tables_gen.fetch_add(1, std::memory_order_release);
+    if(m_answers) {
+      m_answers->Clear();
+      m_nxanswers->Clear();
+    }
     if(m_verbose > 1)
-	 LogPrintf("EmcDns::EmcDns: Created/Attached: [%s]:%u; TLD=%u Local=%u\n",
-		 (bind_ip == NULL)? "INADDR_ANY" : bind_ip,
-		 port_no, m_allowed_qty, local_qty);
+      LogPrintf("EmcDns::Reload: TLD=%u Local=%u\n", tables->allowed_qty, tables->local_qty);
+    return tables;
+} // EmcDns::Reload
 
-    // Hack - pass TF file list through m_value to HandlePacket()
+/*---------------------------------------------------*/
+// Creates UDP socket, bound to bind_ip:port_no with SO_REUSEPORT,
+// or non-blocking TCP listener, if tcp
+SOCKET EmcDns::OpenSocket(const char *bind_ip, uint16_t port_no, bool tcp) {
+    SOCKET sockfd;
+    int ret = -1;
+    int type = tcp? SOCK_STREAM : SOCK_DGRAM;
+    // If bind IP started with ".", then we will create IPv4 socket
+    // Otherwise, try to open IPv6 in dual mode.
+    // For INADDR_ANY, yous just "." as Bind IP, or ".0.0.0.0"
+    if(bind_ip[0] == '.')
+        bind_ip++; // Skip dot, use "-1" here
+    else
+        ret = socket(PF_INET6, type, 0); // Try to create IPv6 socket
+    if(ret < 0) {
+        // Cannot create IPv46 - try IPv4
+        // Create and bind socket - IPv4 Only
+        ret = socket(PF_INET, type, 0);
+        if(ret < 0)
+            throw runtime_error("EmcDns::EmcDns: Cannot create ipv4 socket");
+        sockfd = ret;
 
-    if(tollfree && *tollfree) {
-      if(m_verbose > 1)
-	LogPrintf("    EmcDns::EmcDns: Setup deferred toll-free=%s\n", tollfree);
-      strcpy(m_value, tollfree);
-    } else
-      m_value[0] = 0;
+        struct sockaddr_in sin;
+        const int sinlen = sizeof(struct sockaddr_in);
+        memset(&sin, 0, sinlen);
+        sin.sin_port = htons(port_no);
+        sin.sin_family = AF_INET;
+        int yes = 1;
+#ifdef WIN32
+        if( (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,  (char *)&yes, sizeof(yes)) < 0)
+         || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,  (char *)&yes, sizeof(yes)) < 0))
+#else
+        if( (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,  (void *)&yes, sizeof(yes)) < 0)
+         || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,  (void *)&yes, sizeof(yes)) < 0))
+#endif
+        {
+            CloseSocket(sockfd);
+            throw runtime_error("EmcDns::EmcDns: Cannot SO_REUSEADDR|SO_REUSEPORT for IPv4 socket to IPV4 socket");
+        }
 
-    m_self_ns = gArgs.GetArg("-selfns", "");
-    if(m_self_ns.size() > 512) {
-	LogPrintf("    EmcDns::EmcDns: too long selfns=%s; ignored\n", m_self_ns.c_str());
-        m_self_ns.clear();
+        if(*bind_ip == 0 || inet_pton(AF_INET, bind_ip, &sin.sin_addr) != 1) {
+            sin.sin_addr.s_addr = INADDR_ANY;
+            bind_ip = NULL;
+        }
+
+        char buf[INET6_ADDRSTRLEN];
+	    LogPrintf("EmcDns::EmcDns: Bind to IPv4=%s:%u\n", inet_ntop(AF_INET, &sin.sin_addr.s_addr, buf, INET6_ADDRSTRLEN), port_no);
+        if(::bind(sockfd, (struct sockaddr *)&sin, sinlen) < 0) {
+            char buf[80];
+            sprintf(buf, "EmcDns::EmcDns: Cannot bind to IPv4 port %u", port_no);
+            CloseSocket(sockfd);
+            throw runtime_error(buf);
+        }
+    } else {
+        // Setup IPv46 socket
+        sockfd = ret;
+        struct sockaddr_in6 sin6;
+        const int sin6len = sizeof(struct sockaddr_in6);
+        memset(&sin6, 0, sin6len);
+        sin6.sin6_port = htons(port_no);
+        sin6.sin6_family = AF_INET6;
+
+        if(*bind_ip == 0 || inet_pton(AF_INET6, bind_ip, &sin6.sin6_addr) != 1) {
+            sin6.sin6_addr = in6addr_any;
+            bind_ip = NULL;
+        }
+        int no  = 0;
+        int yes = 1;
+#ifdef WIN32
+        if( (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&no,  sizeof(no))  < 0)
+         || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,  (char *)&yes, sizeof(yes)) < 0)
+         || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,  (char *)&yes, sizeof(yes)) < 0))
+#else
+        if( (setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&no,  sizeof(no))  < 0)
+         || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,  (void *)&yes, sizeof(yes)) < 0)
+         || (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,  (void *)&yes, sizeof(yes)) < 0))
+#endif
+        {
+            CloseSocket(sockfd);
+            throw runtime_error("EmcDns::EmcDns: Cannot switch socket to IPV4 compatibility mode");
+        }
+
+        char buf[INET6_ADDRSTRLEN];
+	    LogPrintf("EmcDns::EmcDns: Bind to IPv6=[%s]:%u\n", inet_ntop(AF_INET6, &sin6.sin6_addr, buf, INET6_ADDRSTRLEN), port_no);
+        if(::bind(sockfd, (struct sockaddr *)&sin6, sin6len) < 0) {
+            char buf[80];
+            sprintf(buf, "EmcDns::EmcDns: Cannot bind to IPv46 port %u; error: %s", port_no, strerror(errno));
+            CloseSocket(sockfd);
+            throw runtime_error(buf);
+        }
+    } // IPv46
+
+    if(tcp && (listen(sockfd, SOMAXCONN) < 0 || !SetSocketNonBlocking(sockfd, true))) {
+        CloseSocket(sockfd);
+        throw runtime_error("EmcDns::EmcDns: Cannot listen on TCP socket");
     }
+    return sockfd;
+} // EmcDns::OpenSocket
 
-    m_status = 1; // Active, and maybe download
-} // EmcDns::EmcDns
 /*---------------------------------------------------*/
 void EmcDns::AddTF(char *tf_tok) {
   // Skip comments and empty lines
@@ -479,18 +598,93 @@ void EmcDns::AddTF(char *tf_tok) {
     LogPrintf("    EmcDns::AddTF: Added token [%s] tf/e2u=%u:%u\n", tf_tok, m_tollfree.size(), m_tollfree.back().e2u.size());
 } // EmcDns::AddTF
 
+/*---------------------------------------------------*/
+// Called by worker while m_status != 0. Once IBD is completed, loads deferred
+// toll-free entries and sets m_status=0; workers see m_tollfree only after that.
+// valbuf is caller's VAL_SIZE buffer. Returns current m_status.
+int8_t EmcDns::DeferredInit(char *valbuf) {
+  LOCK(cs_init);
+  if(m_status == 0)
+    return 0; // Another worker completed init
+
+  // Embedded instance serves from nameindex as is
+  if(!m_workers.empty() && ::ChainstateActive().IsInitialBlockDownload())
+    return m_status = 1; // Not available valid nameindex DB yet
+
+  // Fill deferred toll-free default entries
+  char *tf_str = &m_tollfree_list[0];
+  // Iterate the list of Toll-Free fnames; can be fnames and NVS records
+  while(char *tf_fname = strsep(&tf_str, "|")) {
+    if(m_verbose > 1)
+      LogPrintf("    EmcDns::DeferredInit: handle deferred toll-free=%s\n", tf_fname);
+    if(tf_fname[0] == '@') { // this is NVS record
+      string value;
+      if(hooks->getNameValue(string(tf_fname + 1), value)) {
+        char *tf_val = strcpy(valbuf, value.c_str());
+        while(char *tf_tok = strsep(&tf_val, "\r\n"))
+          AddTF(tf_tok);
+      }
+    } else { // This is file
+      FILE *tf = fopen(tf_fname, "r");
+      if(tf != NULL) {
+        while(fgets(valbuf, VAL_SIZE, tf))
+          AddTF(valbuf);
+        fclose(tf);
+      }
+    } // if @
+  } // while tf_name
+  m_tollfree_list.clear();
+
+  // Names filter is filled in background; until completed, all names are looked up in nameindex
+  m_filter_thread = boost::thread(&EmcDns::FillNameFilter, this);
+
+  return m_status = 0;
+} // EmcDns::DeferredInit
+
+/*---------------------------------------------------*/
+// Adds all "dns:" names from nameindex into names filter.
+// Names changed meanwhile are added by NotifyNameChanged handler.
+void EmcDns::FillNameFilter() {
+  if(!pNameDB)
+    return; // No nameindex; filter is not ready and passes all names
+  const CNameVal prefix = nameValFromString(DNS_PREFIX ":");
+  uint32_t qty = 0;
+  for(CNameCursor cursor(*pNameDB, prefix); cursor.Valid() && !m_filter_stop; cursor.Next()) {
+    const CNameVal &name = cursor.GetName();
+    if(name.size() < prefix.size() || !std::equal(prefix.begin(), prefix.end(), name.begin()))
+      break; // End of dns: names
+    if(cursor.GetHead().deleted())
+      continue;
+    m_name_filter->Add((const char *)name.data(), name.size());
+    qty++;
+  }
+  if(m_filter_stop)
+    return;
+  m_name_filter->m_ready = true;
+  if(m_verbose > 1)
+    LogPrintf("EmcDns::FillNameFilter: Added %u names\n", qty);
+} // EmcDns::FillNameFilter
+
 /*---------------------------------------------------*/
 
 EmcDns::~EmcDns() {
     // reset current object to initial state
-#ifndef WIN32
-    shutdown(m_sockfd, SHUT_RDWR);
-#endif
-    CloseSocket(m_sockfd);
-    MilliSleep(100); // Allow 0.1s my thread to exit
-    // m_thread.join();
-    free(m_buf);
-    free(m_dap_ht);
+    m_name_changed.disconnect();
+    m_filter_stop = true;
+    if(m_filter_thread.joinable())
+      m_filter_thread.join();
+    for(EmcDnsWorker *w : m_workers)
+        w->Stop();
+    // Workers use shared tables and caches below, so wait until all of them exit
+    for(EmcDnsWorker *w : m_workers)
+        w->Join();
+    for(EmcDnsWorker *w : m_workers)
+        delete w;
+    delete[] m_dap_ht;
+    delete m_answers;
+    delete m_nxanswers;
+    delete m_sigs;
+    delete m_name_filter;
     if(m_verbose > 1)
 	 LogPrintf("EmcDns::~EmcDns: Destroyed OK\n");
 } // EmcDns::~EmcDns
@@ -498,34 +692,324 @@ EmcDns::~EmcDns() {
 
 /*---------------------------------------------------*/
 
-void EmcDns::StatRun(void *p) {
-  EmcDns *obj = (EmcDns*)p;
+EmcDnsWorker::EmcDnsWorker(EmcDns *dns, SOCKET sockfd, bool tcp)
+    : m_dns(dns), m_hdr(NULL), m_value(NULL), m_buf(NULL), m_snd(NULL), m_rcv(NULL),
+      m_rcvend(NULL), m_obufend(NULL), m_sockfd(sockfd), m_rcvlen(0), m_timestamp(0),
+      m_mintemp(0), m_ttl(0), m_label_ref(0), m_verbose(dns->m_verbose), m_tcp(tcp), m_cacheable(false),
+      m_tables(std::atomic_load(&dns->m_tables)), m_tables_gen(dns->m_tables_gen), m_stop(false) {
+
+    // Common buffers structure:
+    m_buf = (uint8_t *)malloc(
+              IO_SIZE  // I/O buf,               65K
+            + BUF_SIZE // Sanity check O-buf,    1K
+            + VAL_SIZE // Sanity check outvalue, 20K
+            + VAL_SIZE // Blockchain value,      20K
+            + 2);      // ?
+
+    if(m_buf == NULL) {
+      CloseSocket(m_sockfd);
+      throw runtime_error("EmcDnsWorker::EmcDnsWorker: Cannot allocate buffer");
+    }
+
+    // Assign data buffers inside m_value hyper-array
+    m_value = (char *)m_buf + IO_SIZE + BUF_SIZE + VAL_SIZE;
+    m_value[0] = 0;
+
+    if(m_sockfd != INVALID_SOCKET)
+      m_thread = boost::thread(StatRun, this);
+} // EmcDnsWorker::EmcDnsWorker
+
+/*---------------------------------------------------*/
+// Answers query in packet without socket I/O, for worker without socket.
+// Returns length of answer in Buffer(), or 0 if query is dropped.
+uint32_t EmcDnsWorker::ServePacket(const uint8_t *packet, int len, const struct sockaddr_storage &ss) {
+    if(len <= 0 || len > BUF_SIZE)
+      return 0;
+    memcpy(m_buf, packet, len);
+    m_rcvlen = len;
+    return Serve(ss);
+} // EmcDnsWorker::ServePacket
+
+/*---------------------------------------------------*/
+
+void EmcDnsWorker::Stop() {
+    m_stop = true;
+#ifndef WIN32
+    shutdown(m_sockfd, SHUT_RDWR);
+#endif
+    if(!m_tcp)
+      CloseSocket(m_sockfd); // TCP event loop closes own sockets at exit
+} // EmcDnsWorker::Stop
+
+/*---------------------------------------------------*/
+
+void EmcDnsWorker::Join() {
+    if(m_thread.joinable())
+      m_thread.join(); // UDP loop is woken by Stop(), TCP loop checks m_stop every second
+} // EmcDnsWorker::Join
+
+/*---------------------------------------------------*/
+
+EmcDnsWorker::~EmcDnsWorker() {
+    Join();
+    free(m_buf);
+} // EmcDnsWorker::~EmcDnsWorker
+
+/*---------------------------------------------------*/
+
+void EmcDnsWorker::StatRun(void *p) {
+  EmcDnsWorker *obj = (EmcDnsWorker*)p;
   obj->Run();
 //emercoin  ExitThread(0);
-} // EmcDns::StatRun
+} // EmcDnsWorker::StatRun
 
 /*---------------------------------------------------*/
-void EmcDns::Run() {
-  if(m_verbose > 1) LogPrintf("EmcDns::Run: started\n");
+void EmcDnsWorker::Run() {
+  if(m_verbose > 1) LogPrintf("EmcDnsWorker::Run: started, TCP=%d\n", m_tcp);
 
-  while(m_status < 0) // not initied yet
+  while(m_dns->m_status < 0 && !m_stop) // not initied yet
     MilliSleep(133);
+  if(m_stop)
+    return;
+
+  if(m_tcp)
+    RunTCP();
+  else
+    RunUDP();
+} //  EmcDnsWorker::Run
 
+/*---------------------------------------------------*/
+void EmcDnsWorker::RunUDP() {
+#ifdef EMCDNS_MMSG
+  if(m_dns->m_batch > 1 && RunUDPBatch())
+    return;
+#endif
   for( ; ; ) {
      struct sockaddr_storage ss;
      socklen_t sslen = sizeof(ss);
      m_rcvlen = recvfrom(m_sockfd, (char *)m_buf, BUF_SIZE, 0,
              (struct sockaddr *)&ss, &sslen);
 
-     if(m_rcvlen <= 0)
+     if(m_rcvlen <= 0 || m_stop)
          break;
 
-    if(m_dap_ht) {
+     uint32_t packet_len = Serve(ss);
+     if(packet_len)
+        sendto(m_sockfd, (const char *)m_buf, packet_len, MSG_NOSIGNAL,
+	             (const struct sockaddr *)&ss, sslen);
+  } // for
+
+  if(m_verbose > 1) LogPrintf("EmcDnsWorker::RunUDP: Received Exit packet_len=%d\n", m_rcvlen);
+
+} //  EmcDnsWorker::RunUDP
+
+/*---------------------------------------------------*/
+// Batch mode for Linux: receives up to m_batch packets by one recvmmsg, and sends
+// their answers by one sendmmsg. Returns false, if kernel does not support it,
+// and caller falls back to recvfrom/sendto.
+bool EmcDnsWorker::RunUDPBatch() {
+#ifdef EMCDNS_MMSG
+  int batch = m_dns->m_batch;
+  // Per-slot buffers: query, answer and client address; allocated once
+  vector<uint8_t>          rbufs(batch * BUF_SIZE), sbufs(batch * MAX_EDNS_OUT);
+  vector<struct sockaddr_storage> addrs(batch);
+  vector<struct iovec>     riov(batch), siov(batch);
+  vector<struct mmsghdr>   rmsgs(batch), smsgs(batch);
+  memset(rmsgs.data(), 0, batch * sizeof(struct mmsghdr));
+  memset(smsgs.data(), 0, batch * sizeof(struct mmsghdr));
+  for(int i = 0; i < batch; i++) {
+    riov[i].iov_base = rbufs.data() + i * BUF_SIZE;
+    riov[i].iov_len  = BUF_SIZE;
+    rmsgs[i].msg_hdr.msg_iov    = &riov[i];
+    rmsgs[i].msg_hdr.msg_iovlen = 1;
+    rmsgs[i].msg_hdr.msg_name   = &addrs[i];
+    siov[i].iov_base = sbufs.data() + i * MAX_EDNS_OUT;
+    smsgs[i].msg_hdr.msg_iov    = &siov[i];
+    smsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  int n;
+  for( ; ; ) {
+    for(int i = 0; i < batch; i++)
+      rmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+    // Wait for the 1st packet only, then take all already queued
+    n = recvmmsg(m_sockfd, rmsgs.data(), batch, MSG_WAITFORONE, NULL);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0 && errno == ENOSYS)
+      return false; // Not supported - use recvfrom
+    if(n <= 0 || m_stop)
+      break;
+
+    int nsend = 0;
+    for(int i = 0; i < n; i++) {
+      m_rcvlen = rmsgs[i].msg_len;
+      if(m_rcvlen <= 0)
+        continue;
+      memcpy(m_buf, riov[i].iov_base, m_rcvlen);
+      uint32_t packet_len = Serve(addrs[i]);
+      if(packet_len == 0 || packet_len > MAX_EDNS_OUT)
+        continue;
+      memcpy(siov[nsend].iov_base, m_buf, packet_len);
+      siov[nsend].iov_len = packet_len;
+      smsgs[nsend].msg_hdr.msg_name    = &addrs[i];
+      smsgs[nsend].msg_hdr.msg_namelen = rmsgs[i].msg_hdr.msg_namelen;
+      nsend++;
+    }
+
+    for(int sent = 0; sent < nsend; ) {
+      int rc = sendmmsg(m_sockfd, smsgs.data() + sent, nsend - sent, MSG_NOSIGNAL);
+      if(rc > 0)
+        sent += rc;
+      else
+      if(rc < 0 && errno == EINTR)
+        continue;
+      else
+        break; // Drop the rest, as sendto does on error
+    }
+  } // for
+
+  if(m_verbose > 1) LogPrintf("EmcDnsWorker::RunUDPBatch: Received Exit rc=%d\n", n);
+  return true;
+#else
+  return false;
+#endif
+} //  EmcDnsWorker::RunUDPBatch
+
+/*---------------------------------------------------*/
+static bool IsTransientError(int err) {
+  return err == WSAEWOULDBLOCK || err == WSAEINTR || err == WSAEINPROGRESS;
+}
+
+struct EmcDnsTCPConn {
+  SOCKET  fd;
+  struct sockaddr_storage ss;
+  time_t  active;	// Time of last I/O
+  string  rbuf;		// Received, not yet answered queries
+  string  wbuf;		// Answers, not yet sent
+};
+
+// Event loop for TCP listener and all its connections. Each message is prefixed
+// with 2-byte length (RFC1035 4.2.2); client can pipeline queries in one connection,
+// answers are sent in the same order.
+void EmcDnsWorker::RunTCP() {
+  vector<EmcDnsTCPConn> conns;
+  char rdbuf[4096];
+
+  while(!m_stop) {
+    fd_set rset, wset;
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    SOCKET maxfd = m_sockfd;
+    if(conns.size() < EMCDNS_TCPMAXCONN)
+      FD_SET(m_sockfd, &rset);
+    for(const EmcDnsTCPConn &c : conns) {
+      if(c.wbuf.size() < IO_SIZE) // Client does not read answers - stop reading its queries
+        FD_SET(c.fd, &rset);
+      if(!c.wbuf.empty())
+        FD_SET(c.fd, &wset);
+      if(c.fd > maxfd)
+        maxfd = c.fd;
+    }
+
+    struct timeval tv = {1, 0}; // Check m_stop and idle connections every second
+    int nready = select(maxfd + 1, &rset, &wset, NULL, &tv);
+    if(m_stop)
+      break;
+    if(nready < 0) {
+      if(WSAGetLastError() == WSAEINTR)
+        continue;
+      if(m_verbose > 0) LogPrintf("EmcDnsWorker::RunTCP: select error=%d\n", WSAGetLastError());
+      break;
+    }
+
+    time_t now = time(NULL);
+    if(nready > 0 && FD_ISSET(m_sockfd, &rset)) {
+      EmcDnsTCPConn c;
+      socklen_t sslen = sizeof(c.ss);
+      c.fd = accept(m_sockfd, (struct sockaddr *)&c.ss, &sslen);
+      if(c.fd != INVALID_SOCKET) {
+        if(IsSelectableSocket(c.fd) && SetSocketNonBlocking(c.fd, true)) {
+          c.active = now;
+          conns.push_back(std::move(c));
+        } else
+          CloseSocket(c.fd);
+      }
+    }
+
+    for(size_t i = 0; i < conns.size(); ) {
+      EmcDnsTCPConn &c = conns[i];
+      bool ok = true;
+      if(nready > 0 && FD_ISSET(c.fd, &rset)) {
+        int len = recv(c.fd, rdbuf, sizeof(rdbuf), 0);
+        if(len > 0) {
+          c.rbuf.append(rdbuf, len);
+          c.active = now;
+          ok = HandleTCPInput(c.rbuf, c.wbuf, c.ss);
+        } else
+          ok = len < 0 && IsTransientError(WSAGetLastError()); // 0 = closed by client
+      }
+      if(ok && nready > 0 && FD_ISSET(c.fd, &wset) && !c.wbuf.empty()) {
+        int len = send(c.fd, c.wbuf.data(), c.wbuf.size(), MSG_NOSIGNAL);
+        if(len > 0) {
+          c.wbuf.erase(0, len);
+          c.active = now;
+        } else
+          ok = len < 0 && IsTransientError(WSAGetLastError());
+      }
+      if(!ok || now - c.active > EMCDNS_TCPIDLE) {
+        CloseSocket(c.fd);
+        conns[i] = std::move(conns.back());
+        conns.pop_back();
+        continue;
+      }
+      i++;
+    } // for conns
+  } // while
+
+  for(EmcDnsTCPConn &c : conns)
+    CloseSocket(c.fd);
+  CloseSocket(m_sockfd);
+
+  if(m_verbose > 1) LogPrintf("EmcDnsWorker::RunTCP: Exit\n");
+} //  EmcDnsWorker::RunTCP
+
+/*---------------------------------------------------*/
+// Answers all complete queries in rbuf, and appends length-prefixed answers to wbuf.
+// Returns false, if stream is not DNS and connection must be closed.
+bool EmcDnsWorker::HandleTCPInput(string &rbuf, string &wbuf, const struct sockaddr_storage &ss) {
+  size_t pos = 0;
+  while(rbuf.size() - pos >= 2) {
+    uint16_t len = ((uint8_t)rbuf[pos] << 8) | (uint8_t)rbuf[pos + 1];
+    if(len < sizeof(DNSHeader) || len > BUF_SIZE)
+      return false; // Not a query
+    if(rbuf.size() - pos < 2u + len)
+      break; // Wait for the rest of query
+    memcpy(m_buf, rbuf.data() + pos + 2, len);
+    m_rcvlen = len;
+    pos += 2 + len;
+    uint32_t packet_len = Serve(ss);
+    if(packet_len) {
+      wbuf += (char)(packet_len >> 8);
+      wbuf += (char)packet_len;
+      wbuf.append((const char *)m_buf, packet_len);
+    }
+  } // while
+  rbuf.erase(0, pos);
+  return true;
+} // EmcDnsWorker::HandleTCPInput
+
+/*---------------------------------------------------*/
+// Answers query in m_buf[0..m_rcvlen) from client ss.
+// Returns length of answer in m_buf, or 0 if query is dropped.
+uint32_t EmcDnsWorker::Serve(const struct sockaddr_storage &ss) {
+    if(m_dns->m_dap_ht) {
       uint32_t now = time(NULL);
-      if(((now ^ m_daprand) & 0xfffff) == 0) {
+      uint32_t daprand = m_dns->m_daprand;
+      if(((now ^ daprand) & 0xfffff) == 0) {
         // ~weekly update daprand
-        GetRandBytes((uint8_t *)&m_daprand, sizeof(m_daprand));
-        m_daprand |= 1;
+        GetRandBytes((uint8_t *)&daprand, sizeof(daprand));
+        m_dns->m_daprand = daprand | 1;
       }
       m_timestamp = now >> EMCDNS_DAPSHIFTDECAY; // time in 256s (~4 min)
     }
@@ -544,33 +1028,40 @@ void EmcDns::Run() {
     }
 
     if(m_verbose > 4)
-        LogPrintf(" *** EmcDns::Run: Got packet_len=%d from: %s\n", m_rcvlen,
+        LogPrintf(" *** EmcDnsWorker::Serve: Got packet_len=%d from: %s\n", m_rcvlen,
                 inet_ntop(ss.ss_family, addr_ptr, ip_str, INET6_ADDRSTRLEN));
 
+    EmcDnsStats::Inc(m_tcp? m_stats.tcp : m_stats.udp);
+    uint32_t packet_len = 0;
     if(CheckDAP(addr_ptr, addr_len, m_rcvlen >> 5)) {
       m_buf[BUF_SIZE] = 0; // Set terminal for infinity QNAME
+      int64_t start = GetTimeMicros();
       uint16_t rc = HandlePacket();
+      uint64_t usecs = std::max<int64_t>(GetTimeMicros() - start, 0);
+      int bucket = 0;
+      while(bucket < EMCDNS_LATBUCKETS - 1 && (usecs >> bucket) != 0)
+        bucket++;
+      EmcDnsStats::Inc(m_stats.latency[bucket]);
+      EmcDnsStats::Inc(m_stats.latency_sum, usecs);
       uint16_t add_temp = rc == 0? 0 : 100;
       if(rc != 0xDead) {
-        uint32_t packet_len = m_snd - m_buf;
-        sendto(m_sockfd, (const char *)m_buf, packet_len, MSG_NOSIGNAL,
-	             (const struct sockaddr *)&ss, sslen);
-        add_temp += packet_len >> 5; // Add temp for long answer
-      } else
+        packet_len = m_snd - m_buf;
+        if(!m_tcp)
+          add_temp += packet_len >> 5; // Add temp for long answer; TCP cannot be amplifier
+      } else {
           add_temp += 50;
+          EmcDnsStats::Inc(m_stats.dap_domain);
+      }
       CheckDAP(addr_ptr, addr_len, add_temp); // More heat!
-    } // dap check
-  } // for
-
-
-  if(m_verbose > 1) LogPrintf("EmcDns::Run: Received Exit packet_len=%d\n", m_rcvlen);
-
-} //  EmcDns::Run
+    } else
+      EmcDnsStats::Inc(m_stats.dap_ip);
+    return packet_len;
+} //  EmcDnsWorker::Serve
 
 /*---------------------------------------------------*/
 
-int EmcDns::HandlePacket() {
-  if(m_verbose > 3) LogPrintf("*    EmcDns::HandlePacket: Handle packet_len=%d\n", m_rcvlen);
+int EmcDnsWorker::HandlePacket() {
+  if(m_verbose > 3) LogPrintf("*    EmcDnsWorker::HandlePacket: Handle packet_len=%d\n", m_rcvlen);
 
   m_hdr = (DNSHeader *)m_buf;
   // Decode input header from network format
@@ -578,24 +1069,33 @@ int EmcDns::HandlePacket() {
 
   m_rcv = m_buf + sizeof(DNSHeader);
   m_rcvend = m_snd = m_buf + m_rcvlen;
-  m_obufend = m_snd + MAX_OUT; // ptr to output bufend - 512b from m_rcvend
+  // ptr to output bufend; answer is generated up to transport limit, and truncated below to client's limit
+  m_obufend = m_snd + (m_tcp? MAX_TCP_OUT - m_rcvlen : MAX_EDNS_OUT);
 
   if(m_verbose > 4) {
-    LogPrintf("    EmcDns::HandlePacket: msgID  : %d\n", m_hdr->msgID);
-    LogPrintf("    EmcDns::HandlePacket: Bits   : %04x\n", m_hdr->Bits);
-    LogPrintf("    EmcDns::HandlePacket: QDCount: %d\n", m_hdr->QDCount);
-    LogPrintf("    EmcDns::HandlePacket: ANCount: %d\n", m_hdr->ANCount);
-    LogPrintf("    EmcDns::HandlePacket: NSCount: %d\n", m_hdr->NSCount);
-    LogPrintf("    EmcDns::HandlePacket: ARCount: %d\n", m_hdr->ARCount);
+    LogPrintf("    EmcDnsWorker::HandlePacket: msgID  : %d\n", m_hdr->msgID);
+    LogPrintf("    EmcDnsWorker::HandlePacket: Bits   : %04x\n", m_hdr->Bits);
+    LogPrintf("    EmcDnsWorker::HandlePacket: QDCount: %d\n", m_hdr->QDCount);
+    LogPrintf("    EmcDnsWorker::HandlePacket: ANCount: %d\n", m_hdr->ANCount);
+    LogPrintf("    EmcDnsWorker::HandlePacket: NSCount: %d\n", m_hdr->NSCount);
+    LogPrintf("    EmcDnsWorker::HandlePacket: ARCount: %d\n", m_hdr->ARCount);
   }
   // Assert following 3 counters and bits are zero
   uint16_t zCount = m_hdr->ANCount | m_hdr->NSCount | (m_hdr->Bits & (m_hdr->QR_MASK | m_hdr->TC_MASK));
 
+  uint16_t qARCount = m_hdr->ARCount;
   // Clear answer counters - maybe contains junk from client
   m_hdr->ANCount = m_hdr->NSCount = m_hdr->ARCount = 0;
   m_hdr->Bits &= m_hdr->RD_MASK;
   m_hdr->Bits |= m_hdr->QR_MASK | m_hdr->AA_MASK;
 
+  // Pick up reloaded tables; old ones are freed, when last worker drops them
+  uint32_t tables_gen = m_dns->m_tables_gen.load(std::memory_order_acquire);
+  if(tables_gen != m_tables_gen) {
+    m_tables = std::atomic_load(&m_dns->m_tables);
+    m_tables_gen = tables_gen;
+  }
+
   uint16_t rc;
 
   do {
@@ -611,40 +1111,53 @@ int EmcDns::HandlePacket() {
       break;
     }
 
-    if(m_status) {
-      if((m_status = ::ChainstateActive().IsInitialBlockDownload()) != 0) {
-        rc = 2; // Server failure - not available valid nameindex DB yet
+    if(m_dns->m_status && m_dns->DeferredInit(m_value) != 0) {
+      rc = 2; // Server failure - not available valid nameindex DB yet
+      break;
+    }
+
+    // Single question can be answered from cache: append cached answer to the question,
+    // header with message ID is already in place
+    string question;
+    if(m_dns->m_answers && m_hdr->QDCount == 1 && GetQuestion(question)) {
+      EmcDnsAnswer answer;
+      bool positive = m_dns->m_answers->Get(question, answer);
+      bool negative = !positive && m_dns->m_nxanswers->Get(question, answer);
+      if(positive || negative) {
+        EmcDnsStats::Inc(m_stats.cache_hit);
+        size_t qt = question.size() - 4; // qtype precedes qclass at the end
+        EmcDnsStats::Inc(m_stats.qtype[EmcDnsStats::QTypeIndex(((uint8_t)question[qt] << 8) | (uint8_t)question[qt + 1])]);
+        // Heat domain as HandleQuery does, including penalty for not found name
+        if(!CheckDAP(answer.dapkey.data(), -(int)answer.dapkey.size(), negative? 240 : 0))
+          return 0xDead; // Botnet detected, as in HandleQuery
+        if(m_verbose > 4)
+          LogPrintf("    EmcDnsWorker::HandlePacket: cached answer for [%s]\n", answer.dapkey.c_str());
+        m_rcv += question.size();
+        memcpy(m_snd, answer.data.data(), answer.data.size());
+        m_snd += answer.data.size();
+        m_hdr->ANCount = answer.ancount;
+        m_hdr->NSCount = answer.nscount;
+        m_hdr->ARCount = answer.arcount;
+        m_hdr->Bits |= answer.rcode;
+        rc = negative? 3 : 0;
         break;
-      } else {
-	// Fill deferred toll-free default entries
-        char *tf_str = m_value;
-        // Iterate the list of Toll-Free fnames; can be fnames and NVS records
-        while(char *tf_fname = strsep(&tf_str, "|")) {
-          if(m_verbose > 1)
-	    LogPrintf("    EmcDns::HandlePacket: handle deferred toll-free=%s\n", tf_fname);
-          if(tf_fname[0] == '@') { // this is NVS record
-            string value;
-            if(hooks->getNameValue(string(tf_fname + 1), value)) {
-              char *tf_val = strcpy(m_value, value.c_str());
-              while(char *tf_tok = strsep(&tf_val, "\r\n"))
-	        AddTF(tf_tok);
-	    }
-          } else { // This is file
-	    FILE *tf = fopen(tf_fname, "r");
- 	    if(tf != NULL) {
-	      while(fgets(m_value, VAL_SIZE, tf))
-	        AddTF(m_value);
-	      fclose(tf);
-	    }
-          } // if @
-        } // while tf_name
-      } // m_status #2
-    } // m_status #1
+      }
+      EmcDnsStats::Inc(m_stats.cache_miss);
+    } else
+      question.clear();
+    // Taken before names are read; answer is not cached, if any name is changed meanwhile
+    uint64_t gen = 0, nxgen = 0;
+    if(!question.empty()) {
+      gen   = m_dns->m_answers->Generation();
+      nxgen = m_dns->m_nxanswers->Generation();
+    }
 
     // Handle questions here
+    m_cacheable = true;
+    m_names.clear();
     for(uint16_t qno = 0; qno < m_hdr->QDCount && m_snd < m_obufend; qno++) {
       if(m_verbose > 5)
-        LogPrintf("    EmcDns::HandlePacket: qno=%u m_hdr->QDCount=%u\n", qno, m_hdr->QDCount);
+        LogPrintf("    EmcDnsWorker::HandlePacket: qno=%u m_hdr->QDCount=%u\n", qno, m_hdr->QDCount);
       rc = HandleQuery();
       if(rc) {
 	if(rc == 0xDead)
@@ -652,8 +1165,32 @@ int EmcDns::HandlePacket() {
 	break;
       }
     }
+
+    // Cache answers and NXDOMAINs; do not cache answer from old tables, if reload happened meanwhile
+    if(!question.empty() && (rc == 0 || rc == 3) && m_cacheable && m_snd - m_rcvend <= MAX_EDNS_OUT * 4
+       && m_tables_gen == m_dns->m_tables_gen.load(std::memory_order_relaxed)) {
+      EmcDnsAnswer answer;
+      answer.dapkey  = m_dapkey;
+      answer.data.assign((const char *)m_rcvend, m_snd - m_rcvend);
+      answer.ancount = m_hdr->ANCount;
+      answer.nscount = m_hdr->NSCount;
+      answer.arcount = m_hdr->ARCount;
+      answer.rcode   = m_hdr->Bits & m_hdr->RCODE_MASK;
+      if(rc == 0)
+        m_dns->m_answers->Put(question, answer, m_names, gen);
+      else
+        m_dns->m_nxanswers->Put(question, answer, m_names, nxgen);
+    }
   } while(false);
 
+  // Max answer size: 64K for TCP; for UDP - client's payload size from EDNS0 OPT record (RFC6891),
+  // which is 1st in AR-section, or 512 for old DNS
+  uint32_t out_max = m_tcp? MAX_TCP_OUT : MAX_OUT;
+  if(!m_tcp && rc == 0 && qARCount && m_rcvend - m_rcv >= 11 && m_rcv[0] == 0 && m_rcv[1] == 0 && m_rcv[2] == 41) {
+    uint16_t edns_size = (m_rcv[3] << 8) | m_rcv[4];
+    out_max = edns_size < MAX_OUT? MAX_OUT : edns_size > MAX_EDNS_OUT? MAX_EDNS_OUT : edns_size;
+  }
+
   // Remove AR-section from request, if exist
   int ar_len = m_rcvend - m_rcv;
 
@@ -671,18 +1208,46 @@ int EmcDns::HandlePacket() {
   if((m_hdr->Bits & 0xf) == 0)
     Answer_OPT();
 
-  // Truncate answer, if needed
-  if(m_snd >= m_buf + MAX_OUT) {
+  // Truncate answer, if needed: send question only, and client will retry over TCP
+  if(m_snd > m_buf + out_max) {
     m_hdr->Bits |= m_hdr->TC_MASK;
-    m_snd = m_buf + MAX_OUT;
+    if(ar_len < 0) { // Broken question - return header only
+      m_snd = m_buf + sizeof(DNSHeader);
+      m_hdr->QDCount = 0;
+    } else
+      m_snd = m_rcv;
+    m_hdr->ANCount = m_hdr->NSCount = m_hdr->ARCount = 0;
+    if((m_hdr->Bits & 0xf) == 0)
+      Answer_OPT();
+    EmcDnsStats::Inc(m_stats.truncated);
   }
+  EmcDnsStats::Inc(m_stats.rcode[m_hdr->Bits & m_hdr->RCODE_MASK]);
   // Encode output header into network format
   m_hdr->Transcode();
   return rc; // answer ready
-} // EmcDns::HandlePacket
+} // EmcDnsWorker::HandlePacket
+
+/*---------------------------------------------------*/
+// Extracts question at m_rcv with qname in lower case - key for answers cache
+bool EmcDnsWorker::GetQuestion(string &question) {
+  const uint8_t *p = m_rcv;
+  uint8_t dom_len;
+  while(p < m_rcvend && (dom_len = *p) != 0) {
+    if(dom_len & 0xc0)
+      return false;
+    p += dom_len + 1;
+  }
+  if(m_rcvend - p < 5) // Zero label, qtype, qclass
+    return false;
+  question.assign((const char *)m_rcv, p + 5 - m_rcv);
+  for(size_t i = 0; i < question.size() - 4; i++)
+    if(question[i] >= 'A' && question[i] <= 'Z')
+      question[i] |= 040;
+  return true;
+} // EmcDnsWorker::GetQuestion
 
 /*---------------------------------------------------*/
-uint16_t EmcDns::HandleQuery() {
+uint16_t EmcDnsWorker::HandleQuery() {
   // Decode qname
   uint8_t key[BUF_SIZE];				// Key, transformed to dot-separated LC
   uint8_t *key_end = key;
@@ -712,6 +1277,7 @@ uint16_t EmcDns::HandleQuery() {
 
   uint16_t qtype  = *m_rcv++; qtype  = (qtype  << 8) + *m_rcv++;
   uint16_t qclass = *m_rcv++; qclass = (qclass << 8) + *m_rcv++;
+  EmcDnsStats::Inc(m_stats.qtype[EmcDnsStats::QTypeIndex(qtype)]);
 
   if(qclass != 1)
     return 4; // Not implemented - support INET only
@@ -719,21 +1285,22 @@ uint16_t EmcDns::HandleQuery() {
   *--key_end = 0; // Remove last dot, set EOLN
 
   if(m_verbose > 4)
-    LogPrintf("EmcDns::HandleQuery: Translated domain name: [%s]; DomainsQty=%d\n", key, (int)(domain_ndx_p - domain_ndx));
+    LogPrintf("EmcDnsWorker::HandleQuery: Translated domain name: [%s]; DomainsQty=%d\n", key, (int)(domain_ndx_p - domain_ndx));
 
   // If this is public gateway, gw-suffix can be specified, like
   // emcdnssuffix=.xyz.com
   // Following block cuts this suffix, if exists.
   // If received domain name "xyz.com" only, key is empty string
-  if(m_gw_suf_len) { // suffix defined [public DNS], need to cut/replace
-    uint8_t *p_suffix = key_end - m_gw_suf_len;
-    if(p_suffix >= key && strcmp((const char *)p_suffix, m_gw_suffix) == 0) {
-      strcpy((char*)p_suffix, m_gw_suffix_replace);
-      key_end = p_suffix + m_gw_suffix_replace_len;
-      domain_ndx_p -= m_gw_suf_dots;
+  const EmcDnsTables *t = m_tables.get();
+  if(t->gw_suf_len) { // suffix defined [public DNS], need to cut/replace
+    uint8_t *p_suffix = key_end - t->gw_suf_len;
+    if(p_suffix >= key && strcmp((const char *)p_suffix, t->gw_suffix) == 0) {
+      strcpy((char*)p_suffix, t->gw_suffix_replace);
+      key_end = p_suffix + t->gw_suffix_replace_len;
+      domain_ndx_p -= t->gw_suf_dots;
     } else
     // check special - if suffix == GW-site, e.g., request: emergate.net
-    if(p_suffix == key - 1 && strcmp((const char *)p_suffix + 1, m_gw_suffix + 1) == 0) {
+    if(p_suffix == key - 1 && strcmp((const char *)p_suffix + 1, t->gw_suffix + 1) == 0) {
       *++p_suffix = 0; // Set empty search key
       key_end = p_suffix;
       domain_ndx_p = domain_ndx;
@@ -742,12 +1309,13 @@ uint16_t EmcDns::HandleQuery() {
 
   if(!CheckDAP(key, key - key_end, 0)) {
     if(m_verbose > 3)
-      LogPrintf("    EmcDns::HandleQuery: Aborted domain %s by DAP mintemp=%u\n", key, m_mintemp);
+      LogPrintf("    EmcDnsWorker::HandleQuery: Aborted domain %s by DAP mintemp=%u\n", key, m_mintemp);
     return 0xDead; // Botnet detected, abort query processing
   }
+  m_dapkey.assign((const char *)key, key_end - key);
 
   if(m_verbose > 2)
-    LogPrintf("EmcDns::HandleQuery: Key=%s QType=0x%x[%s] mintemp=%u\n", key, qtype, decodeQtype(qtype), m_mintemp);
+    LogPrintf("EmcDnsWorker::HandleQuery: Key=%s QType=0x%x[%s] mintemp=%u\n", key, qtype, decodeQtype(qtype), m_mintemp);
 
   // Search for TLD-suffix, like ".coin"
   // If name without dot, like "www", this is candidate for local search
@@ -759,7 +1327,7 @@ uint16_t EmcDns::HandleQuery() {
   uint8_t *p0 = key_end, *p_tld = key;
 
   if(m_verbose > 4)
-    LogPrintf("EmcDns::HandleQuery: After GW-suffix cut: [%s]\n", key);
+    LogPrintf("EmcDnsWorker::HandleQuery: After GW-suffix cut: [%s]\n", key);
 
   while(p0 > key) {
     uint8_t c = *--p0;
@@ -770,7 +1338,7 @@ uint16_t EmcDns::HandleQuery() {
     } // if(c == '.')
     pos0  = ((pos0 >> 7) | (pos0 << 1)) + c;
     step0 = ((step0 << 5) - step0) ^ c; // (step * 31) ^ c
-    if(c == '.' && (m_flags & FLAG_LOCAL_SD) && LocalSearch(p0, pos0, step0 | 1) > 0) { // search there with SDs, like SD.emer.emc
+    if(c == '.' && (t->flags & FLAG_LOCAL_SD) && LocalSearch(p0, pos0, step0 | 1) > 0) { // search there with SDs, like SD.emer.emc
       p_tld = NULL; // local search is OK, do not perform nameindex search
       break;
     }
@@ -790,27 +1358,27 @@ uint16_t EmcDns::HandleQuery() {
       step = step0;
     }
     // Check domain by tld filters, if activated. Otherwise, pass to nameindex as is.
-    if(m_allowed_qty) { // Activated TLD-filter
+    if(t->allowed_qty) { // Activated TLD-filter
       if(*p_tld != '.') {
         if(m_verbose > 0)
-          LogPrintf("EmcDns::HandleQuery: TLD-suffix=[.%s] is not specified in given key=%s; return NXDOMAIN\n", p_tld, key);
+          LogPrintf("EmcDnsWorker::HandleQuery: TLD-suffix=[.%s] is not specified in given key=%s; return NXDOMAIN\n", p_tld, key);
 	return 3; // TLD-suffix is not specified, so NXDOMAIN
       }
       p_tld++; // Set PTR after dot, to the suffix lile .[coin]
       const char *allowed_tld;
       do {
         pos += step;
-        if(m_ht_offset[pos] == 0) {
+        if(t->ht_offset[pos] == 0) {
           if(m_verbose > 0)
-  	    LogPrintf("EmcDns::HandleQuery: TLD-suffix=[.%s] in given key=%s is not allowed; return REFUSED\n", p_tld, key);
+  	    LogPrintf("EmcDnsWorker::HandleQuery: TLD-suffix=[.%s] in given key=%s is not allowed; return REFUSED\n", p_tld, key);
 	  return 5; // Reached EndOfList, so REFUSED
         }
-        allowed_tld = m_allowed_base + (m_ht_offset[pos] & ~ENUM_FLAG);
-      } while(m_ht_offset[pos] < 0 || strcmp((const char *)p_tld, allowed_tld) != 0);
+        allowed_tld = t->allowed_base + (t->ht_offset[pos] & ~ENUM_FLAG);
+      } while(t->ht_offset[pos] < 0 || strcmp((const char *)p_tld, allowed_tld) != 0);
 
       maxlen_domchain = allowed_tld[-1];
       // ENUM SPFUN works only if TLD-filter is active and if requested NAPTR. Otherwise - NXDOMAIN
-      if(m_ht_offset[pos] & ENUM_FLAG)
+      if(t->ht_offset[pos] & ENUM_FLAG)
         return qtype == 0x23? SpfunENUM(maxlen_domchain, domain_ndx, domain_ndx_p) : 3;
 
     } // if(m_allowed_qty)
@@ -821,7 +1389,7 @@ uint16_t EmcDns::HandleQuery() {
     // Is not needed, already checked when domain_ndx_p increased
     if(domain_ndx_p - domain_ndx > maxlen_domchain) {
       if(m_verbose > 0)
-        LogPrintf("EmcDns::HandleQuery: Requested domain [%s] has too long chain=%d, disallowed for TLD-suffix=[.%s] maxlen=%d; return REFUSED\n",
+        LogPrintf("EmcDnsWorker::HandleQuery: Requested domain [%s] has too long chain=%d, disallowed for TLD-suffix=[.%s] maxlen=%d; return REFUSED\n",
                 key, domain_ndx_p - domain_ndx, p_tld, maxlen_domchain);
       return 5; // Too long subdomains chain, so REFUSED
     }
@@ -905,10 +1473,10 @@ uint16_t EmcDns::HandleQuery() {
       break;
   } // switch
   return 0;
-} // EmcDns::HandleQuery
+} // EmcDnsWorker::HandleQuery
 
 /*---------------------------------------------------*/
-int EmcDns::TryMakeref(uint16_t label_ref) {
+int EmcDnsWorker::TryMakeref(uint16_t label_ref) {
   char val2[VAL_SIZE];
   char *tokens[MAX_TOK];
   int ttlqty = Tokenize("TTL", NULL, tokens, strcpy(val2, m_value));
@@ -919,12 +1487,12 @@ int EmcDns::TryMakeref(uint16_t label_ref) {
   m_label_ref = orig_label_ref;
   m_hdr->NSCount = m_hdr->ANCount;
   m_hdr->ANCount = 0;
-  LogPrintf("EmcDns::TryMakeref: Generated REF NS=%u\n", m_hdr->NSCount);
+  LogPrintf("EmcDnsWorker::TryMakeref: Generated REF NS=%u\n", m_hdr->NSCount);
   return m_hdr->NSCount;
-} //  EmcDns::TryMakeref
+} //  EmcDnsWorker::TryMakeref
 /*---------------------------------------------------*/
 
-int EmcDns::Tokenize(const char *key, const char *sep2, char **tokens, char *buf) {
+int EmcDnsWorker::Tokenize(const char *key, const char *sep2, char **tokens, char *buf) {
   int tokensN = 0;
 
   // Figure out main separator. If not defined, use |
@@ -974,10 +1542,10 @@ int EmcDns::Tokenize(const char *key, const char *sep2, char **tokens, char *buf
       break;
   } // for - big tokens (MX, A, AAAA, etc)
   return tokensN;
-} // EmcDns::Tokenize
+} // EmcDnsWorker::Tokenize
 
 /*---------------------------------------------------*/
-void EmcDns::Answer_ALL(uint16_t qtype, char *buf) {
+void EmcDnsWorker::Answer_ALL(uint16_t qtype, char *buf) {
   uint16_t needed_addl = qtype & QTYPE_ADDL;
   qtype ^= needed_addl;
   const char *key = decodeQtype(qtype);
@@ -988,7 +1556,7 @@ void EmcDns::Answer_ALL(uint16_t qtype, char *buf) {
   int tokQty = Tokenize(key, ",", tokens, buf);
 
   if(m_verbose > 4)
-      LogPrintf("EmcDns::Answer_ALL(QT=%d, key=%s); TokenQty=%d\n", qtype, key, tokQty);
+      LogPrintf("EmcDnsWorker::Answer_ALL(QT=%d, key=%s); TokenQty=%d\n", qtype, key, tokQty);
 
   if(tokQty == 0)
       return; // Nothing to do
@@ -1001,9 +1569,9 @@ void EmcDns::Answer_ALL(uint16_t qtype, char *buf) {
       int orig_tokQty = tokQty;
       for(int tok_no = 0; tok_no < orig_tokQty; tok_no++)
           if(tokens[tok_no][0] == '@') {
-              if(self_list == (char *)0x1 && !m_self_ns.empty()) {
+              if(self_list == (char *)0x1 && !m_dns->m_self_ns.empty()) {
                   // Expand '@' just once
-                  self_list = (char *)memcpy(alloca(m_self_ns.length() + 1), m_self_ns.c_str(), m_self_ns.length() + 1);
+                  self_list = (char *)memcpy(alloca(m_dns->m_self_ns.length() + 1), m_dns->m_self_ns.c_str(), m_dns->m_self_ns.length() + 1);
                   while(char *tok = strsep(&self_list, ",|;"))
                       if(tokQty < MAX_TOK + 32)
                           tokens[tokQty++] = tok;
@@ -1035,7 +1603,7 @@ void EmcDns::Answer_ALL(uint16_t qtype, char *buf) {
           continue;
       }
       if(m_verbose > 4)
-	LogPrintf("    EmcDns::Answer_ALL: Token:%u=[%s]\n", tok_no, tokens[tok_no]);
+	LogPrintf("    EmcDnsWorker::Answer_ALL: Token:%u=[%s]\n", tok_no, tokens[tok_no]);
       Out2(m_label_ref);
       Out2(qtype); // A record, or maybe something else
       Out2(1); //  INET
@@ -1059,7 +1627,7 @@ void EmcDns::Answer_ALL(uint16_t qtype, char *buf) {
     m_hdr->NSCount += actual_tokQty;
   else
     m_hdr->ANCount += actual_tokQty;
-} // EmcDns::Answer_ALL
+} // EmcDnsWorker::Answer_ALL
 
 /*---------------------------------------------------*/
 /*
@@ -1070,17 +1638,17 @@ TTL 	u_int32_t 	extended RCODE and flags
 RDLEN 	u_int16_t 	length of all RDATA
 RDATA 	octet stream 	{attribute,value} pairs
 */
-void EmcDns::Answer_OPT() {
+void EmcDnsWorker::Answer_OPT() {
   *m_snd++ = 0; // Name: =0
   Out2(41);     // Type: OPT record 0x29
-  Out2(MAX_OUT);// Class: Out size
+  Out2(MAX_EDNS_OUT); // Class: Out size
   Out4(0);      // TTL - all zeroes
   Out2(0);      // RDLEN
   m_hdr->ARCount++;
-} // EmcDns::Answer_OPT
+} // EmcDnsWorker::Answer_OPT
 /*---------------------------------------------------*/
 
-void EmcDns::Fill_RD_IP(char *ipddrtxt, int af) {
+void EmcDnsWorker::Fill_RD_IP(char *ipddrtxt, int af) {
   uint16_t out_sz;
   switch(af) {
       case AF_INET : out_sz = 4;  break;
@@ -1092,11 +1660,11 @@ void EmcDns::Fill_RD_IP(char *ipddrtxt, int af) {
     m_snd += out_sz;
   else
     m_snd -= 12, m_hdr->ANCount--; // 12 = clear this 2 and 10 bytes at caller
-} // EmcDns::Fill_RD_IP
+} // EmcDnsWorker::Fill_RD_IP
 
 /*---------------------------------------------------*/
 
-int EmcDns::Fill_RD_DName(char *txt, uint8_t mxsz, int8_t txtcor) {
+int EmcDnsWorker::Fill_RD_DName(char *txt, uint8_t mxsz, int8_t txtcor) {
   uint8_t *snd0 = m_snd;
   m_snd += 3 + mxsz; // skip SZ and sz0
   uint8_t *tok_sz = m_snd - 1;
@@ -1165,12 +1733,12 @@ int EmcDns::Fill_RD_DName(char *txt, uint8_t mxsz, int8_t txtcor) {
     *snd0++ = mx_pri;
   }
   return label_ref;
-} // EmcDns::Fill_RD_DName
+} // EmcDnsWorker::Fill_RD_DName
 
 /*---------------------------------------------------*/
 // SRV record input format: SRV=Pref:Prio:domain:port:domain-TXT
 // Wire format: RDlen[2] Pri[2] Wei[2] Port[2] Domain[*]
-void EmcDns::Fill_RD_SRV(char *txt) {
+void EmcDnsWorker::Fill_RD_SRV(char *txt) {
   uint8_t *snd0 = m_snd;
   do {
     uint16_t pri = atoi(txt);
@@ -1199,7 +1767,7 @@ void EmcDns::Fill_RD_SRV(char *txt) {
   } while(0);
   m_hdr->Bits |= 2; // SERVFAIL - Server failed to complete the DNS request
   m_snd = snd0;
-} // EmcDns::Fill_RD_SRV
+} // EmcDnsWorker::Fill_RD_SRV
 
 /*---------------------------------------------------*/
 static unsigned GetHex(uint8_t c) {
@@ -1213,7 +1781,7 @@ static unsigned GetHex(uint8_t c) {
 /*---------------------------------------------------*/
 // TLSA record input format: TLSA=Usage:Selector:Matching:TXT
 // Wire format: Usage[1] Selector[1] Matching[1] TXT[*]
-void EmcDns::Fill_RD_TLSA(char *txt) {
+void EmcDnsWorker::Fill_RD_TLSA(char *txt) {
   uint8_t *snd0 = m_snd;
   m_snd += 2; // Allocate space for RR_size
   do {
@@ -1252,13 +1820,13 @@ void EmcDns::Fill_RD_TLSA(char *txt) {
   hex_failure:
   m_hdr->Bits |= 2; // SERVFAIL - Server failed to complete the DNS request
   m_snd = snd0;
-} // EmcDns::Fill_RD_TLSA
+} // EmcDnsWorker::Fill_RD_TLSA
 
 /*---------------------------------------------------*/
 // CAA record input format: CAA=flag tag value
 // Wire format: flag[1] tag_len[1] tag[tag_len] value[*]
 // https://www.rfc-editor.org/rfc/rfc6844#section-5.1
-void EmcDns::Fill_RD_CAA(char *txt) {
+void EmcDnsWorker::Fill_RD_CAA(char *txt) {
   uint8_t *snd0 = m_snd;
   m_snd += 2; // Allocate space for RR_size
   *m_snd++ = atoi(txt); // save flags
@@ -1307,29 +1875,39 @@ void EmcDns::Fill_RD_CAA(char *txt) {
   bad_data:
   m_hdr->Bits |= 2; // SERVFAIL - Server failed to complete the DNS request
   m_snd = snd0;
-} // EmcDns::Fill_RD_CAA
+} // EmcDnsWorker::Fill_RD_CAA
+
+/*---------------------------------------------------*/
+// Returns false, if name surely does not exist, and nameindex lookup can be skipped
+bool EmcDnsWorker::NameMayExist(const char *name, int len) {
+  if(len < 0 || len >= BUF_SIZE || m_dns->m_name_filter->MayContain(name, len))
+    return true;
+  EmcDnsStats::Inc(m_stats.filtered);
+  return false;
+} // EmcDnsWorker::NameMayExist
 
 /*---------------------------------------------------*/
 
-int EmcDns::Search(uint8_t *key, bool check_domain_sig) {
+int EmcDnsWorker::Search(uint8_t *key, bool check_domain_sig) {
   if(m_verbose > 4)
-    LogPrintf("EmcDns::Search(%s, check_domain_sig=%d)\n", key, check_domain_sig);
+    LogPrintf("EmcDnsWorker::Search(%s, check_domain_sig=%d)\n", key, check_domain_sig);
 
   char search_key[BUF_SIZE];
   string value;
   if(check_domain_sig) {
+      m_cacheable = false; // Answer depends on verifiers, too
       // Search iteration with sigcheck
-      if(m_verifiers.empty())
+      if(m_dns->m_verifiers.empty())
           return 0; // Cannot check any signature without verifiers list
       // Iterate over query numbers, start from 0, up to 32K
       int16_t qno = -1;
       do {
         if(++qno > 100)
           return -250; // Exhaust 100 attempts, stop search, increase temp to 2 searches only
-        snprintf(search_key, sizeof(search_key), DNS_PREFIX ":%s:%d", (const char *)key, qno);
+        int len = snprintf(search_key, sizeof(search_key), DNS_PREFIX ":%s:%d", (const char *)key, qno);
         if(m_verbose > 4)
-            LogPrintf("EmcDns::SIG-Search(%s)\n", search_key);
-        if(!hooks->getNameValue(string(search_key), value))
+            LogPrintf("EmcDnsWorker::SIG-Search(%s)\n", search_key);
+        if(!NameMayExist(search_key, len) || !hooks->getNameValue(string(search_key), value))
             return -qno * 2; // Record not found, stop search, NXDOMAIN and increase DAP
         size_t sig_begin = value.find("SIG=");
         if(sig_begin == std::string::npos)
@@ -1344,41 +1922,43 @@ int EmcDns::Search(uint8_t *key, bool check_domain_sig) {
       } while(!CheckEnumSigList(search_key, m_value, '!'));
   } else {
       // No sigcheck search
-      snprintf(search_key, sizeof(search_key), DNS_PREFIX ":%s", (const char *)key);
-      if (!hooks->getNameValue(string(search_key), value))
+      int len = snprintf(search_key, sizeof(search_key), DNS_PREFIX ":%s", (const char *)key);
+      m_names.push_back(search_key);
+      if (!NameMayExist(search_key, len) || !hooks->getNameValue(string(search_key), value))
           return 0; // Record not found, stop search, NXDOMAIN
   }
 
   strcpy(m_value, value.c_str());
   return 1;
-} //  EmcDns::Search
+} //  EmcDnsWorker::Search
 
 /*---------------------------------------------------*/
 
-int EmcDns::LocalSearch(const uint8_t *key, uint8_t pos, uint8_t step) {
-  if(m_local_base == NULL)
+int EmcDnsWorker::LocalSearch(const uint8_t *key, uint8_t pos, uint8_t step) {
+  const EmcDnsTables *t = m_tables.get();
+  if(t->local_base == NULL)
     return 0; // empty local, no sense to search
   if(m_verbose > 6)
-    LogPrintf("EmcDns::LocalSearch(%s, %u, %u) called\n", key, pos, step);
+    LogPrintf("EmcDnsWorker::LocalSearch(%s, %u, %u) called\n", key, pos, step);
   do {
     pos += step;
-    if(m_ht_offset[pos] == 0) {
+    if(t->ht_offset[pos] == 0) {
       if(m_verbose > 6)
-        LogPrintf("EmcDns::LocalSearch: Local key=[%s] not found\n", key);
+        LogPrintf("EmcDnsWorker::LocalSearch: Local key=[%s] not found\n", key);
       return 0; // Reached EndOfList
     }
-  } while(m_ht_offset[pos] > 0 || strcmp((const char *)key, m_local_base - m_ht_offset[pos]) != 0);
+  } while(t->ht_offset[pos] > 0 || strcmp((const char *)key, t->local_base - t->ht_offset[pos]) != 0);
 
-  strcpy(m_value, strchr(m_local_base - m_ht_offset[pos], 0) + 1);
+  strcpy(m_value, strchr(t->local_base - t->ht_offset[pos], 0) + 1);
 
   return 1;
-} // EmcDns::LocalSearch
+} // EmcDnsWorker::LocalSearch
 
 
 /*---------------------------------------------------*/
 #define ROLADD(h,s,x)   h = ((h << s) | (h >> (32 - s))) + (x)
 // Returns true - can handle packet; false = ignore
-bool EmcDns::CheckDAP(const void *key, int len, uint16_t inctemp) {
+bool EmcDns::CheckDAP(const void *key, int len, uint16_t inctemp, uint32_t timestamp, uint32_t &mintemp) {
   if(m_dap_ht == NULL)
     return true; // Filter is inactive
 
@@ -1392,7 +1972,8 @@ bool EmcDns::CheckDAP(const void *key, int len, uint16_t inctemp) {
   }
 
   inctemp++;
-  uint32_t hash = m_daprand, mintemp = ~0;
+  uint32_t hash = m_daprand;
+  mintemp = ~0;
 
   int used_ndx[EMCDNS_DAPBLOOMSTEP];
   for(int bloomstep = 0; bloomstep < EMCDNS_DAPBLOOMSTEP; bloomstep++) {
@@ -1408,16 +1989,22 @@ bool EmcDns::CheckDAP(const void *key, int len, uint16_t inctemp) {
 	  ndx = -1;
     } while(ndx < 0);
 
-    DNSAP *dap = &m_dap_ht[used_ndx[bloomstep] = ndx];
-    uint16_t dt = m_timestamp - dap->timestamp;
-    uint32_t new_temp = (dt > 15? 0 : dap->temp >> dt) + inctemp;
-    dap->temp = (new_temp > 0xffff)? 0xffff : new_temp;
-    dap->timestamp = m_timestamp;
+    // Cell is shared between workers: read and write it as a single word.
+    // Concurrent update can lose a heat increment, that is OK for decay filter.
+    std::atomic<uint32_t> &cell = m_dap_ht[used_ndx[bloomstep] = ndx];
+    uint32_t word = cell.load(std::memory_order_relaxed);
+    DNSAP dap;
+    memcpy(&dap, &word, sizeof(dap));
+    uint16_t dt = timestamp - dap.timestamp;
+    uint32_t new_temp = (dt > 15? 0 : dap.temp >> dt) + inctemp;
+    dap.temp = (new_temp > 0xffff)? 0xffff : new_temp;
+    dap.timestamp = timestamp;
+    memcpy(&word, &dap, sizeof(dap));
+    cell.store(word, std::memory_order_relaxed);
     if(new_temp < mintemp)
       mintemp = new_temp;
   } // for
 
-  m_mintemp = mintemp; // Save for logging
   bool rc = mintemp < m_dap_treshold;
   if(m_verbose > 5 || (!rc && m_verbose > 3)) {
     char buf[INET6_ADDRSTRLEN], outbuf[120 + INET6_ADDRSTRLEN];
@@ -1429,18 +2016,24 @@ bool EmcDns::CheckDAP(const void *key, int len, uint16_t inctemp) {
   return rc;
 } // EmcDns::CheckDAP
 
+/*---------------------------------------------------*/
+bool EmcDnsWorker::CheckDAP(const void *key, int len, uint16_t inctemp) {
+  return m_dns->CheckDAP(key, len, inctemp, m_timestamp, m_mintemp); // m_mintemp saved for logging
+} // EmcDnsWorker::CheckDAP
+
 /*---------------------------------------------------*/
 // Handle Special function - phone number in the E.164 format
 // to support ENUM service
-int EmcDns::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end) {
+int EmcDnsWorker::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end) {
   int dom_length = domain_end - domain_start;
   const char *tld = (const char*)domain_end[-1];
+  m_cacheable = false; // ENUM answer depends on verifiers and toll-free list
 
   bool sigOK = len & 0200; // If set no-check-sig, then signature already quasi-checked: OK
   len &= 0177; // Cut flag no-check-sig
 
   if(m_verbose > 3)
-    LogPrintf("    EmcDns::SpfunENUM: Domain=[%s] N=%u TLD=[%s] Len=%u sigOK=%u\n",
+    LogPrintf("    EmcDnsWorker::SpfunENUM: Domain=[%s] N=%u TLD=[%s] Len=%u sigOK=%u\n",
 	    (const char*)*domain_start, dom_length, tld, len, sigOK);
 
   do {
@@ -1448,7 +2041,7 @@ int EmcDns::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end)
       break; // no domains for phone number - NXDOMAIN
 
 
-    if(!sigOK && m_verifiers.empty() && m_tollfree.empty())
+    if(!sigOK && m_dns->m_verifiers.empty() && m_dns->m_tollfree.empty())
       break; // no verifier/toll-free/open_zone - no sense to search
 
     if(len > 64)
@@ -1467,15 +2060,15 @@ int EmcDns::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end)
       break; // Empty phone number - NXDOMAIN
 
     if(m_verbose > 4)
-      LogPrintf("    EmcDns::SpfunENUM: ITU-T num=[%s]\n", itut_num);
+      LogPrintf("    EmcDnsWorker::SpfunENUM: ITU-T num=[%s]\n", itut_num);
 
     // Iterate all available ENUM-records, and build joined answer from them
-    if(sigOK || !m_verifiers.empty()) {
+    if(sigOK || !m_dns->m_verifiers.empty()) {
       for(int16_t qno = 0; qno >= 0; qno++) {
         char q_str[160];
         snprintf(q_str, sizeof(q_str), "%s:%s:%u", tld, itut_num, qno);
         if(m_verbose > 4)
-          LogPrintf("    EmcDns::SpfunENUM Search(%s)\n", q_str);
+          LogPrintf("    EmcDnsWorker::SpfunENUM Search(%s)\n", q_str);
 
         string value;
         if(!hooks->getNameValue(string(q_str), value))
@@ -1489,13 +2082,13 @@ int EmcDns::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end)
     // If nothing found in the ENUM - try to search in the Toll-Free
     m_ttl = 24 * 3600; // 24h by default
     boost::xpressive::smatch nameparts;
-    for(vector<TollFree>::const_iterator tf = m_tollfree.begin();
-	      m_hdr->ANCount == 0 && tf != m_tollfree.end();
+    for(vector<TollFree>::const_iterator tf = m_dns->m_tollfree.begin();
+	      m_hdr->ANCount == 0 && tf != m_dns->m_tollfree.end();
 	      tf++) {
       bool matched = regex_match(string(itut_num), nameparts, tf->regex);
       // bool matched = regex_search(string(itut_num), nameparts, tf->regex);
       if(m_verbose > 4)
-          LogPrintf("    EmcDns::SpfunENUM TF-match N=[%s] RE=[%s] -> %u\n", itut_num, tf->regex_str.c_str(), matched);
+          LogPrintf("    EmcDnsWorker::SpfunENUM TF-match N=[%s] RE=[%s] -> %u\n", itut_num, tf->regex_str.c_str(), matched);
       if(matched)
         for(vector<string>::const_iterator e2u = tf->e2u.begin(); e2u != tf->e2u.end(); e2u++)
           HandleE2U(strcpy(m_value, e2u->c_str()));
@@ -1510,7 +2103,7 @@ int EmcDns::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end)
   } while(false);
 
   return 3; // NXDOMAIN
-} // EmcDns::SpfunENUM
+} // EmcDnsWorker::SpfunENUM
 
 /*---------------------------------------------------*/
 
@@ -1518,7 +2111,7 @@ int EmcDns::SpfunENUM(uint8_t len, uint8_t **domain_start, uint8_t **domain_end)
 
 /*---------------------------------------------------*/
 // Generate answewr for found EMUM NVS record
-void EmcDns::Answer_ENUM(const char *q_str, bool sigOK) {
+void EmcDnsWorker::Answer_ENUM(const char *q_str, bool sigOK) {
   // DIG checks NAPTR answer for regex, and prints error, if undef variable applied:
   // BAD: strcpy(m_value, "SIG=ver:enum|H+P0LucJJVRbPhKWotFS2Zr5o40501M4U1SmZ6ClDXUnBY6oQg1k9Kk+J+iLFcZ/FbUTk/rbt/169GtPt7vdTDY=\nE2U+sip=100|11|!^.*$!sip:\\1@postmet.com!");
   // GOOD strcpy(m_value, "SIG=ver:enum|H+P0LucJJVRbPhKWotFS2Zr5o40501M4U1SmZ6ClDXUnBY6oQg1k9Kk+J+iLFcZ/FbUTk/rbt/169GtPt7vdTDY=\nE2U+sip=100|11|!^(.)*$!sip:\\1@postmet.com!");
@@ -1561,19 +2154,19 @@ void EmcDns::Answer_ENUM(const char *q_str, bool sigOK) {
     if(m_snd < m_obufend - 24)
       HandleE2U(e2u[e2undx]);
 
- } // EmcDns::Answer_ENUM
+ } // EmcDnsWorker::Answer_ENUM
 
 /*---------------------------------------------------*/
-void EmcDns::OutS(const char *p) {
+void EmcDnsWorker::OutS(const char *p) {
   int len = strlen(strcpy((char *)m_snd + 1, p));
   *m_snd = len;
   m_snd += len + 1;
-} // EmcDns::OutS
+} // EmcDnsWorker::OutS
 
 /*---------------------------------------------------*/
  // Generate ENUM-answers for a single E2U entry
  // E2U+sip=100|10|!^(.*)$!sip:17771234567@in.callcentric.com!
-void EmcDns::HandleE2U(char *e2u) {
+void EmcDnsWorker::HandleE2U(char *e2u) {
   char *data = strchr(e2u, '=');
   if(data == NULL)
     return;
@@ -1590,7 +2183,7 @@ void EmcDns::HandleE2U(char *e2u) {
     return;
 
   if(m_verbose > 5)
-    LogPrintf("    EmcDns::HandleE2U: Parsed: %u %u %s %s\n", ord, pref, e2u, re);
+    LogPrintf("    EmcDnsWorker::HandleE2U: Parsed: %u %u %s %s\n", ord, pref, e2u, re);
 
   if(m_snd + strlen(re) + strlen(e2u) + 24 >= m_obufend)
     return;
@@ -1612,10 +2205,10 @@ void EmcDns::HandleE2U(char *e2u) {
   *snd0++ = len;
 
   m_hdr->ANCount++;
-} //  EmcDns::HandleE2U
+} //  EmcDnsWorker::HandleE2U
 
 /*---------------------------------------------------*/
-bool EmcDns::CheckEnumSigList(const char *q_str, char *siglist_str, char sig_separ) {
+bool EmcDnsWorker::CheckEnumSigList(const char *q_str, char *siglist_str, char sig_separ) {
     char *comma_ptr;
     do {
       comma_ptr = strchr(siglist_str, ',');
@@ -1625,13 +2218,13 @@ bool EmcDns::CheckEnumSigList(const char *q_str, char *siglist_str, char sig_sep
         return true;
     } while((siglist_str = comma_ptr) != 0);
     return false;
-} // EmcDns::CheckEnumSigList
+} // EmcDnsWorker::CheckEnumSigList
 
 /*---------------------------------------------------*/
 // q_str is DNS name, like "enum:17771234567:0" or "dns:signed.sig:0"
 // sig_str is &signature[-1], i.e. 1st char will be skipped
 // sig_separ is '|' for ENUM and '!' for DNS
-bool EmcDns::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
+bool EmcDnsWorker::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
     if(sig_str == NULL)
       return false;
 
@@ -1645,35 +2238,58 @@ bool EmcDns::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
     for(char *p = signature; *--p <= 040; *p = 0) {}
     *signature++ = 0;
 
-    map<string, Verifier>::iterator it = m_verifiers.find(sig_str);
-    if(it == m_verifiers.end())
-      return false; // Unknown verifier - do not trust it
+    while(*signature <= 040 && *signature)
+      signature++;
 
-    Verifier &ver = it->second;
+    char *sig_end = strchr(signature, 0);
+    while(*--sig_end <= 040)
+        *sig_end = 0; // Cut SP\n\r at signature end
+
+    // Repeated lookups of the same record skip verifier refresh and ECDSA recovery
+    uint256 sigkey;
+    uint64_t siggen = 0;
+    bool result;
+    if(m_dns->m_sigs) {
+      sigkey = EmcDnsSigCache::Key(q_str, sig_str, signature);
+      if(m_dns->m_sigs->Get(sigkey, result))
+        return result;
+      siggen = m_dns->m_sigs->Generation(); // Before verifier and SRL are read
+    }
+    vector<string> depends(1, sig_str); // Names, result depends on
+    auto done = [&](bool rc) {
+      if(m_dns->m_sigs)
+        m_dns->m_sigs->Put(sigkey, rc, depends, siggen);
+      return rc;
+    };
 
     uint32_t now = time(NULL);
     // SHO
-    char *valbuf = (char*)alloca(VAL_SIZE + (uint8_t)(now ^ m_daprand));
+    char *valbuf = (char*)alloca(VAL_SIZE + (uint8_t)(now ^ m_dns->m_daprand));
+
+    // Verifier cache is shared between workers: refresh it under lock,
+    // and check signature with the local copy
+    Verifier snapshot;
+    {
+    LOCK(m_dns->cs_verifiers);
+    map<string, Verifier>::iterator it = m_dns->m_verifiers.find(sig_str);
+    if(it == m_dns->m_verifiers.end())
+      return false; // Unknown verifier - do not trust it
+
+    Verifier &ver = it->second;
+
     if(now > ver.forgot) {
       // Remember time is expired - try to upgrade the ver-record
       ver.forgot = now + 5 * 60;    // Remember status for 5 mins
       ver.mask = VERMASK_NOSRL + 1; // Read/check breaks will produce out-of-range mask
       do {
-        CNameRecord nameRec;
-        CTransactionRef tx;
-        LOCK(cs_main);
-        if(!pNameDB->ReadName(CNameVal(it->first.c_str(), it->first.c_str() + it->first.size()), nameRec))
+        CNameState state;
+        if(!pNameDB->ReadNameState(CNameVal(it->first.c_str(), it->first.c_str() + it->first.size()), state))
 	  break; // failed to read from name DB
-        if(nameRec.vNameOp.size() < 1)
-	  break; // no result returned
-        if(!g_txindex || !g_txindex->FindTx(nameRec.vNameOp.back().txPos, tx))
-          break; // failed to read from from disk
-        NameTxInfo nti;
-        if (!DecodeNameOutput(tx, nameRec.vNameOp.back().nOut, nti, true))
-            break; // failed to decode name
-        if(nti.value.size() > MAX_VALUE_LENGTH)
+        if(state.deleted())
+	  break; // no active verifier
+        if(state.value.size() > MAX_VALUE_LENGTH)
             break; // corrupted VAL-record
-        CTxDestination dest = DecodeDestination(nti.strAddress);
+        CTxDestination dest = DecodeDestination(state.address);
         if (!IsValidDestination(dest))
             break; // Invalid address
         const WitnessV0KeyHash *w0pkhash;
@@ -1688,8 +2304,8 @@ bool EmcDns::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
 
 	// Verifier has been read successfully, configure SRL if exist
 	char *str_val = valbuf;
-        memcpy(valbuf, &nti.value[0], nti.value.size());
-        valbuf[nti.value.size()] = 0;
+        memcpy(valbuf, state.value.data(), state.value.size());
+        valbuf[state.value.size()] = 0;
 
 	// Proces Signatures Revocation list[s] in the format:
         // SRL=nBits|Templete
@@ -1729,22 +2345,18 @@ bool EmcDns::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
 	  } // while + if
       } while(false);
     } // if(now > ver.forgot)
+    snapshot = ver;
+    } // LOCK(cs_verifiers)
+    const Verifier &ver = snapshot;
 
     if(ver.mask > VERMASK_NOSRL)
-      return false; // DB read error, or strlen(template) > 256b
-
-    while(*signature <= 040 && *signature)
-      signature++;
-
-    char *sig_end = strchr(signature, 0);
-    while(*--sig_end <= 040)
-        *sig_end = 0; // Cut SP\n\r at signature end
+      return done(false); // DB read error, or strlen(template) > 256b
 
     bool fInvalid = false;
     vector<unsigned char> vchSig(DecodeBase64(signature, &fInvalid));
 
     if(fInvalid)
-      return false;
+      return done(false);
 
     CHashWriter ss(SER_GETHASH, 0);
     ss << strMessageMagic;
@@ -1752,13 +2364,13 @@ bool EmcDns::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
 
     CPubKey pubkey;
     if(!pubkey.RecoverCompact(ss.GetHash(), vchSig))
-      return false;
+      return done(false);
 
     if(pubkey.GetID() != ver.keyID)
-	return false; // Signature check did not passed
+	return done(false); // Signature check did not passed
 
     if(ver.mask == VERMASK_NOSRL)
-	return true; // This verifiyer does not have active SRL
+	return done(true); // This verifiyer does not have active SRL
 
     // Compute a simple hash from q_str like enum:17771234567:0
     // This hash must be used by verifiyers for build buckets
@@ -1767,11 +2379,391 @@ bool EmcDns::CheckEnumSig(const char *q_str, char *sig_str, char sig_separ) {
 	h += (h << 5) + *p;
     snprintf(valbuf, MAX_NAME_LENGTH, ver.srl_tpl.c_str(), h & ver.mask);
 
+    depends.push_back(valbuf); // SRL update can revoke signature
+
     string value;
     if(!hooks->getNameValue(string(valbuf), value))
-      return true; // Unable fetch SRL - as same as SRL does not exist
+      return done(true); // Unable fetch SRL - as same as SRL does not exist
 
     // Is q_str missing in the SRL
-    return value.find(q_str) == string::npos;
-} // EmcDns::CheckEnumSig
+    return done(value.find(q_str) == string::npos);
+} // EmcDnsWorker::CheckEnumSig
+
+
+/*---------------------------------------------------*/
+EmcDnsAnswerCache::Shard &EmcDnsAnswerCache::GetShard(const string &question) {
+  uint32_t h = 0x5555;
+  for(char c : question)
+    h += (h << 5) + (uint8_t)c;
+  return m_shards[h % EMCDNS_CACHESHARDS];
+} // EmcDnsAnswerCache::GetShard
+
+/*---------------------------------------------------*/
+bool EmcDnsAnswerCache::Get(const string &question, EmcDnsAnswer &answer) {
+  Shard &shard = GetShard(question);
+  LOCK(shard.cs);
+  map<string, Entry>::iterator it = shard.entries.find(question);
+  if(it == shard.entries.end())
+    return false;
+  if(time(NULL) > it->second.expires) {
+    Erase(shard, it);
+    return false;
+  }
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru);
+  answer = it->second.answer;
+  return true;
+} // EmcDnsAnswerCache::Get
+
+/*---------------------------------------------------*/
+// gen is Generation() taken before names were read; answer is stale, if it is changed.
+// Checked under shard lock, so Invalidate after the check finds the new entry.
+void EmcDnsAnswerCache::Put(const string &question, const EmcDnsAnswer &answer, const vector<string> &names, uint64_t gen) {
+  size_t size = question.size() + answer.dapkey.size() + answer.data.size();
+  Shard &shard = GetShard(question);
+  LOCK(shard.cs);
+  if(size > m_max_bytes || gen != m_gen.load())
+    return;
+  map<string, Entry>::iterator it = shard.entries.find(question);
+  if(it != shard.entries.end())
+    Erase(shard, it);
+  while(!shard.lru.empty() && shard.bytes + size > m_max_bytes)
+    Erase(shard, shard.entries.find(shard.lru.back()));
+
+  shard.lru.push_front(question);
+  Entry &entry = shard.entries[question];
+  entry.answer  = answer;
+  entry.names   = names;
+  entry.expires = time(NULL) + EMCDNS_CACHEAGE;
+  entry.lru     = shard.lru.begin();
+  for(const string &name : names)
+    shard.by_name.insert(make_pair(name, question));
+  shard.bytes += size;
+} // EmcDnsAnswerCache::Put
+
+/*---------------------------------------------------*/
+// Drops answers made from the name
+void EmcDnsAnswerCache::Invalidate(const string &name) {
+  m_gen++; // Before entries are dropped, so answers being made are not stored
+  for(Shard &shard : m_shards) {
+    LOCK(shard.cs);
+    multimap<string, string>::iterator it;
+    while((it = shard.by_name.find(name)) != shard.by_name.end()) {
+      map<string, Entry>::iterator entry = shard.entries.find(it->second);
+      if(entry != shard.entries.end())
+        Erase(shard, entry); // Erases it, too
+      else
+        shard.by_name.erase(it);
+    }
+  }
+} // EmcDnsAnswerCache::Invalidate
+
+/*---------------------------------------------------*/
+void EmcDnsAnswerCache::Clear() {
+  m_gen++;
+  for(Shard &shard : m_shards) {
+    LOCK(shard.cs);
+    shard.entries.clear();
+    shard.lru.clear();
+    shard.by_name.clear();
+    shard.bytes = 0;
+  }
+} // EmcDnsAnswerCache::Clear
+
+/*---------------------------------------------------*/
+void EmcDnsAnswerCache::Erase(Shard &shard, map<string, Entry>::iterator it) {
+  const string &question = it->first;
+  for(const string &name : it->second.names) {
+    pair<multimap<string, string>::iterator, multimap<string, string>::iterator> range = shard.by_name.equal_range(name);
+    for(multimap<string, string>::iterator n = range.first; n != range.second; ++n)
+      if(n->second == question) {
+        shard.by_name.erase(n);
+        break;
+      }
+  }
+  shard.bytes -= question.size() + it->second.answer.dapkey.size() + it->second.answer.data.size();
+  shard.lru.erase(it->second.lru);
+  shard.entries.erase(it);
+} // EmcDnsAnswerCache::Erase
+
+/*---------------------------------------------------*/
+uint256 EmcDnsSigCache::Key(const char *q_str, const char *verifier, const char *signature) {
+  CHashWriter ss(SER_GETHASH, 0);
+  ss << string(q_str) << string(verifier) << string(signature);
+  return ss.GetHash();
+} // EmcDnsSigCache::Key
+
+/*---------------------------------------------------*/
+bool EmcDnsSigCache::Get(const uint256 &key, bool &result) {
+  LOCK(cs);
+  map<uint256, Entry>::iterator it = m_entries.find(key);
+  if(it == m_entries.end())
+    return false;
+  if(time(NULL) > it->second.expires) {
+    Erase(it);
+    return false;
+  }
+  m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+  result = it->second.result;
+  return true;
+} // EmcDnsSigCache::Get
+
+/*---------------------------------------------------*/
+uint64_t EmcDnsSigCache::Generation() {
+  LOCK(cs);
+  return m_gen;
+} // EmcDnsSigCache::Generation
+
+/*---------------------------------------------------*/
+void EmcDnsSigCache::Put(const uint256 &key, bool result, const vector<string> &names, uint64_t gen) {
+  LOCK(cs);
+  if(gen != m_gen)
+    return; // Verifier or SRL changed, while result was checked
+  map<uint256, Entry>::iterator it = m_entries.find(key);
+  if(it != m_entries.end())
+    Erase(it);
+  while(!m_lru.empty() && m_entries.size() >= m_max_entries)
+    Erase(m_entries.find(m_lru.back()));
+
+  m_lru.push_front(key);
+  Entry &entry = m_entries[key];
+  entry.result  = result;
+  entry.names   = names;
+  entry.expires = time(NULL) + EMCDNS_SIGCACHEAGE;
+  entry.lru     = m_lru.begin();
+  for(const string &name : names)
+    m_by_name.insert(make_pair(name, key));
+} // EmcDnsSigCache::Put
+
+/*---------------------------------------------------*/
+// Drops results, which depend on the name
+void EmcDnsSigCache::Invalidate(const string &name) {
+  LOCK(cs);
+  m_gen++;
+  multimap<string, uint256>::iterator it;
+  while((it = m_by_name.find(name)) != m_by_name.end()) {
+    map<uint256, Entry>::iterator entry = m_entries.find(it->second);
+    if(entry != m_entries.end())
+      Erase(entry); // Erases it, too
+    else
+      m_by_name.erase(it);
+  }
+} // EmcDnsSigCache::Invalidate
+
+/*---------------------------------------------------*/
+void EmcDnsSigCache::Erase(map<uint256, Entry>::iterator it) {
+  const uint256 key = it->first;
+  for(const string &name : it->second.names) {
+    pair<multimap<string, uint256>::iterator, multimap<string, uint256>::iterator> range = m_by_name.equal_range(name);
+    for(multimap<string, uint256>::iterator n = range.first; n != range.second; ++n)
+      if(n->second == key) {
+        m_by_name.erase(n);
+        break;
+      }
+  }
+  m_lru.erase(it->second.lru);
+  m_entries.erase(it);
+} // EmcDnsSigCache::Erase
+
+/*---------------------------------------------------*/
+static const struct { uint16_t code; const char *name; } qtypes[EmcDnsStats::QT_QTY] = {
+  {1, "A"}, {2, "NS"}, {5, "CNAME"}, {6, "SOA"}, {12, "PTR"}, {15, "MX"}, {16, "TXT"}, {28, "AAAA"},
+  {33, "SRV"}, {35, "NAPTR"}, {52, "TLSA"}, {257, "CAA"}, {0xff, "ANY"}, {0, "OTHER"}
+};
+
+int EmcDnsStats::QTypeIndex(uint16_t qtype) {
+  for(int i = 0; i < QT_OTHER; i++)
+    if(qtypes[i].code == qtype)
+      return i;
+  return QT_OTHER;
+} // EmcDnsStats::QTypeIndex
+
+const char *EmcDnsStats::QTypeName(int ndx) {
+  return qtypes[ndx].name;
+} // EmcDnsStats::QTypeName
+
+/*---------------------------------------------------*/
+void EmcDnsStats::Reset() {
+  udp = tcp = dap_ip = dap_domain = cache_hit = cache_miss = truncated = filtered = latency_sum = 0;
+  for(auto &c : qtype)   c = 0;
+  for(auto &c : rcode)   c = 0;
+  for(auto &c : latency) c = 0;
+} // EmcDnsStats::Reset
+
+/*---------------------------------------------------*/
+void EmcDnsStats::Add(const EmcDnsStats &x) {
+  Inc(udp, x.udp);   Inc(tcp, x.tcp);
+  Inc(dap_ip, x.dap_ip); Inc(dap_domain, x.dap_domain);
+  Inc(cache_hit, x.cache_hit); Inc(cache_miss, x.cache_miss);
+  Inc(truncated, x.truncated);
+  Inc(filtered, x.filtered);
+  Inc(latency_sum, x.latency_sum);
+  for(int i = 0; i < QT_QTY; i++)
+    Inc(qtype[i], x.qtype[i]);
+  for(int i = 0; i < 16; i++)
+    Inc(rcode[i], x.rcode[i]);
+  for(int i = 0; i < EMCDNS_LATBUCKETS; i++)
+    Inc(latency[i], x.latency[i]);
+} // EmcDnsStats::Add
+
+/*---------------------------------------------------*/
+uint64_t EmcDnsStats::LatencyPercentile(double pct) const {
+  uint64_t total = 0;
+  for(const auto &c : latency)
+    total += c;
+  if(total == 0)
+    return 0;
+  uint64_t rank = ceil(total * pct / 100), sum = 0;
+  int i = 0;
+  while(i < EMCDNS_LATBUCKETS - 1 && (sum += latency[i]) < rank)
+    i++;
+  return (uint64_t)1 << i;
+} // EmcDnsStats::LatencyPercentile
+
+/*---------------------------------------------------*/
+int64_t EmcDns::Uptime() const {
+  return GetTime() - m_started;
+} // EmcDns::Uptime
+
+/*---------------------------------------------------*/
+void EmcDns::GetStats(EmcDnsStats &stats, uint64_t &dap_used, uint64_t &dap_hot) const {
+  stats.Reset();
+  for(const EmcDnsWorker *w : m_workers)
+    stats.Add(w->Stats());
+
+  // Scan DAP table with decay to now, as CheckDAP does
+  dap_used = dap_hot = 0;
+  if(m_dap_ht == NULL)
+    return;
+  uint16_t timestamp = time(NULL) >> EMCDNS_DAPSHIFTDECAY;
+  for(uint32_t i = 0; i <= m_dapmask; i++) {
+    uint32_t word = m_dap_ht[i].load(std::memory_order_relaxed);
+    DNSAP dap;
+    memcpy(&dap, &word, sizeof(dap));
+    uint16_t dt = timestamp - dap.timestamp;
+    uint32_t temp = dt > 15? 0 : dap.temp >> dt;
+    if(temp) {
+      dap_used++;
+      if(temp >= m_dap_treshold)
+        dap_hot++;
+    }
+  }
+} // EmcDns::GetStats
+
+/*---------------------------------------------------*/
+// Statistics in Prometheus text exposition format
+string EmcDns::GetStatsPrometheus() const {
+  EmcDnsStats st;
+  uint64_t dap_used, dap_hot;
+  GetStats(st, dap_used, dap_hot);
+
+  string out;
+  auto head = [&out](const char *name, const char *type, const char *help) {
+    out += strprintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  };
+
+  head("emcdns_queries_total", "counter", "Received DNS queries");
+  out += strprintf("emcdns_queries_total{transport=\"udp\"} %u\n", (uint64_t)st.udp);
+  out += strprintf("emcdns_queries_total{transport=\"tcp\"} %u\n", (uint64_t)st.tcp);
+
+  head("emcdns_questions_total", "counter", "Handled questions by QTYPE");
+  for(int i = 0; i < EmcDnsStats::QT_QTY; i++)
+    out += strprintf("emcdns_questions_total{qtype=\"%s\"} %u\n", EmcDnsStats::QTypeName(i), (uint64_t)st.qtype[i]);
+
+  head("emcdns_responses_total", "counter", "Sent answers by RCODE");
+  for(int i = 0; i < 16; i++)
+    if(st.rcode[i] || i <= 5)
+      out += strprintf("emcdns_responses_total{rcode=\"%d\"} %u\n", i, (uint64_t)st.rcode[i]);
+
+  head("emcdns_truncated_total", "counter", "UDP answers truncated to client's payload size");
+  out += strprintf("emcdns_truncated_total %u\n", (uint64_t)st.truncated);
+
+  head("emcdns_dap_drops_total", "counter", "Queries dropped by DNS amplifier protector");
+  out += strprintf("emcdns_dap_drops_total{reason=\"ip\"} %u\n", (uint64_t)st.dap_ip);
+  out += strprintf("emcdns_dap_drops_total{reason=\"domain\"} %u\n", (uint64_t)st.dap_domain);
+
+  head("emcdns_dap_cells", "gauge", "DAP table cells: total, warm now, and over treshold");
+  out += strprintf("emcdns_dap_cells{state=\"total\"} %u\n", DapSize());
+  out += strprintf("emcdns_dap_cells{state=\"used\"} %u\n", dap_used);
+  out += strprintf("emcdns_dap_cells{state=\"hot\"} %u\n", dap_hot);
+
+  head("emcdns_dap_treshold", "gauge", "DAP temperature treshold");
+  out += strprintf("emcdns_dap_treshold %u\n", DapTreshold());
+
+  head("emcdns_cache_lookups_total", "counter", "Answers cache lookups");
+  out += strprintf("emcdns_cache_lookups_total{result=\"hit\"} %u\n", (uint64_t)st.cache_hit);
+  out += strprintf("emcdns_cache_lookups_total{result=\"miss\"} %u\n", (uint64_t)st.cache_miss);
+
+  head("emcdns_filtered_total", "counter", "Name lookups skipped by names filter");
+  out += strprintf("emcdns_filtered_total %u\n", (uint64_t)st.filtered);
+
+  head("emcdns_query_duration_seconds", "histogram", "Time to make an answer");
+  uint64_t count = 0;
+  for(int i = 0; i < EMCDNS_LATBUCKETS; i++) {
+    count += st.latency[i];
+    if(i < EMCDNS_LATBUCKETS - 1)
+      out += strprintf("emcdns_query_duration_seconds_bucket{le=\"%g\"} %u\n", ((uint64_t)1 << i) / 1e6, count);
+  }
+  out += strprintf("emcdns_query_duration_seconds_bucket{le=\"+Inf\"} %u\n", count);
+  out += strprintf("emcdns_query_duration_seconds_sum %g\n", st.latency_sum / 1e6);
+  out += strprintf("emcdns_query_duration_seconds_count %u\n", count);
+
+  head("emcdns_uptime_seconds", "gauge", "Time since emcdns start");
+  out += strprintf("emcdns_uptime_seconds %d\n", Uptime());
+  return out;
+} // EmcDns::GetStatsPrometheus
+
+/*---------------------------------------------------*/
+bool EmcDnsHTTPMetrics(HTTPRequest *req, const std::string &strReq) {
+  if(req->GetRequestMethod() != HTTPRequest::GET) {
+    req->WriteReply(HTTP_BAD_METHOD, "Only GET is supported\n");
+    return false;
+  }
+  if(emcdns == NULL) {
+    req->WriteReply(HTTP_SERVICE_UNAVAILABLE, "emcdns is not running\n");
+    return false;
+  }
+  req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+  req->WriteReply(HTTP_OK, emcdns->GetStatsPrometheus());
+  return true;
+} // EmcDnsHTTPMetrics
+
+/*---------------------------------------------------*/
+EmcDnsNameFilter::EmcDnsNameFilter() : m_ready(false) {
+  m_bits = new std::atomic<uint64_t>[((uint64_t)1 << EMCDNS_FILTERBITS) / 64]();
+  GetRandBytes((uint8_t *)&m_k0, sizeof(m_k0));
+  GetRandBytes((uint8_t *)&m_k1, sizeof(m_k1));
+} // EmcDnsNameFilter::EmcDnsNameFilter
+
+/*---------------------------------------------------*/
+// Double hashing: bit i is h1 + i * h2
+void EmcDnsNameFilter::Hash(const char *name, size_t len, uint64_t &h1, uint64_t &h2) const {
+  uint64_t h = CSipHasher(m_k0, m_k1).Write((const unsigned char *)name, len).Finalize();
+  h1 = h;
+  h2 = (h >> 32) | 1;
+} // EmcDnsNameFilter::Hash
+
+/*---------------------------------------------------*/
+void EmcDnsNameFilter::Add(const char *name, size_t len) {
+  uint64_t h1, h2;
+  Hash(name, len, h1, h2);
+  const uint64_t mask = ((uint64_t)1 << EMCDNS_FILTERBITS) - 1;
+  for(int i = 0; i < EMCDNS_FILTERHASHES; i++) {
+    uint64_t bit = (h1 + i * h2) & mask;
+    m_bits[bit >> 6].fetch_or((uint64_t)1 << (bit & 63), std::memory_order_relaxed);
+  }
+} // EmcDnsNameFilter::Add
 
+/*---------------------------------------------------*/
+bool EmcDnsNameFilter::MayContain(const char *name, size_t len) const {
+  if(!m_ready.load(std::memory_order_acquire))
+    return true;
+  uint64_t h1, h2;
+  Hash(name, len, h1, h2);
+  const uint64_t mask = ((uint64_t)1 << EMCDNS_FILTERBITS) - 1;
+  for(int i = 0; i < EMCDNS_FILTERHASHES; i++) {
+    uint64_t bit = (h1 + i * h2) & mask;
+    if((m_bits[bit >> 6].load(std::memory_order_relaxed) & ((uint64_t)1 << (bit & 63))) == 0)
+      return false;
+  }
+  return true;
+} // EmcDnsNameFilter::MayContain
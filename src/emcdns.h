@@ -3,6 +3,11 @@
 
 #include <string>
 #include <map>
+#include <list>
+#include <atomic>
+#include <memory>
+
+#include <boost/signals2/connection.hpp>
 
 #include <boost/thread.hpp>
 #include <boost/xpressive/xpressive_dynamic.hpp>
@@ -10,13 +15,35 @@
 using namespace std;
 
 
+#include "compat.h"
 #include "pubkey.h"
+#include "sync.h"
 
 
 #define EMCDNS_PORT		5335
 #define EMCDNS_DAPBLOOMSTEP	3				// 3 steps in bloom filter
 #define EMCDNS_DAPSHIFTDECAY	8				// Dap time shift 8 = 256 secs (~4min) in decay
 #define EMCDNS_DAPTRESHOLD	(4 << EMCDNS_DAPSHIFTDECAY)	// ~4r/s found name, ~1 r/s - clien IP
+#define EMCDNS_THREADS		1				// Default workers qty; 0 = one per CPU core
+#define EMCDNS_MAXTHREADS	64				// Upper limit for -emcdnsthreads
+#define EMCDNS_TCP		false				// Serve queries over TCP, too
+#define EMCDNS_TCPMAXCONN	256				// Max simultaneous TCP connections
+#define EMCDNS_TCPIDLE		10				// Close TCP connection after 10 secs idle
+#define EMCDNS_CACHESIZE	8				// Answer cache size, MiB; 0 = disable
+#define EMCDNS_CACHEAGE		60				// Max age of cached answer, secs
+#define EMCDNS_CACHESHARDS	16				// Independently locked parts of answer cache
+#define EMCDNS_NXCACHEPART	8				// NXDOMAIN cache is 1/8 of answers cache
+#define EMCDNS_FILTERBITS	24				// log2 of bits in names filter; 2MiB
+#define EMCDNS_FILTERHASHES	6				// Bits per name in names filter
+#define EMCDNS_BATCH		32				// UDP packets per recvmmsg/sendmmsg; 1 = recvfrom/sendto
+#define EMCDNS_MAXBATCH		1024				// Upper limit for -emcdnsbatch
+#define EMCDNS_SIGCACHE		8192				// Cached signature check results
+#define EMCDNS_SIGCACHEAGE	(5 * 60)			// Max age of signature check result, as for verifier
+#define EMCDNS_LATBUCKETS	24				// Latency histogram: bucket i counts [2^(i-1), 2^i) usecs
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define EMCDNS_MMSG		1				// recvmmsg/sendmmsg are available
+#endif
 
 #define VERMASK_NEW	-1
 #define VERMASK_NOSRL	(1 << 16)	// ENUM: undef/missing mask for Signature Revocation List
@@ -71,23 +98,189 @@ struct TollFree {
     vector<string>		e2u;
 };
 
-class EmcDns {
+// Answer to a single question, ready to be appended after it in the wire format
+struct EmcDnsAnswer {
+    string   dapkey;	// Translated domain, heated in DAP on each use
+    string   data;	// Answer, authority and additional sections
+    uint16_t ancount;
+    uint16_t nscount;
+    uint16_t arcount;
+    uint16_t rcode;	// RCODE bits set while answer was made
+};
+
+// Answers cache, shared by workers. Key is question (qname in lower case, qtype, qclass) in the wire format.
+// Entry is dropped, when any name looked up for it is changed on chain, and after EMCDNS_CACHEAGE secs,
+// so expired names and shuffled token order are refreshed.
+// Generation is increased by each invalidation; answer made from names read before it is not stored.
+class EmcDnsAnswerCache {
   public:
-     EmcDns(const char *bind_ip, uint16_t port_no,
-	    const char *gw_suffix, const char *allowed_suff,
-	    const char *local_fname,
-	    uint32_t dapsize, uint32_t daptreshold,
-	    const char *enums, const char *tollfree,
-	    uint8_t verbose);
-    ~EmcDns();
+    explicit EmcDnsAnswerCache(size_t max_bytes) : m_max_bytes(max_bytes / EMCDNS_CACHESHARDS), m_gen(0) {}
+
+    bool Get(const string &question, EmcDnsAnswer &answer);
+    uint64_t Generation() const { return m_gen.load(); }
+    void Put(const string &question, const EmcDnsAnswer &answer, const vector<string> &names, uint64_t gen);
+    void Invalidate(const string &name);
+    void Clear();
+
+  private:
+    struct Entry {
+      EmcDnsAnswer answer;
+      vector<string> names;	// Names, answer is made from
+      time_t expires;
+      list<string>::iterator lru;
+    };
+    struct Shard {
+      Shard() : bytes(0) {}
+      Mutex cs;
+      map<string, Entry> entries;
+      list<string> lru;		// front = most recently used
+      multimap<string, string> by_name; // name -> question
+      size_t bytes;
+    };
+
+    Shard &GetShard(const string &question);
+    static void Erase(Shard &shard, map<string, Entry>::iterator it);
+
+    Shard  m_shards[EMCDNS_CACHESHARDS];
+    size_t m_max_bytes; // per shard
+    std::atomic<uint64_t> m_gen;
+}; // class EmcDnsAnswerCache
+
+// Results of ENUM/DNS signature checks, shared by workers. Key is hash of (name, verifier, signature);
+// entry depends on the verifier and SRL names, and is dropped, when any of them is changed on chain.
+// Generation works as in EmcDnsAnswerCache.
+class EmcDnsSigCache {
+  public:
+    explicit EmcDnsSigCache(size_t max_entries) : m_max_entries(max_entries), m_gen(0) {}
+
+    static uint256 Key(const char *q_str, const char *verifier, const char *signature);
+    bool Get(const uint256 &key, bool &result);
+    uint64_t Generation();
+    void Put(const uint256 &key, bool result, const vector<string> &names, uint64_t gen);
+    void Invalidate(const string &name);
+
+  private:
+    struct Entry {
+      bool result;
+      vector<string> names;	// Verifier and SRL, result depends on
+      time_t expires;
+      list<uint256>::iterator lru;
+    };
+
+    void Erase(map<uint256, Entry>::iterator it);
+
+    Mutex cs;
+    map<uint256, Entry> m_entries;
+    list<uint256> m_lru;	// front = most recently used
+    multimap<string, uint256> m_by_name;
+    size_t m_max_entries;
+    uint64_t m_gen;
+}; // class EmcDnsSigCache
+
+// Query counters. Each worker updates own copy without atomic read-modify-write,
+// since it is the single writer; readers sum relaxed loads over all workers.
+struct EmcDnsStats {
+  enum { QT_A, QT_NS, QT_CNAME, QT_SOA, QT_PTR, QT_MX, QT_TXT, QT_AAAA,
+	 QT_SRV, QT_NAPTR, QT_TLSA, QT_CAA, QT_ANY, QT_OTHER, QT_QTY };
+
+  EmcDnsStats() { Reset(); }
+  void Reset();
+  void Add(const EmcDnsStats &x);
+  uint64_t Queries() const { return udp + tcp; }
+  uint64_t LatencyPercentile(double pct) const; // Upper bound of bucket, usecs
+  static int QTypeIndex(uint16_t qtype);
+  static const char *QTypeName(int ndx);
+
+  static inline void Inc(std::atomic<uint64_t> &c, uint64_t n = 1) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> udp, tcp;		// Received queries
+  std::atomic<uint64_t> dap_ip, dap_domain;	// Dropped by DAP: client IP, or requested domain is too hot
+  std::atomic<uint64_t> cache_hit, cache_miss;	// Answers cache lookups
+  std::atomic<uint64_t> truncated;		// UDP answers with TC bit
+  std::atomic<uint64_t> filtered;		// Name lookups skipped by names filter
+  std::atomic<uint64_t> qtype[QT_QTY];
+  std::atomic<uint64_t> rcode[16];
+  std::atomic<uint64_t> latency[EMCDNS_LATBUCKETS];
+  std::atomic<uint64_t> latency_sum;		// usecs
+}; // struct EmcDnsStats
+
+// Gateway suffix, allowed TLD-suffixes and local names with common hashtable.
+// Immutable after build; reload builds new tables and swaps pointer (RCU-style),
+// so queries in flight complete with old tables, which are freed by the last user.
+struct EmcDnsTables {
+    EmcDnsTables() :
+	varbufs(NULL), gw_suffix(NULL), gw_suffix_replace(NULL), allowed_base(NULL), local_base(NULL),
+	gw_suf_len(0), gw_suffix_replace_len(0), gw_suf_dots(0), allowed_qty(0), local_qty(0), flags(0) {
+      memset(ht_offset, 0, sizeof(ht_offset));
+    }
+    ~EmcDnsTables() { free(varbufs); }
+
+    char     *varbufs;	// Storage for suffixes and local names
+    char     *gw_suffix;
+    char     *gw_suffix_replace;
+    char     *allowed_base;
+    char     *local_base;
+    int16_t   ht_offset[0x100]; // Hashtable for allowed TLD-suffixes(>0) and local names(<0)
+    uint16_t  gw_suf_len;
+    uint16_t  gw_suffix_replace_len;
+    uint8_t   gw_suf_dots;
+    uint8_t   allowed_qty;
+    uint8_t   local_qty;
+    uint16_t  flags;		// FLAG_LOCAL_SD
+}; // struct EmcDnsTables
+
+// Bloom filter over "dns:" names in nameindex, so lookups of not existing names are answered
+// without nameindex reads. Names are added by initial scan and on chain changes, and are never
+// removed: deleted names are just false positives. Bits are shared by workers lock-free.
+class EmcDnsNameFilter {
+  public:
+    EmcDnsNameFilter();
+    ~EmcDnsNameFilter() { delete[] m_bits; }
+
+    void Add(const char *name, size_t len);
+    bool MayContain(const char *name, size_t len) const;
+
+    std::atomic<bool> m_ready; // Initial scan completed; until then, any name may be contained
+
+  private:
+    void Hash(const char *name, size_t len, uint64_t &h1, uint64_t &h2) const;
+
+    std::atomic<uint64_t> *m_bits;
+    uint64_t  m_k0, m_k1;	// SipHash key
+}; // class EmcDnsNameFilter
+
+class EmcDns;
+
+// Query processor, runs in own thread. Each worker owns UDP socket (SO_REUSEPORT),
+// or TCP listener with all its connections, I/O buffers and state of the current query;
+// tables are shared within EmcDns
+class EmcDnsWorker {
+  public:
+    EmcDnsWorker(EmcDns *dns, SOCKET sockfd, bool tcp = false);
+    ~EmcDnsWorker();
 
     void Run();
+    void Stop();
+    void Join();
+    const EmcDnsStats &Stats() const { return m_stats; }
+    // Worker without socket (INVALID_SOCKET) has no thread, and is driven by ServePacket
+    uint32_t ServePacket(const uint8_t *packet, int len, const struct sockaddr_storage &ss);
+    const uint8_t *Buffer() const { return m_buf; }
 
   private:
     static void StatRun(void *p);
+    void RunUDP();
+    bool RunUDPBatch();
+    void RunTCP();
+    bool HandleTCPInput(string &rbuf, string &wbuf, const struct sockaddr_storage &ss);
+    uint32_t Serve(const struct sockaddr_storage &ss);
     int  HandlePacket();
+    bool GetQuestion(string &question);
     uint16_t HandleQuery();
     int  Search(uint8_t *key, bool check_domain_sig);
+    bool NameMayExist(const char *name, int len);
     int  LocalSearch(const uint8_t *key, uint8_t pos, uint8_t step);
     int  Tokenize(const char *key, const char *sep2, char **tokens, char *buf);
     void Answer_ALL(uint16_t qtype, char *buf);
@@ -104,7 +297,6 @@ class EmcDns {
     void HandleE2U(char *e2u);
     bool CheckEnumSigList(const char *q_str, char *siglist_str, char sig_separ);
     bool CheckEnumSig(const char *q_str, char *sig_str, char sig_separ);
-    void AddTF(char *tf_tok);
     bool CheckDAP(const void *key, int len, uint16_t inctemp);
 
     void Fill_RD_SRV(char *txt);
@@ -117,35 +309,89 @@ class EmcDns {
     inline void Out4(uint32_t x) { x = htonl(x); memcpy(m_snd, &x, 4); m_snd += 4; }
     void OutS(const char *p);
 
-    DNSHeader *m_hdr; // 1st bzero element
-    DNSAP    *m_dap_ht;	// Hashtable for DAP; index is hash(IP)
+    EmcDns   *m_dns;	// Shared tables and config
+    DNSHeader *m_hdr;
     char     *m_value;
-    char     *m_gw_suffix;
     uint8_t  *m_buf, *m_snd, *m_rcv, *m_rcvend, *m_obufend;
     SOCKET    m_sockfd;
     int       m_rcvlen;
     uint32_t  m_timestamp;
     uint32_t  m_mintemp; // Saved minimal DAP-remperature
-    uint32_t  m_daprand; // DAP random value for universal hashing
-    uint32_t  m_dapmask, m_dap_treshold;
     uint32_t  m_ttl;
     uint16_t  m_label_ref;
-    uint16_t  m_gw_suf_len;
-    uint16_t  m_gw_suffix_replace_len;
-    char     *m_allowed_base;
-    char     *m_local_base;
-    char     *m_gw_suffix_replace;
-    int16_t   m_ht_offset[0x100]; // Hashtable for allowed TLD-suffixes(>0) and local names(<0)
-    uint8_t   m_gw_suf_dots;
-    uint8_t   m_allowed_qty;
-    uint8_t   m_verbose;	// LAST bzero element
-    int8_t    m_status;
-    uint16_t  m_flags;          // runtime flags
+    uint8_t   m_verbose;
+    bool      m_tcp;
+    bool      m_cacheable;	// Answer to current question depends on names only
+    string    m_dapkey;		// Translated domain of current question
+    vector<string> m_names;	// Names, looked up for current question
+    EmcDnsStats m_stats;
+    std::shared_ptr<const EmcDnsTables> m_tables; // Snapshot, refreshed before packet, if reloaded
+    uint32_t  m_tables_gen;
+    std::atomic<bool> m_stop;
     boost::thread m_thread;
+}; // class EmcDnsWorker
+
+class EmcDns {
+  friend class EmcDnsWorker;
+  public:
+     EmcDns(const char *bind_ip, uint16_t port_no,
+	    const char *gw_suffix, const char *allowed_suff,
+	    const char *local_fname,
+	    uint32_t dapsize, uint32_t daptreshold,
+	    const char *enums, const char *tollfree,
+	    uint8_t verbose, int threads = EMCDNS_THREADS, bool tcp = EMCDNS_TCP,
+	    uint32_t cachesize = EMCDNS_CACHESIZE, int batch = EMCDNS_BATCH);
+    ~EmcDns();
+
+    // Sums counters of all workers; dap_used/dap_hot - DAP cells warm now, and over treshold
+    void GetStats(EmcDnsStats &stats, uint64_t &dap_used, uint64_t &dap_hot) const;
+    string GetStatsPrometheus() const;
+    uint32_t DapSize() const { return m_dap_ht? m_dapmask + 1 : 0; }
+    uint32_t DapTreshold() const { return m_dap_treshold; }
+    int64_t Uptime() const;
+    // Rebuilds tables, re-reading -emcdnslocalcf; allowed_suff replaces -emcdnsallowed, if not NULL
+    std::shared_ptr<const EmcDnsTables> Reload(const string *allowed_suff = NULL);
+
+  private:
+    SOCKET OpenSocket(const char *bind_ip, uint16_t port_no, bool tcp);
+    void AddTF(char *tf_tok);
+    int8_t DeferredInit(char *valbuf);
+    bool CheckDAP(const void *key, int len, uint16_t inctemp, uint32_t timestamp, uint32_t &mintemp);
+    void FillNameFilter();
+    std::shared_ptr<EmcDnsTables> BuildTables(const string &gw_suffix, const string &allowed_suff, const string &local_fname) const;
+
+    std::atomic<uint32_t> *m_dap_ht; // Hashtable for DAP, DNSAP cells; index is hash(IP)
+    EmcDnsAnswerCache *m_answers;    // NULL, if disabled
+    EmcDnsAnswerCache *m_nxanswers;  // NXDOMAIN answers; NULL, if disabled
+    EmcDnsSigCache    *m_sigs;       // NULL, if no verifiers
+    EmcDnsNameFilter  *m_name_filter;
+    boost::thread      m_filter_thread; // Initial scan of names filter
+    std::atomic<bool>  m_filter_stop;
+    boost::signals2::connection m_name_changed;
+    std::atomic<uint32_t> m_daprand; // DAP random value for universal hashing
+    uint32_t  m_dapmask, m_dap_treshold;
+    uint8_t   m_verbose;
+    std::atomic<int8_t> m_status;
+    int       m_batch;          // UDP packets per syscall
+    CCriticalSection cs_init;       // Serializes deferred init after IBD
+    CCriticalSection cs_verifiers;  // Guards m_verifiers cache
     map<string, Verifier> m_verifiers;
     vector<TollFree>      m_tollfree;
+    vector<EmcDnsWorker*> m_workers;
+    string   m_tollfree_list; // Deferred toll-free sources, loaded after IBD
     string   m_self_ns;
+    int64_t  m_started;         // Start time, for average rates
+    std::shared_ptr<const EmcDnsTables> m_tables; // Use atomic_load/atomic_store only
+    std::atomic<uint32_t> m_tables_gen;	// Incremented after m_tables replaced
+    CCriticalSection cs_tables;		// Serializes reloads
+    string   m_gw_suffix_str, m_allowed_str, m_local_fname; // Sources for tables
 }; // class EmcDns
 
+extern EmcDns *emcdns;
+
+class HTTPRequest;
+// Serves emcdns statistics in Prometheus text format, if -emcdnsmetrics
+bool EmcDnsHTTPMetrics(HTTPRequest *req, const std::string &strReq);
+
 #endif // EMCDNS_H
 
@@ -21,7 +21,7 @@ class CBlockIndex;
  */
 class BaseIndex : public CValidationInterface
 {
-protected:
+public:
     class DB : public CDBWrapper
     {
     public:
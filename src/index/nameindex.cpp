@@ -0,0 +1,69 @@
+// Copyright (c) 2019 The Emercoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <index/nameindex.h>
+#include <namecoin.h>
+#include <undo.h>
+#include <validation.h>
+
+std::unique_ptr<NameIndex> g_name_index;
+
+NameIndex::NameIndex(CNameDB& db) : m_db(db) {}
+
+BaseIndex::DB& NameIndex::GetDB() const { return m_db; }
+
+bool NameIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    // Exclude genesis block transaction because outputs are not spendable.
+    if (pindex->nHeight == 0)
+        return true;
+
+    // fees are taken from undo data, so the index does not depend on txindex being in sync
+    CBlockUndo blockundo;
+    if (!UndoReadFromDisk(blockundo, pindex))
+        return error("%s: failed to read undo data for block %d", __func__, pindex->nHeight);
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return error("%s: block and undo data inconsistent at %d", __func__, pindex->nHeight);
+
+    // collect valid name tx
+    std::vector<nameCheckResult> vName;
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size())); // start position
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransactionRef& tx = block.vtx[i];
+        if (i > 0 && !tx->IsCoinStake() && tx->nVersion == NAMECOIN_TX_VERSION) {
+            CAmount input = 0;
+            for (const auto& coin : blockundo.vtxundo[i - 1].vprevout) // randpay input has no undo record
+                input += coin.out.nValue;
+            CheckNameTx(tx, pindex, vName, pos, input - tx->GetValueOut());
+        }
+        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);  // set next tx position
+    }
+
+    if (vName.empty())
+        return true;
+
+    CBlockLocator locator;
+    {
+        LOCK(cs_main);
+        locator = ::ChainActive().GetLocator(pindex);
+    }
+    return ConnectNameBlock(pindex, vName, &locator);
+}
+
+bool NameIndex::Rewind(const CBlockIndex* current_tip, const CBlockIndex* new_tip)
+{
+    assert(current_tip->GetAncestor(new_tip->nHeight) == new_tip);
+
+    // undo name transactions in reverse order, newest block first
+    for (const CBlockIndex* pindex = current_tip; pindex != new_tip; pindex = pindex->pprev) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+            return error("%s: failed to read block %s from disk", __func__, pindex->GetBlockHash().ToString());
+        for (int i = block.vtx.size() - 1; i >= 0; i--)
+            DisconnectNameTx(block.vtx[i], IsV8Enabled(pindex->pprev, Params().GetConsensus()));
+    }
+
+    return BaseIndex::Rewind(current_tip, new_tip);
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2019 The Emercoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_NAMEINDEX_H
+#define BITCOIN_INDEX_NAMEINDEX_H
+
+#include <index/base.h>
+
+class CNameDB;
+
+static const bool DEFAULT_NAMEINDEX_ASYNC = false;
+
+/**
+ * NameIndex keeps nameindexV3 (and nameaddressV3 with -nameaddress) in sync with
+ * the active chain from the ValidationInterface queue, so block validation does not
+ * wait on name index I/O. It is used instead of writing names in
+ * CChainState::ConnectBlock when -nameindexasync is set.
+ *
+ * Name operations of a block are written in one batch together with the block
+ * locator, so the index resumes from the last written block after restart.
+ */
+class NameIndex final : public BaseIndex
+{
+private:
+    CNameDB& m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    /// Disconnect name operations of blocks above new_tip.
+    bool Rewind(const CBlockIndex* current_tip, const CBlockIndex* new_tip) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "nameindex"; }
+
+public:
+    /// Constructs the index on top of already opened name database, which must outlive it.
+    explicit NameIndex(CNameDB& db);
+};
+
+/// The global name index when running with -nameindexasync. May be null.
+extern std::unique_ptr<NameIndex> g_name_index;
+
+#endif // BITCOIN_INDEX_NAMEINDEX_H
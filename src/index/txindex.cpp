@@ -264,7 +264,7 @@ bool TxIndex::FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRe
     return true;
 }
 
-bool TxIndex::FindTx(const CDiskTxPos& postx, CTransactionRef& tx) const
+bool TxIndex::FindTx(const CDiskTxPos& postx, CTransactionRef& tx)
 {
     CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
     if (file.IsNull()) {
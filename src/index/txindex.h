@@ -71,7 +71,8 @@ public:
     /// @param[out]  tx  The transaction itself.
     /// @return  true if transaction is found, false otherwise
     bool FindTx(const uint256& tx_hash, uint256& block_hash, CTransactionRef& tx) const;
-    bool FindTx(const CDiskTxPos& postx, CTransactionRef& tx) const;
+    /// Read a transaction at its position in block files; does not use the index.
+    static bool FindTx(const CDiskTxPos& postx, CTransactionRef& tx);
     bool FindTxPosition(const uint256& txid, CDiskTxPos& pos) const;
 };
 
@@ -21,6 +21,7 @@
 #include <httprpc.h>
 #include <httpserver.h>
 #include <index/blockfilterindex.h>
+#include <index/nameindex.h>
 #include <index/txindex.h>
 #include <interfaces/chain.h>
 #include <key.h>
@@ -175,6 +176,9 @@ void Interrupt()
     if (g_txindex) {
         g_txindex->Interrupt();
     }
+    if (g_name_index) {
+        g_name_index->Interrupt();
+    }
     ForEachBlockFilterIndex([](BlockFilterIndex& index) { index.Interrupt(); });
 }
 
@@ -183,8 +187,6 @@ extern void shutdown_randpay();
 void Shutdown(InitInterfaces& interfaces)
 {
     LogPrintf("%s: In progress...\n", __func__);
-    if (emcdns)
-        delete emcdns;
     static CCriticalSection cs_Shutdown;
     TRY_LOCK(cs_Shutdown, lockShutdown);
     if (!lockShutdown)
@@ -201,8 +203,14 @@ void Shutdown(InitInterfaces& interfaces)
 #endif
     StopHTTPRPC();
     StopREST();
+    UnregisterHTTPHandler("/metrics", true);
     StopRPC();
     StopHTTPServer();
+    // emcdns statistics are served by RPC and HTTP threads, so stop emcdns after them
+    if (emcdns) {
+        delete emcdns;
+        emcdns = nullptr;
+    }
     for (const auto& client : interfaces.chain_clients) {
         client->flush();
     }
@@ -264,6 +272,10 @@ void Shutdown(InitInterfaces& interfaces)
         g_txindex->Stop();
         g_txindex.reset();
     }
+    if (g_name_index) {
+        g_name_index->Stop();
+        g_name_index.reset();
+    }
     ForEachBlockFilterIndex([](BlockFilterIndex& index) { index.Stop(); });
     DestroyAllBlockFilterIndexes();
 
@@ -577,6 +589,8 @@ void SetupServerArgs()
 #endif
 
     gArgs.AddArg("-nameaddress", "Enable address->names index (default: false)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-namevaluecache", strprintf("Memory for cached name values served to emcdns, in MiB; 0 = disable (default: %u)", NAMEVALUE_CACHE_SIZE), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-nameindexasync", strprintf("Update name indexes in background instead of during block validation. Name RPCs wait for the index, mempool name checks may see it a few blocks behind (default: %u)", DEFAULT_NAMEINDEX_ASYNC), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-nameindexchainsize", strprintf("Number of updates per each name to memorize on disk (default: %u)", NAMEINDEX_CHAIN_SIZE), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-stunsrcport", "Port for STUN system to identify your own ip (default: 0)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-exchtest", "Enable exchange testing (for code debugging only) (default: 0)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
@@ -592,8 +606,9 @@ void SetupServerArgs()
     gArgs.AddArg("-printfee", "Print stake fee to debug log (default: false)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-printcreation", "Print block reward checks to debug log (default: false)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-printcoinage", "Print block reward checks to debug log (default: false)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
-    gArgs.AddArg("-modcache", "Stake modifier optimization parameter 0=disable; 1=InitialDownload; 2=always (default: 2)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-modcache", "Stake modifier cache 0=disable; 1=enable (default: 1)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-splitpos", "Stake creation parameter 0=No Split, 1=RandSplit before 90d, -1=Principal+Reward (default: 1)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-stakethreads=<n>", "Threads for kernel search in large staking wallets, 0=number of cores, 1=no threads (default: 0)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-staketimio", "Stake creation timeout (default: 530 * sqrt(number of wallet txs))", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-checkpointkey", "Checkpoint master key, used to print checkpoints (default: empty)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-checkpointdepth", "Checkpoint depth (delay from chain tip)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
@@ -608,6 +623,11 @@ void SetupServerArgs()
     gArgs.AddArg("-emcdns", "Enable emcdns (default: false)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-emcdnsport", strprintf("emcdns port (default: %u)", EMCDNS_PORT), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-emcdnsverbose", "emcdns verbose debug log (default: true)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-emcdnsthreads", strprintf("emcdns worker threads, each with own SO_REUSEPORT socket; 0 = one per CPU core (default: %u, max: %u)", EMCDNS_THREADS, EMCDNS_MAXTHREADS), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-emcdnstcp", strprintf("Set to 1 to serve emcdns queries over TCP as well, on the same port, for answers which do not fit into UDP (default: %u)", EMCDNS_TCP), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-emcdnscache", strprintf("Memory for emcdns answers cache, in MiB; 0 = disable (default: %u)", EMCDNS_CACHESIZE), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-emcdnsbatch", strprintf("emcdns UDP packets received and answered per system call, Linux only; 1 = one packet per call (default: %u, max: %u)", EMCDNS_BATCH, EMCDNS_MAXBATCH), ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
+    gArgs.AddArg("-emcdnsmetrics", "Serve emcdns statistics in Prometheus format at /metrics of the RPC HTTP server (default: false)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-emcdnssuffix", "emcdns suffix (default: empty)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-emcdnsbindip", "emcdns bindip (default: empty)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
     gArgs.AddArg("-emcdnsallowed", "emcdns allowed (default: empty)", ArgsManager::ALLOW_ANY, OptionsCategory::RPC);
@@ -836,6 +856,7 @@ static bool AppInitServers()
     if (!StartHTTPRPC())
         return false;
     if (gArgs.GetBoolArg("-rest", DEFAULT_REST_ENABLE)) StartREST();
+    if (gArgs.GetBoolArg("-emcdnsmetrics", false)) RegisterHTTPHandler("/metrics", true, EmcDnsHTTPMetrics);
     StartHTTPServer();
     return true;
 }
@@ -1790,22 +1811,76 @@ bool AppInitMain(InitInterfaces& interfaces)
         }
     }
 
+    bool fNameIndexAsync = gArgs.GetBoolArg("-nameindexasync", DEFAULT_NAMEINDEX_ASYNC);
+    bool fNameAddress = gArgs.GetBoolArg("-nameaddress", false);
     pNameDB = MakeUnique<CNameDB>(nTxIndexCache, false, fReindexName);
-    if (fReindexName)
-        reindexNameIndex();
+    int nNameIndexVersion = 0;
+    uint256 hashNameReindex;
+    CBlockLocator nameLocator;
+    bool fWipeName = false;
+    if (!fReindexName && (!pNameDB->ReadVersion(nNameIndexVersion) || nNameIndexVersion != NAMEINDEX_VERSION)) {
+        // emercoin: nameindex was created by older version and lacks current name state - re-create both indexes
+        LogPrintf("Name index version %d is outdated, re-creating name indexes\n", nNameIndexVersion);
+        fWipeName = true;
+    } else if (!fReindexName && pNameDB->ReadBestBlock(nameLocator) != fNameIndexAsync) {
+        // emercoin: only background index keeps block locator - nameindex was built in other -nameindexasync mode
+        LogPrintf("Name index was built with different -nameindexasync, re-creating name indexes\n");
+        fWipeName = true;
+    } else if (!fReindexName && fNameIndexAsync && fNameAddress && !boost::filesystem::exists(pathNameAddress)) {
+        // emercoin: background index writes both indexes, so address index can be re-created only together with main one
+        fWipeName = true;
+    } else if (!fReindexName && pNameDB->ReadReindexBlock(hashNameReindex)) {
+        // emercoin: previous nameindex creation was interrupted - resume it, unless its last block was reorganized away
+        LOCK(cs_main);
+        const CBlockIndex* pindexResume = hashNameReindex.IsNull() ? nullptr : LookupBlockIndex(hashNameReindex);
+        if (!hashNameReindex.IsNull() && (!pindexResume || !::ChainActive().Contains(pindexResume))) {
+            LogPrintf("Interrupted name index creation stopped at block %s, which is not in active chain, re-creating name indexes\n", hashNameReindex.ToString());
+            fWipeName = true;
+        } else
+            fReindexName = true;
+    }
+    if (fWipeName) {
+        pNameDB.reset();
+        pNameDB = MakeUnique<CNameDB>(nTxIndexCache, false, true);
+        fReindexName = true;
+    }
+    if (fReindexName && boost::filesystem::exists(pathNameAddress)) {
+        boost::filesystem::remove_all(pathNameAddress);
+        fReindexNameAddress = true;
+    }
+    int64_t nNameValueCache = gArgs.GetArg("-namevaluecache", NAMEVALUE_CACHE_SIZE);
+    if (nNameValueCache > 0)
+        pNameValueCache = MakeUnique<CNameValueCache>(nNameValueCache << 20);
+    if (fReindexName) {
+        if (fNameIndexAsync)
+            pNameDB->WriteVersion(); // g_name_index will fill empty index from genesis
+        else if (!reindexNameIndex()) {
+            if (ShutdownRequested()) {
+                // interrupted name index creation is resumed on next start
+                LogPrintf("Shutdown requested. Exiting.\n");
+                return false;
+            }
+            return InitError(_("Failed to create name index, see debug.log for details.").translated);
+        }
+    }
 
-    if (gArgs.GetBoolArg("-nameaddress", false)) {
+    if (fNameAddress) {
         if (!boost::filesystem::exists(pathNameAddress))
             fReindexNameAddress = true;
         pNameAddressDB = MakeUnique<CNameAddressDB>(nTxIndexCache, false, fReindexNameAddress);
-        if (fReindexNameAddress)
-            reindexNameAddressIndex();
+        if (fReindexNameAddress && !fNameIndexAsync && !reindexNameAddressIndex())
+            return InitError(_("Failed to create name address index, see debug.log for details.").translated);
         fNameAddressIndex = true; // allow retrieval at name_scan_address
     } else {
         if (boost::filesystem::exists(pathNameAddress))
             boost::filesystem::remove_all(pathNameAddress);
     }
 
+    if (fNameIndexAsync) {
+        g_name_index = MakeUnique<NameIndex>(*pNameDB);
+        g_name_index->Start();
+    }
+
     // ********************************************************* Step 9: load wallet
     for (const auto& client : interfaces.chain_clients) {
         if (!client->load()) {
@@ -1990,10 +2065,14 @@ bool AppInitMain(InitInterfaces& interfaces)
         string tf      = gArgs.GetArg("-enumtollfree", "");
         uint32_t dapzs = gArgs.GetArg("-dapsize", 0);
         uint32_t dapth = gArgs.GetArg("-daptreshold", EMCDNS_DAPTRESHOLD);
+        int threads    = gArgs.GetArg("-emcdnsthreads", EMCDNS_THREADS);
+        bool tcp       = gArgs.GetBoolArg("-emcdnstcp", EMCDNS_TCP);
+        uint32_t cache = gArgs.GetArg("-emcdnscache", EMCDNS_CACHESIZE);
+        int batch      = gArgs.GetArg("-emcdnsbatch", EMCDNS_BATCH);
         emcdns = new EmcDns(bind_ip.c_str(), port,
         suffix.c_str(), allowed.c_str(), localcf.c_str(),
         dapzs, dapth,
-        enums.c_str(), tf.c_str(), verbose);
+        enums.c_str(), tf.c_str(), verbose, threads, tcp, cache, batch);
         LogPrintf("DNS server started\n");
     }
 
@@ -12,7 +12,16 @@
 #include <consensus/validation.h>
 #include <txdb.h>
 #include <index/txindex.h>
-#include <wallet/coincontrol.h>
+#include <pow.h>
+
+#include <crypto/common.h>
+#include <crypto/sha256.h>
+
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <thread>
+#include <unordered_map>
 
 using namespace std;
 #if 0
@@ -24,11 +33,136 @@ static std::map<int, unsigned int> mapStakeModifierCheckpoints =
 };
 #endif
 
+// Stake modifier cache: all modifier generations along the active chain, ordered
+// by height. Replaces CBlockIndex pprev/next walks in modifier lookups with binary
+// search. Maintained by ConnectTip/DisconnectTip; rebuilt from ::ChainActive() if
+// found out of sync (startup, reindex). Protected by cs_main.
+struct StakeModifierEntry {
+    int      nHeight;
+    int64_t  nTime;          // Generating block time
+    int64_t  nTimeMax;       // Max nTime over this and all previous entries
+    uint64_t nStakeModifier;
+};
+static std::vector<StakeModifierEntry> vModCache;
+static std::vector<uint32_t> vModCacheUnordered; // Indexes of entries with nTime < nTimeMax
+static uint256 hashModCacheTip;                  // Active chain tip the cache is synced with
+static int     nModCacheTipHeight = -1;
+static int     nModCache = -1;                   // -modcache: 0=disable; 1=enable
+
+static void ModCacheAppend(const CBlockIndex* pindex)
+{
+    if (pindex->GeneratedStakeModifier()) {
+        StakeModifierEntry e;
+        e.nHeight = pindex->nHeight;
+        e.nTime = pindex->GetBlockTime();
+        e.nTimeMax = vModCache.empty()? e.nTime : max(e.nTime, vModCache.back().nTimeMax);
+        e.nStakeModifier = pindex->nStakeModifier;
+        if (e.nTime < e.nTimeMax)
+            vModCacheUnordered.push_back(vModCache.size());
+        vModCache.push_back(e);
+    }
+    hashModCacheTip = pindex->GetBlockHash();
+    nModCacheTipHeight = pindex->nHeight;
+}
+
+// Drop entries above nHeight
+static void ModCacheTruncate(int nHeight)
+{
+    while (!vModCache.empty() && vModCache.back().nHeight > nHeight) {
+        if (!vModCacheUnordered.empty() && vModCacheUnordered.back() == vModCache.size() - 1)
+            vModCacheUnordered.pop_back();
+        vModCache.pop_back();
+    }
+}
+
+// Returns true if the cache can be used for lookups below the active tip
+static bool SyncStakeModifierCache()
+{
+    AssertLockHeld(cs_main);
+    if (nModCache < 0)
+        nModCache = gArgs.GetArg("-modcache", 1);
+    const CBlockIndex* pindexTip = ::ChainActive().Tip();
+    if (nModCache == 0 || pindexTip == NULL)
+        return false;
+    if (nModCacheTipHeight == pindexTip->nHeight && hashModCacheTip == pindexTip->GetBlockHash())
+        return true;
+    const CBlockIndex* pindexSynced = ::ChainActive()[nModCacheTipHeight];
+    if (pindexSynced == NULL || pindexSynced->GetBlockHash() != hashModCacheTip) {
+        // Not a prefix of the active chain, rebuild
+        vModCache.clear();
+        vModCacheUnordered.clear();
+        nModCacheTipHeight = -1;
+    }
+    for (int h = nModCacheTipHeight + 1; h <= pindexTip->nHeight; h++)
+        ModCacheAppend(::ChainActive()[h]);
+    return true;
+}
+
+void StakeModifierCacheConnect(const CBlockIndex* pindexNew)
+{
+    AssertLockHeld(cs_main);
+    // Otherwise, will be resynced on the next lookup
+    if (pindexNew->pprev && nModCacheTipHeight == pindexNew->nHeight - 1 && hashModCacheTip == pindexNew->pprev->GetBlockHash())
+        ModCacheAppend(pindexNew);
+}
+
+void StakeModifierCacheDisconnect(const CBlockIndex* pindexDelete)
+{
+    AssertLockHeld(cs_main);
+    if (pindexDelete->pprev && nModCacheTipHeight == pindexDelete->nHeight && hashModCacheTip == pindexDelete->GetBlockHash()) {
+        ModCacheTruncate(pindexDelete->nHeight - 1);
+        hashModCacheTip = pindexDelete->pprev->GetBlockHash();
+        nModCacheTipHeight = pindexDelete->nHeight - 1;
+    }
+}
+
+// Index of the highest generation at or below nHeight with nTime <= nTimeLimit, or -1
+static int ModCacheFindBackward(int nHeight, int64_t nTimeLimit)
+{
+    auto itEnd = upper_bound(vModCache.begin(), vModCache.end(), nHeight,
+            [](int h, const StakeModifierEntry& e) { return h < e.nHeight; });
+    // All entries up to the partition point are within limit, nTimeMax is nondecreasing
+    auto it = partition_point(vModCache.begin(), itEnd,
+            [nTimeLimit](const StakeModifierEntry& e) { return e.nTimeMax <= nTimeLimit; });
+    int nFound = int(it - vModCache.begin()) - 1;
+    // Above it, only entries older than some predecessor can be within limit
+    int nEnd = itEnd - vModCache.begin();
+    for (auto u = vModCacheUnordered.rbegin(); u != vModCacheUnordered.rend() && (int)*u > nFound; ++u)
+        if ((int)*u < nEnd && vModCache[*u].nTime <= nTimeLimit)
+            return *u;
+    return nFound;
+}
+
+// Index of the lowest generation above nHeight with nTime >= nTimeLimit, or -1
+static int ModCacheFindForward(int nHeight, int64_t nTimeLimit)
+{
+    auto itBegin = upper_bound(vModCache.begin(), vModCache.end(), nHeight,
+            [](int h, const StakeModifierEntry& e) { return h < e.nHeight; });
+    if (itBegin != vModCache.begin() && (itBegin - 1)->nTimeMax >= nTimeLimit) {
+        // Some earlier entry already reached the limit, nTimeMax cannot partition
+        for (auto it = itBegin; it != vModCache.end(); ++it)
+            if (it->nTime >= nTimeLimit)
+                return it - vModCache.begin();
+        return -1;
+    }
+    auto it = partition_point(itBegin, vModCache.end(),
+            [nTimeLimit](const StakeModifierEntry& e) { return e.nTimeMax < nTimeLimit; });
+    return it == vModCache.end()? -1 : it - vModCache.begin();
+}
+
 // Get the last stake modifier and its generation time from a given block
-static bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime)
+bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime)
 {
     if (!pindex)
         return error("%s: null pindex", __func__);
+    if (SyncStakeModifierCache() && ::ChainActive().Contains(pindex)) {
+        int n = ModCacheFindBackward(pindex->nHeight, std::numeric_limits<int64_t>::max());
+        if (n < 0)
+            return error("%s: no generation at genesis block", __func__);
+        nStakeModifier = vModCache[n].nStakeModifier;
+        nModifierTime = vModCache[n].nTime;
+        return true;
+    }
     do {
         if (pindex->GeneratedStakeModifier()) {
             nStakeModifier = pindex->nStakeModifier;
@@ -245,7 +379,7 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStake
 // V0.5: Stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier that is (nStakeMinAge minus a selection interval) earlier than the
 // stake, thus at least a selection interval later than the coin generating the // kernel, as the generating coin is from at least nStakeMinAge ago.
-static bool GetKernelStakeModifierV05(CBlockIndex* pindexPrev, unsigned int nTimeTx, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
+bool GetKernelStakeModifierV05(CBlockIndex* pindexPrev, unsigned int nTimeTx, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
 {
     const Consensus::Params& params = Params().GetConsensus();
     const CBlockIndex* pindex = pindexPrev;
@@ -261,23 +395,16 @@ static bool GetKernelStakeModifierV05(CBlockIndex* pindexPrev, unsigned int nTim
         return false;
     }
 
-    static int64_t       cache_TimeTxBarrier = 0;
-    static int64_t       cache_nStakeModifierTime, cache_nStakeModifierTime_in;
-    static uint64_t      cache_nStakeModifier;
-    static int           cache_nStakeModifierHeight;
-    static unsigned int  cache_nTimeTx;
-    static int           modcache = -1; // 0=disable; 1=InitialDownload; 2=always
-    if(modcache < 0)
-        modcache = gArgs.GetArg("-modcache", 1);
-    if (modcache > 1 || (modcache > 0 && ::ChainstateActive().IsInitialBlockDownload())) {
-        if(nTimeTx <= cache_TimeTxBarrier && nStakeModifierTime >= cache_nStakeModifierTime_in && nTimeTx >= cache_nTimeTx) {
-            nStakeModifier       = cache_nStakeModifier;
-            nStakeModifierTime   = cache_nStakeModifierTime;
-            nStakeModifierHeight = cache_nStakeModifierHeight;
-            return true;
-        }
-        cache_nStakeModifierTime_in = nStakeModifierTime;
-    } // modcache
+    if (SyncStakeModifierCache() && ::ChainActive().Contains(pindex)) {
+        // Same as the loop below: first generation back from pindexPrev within the limit
+        int n = ModCacheFindBackward(pindex->nHeight, (int64_t)nTimeTx - params.nStakeMinAge + nStakeModifierSelectionInterval);
+        if (n < 0)
+            return error("GetKernelStakeModifier() : reached genesis block");
+        nStakeModifier       = vModCache[n].nStakeModifier;
+        nStakeModifierHeight = vModCache[n].nHeight;
+        nStakeModifierTime   = vModCache[n].nTime;
+        return true;
+    }
     // loop to find the stake modifier earlier by
     // (nStakeMinAge minus a selection interval)
     while (nStakeModifierTime + params.nStakeMinAge - nStakeModifierSelectionInterval >(int64_t) nTimeTx)
@@ -291,19 +418,15 @@ static bool GetKernelStakeModifierV05(CBlockIndex* pindexPrev, unsigned int nTim
         {
             nStakeModifierHeight = pindex->nHeight;
             nStakeModifierTime = pindex->GetBlockTime();
-            cache_TimeTxBarrier = nStakeModifierTime + params.nStakeMinAge - nStakeModifierSelectionInterval;
         }
     } // while
-    cache_nStakeModifier = nStakeModifier = pindex->nStakeModifier;
-    cache_nStakeModifierHeight = nStakeModifierHeight;
-    cache_nStakeModifierTime = nStakeModifierTime;
-    cache_nTimeTx = nTimeTx;
+    nStakeModifier = pindex->nStakeModifier;
     return true;
 }
 
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-static bool GetKernelStakeModifierV03(CBlockIndex* pindexPrev, uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
+bool GetKernelStakeModifierV03(CBlockIndex* pindexPrev, uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime)
 {
     const Consensus::Params& params = Params().GetConsensus();
     nStakeModifier = 0;
@@ -314,6 +437,22 @@ static bool GetKernelStakeModifierV03(CBlockIndex* pindexPrev, uint256 hashBlock
     nStakeModifierTime = pindexFrom->GetBlockTime();
     int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
 
+    if (SyncStakeModifierCache() && ::ChainActive().Contains(pindexPrev) && ::ChainActive().Contains(pindexFrom)) {
+        // Same as the loop below: first generation forward from pindexFrom up to the active tip
+        int n = ModCacheFindForward(pindexFrom->nHeight, pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval);
+        if (n < 0) {
+            const CBlockIndex* pindexTip = ::ChainActive().Tip();
+            auto cat = pindexTip->GetBlockTime() + params.nStakeMinAge - nStakeModifierSelectionInterval > GetAdjustedTime() ? BCLog::NONE : BCLog::STAKE;
+            LogPrint(cat, "%s: reached best block %s at height %d from block %s", __func__,
+                     pindexTip->GetBlockHash().ToString(), pindexTip->nHeight, hashBlockFrom.ToString());
+            return false;
+        }
+        nStakeModifier       = vModCache[n].nStakeModifier;
+        nStakeModifierHeight = vModCache[n].nHeight;
+        nStakeModifierTime   = vModCache[n].nTime;
+        return true;
+    }
+
     // emercoin: we need to iterate index forward but we cannot use ::ChainActive().Next()
     // because there is no guarantee that we are checking blocks in active chain.
     // So, we construct a temporary chain that we will iterate over.
@@ -365,6 +504,95 @@ static bool GetKernelStakeModifier(CBlockIndex* pindexPrev, uint256 hashBlockFro
         return GetKernelStakeModifierV03(pindexPrev, hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime);
 }
 
+// Kernel input cache: the same coinstake is checked in AcceptBlock, TestBlockValidity
+// and sometimes again in ConnectBlock, and minted kernels are checked right after
+// CreateCoinStake. Keeps staked outputs, so each is looked up once.
+// FIFO eviction; cleared on disconnect, since txPrev block can leave the chain.
+// Protected by cs_main.
+static const size_t KERNEL_INPUT_CACHE_SIZE = 4096;
+static std::unordered_map<COutPoint, KernelInput, SaltedOutpointHasher> mapKernelInputs;
+static std::deque<COutPoint> dqKernelInputs;
+
+static void CacheKernelInput(const COutPoint& prevout, const KernelInput& in)
+{
+    AssertLockHeld(cs_main);
+    if (!mapKernelInputs.emplace(prevout, in).second)
+        return;
+    dqKernelInputs.push_back(prevout);
+    if (dqKernelInputs.size() > KERNEL_INPUT_CACHE_SIZE) {
+        mapKernelInputs.erase(dqKernelInputs.front());
+        dqKernelInputs.pop_front();
+    }
+}
+
+// Read staked output from cache, from UTXO set and block index, or from block files
+static bool GetKernelInput(const COutPoint& prevout, KernelInput& in)
+{
+    AssertLockHeld(cs_main);
+    auto it = mapKernelInputs.find(prevout);
+    if (it != mapKernelInputs.end()) {
+        in = it->second;
+        return true;
+    }
+
+    // Get transaction index for the previous transaction
+    CDiskTxPos postx;
+    if (!g_txindex->FindTxPosition(prevout.hash, postx))
+        return error("CheckProofOfStake() : tx index not found");  // tx index not found
+
+    // Unspent output (the kernel of a block being connected, as in IBD): txout and tx time are
+    // kept in the coin, its block is in the active chain at coin height - no block file is read
+    Coin coin;
+    if (::ChainstateActive().CoinsTip().GetCoin(prevout, coin)) {
+        const CBlockIndex* pindexFrom = ::ChainActive()[coin.nHeight];
+        if (pindexFrom) {
+            in.hashBlockFrom = pindexFrom->GetBlockHash();
+            in.nTimeBlockFrom = pindexFrom->GetBlockTime();
+            in.nTxPrevOffset = postx.nTxOffset + CBlockHeader::NORMAL_SERIALIZE_SIZE;
+            in.nTimeTxPrev = coin.nTime;
+            in.txout = coin.out;
+            CacheKernelInput(prevout, in);
+            return true;
+        }
+    }
+
+    // Read txPrev and header of its block
+    CBlockHeader header;
+    CTransactionRef txPrev;
+    {
+        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            return error("%s: OpenBlockFile failed", __func__);
+        }
+        try {
+            file >> header;
+            if (fseek(file.Get(), postx.nTxOffset, SEEK_CUR)) {
+                return error("%s: fseek(...) failed", __func__);
+            }
+            file >> txPrev;
+        } catch (std::exception &e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (txPrev->GetHash() != prevout.hash) {
+            return error("%s: txid mismatch", __func__);
+        }
+        if (prevout.n >= txPrev->vout.size()) {
+            return error("%s: prevout index out of range", __func__);
+        }
+    }
+
+    in = KernelInput(header, postx.nTxOffset + CBlockHeader::NORMAL_SERIALIZE_SIZE, *txPrev, prevout.n);
+    CacheKernelInput(prevout, in);
+    return true;
+}
+
+void KernelInputCacheDisconnect()
+{
+    AssertLockHeld(cs_main);
+    mapKernelInputs.clear();
+    dqKernelInputs.clear();
+}
+
 // ppcoin kernel protocol
 // coinstake must meet hash target according to the protocol:
 // kernel (input 0) must meet the formula
@@ -391,23 +619,23 @@ static bool GetKernelStakeModifier(CBlockIndex* pindexPrev, uint256 hashBlockFro
 //   quantities so as to generate blocks faster, degrading the system back into
 //   a proof-of-work situation.
 //
-static bool CheckStakeKernelHash(unsigned int nBits, CBlockIndex* pindexPrev, const CBlockHeader& blockFrom, unsigned int nTxPrevOffset, const CTransactionRef& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake)
+bool CheckStakeKernelHash(unsigned int nBits, CBlockIndex* pindexPrev, const KernelInput& in, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake)
 {
     const Consensus::Params& params = Params().GetConsensus();
-    if (nTimeTx < txPrev->nTime)  // Transaction timestamp violation
+    if (nTimeTx < in.nTimeTxPrev)  // Transaction timestamp violation
         return error("%s: nTime violation", __func__);
 
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    unsigned int nTimeBlockFrom = in.nTimeBlockFrom;
     if (nTimeBlockFrom + params.nStakeMinAge > nTimeTx) // Min age requirement
         return error("%s: min age violation", __func__);
 
     arith_uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev->vout[prevout.n].nValue;
+    int64_t nValueIn = in.txout.nValue;
     // v0.3 protocol kernel hash weight starts from 0 at the 30-day min age
     // this change increases active coins participating the hash and helps
     // to secure the network when proof-of-stake difficulty is low
-    int64_t nTimeWeight = min((int64_t)nTimeTx - txPrev->nTime, params.nStakeMaxAge) - (IsProtocolV03(nTimeTx)? params.nStakeMinAge : 0);
+    int64_t nTimeWeight = min((int64_t)nTimeTx - in.nTimeTxPrev, params.nStakeMaxAge) - (IsProtocolV03(nTimeTx)? params.nStakeMinAge : 0);
     arith_uint256 bnCoinDayWeight = arith_uint256(nValueIn) * nTimeWeight / COIN / (24 * 60 * 60);
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
@@ -415,14 +643,14 @@ static bool CheckStakeKernelHash(unsigned int nBits, CBlockIndex* pindexPrev, co
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
     if (IsProtocolV03(nTimeTx)) {  // v0.3 protocol
-        if (!GetKernelStakeModifier(pindexPrev, blockFrom.GetHash(), nTimeTx, nStakeModifier, nStakeModifierHeight, nStakeModifierTime))
+        if (!GetKernelStakeModifier(pindexPrev, in.hashBlockFrom, nTimeTx, nStakeModifier, nStakeModifierHeight, nStakeModifierTime))
             return false;
         ss << nStakeModifier;
     } else {                       // v0.2 protocol
         ss << nBits;
     }
 
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev->nTime << prevout.n << nTimeTx;
+    ss << nTimeBlockFrom << in.nTxPrevOffset << in.nTimeTxPrev << prevout.n << nTimeTx;
 
     if (nTimeTx >= 1489782503 && !IsProtocolV05(nTimeTx)) // block 219831, until 06/18/2019
         ss << pindexPrev->GetBlockHash();
@@ -437,12 +665,12 @@ static bool CheckStakeKernelHash(unsigned int nBits, CBlockIndex* pindexPrev, co
         LogPrint(fPass ? BCLog::NONE : BCLog::STAKE, "%s: using modifier 0x%016x at height=%d timestamp=%s for block from height=%d timestamp=%s\n", __func__,
             nStakeModifier, nStakeModifierHeight,
             FormatISO8601DateTime(nStakeModifierTime),
-            LookupBlockIndex(blockFrom.GetHash())->nHeight,
-            FormatISO8601DateTime(blockFrom.GetBlockTime()));
+            LookupBlockIndex(in.hashBlockFrom)->nHeight,
+            FormatISO8601DateTime(in.nTimeBlockFrom));
     LogPrint(fPass ? BCLog::NONE : BCLog::STAKE, "%s: check protocol=%s modifier=0x%016x nTimeBlockFrom=%u nTxPrevOffset=%u nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n", __func__,
         IsProtocolV05(nTimeTx)? "0.5" : (IsProtocolV03(nTimeTx)? "0.3" : "0.2"),
         IsProtocolV03(nTimeTx)? nStakeModifier : (uint64_t) nBits,
-        nTimeBlockFrom, nTxPrevOffset, txPrev->nTime, prevout.n, nTimeTx,
+        nTimeBlockFrom, in.nTxPrevOffset, in.nTimeTxPrev, prevout.n, nTimeTx,
         hashProofOfStake.ToString());
 #endif
     return fPass;
@@ -461,44 +689,22 @@ bool CheckProofOfStake(CValidationState &state, CBlockIndex* pindexPrev, const C
     if (!g_txindex)
         return error("CheckProofOfStake() : transaction index not available");
 
-    // Get transaction index for the previous transaction
-    CDiskTxPos postx;
-    if (!g_txindex->FindTxPosition(txin.prevout.hash, postx))
-        return error("CheckProofOfStake() : tx index not found");  // tx index not found
-
-    // Read txPrev and header of its block
-    CBlockHeader header;
-    CTransactionRef txPrev;
-    {
-        CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-        if (file.IsNull()) {
-            return error("%s: OpenBlockFile failed", __func__);
-        }
-        try {
-            file >> header;
-            if (fseek(file.Get(), postx.nTxOffset, SEEK_CUR)) {
-                return error("%s: fseek(...) failed", __func__);
-            }
-            file >> txPrev;
-        } catch (std::exception &e) {
-            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-        }
-        if (txPrev->GetHash() != txin.prevout.hash) {
-            return error("%s: txid mismatch", __func__);
-        }
-    }
+    // Read txPrev output and header of its block
+    KernelInput in;
+    if (!GetKernelInput(txin.prevout, in))
+        return false;
 
     // Verify signature
     {
         int nIn = 0;
-        const CTxOut& prevOut = txPrev->vout[tx->vin[nIn].prevout.n];
+        const CTxOut& prevOut = in.txout;
         TransactionSignatureChecker checker(&(*tx), nIn, prevOut.nValue, PrecomputedTransactionData(*tx));
 
         if (!VerifyScript(tx->vin[nIn].scriptSig, prevOut.scriptPubKey, tx->nVersion, &(tx->vin[nIn].scriptWitness), SCRIPT_VERIFY_P2SH, checker, nullptr))
             return state.Invalid(ValidationInvalidReason::CONSENSUS, false, REJECT_INVALID, "invalid-pos-script", strprintf("%s: VerifyScript failed on coinstake %s", __func__, tx->GetHash().ToString()));
     }
 
-    if (!CheckStakeKernelHash(nBits, pindexPrev, header, postx.nTxOffset + CBlockHeader::NORMAL_SERIALIZE_SIZE, txPrev, txin.prevout, tx->nTime, hashProofOfStake))
+    if (!CheckStakeKernelHash(nBits, pindexPrev, in, txin.prevout, tx->nTime, hashProofOfStake))
         return state.Invalid(ValidationInvalidReason::CONSENSUS, false, REJECT_INVALID, "invalid-stake-hash", strprintf("%s: INFO: check kernel failed on coinstake %s, hashProof=%s", __func__, tx->GetHash().ToString(), hashProofOfStake.ToString()));
 
     return true;
@@ -539,6 +745,475 @@ bool CheckStakeModifierCheckpoints(int nHeight, unsigned int nStakeModifierCheck
     return true;
 }
 
+// Min candidates x timestamps to run the scan in worker threads, and candidates per work unit
+static const size_t KERNEL_SCAN_PARALLEL_MIN = 16 * 1024;
+static const size_t KERNEL_SCAN_CHUNK = 64;
+// Kernels per SHA256D1 batch: one AVX2 8-way or two SSE4.1 4-way transforms
+static const size_t KERNEL_SCAN_LANES = 8;
+
+// Same as CheckStakeKernelHash for V05 protocol with the modifier given. The kernel is
+// a single SHA-256 block, so there is no midstate to share; it is serialized into a
+// fixed buffer instead of CDataStream.
+static bool CheckStakeKernelHashV05(const arith_uint256& bnTargetPerCoinDay, uint64_t nStakeModifier, const KernelInput& in, uint32_t n, unsigned int nTimeTx)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    if (nTimeTx < in.nTimeTxPrev || in.nTimeBlockFrom + params.nStakeMinAge > nTimeTx)
+        return false;
+
+    int64_t nTimeWeight = min((int64_t)nTimeTx - in.nTimeTxPrev, params.nStakeMaxAge) - params.nStakeMinAge;
+    arith_uint256 bnCoinDayWeight = arith_uint256(in.txout.nValue) * nTimeWeight / COIN / (24 * 60 * 60);
+
+    unsigned char kernel[28];
+    WriteLE64(kernel, nStakeModifier);
+    WriteLE32(kernel + 8, in.nTimeBlockFrom);
+    WriteLE32(kernel + 12, in.nTxPrevOffset);
+    WriteLE32(kernel + 16, in.nTimeTxPrev);
+    WriteLE32(kernel + 20, n);
+    WriteLE32(kernel + 24, nTimeTx);
+    uint256 hashProofOfStake;
+    CHash256().Write(kernel, sizeof(kernel)).Finalize(hashProofOfStake.begin());
+
+    return !(UintToArith256(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay);
+}
+
+// Appends hits (candidate index, timestamp offset) for candidates [nBegin, nEnd); first offset per candidate.
+// Kernels are padded into single SHA-256 blocks and hashed in batches by the multi-way SHA256D1.
+// A hash is compared with the candidate target at the latest timestamp, which is the largest one,
+// and passed hashes are confirmed by CheckStakeKernelHashV05, so hits are the same as of one-by-one check.
+void ScanKernelRange(const KernelSearch& search, const std::vector<KernelCandidate>& vCandidates, size_t nBegin, size_t nEnd, std::vector<std::pair<size_t, unsigned int> >& vHits)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    struct Lane {
+        size_t        i;
+        unsigned int  n;
+        arith_uint256 bnBound;
+    } lanes[KERNEL_SCAN_LANES];
+    unsigned char blocks[KERNEL_SCAN_LANES * 64];
+    unsigned char hashes[KERNEL_SCAN_LANES * 32];
+    size_t nLanes = 0;
+
+    // Padding of 28-byte message: 0x80 terminator and big-endian bit length
+    memset(blocks, 0, sizeof(blocks));
+    for (size_t l = 0; l < KERNEL_SCAN_LANES; l++) {
+        blocks[l * 64 + 28] = 0x80;
+        blocks[l * 64 + 63] = 28 * 8;
+    }
+
+    auto flush = [&]() {
+        SHA256D1(hashes, blocks, nLanes);
+        for (size_t l = 0; l < nLanes; l++) {
+            const Lane& lane = lanes[l];
+            if (!vHits.empty() && vHits.back().first == lane.i)
+                continue; // Hit at earlier offset
+            uint256 hashProofOfStake;
+            memcpy(hashProofOfStake.begin(), hashes + l * 32, 32);
+            if (UintToArith256(hashProofOfStake) > lane.bnBound)
+                continue;
+            const KernelCandidate& c = vCandidates[lane.i];
+            if (CheckStakeKernelHashV05(search.bnTargetPerCoinDay, search.vModifier[lane.n].second, c.in, c.prevout.n, search.nTime - lane.n))
+                vHits.emplace_back(lane.i, lane.n);
+        }
+        nLanes = 0;
+    };
+
+    for (size_t i = nBegin; i < nEnd; i++) {
+        const KernelInput& in = vCandidates[i].in;
+        // Too young or older than the coinstake for latest timestamp - also for all earlier ones
+        if (search.nTime < in.nTimeTxPrev || in.nTimeBlockFrom + params.nStakeMinAge > search.nTime)
+            continue;
+        int64_t nTimeWeight = min((int64_t)search.nTime - in.nTimeTxPrev, params.nStakeMaxAge) - params.nStakeMinAge;
+        arith_uint256 bnBound = arith_uint256(in.txout.nValue) * nTimeWeight / COIN / (24 * 60 * 60) * search.bnTargetPerCoinDay;
+
+        for (unsigned int n = 0; n < search.vModifier.size(); n++) {
+            unsigned int nTimeTx = search.nTime - n;
+            if (nTimeTx < in.nTimeTxPrev || in.nTimeBlockFrom + params.nStakeMinAge > nTimeTx)
+                break;
+            if (!search.vModifier[n].first)
+                continue;
+            unsigned char* kernel = blocks + nLanes * 64;
+            WriteLE64(kernel, search.vModifier[n].second);
+            WriteLE32(kernel + 8, in.nTimeBlockFrom);
+            WriteLE32(kernel + 12, in.nTxPrevOffset);
+            WriteLE32(kernel + 16, in.nTimeTxPrev);
+            WriteLE32(kernel + 20, vCandidates[i].prevout.n);
+            WriteLE32(kernel + 24, nTimeTx);
+            lanes[nLanes].i = i;
+            lanes[nLanes].n = n;
+            lanes[nLanes].bnBound = bnBound;
+            if (++nLanes == KERNEL_SCAN_LANES) {
+                flush();
+                if (!vHits.empty() && vHits.back().first == i)
+                    break;
+            }
+        }
+    }
+    if (nLanes)
+        flush();
+}
+
+// Hits are returned in candidate order, like the sequential search would find them
+void ScanKernels(const KernelSearch& search, const std::vector<KernelCandidate>& vCandidates, std::vector<std::pair<size_t, unsigned int> >& vHits)
+{
+    // Read once; initialization of a local static is thread-safe between wallet minters
+    static const int nThreads = []() {
+        int n = gArgs.GetArg("-stakethreads", 0);
+        return n > 0 ? n : GetNumCores();
+    }();
+    if (nThreads <= 1 || vCandidates.size() * search.vModifier.size() < KERNEL_SCAN_PARALLEL_MIN) {
+        ScanKernelRange(search, vCandidates, 0, vCandidates.size(), vHits);
+        return;
+    }
+
+    // Workers take chunks of candidates; std::thread, since the minting thread may be
+    // interrupted, and an interrupted join would leave workers on this stack
+    std::atomic<size_t> nNext(0);
+    std::vector<std::vector<std::pair<size_t, unsigned int> > > vThreadHits(nThreads);
+    std::vector<std::thread> vThreads;
+    for (int t = 0; t < nThreads; t++)
+        vThreads.emplace_back([&, t]() {
+            size_t nBegin;
+            while ((nBegin = nNext.fetch_add(KERNEL_SCAN_CHUNK)) < vCandidates.size())
+                ScanKernelRange(search, vCandidates, nBegin, min(nBegin + KERNEL_SCAN_CHUNK, vCandidates.size()), vThreadHits[t]);
+        });
+    for (auto& thread : vThreads)
+        thread.join();
+
+    for (const auto& v : vThreadHits)
+        vHits.insert(vHits.end(), v.begin(), v.end());
+    sort(vHits.begin(), vHits.end());
+}
+
+// Staking coins of a wallet: compact kernel records of its mintable UTXOs, owned by
+// CWallet::m_stake_cache. Built once from mapWallet, then kept up to date from
+// NotifyTransactionChanged: changed transactions are queued, and before the next
+// search their outputs and the outputs they spend are re-evaluated. Block time and
+// hash come from the block index and tx offset from txindex, so no block is read.
+// Records are erased when spent; the queue falls back to a rebuild when it overflows.
+// Protected by cs_wallet, which is held for the notifications.
+struct StakeCoin {
+    uint256      hashBlockFrom;
+    CAmount      nValue;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+};
+
+static const size_t STAKE_CACHE_MAX_QUEUE = 10000;
+
+extern uint256HashMap<time_t> g_RandPayLockUTXO;
+
+class StakeCache
+{
+public:
+    explicit StakeCache(CWallet* pwalletIn) : pwallet(pwalletIn), fRebuild(true)
+    {
+        // The cache is owned by the wallet, so the connection lives as long as it
+        pwallet->NotifyTransactionChanged.connect([this](CWallet*, const uint256& hash, ChangeType status) {
+            TxChanged(hash, status);
+        });
+    }
+
+    // Applies queued changes; called with cs_main and cs_wallet held
+    void Sync(interfaces::Chain::Lock& locked_chain);
+
+    const std::map<COutPoint, StakeCoin>& Coins() const { return mapCoins; }
+    uint64_t Changes() const { return nChanges; }
+
+    // Staking forecast, see GetStakeInfo; nInfoHorizon = 0 until requested, no updates on blocks
+    CCriticalSection cs_info;
+    std::shared_ptr<const StakeInfo> pinfo GUARDED_BY(cs_info);
+    int64_t nInfoHorizon GUARDED_BY(cs_info) = 0;
+
+private:
+    void TxChanged(const uint256& hash, ChangeType status);
+    bool Update(interfaces::Chain::Lock& locked_chain, const CWalletTx& wtx, int nOut = -1);
+
+    CWallet* pwallet;
+    bool fRebuild;                          // Reload all, on start and after queue overflow or tx removal
+    std::set<uint256> setChanged;           // Queued transactions
+    std::map<COutPoint, StakeCoin> mapCoins;
+    uint64_t nChanges = 0;                  // Counter of record changes
+};
+
+void StakeCache::TxChanged(const uint256& hash, ChangeType status)
+{
+    if (fRebuild)
+        return;
+    // Deleted tx is gone with its inputs, and coins it spent may be unspent again
+    if (status == CT_DELETED || setChanged.size() >= STAKE_CACHE_MAX_QUEUE) {
+        fRebuild = true;
+        setChanged.clear();
+        return;
+    }
+    setChanged.insert(hash);
+}
+
+// Re-evaluates outputs of wtx, all or nOut only. Returns false, if some record
+// cannot be built yet (txindex is behind the chain); the tx must be retried.
+bool StakeCache::Update(interfaces::Chain::Lock& locked_chain, const CWalletTx& wtx, int nOut)
+{
+    bool fInChain = wtx.GetDepthInMainChain(locked_chain) > 0;
+    const CBlockIndex* pindex = NULL;
+    CDiskTxPos postx;
+    for (unsigned int n = 0; n < wtx.tx->vout.size(); n++) {
+        if (nOut >= 0 && n != (unsigned int)nOut)
+            continue;
+        COutPoint prevout(wtx.GetHash(), n);
+        const CTxOut& txout = wtx.tx->vout[n];
+        // Keep only mintable UTXOs: no names, no nonstandard scripts
+        CTxDestination address;
+        txnouttype utxo_type = ExtractDestination(txout.scriptPubKey, address);
+        NameTxInfo nti;
+        bool fStake = fInChain && txout.nValue > 0 &&
+            (utxo_type == TX_PUBKEY || utxo_type == TX_PUBKEYHASH || utxo_type == TX_SCRIPTHASH ||
+             utxo_type == TX_WITNESS_V0_SCRIPTHASH || utxo_type == TX_WITNESS_V0_KEYHASH) &&
+            !(wtx.tx->nVersion == NAMECOIN_TX_VERSION && DecodeNameScript(txout.scriptPubKey, nti)) &&
+            (pwallet->IsMine(txout) & ISMINE_SPENDABLE) &&
+            !pwallet->IsSpent(locked_chain, prevout.hash, n);
+        if (!fStake) {
+            nChanges += mapCoins.erase(prevout);
+            continue;
+        }
+
+        // Up to date, unless the tx moved to another block in a reorg
+        auto it = mapCoins.find(prevout);
+        if (it != mapCoins.end() && it->second.hashBlockFrom == wtx.m_confirm.hashBlock)
+            continue;
+        if (pindex == NULL) {
+            pindex = LookupBlockIndex(wtx.m_confirm.hashBlock);
+            if (pindex == NULL || !g_txindex || !g_txindex->FindTxPosition(prevout.hash, postx))
+                return false;
+        }
+        mapCoins[prevout] = StakeCoin{pindex->GetBlockHash(), txout.nValue, (unsigned int)pindex->GetBlockTime(),
+                                      postx.nTxOffset + CBlockHeader::NORMAL_SERIALIZE_SIZE, wtx.tx->nTime};
+        nChanges++;
+    }
+    return true;
+}
+
+void StakeCache::Sync(interfaces::Chain::Lock& locked_chain)
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    std::set<uint256> setTx;
+    setTx.swap(setChanged);
+    if (fRebuild) {
+        fRebuild = false;
+        setTx.clear();
+        mapCoins.clear();
+        nChanges++;
+        for (const auto& entry : pwallet->mapWallet)
+            if (!Update(locked_chain, entry.second))
+                setChanged.insert(entry.first);
+        LogPrint(BCLog::STAKE, "StakeCache: loaded %u coins\n", mapCoins.size());
+        return;
+    }
+
+    for (const uint256& hash : setTx) {
+        const CWalletTx* wtx = pwallet->GetWalletTx(hash);
+        if (wtx == NULL)
+            continue;
+        bool fOk = Update(locked_chain, *wtx);
+        // Coins spent by the tx, or unspent again, if it is abandoned or conflicted
+        for (const CTxIn& txin : wtx->tx->vin) {
+            const CWalletTx* wtxPrev = pwallet->GetWalletTx(txin.prevout.hash);
+            if (wtxPrev != NULL && txin.prevout.n < wtxPrev->tx->vout.size())
+                fOk &= Update(locked_chain, *wtxPrev, txin.prevout.n);
+        }
+        if (!fOk)
+            setChanged.insert(hash);
+    }
+}
+
+// Collect wallet coins mature at nTimeSearchFrom and not above nTargetValue, with their kernel inputs.
+// Called with cs_main and cs_wallet held.
+static bool GetStakeCandidates(CWallet* pwallet, CAmount nTargetValue, unsigned int nTimeSearchFrom, std::vector<KernelCandidate>& vCandidates)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    if (!pwallet->m_stake_cache)
+        pwallet->m_stake_cache = std::make_shared<StakeCache>(pwallet);
+    StakeCache& cache = *pwallet->m_stake_cache;
+    auto locked_chain = pwallet->chain().lock();
+    cache.Sync(*locked_chain);
+
+    time_t cur_time = GetSystemTimeInSeconds();
+    vCandidates.reserve(cache.Coins().size());
+    for (const auto& entry : cache.Coins()) {
+        const COutPoint& prevout = entry.first;
+        const StakeCoin& coin = entry.second;
+        // ORIG: if (header.GetBlockTime() + params.nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
+        if (coin.nTimeBlockFrom + params.nStakeMinAge > nTimeSearchFrom)
+            continue; // only count coins meeting min age requirement
+        if (coin.nValue > nTargetValue || pwallet->IsLockedCoin(prevout.hash, prevout.n))
+            continue;
+        // Skip UTXOs reserved for randpay, same as AvailableCoins
+        uint256 rpLockTXkey(prevout.hash);
+        ((uint32_t*)rpLockTXkey.GetDataPtr())[0] += prevout.n;
+        uint256HashMap<time_t>::Data *p = g_RandPayLockUTXO.Search(rpLockTXkey);
+        if (p && p->value > cur_time)
+            continue;
+
+        const CWalletTx* wtx = pwallet->GetWalletTx(prevout.hash);
+        if (wtx == NULL)
+            return error("failed to find tx");
+
+        KernelInput in(coin.hashBlockFrom, coin.nTimeBlockFrom, coin.nTxPrevOffset, *wtx->tx, prevout.n);
+        vCandidates.push_back(KernelCandidate{prevout, in, wtx->tx});
+    }
+    return true;
+}
+
+// Staking forecast. A snapshot of the cache records and the next PoS target is
+// taken under cs_main and cs_wallet on each new block, by the wallet block tip
+// notification on the scheduler thread; coins are copied only when the cache was
+// changed. Weights and probabilities are computed without locks, and RPC reads
+// the latest result under cs_info only.
+static std::shared_ptr<StakeCache> GetStakeCache(CWallet* pwallet)
+{
+    LOCK(pwallet->cs_wallet);
+    if (!pwallet->m_stake_cache)
+        pwallet->m_stake_cache = std::make_shared<StakeCache>(pwallet);
+    return pwallet->m_stake_cache;
+}
+
+// Takes the snapshot into info; coins are left empty, if they are the same as in prev
+static bool TakeStakeSnapshot(CWallet* pwallet, StakeCache& cache, const StakeInfo* pprev, StakeInfo& info, std::set<COutPoint>& setLocked)
+{
+    LOCK2(cs_main, pwallet->cs_wallet);
+    auto locked_chain = pwallet->chain().lock();
+    cache.Sync(*locked_chain);
+    const CBlockIndex* pindex = ::ChainActive().Tip();
+    info.nHeight = pindex->nHeight;
+    info.nBits = GetNextTargetRequired(pindex, true, Params().GetConsensus());
+    info.nTime = GetAdjustedTime();
+    info.nChanges = cache.Changes();
+    setLocked = pwallet->setLockedCoins;
+    if (pprev && pprev->nChanges == info.nChanges)
+        return false;
+    const Consensus::Params& params = Params().GetConsensus();
+    info.vCoins.reserve(cache.Coins().size());
+    for (const auto& entry : cache.Coins()) {
+        StakeCoinInfo coin;
+        coin.prevout = entry.first;
+        coin.nValue = entry.second.nValue;
+        coin.nTimeTxPrev = entry.second.nTimeTxPrev;
+        coin.nTimeMature = (int64_t)entry.second.nTimeBlockFrom + params.nStakeMinAge;
+        coin.nTimeFullWeight = (int64_t)entry.second.nTimeTxPrev + params.nStakeMaxAge;
+        info.vCoins.push_back(coin);
+    }
+    return true;
+}
+
+// Sum of coin-day weights for timestamps in (nFrom, nTo], as in CheckStakeKernelHash,
+// with the weight taken continuous
+static double StakeWeightSum(const StakeCoinInfo& coin, int64_t nFrom, int64_t nTo)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    double dRate = (double)coin.nValue / COIN / (24 * 60 * 60); // Weight growth per second
+    int64_t nBegin = max(max(nFrom, coin.nTimeMature), (int64_t)coin.nTimeTxPrev + params.nStakeMinAge);
+    int64_t nFull = coin.nTimeFullWeight;
+    double dSum = 0;
+    if (nBegin < min(nTo, nFull)) {
+        // Weight grows with age over min age
+        double x0 = nBegin - coin.nTimeTxPrev - params.nStakeMinAge;
+        double x1 = min(nTo, nFull) - coin.nTimeTxPrev - params.nStakeMinAge;
+        dSum += dRate * (x1 * x1 - x0 * x0) / 2;
+    }
+    if (max(nBegin, nFull) < nTo)
+        dSum += dRate * (params.nStakeMaxAge - params.nStakeMinAge) * (nTo - max(nBegin, nFull));
+    return dSum;
+}
+
+static void ComputeStakeInfo(StakeInfo& info, const std::set<COutPoint>& setLocked, int64_t nHorizon)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    arith_uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(info.nBits);
+    // Kernel hash is below weight * target with probability weight * target / 2^256 per timestamp
+    double dTarget = bnTargetPerCoinDay.getdouble() / pow(2.0, 256);
+    double dSum = 0;
+    info.nHorizon = nHorizon;
+    info.nWeight = 0;
+    info.nMature = 0;
+    info.nNextMature = 0;
+    for (StakeCoinInfo& coin : info.vCoins) {
+        coin.fLocked = !setLocked.empty() && setLocked.count(coin.prevout);
+        coin.nWeight = 0;
+        if (coin.nTimeMature <= info.nTime && coin.nTimeTxPrev <= info.nTime) {
+            int64_t nTimeWeight = min(info.nTime - coin.nTimeTxPrev, params.nStakeMaxAge) - params.nStakeMinAge;
+            coin.nWeight = (arith_uint256(coin.nValue) * max(nTimeWeight, (int64_t)0) / COIN / (24 * 60 * 60)).GetLow64();
+        } else if (!coin.fLocked && (info.nNextMature == 0 || coin.nTimeMature < info.nNextMature))
+            info.nNextMature = coin.nTimeMature;
+        if (coin.fLocked) {
+            coin.dProbability = 0;
+            continue;
+        }
+        double dCoinSum = StakeWeightSum(coin, info.nTime, info.nTime + nHorizon);
+        coin.dProbability = -expm1(-dTarget * dCoinSum);
+        dSum += dCoinSum;
+        info.nWeight += coin.nWeight;
+        if (coin.nWeight > 0)
+            info.nMature++;
+    }
+    info.dProbability = -expm1(-dTarget * dSum);
+    info.nExpectedTime = info.nWeight > 0 ? (int64_t)(1 / (dTarget * info.nWeight)) : -1;
+}
+
+void UpdateStakeInfo(CWallet* pwallet)
+{
+    std::shared_ptr<StakeCache> cache;
+    {
+        LOCK(pwallet->cs_wallet);
+        cache = pwallet->m_stake_cache;
+    }
+    if (!cache || ::ChainstateActive().IsInitialBlockDownload())
+        return;
+    int64_t nHorizon;
+    std::shared_ptr<const StakeInfo> pprev;
+    {
+        LOCK(cache->cs_info);
+        nHorizon = cache->nInfoHorizon;
+        pprev = cache->pinfo;
+    }
+    if (nHorizon == 0)
+        return;
+
+    auto pinfo = std::make_shared<StakeInfo>();
+    std::set<COutPoint> setLocked;
+    if (!TakeStakeSnapshot(pwallet, *cache, pprev.get(), *pinfo, setLocked))
+        pinfo->vCoins = pprev->vCoins;
+    ComputeStakeInfo(*pinfo, setLocked, nHorizon);
+    LOCK(cache->cs_info);
+    cache->pinfo = pinfo;
+}
+
+std::shared_ptr<const StakeInfo> GetStakeInfo(CWallet* pwallet, int64_t nHorizon)
+{
+    std::shared_ptr<StakeCache> cache = GetStakeCache(pwallet);
+    std::shared_ptr<const StakeInfo> pprev;
+    {
+        LOCK(cache->cs_info);
+        cache->nInfoHorizon = nHorizon;
+        pprev = cache->pinfo;
+    }
+    if (pprev && pprev->nHorizon == nHorizon)
+        return pprev;
+
+    // First request takes a snapshot; another horizon is recomputed from the latest one
+    auto pinfo = std::make_shared<StakeInfo>();
+    std::set<COutPoint> setLocked;
+    if (pprev) {
+        *pinfo = *pprev;
+        LOCK(pwallet->cs_wallet);
+        setLocked = pwallet->setLockedCoins;
+    } else
+        TakeStakeSnapshot(pwallet, *cache, NULL, *pinfo, setLocked);
+    ComputeStakeInfo(*pinfo, setLocked, nHorizon);
+    LOCK(cache->cs_info);
+    if (!cache->pinfo || cache->pinfo->nHeight <= pinfo->nHeight)
+        cache->pinfo = pinfo;
+    return pinfo;
+}
+
 // emercoin: GetQuantProtection
 // This global function is used here within CreateCoinStake(),
 // and in the miner.cpp for generate AuxPOW block
@@ -568,229 +1243,157 @@ bool CreateCoinStake(CWallet* pwallet, unsigned int nBits, int64_t nSearchInterv
     if (!g_txindex)
         return error("CreateCoinStake : transaction index unavailable");
 
-    const Consensus::Params& params = Params().GetConsensus();
     // The following split & combine thresholds are important to security
     // Should not be adjusted if you don't understand the consequences
     static unsigned int nStakeSplitAge = (60 * 60 * 24 * 90);
-    LOCK2(cs_main, pwallet->cs_wallet);
-    CAmount nPoWReward = GetProofOfWorkReward(GetLastBlockIndex(::ChainActive().Tip(), false)->nBits);
+    static int nMaxStakeSearchInterval = 60;
+    unsigned int nSearchCount = std::min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
+    CAmount nPoWReward;
     // used within coinstake collector, disabled since 0.8.0     CAmount nCombineThreshold = nPoWReward / 3;
 
-    arith_uint256 bnTargetPerCoinDay;
-    bnTargetPerCoinDay.SetCompact(nBits);
-
-    txNew.vin.clear();
-    // Mark coin stake transaction
-    CScript scriptEmpty;
-    scriptEmpty.clear();
-    // Choose coins to use
-    CAmount nBalance = pwallet->GetBalance().m_mine_trusted;
+    CAmount nBalance;
     CAmount nReserveBalance = 0;
-    if (gArgs.IsArgSet("-reservebalance") && !ParseMoney(gArgs.GetArg("-reservebalance", ""), nReserveBalance))
-        return error("CreateCoinStake : invalid reserve balance amount");
-    if (nBalance <= nReserveBalance)
-        return false;
-    std::vector<CTransactionRef> vtxPrev;
-    CAmount nValueIn = 0;
-    static std::set<CInputCoin> setCoins;
-    static uint32_t prev_committed_txes = ~0; // Undef, need reload setCoins
-    if(pwallet->m_nCommitCnt != prev_committed_txes || GetRand(3 * 3600) == 0) {
-        // Something changed in the wallet, reload setCoins
-        // Also, randomly every ~3 hours to refresh possible unsynch UTXOs (i.e. sent from another wallet)
-        setCoins.clear();
-        std::vector<COutput> vAvailableCoins;
-        bool include_unsafe = false;
-        CCoinControl cctl;
-        cctl.m_avoid_address_reuse = false;
-        cctl.m_min_depth = 1;
-        cctl.m_max_depth = 9999999;
-        CAmount nMinimumAmount = 0;
-        CAmount nMaximumAmount = MAX_MONEY;
-        CAmount nMinimumSumAmount = MAX_MONEY;
-        uint64_t nMaximumCount = 0;
-        auto locked_chain = pwallet->chain().lock();
-        LOCK(pwallet->cs_wallet);
-        pwallet->AvailableCoins(*locked_chain, vAvailableCoins, include_unsafe, &cctl, nMinimumAmount, nMaximumAmount, nMinimumSumAmount, nMaximumCount);
 
-        bool bnb_used;
-        CoinSelectionParams coin_selection_params; // Parameters for coin selection, init with dummy
-        if (!pwallet->SelectCoins(vAvailableCoins, nBalance - nReserveBalance, setCoins, nValueIn, cctl, coin_selection_params, bnb_used)) {
+    // Snapshot of staking coins and modifiers; for V05, the search runs without locks
+    std::vector<KernelCandidate> vCandidates;
+    std::vector<std::pair<size_t, unsigned int> > vHits; // (candidate, timestamp offset)
+    KernelSearch search;
+    search.nTime = txNew.nTime;
+    search.bnTargetPerCoinDay.SetCompact(nBits);
+    CBlockIndex* pindexPrev;
+    uint32_t nCommitCnt;
+    {
+        LOCK2(cs_main, pwallet->cs_wallet);
+        pindexPrev = ::ChainActive().Tip();
+        nPoWReward = GetProofOfWorkReward(GetLastBlockIndex(pindexPrev, false)->nBits);
+        // Choose coins to use
+        nBalance = pwallet->GetBalance().m_mine_trusted;
+        if (gArgs.IsArgSet("-reservebalance") && !ParseMoney(gArgs.GetArg("-reservebalance", ""), nReserveBalance))
+            return error("CreateCoinStake : invalid reserve balance amount");
+        if (nBalance <= nReserveBalance)
             return false;
+        if (!GetStakeCandidates(pwallet, nBalance - nReserveBalance, txNew.nTime - nMaxStakeSearchInterval, vCandidates))
+            return false;
+        if (vCandidates.empty())
+            return false;
+        nCommitCnt = pwallet->m_nCommitCnt;
+
+        if (IsProtocolV05(txNew.nTime - nSearchCount + 1)) {
+            search.vModifier.resize(nSearchCount);
+            for (unsigned int n = 0; n < nSearchCount; n++) {
+                int nStakeModifierHeight;
+                int64_t nStakeModifierTime;
+                search.vModifier[n].first = GetKernelStakeModifierV05(pindexPrev, txNew.nTime - n, search.vModifier[n].second, nStakeModifierHeight, nStakeModifierTime);
+            }
+        } else {
+            // Older protocols need chain access for each candidate; search under locks
+            for (size_t i = 0; i < vCandidates.size(); i++)
+                for (unsigned int n = 0; n < nSearchCount; n++) {
+                    uint256 hashProofOfStake; // Dummy, write only
+                    if (CheckStakeKernelHash(nBits, pindexPrev, vCandidates[i].in, vCandidates[i].prevout, txNew.nTime - n, hashProofOfStake)) {
+                        vHits.emplace_back(i, n);
+                        break;
+                    }
+                }
         }
-        prev_committed_txes = pwallet->m_nCommitCnt;
-        // Cleanup non-mintable UTXOs
-        for (auto pcoin = setCoins.begin(); pcoin != setCoins.end(); ) {
-            // We keep only mintable UTXOs into minting view list
-            // Don't add nonstandard or name UTXOs
-            CTxDestination address;
-            txnouttype utxo_type = ExtractDestination(pcoin->txout.scriptPubKey, address);
-            if (
-                    utxo_type == TX_PUBKEY ||
-                    utxo_type == TX_PUBKEYHASH ||
-                    utxo_type == TX_SCRIPTHASH ||
-                    utxo_type == TX_WITNESS_V0_SCRIPTHASH ||
-                    utxo_type == TX_WITNESS_V0_KEYHASH
-               )
-                ++pcoin;
-            else
-                pcoin = setCoins.erase(pcoin);
-        } // for - cleanup set
     }
-
-    if (setCoins.empty())
+    if (!search.vModifier.empty())
+        ScanKernels(search, vCandidates, vHits);
+    if (vHits.empty())
         return false;
+
+    // Build and sign coinstake for the first usable kernel
+    LOCK2(cs_main, pwallet->cs_wallet);
+    if (::ChainActive().Tip() != pindexPrev || pwallet->m_nCommitCnt != nCommitCnt)
+        return false; // Chain or wallet changed during the search; next attempt takes a new snapshot
+
+    txNew.vin.clear();
+    // Mark coin stake transaction
+    CScript scriptEmpty;
+    scriptEmpty.clear();
+    std::vector<CTransactionRef> vtxPrev;
     CAmount nCredit = 0;
     CScript scriptPubKeyKernel;
-
-    // This is static cache for minimize block loads for each POS-attempt
-    // Possible values of ->value.first
-    // Addr > 0x4 -- This is pointer to blockheader in the memory
-    // Addr = 0x1 -- Was read error, don't load this block anymore
-    // NULL -- Block removed after mint, but maybe need reload again into same cell
-    static uint256HashMap<std::pair<CBlockHeader*, unsigned int> > CacheBlockOffset;
-    CacheBlockOffset.Set(setCoins.size() << 1); // 2x pointers
-    uint256HashMap<std::pair<CBlockHeader*, unsigned int> >::Data *pbo = NULL;
+    const KernelCandidate* pkernel = NULL;
 
     int nSplitPos = gArgs.GetArg("-splitpos", 1); // 0=No Split, 1=RandSplit before 90d, -1=Principal+Reward
     CAmount nQuantProtection = GetQuantProtection();
-    time_t header_blocktime = 0;
 
     CScript scriptPubKeyOut; // For use in vout[1] for signing
-    for (auto pcoin = setCoins.begin(); pcoin != setCoins.end(); ) {
-        uint256 tx_hash = pcoin->outpoint.hash;
-        pbo = CacheBlockOffset.Search(tx_hash);
-        // Try Load, if missing or temporary removed
-        if (pbo == NULL || pbo->value.first == NULL) {
-          CDiskTxPos postx;
-          CBlockHeader *cbh = (CBlockHeader *)0x1; // default=Error
-          if (g_txindex && g_txindex->FindTxPosition(tx_hash, postx)) {
-            // Read block header
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            cbh = new CBlockHeader;
-            try {
-              file >> *cbh;
-            } catch (std::exception &e) {
-          delete cbh;
-          cbh = (CBlockHeader *)0x1; // Error
-            }
-          } // ReadTxIndex()
-
-          if (pbo == NULL) {
-              std::pair<CBlockHeader*, unsigned int> bo(cbh, postx.nTxOffset + CBlockHeader::NORMAL_SERIALIZE_SIZE);
-              pbo = CacheBlockOffset.Insert(tx_hash, bo);
-          } else
-              pbo->value.first = cbh;
-        } // if(pbo == NULL)
-
-        // Don't work, if reaadErr=0x1, or temporary removed=NULL
-        if(pbo->value.first < (CBlock*)0x4) {
-            ++pcoin;
-            continue;
-        }
-
-        CBlockHeader& header = *(pbo->value.first);
-        unsigned int offset  = pbo->value.second;
-
-        static int nMaxStakeSearchInterval = 60;
-        // ORIG: if (header.GetBlockTime() + params.nStakeMinAge > txNew.nTime - nMaxStakeSearchInterval)
-        header_blocktime = header.GetBlockTime();
-        int not_mature_secs = header_blocktime + params.nStakeMinAge - (txNew.nTime - nMaxStakeSearchInterval);
-        if (not_mature_secs > 0) {
-            if (not_mature_secs > 24 * 3600)
-                pcoin = setCoins.erase(pcoin); // Remove from setCoins cache very non-matured UTXO
+    for (const auto& hit : vHits) {
+        const KernelCandidate& kernel = vCandidates[hit.first];
+        unsigned int n = hit.second;
+        // Found a kernel
+        bool f_printcoinstake = gArgs.GetBoolArg("-printcoinstake", false);
+        if (f_printcoinstake)
+            LogPrintf("CreateCoinStake : kernel found\n");
+        std::vector<valtype> vSolutions;
+        scriptPubKeyKernel = kernel.in.txout.scriptPubKey;
+        txnouttype whichType = Solver(scriptPubKeyKernel, vSolutions);
+        if (f_printcoinstake)
+            LogPrintf("CreateCoinStake : parsed kernel type=%s\n", GetTxnOutputType(whichType));
+
+        // On ScriptHash - unpack external P2SH layer, to extract script for future processing
+        if (whichType == TX_WITNESS_V0_SCRIPTHASH || whichType == TX_SCRIPTHASH) {
+            uint160 hash;
+            if(whichType == TX_SCRIPTHASH)
+                hash = uint160(vSolutions[0]);
             else
-                ++pcoin;
-            continue; // only count coins meeting min age requirement
-        }
-
-        uint256 hashBlock;
-        CTransactionRef tx;
-        if (!g_txindex->FindTx(tx_hash, hashBlock, tx))
-            return error("failed to find tx");
-
-        uint256 hashProofOfStake; // Dummy, write only
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<std::min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound; n++)
-        {
-            // Search backward in time from the given txNew timestamp
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            if (CheckStakeKernelHash(nBits, ::ChainActive().Tip(), header, offset, tx, pcoin->outpoint, txNew.nTime - n, hashProofOfStake))
-            {
-                // Found a kernel
-                bool f_printcoinstake = gArgs.GetBoolArg("-printcoinstake", false);
+                CRIPEMD160().Write(&vSolutions[0][0], vSolutions[0].size()).Finalize(hash.begin());
+             CScriptID scriptID(hash);
+             // Unpack p2sh and rewrite scriptPubKeyKernel
+             if (!pwallet->GetCScript(scriptID, scriptPubKeyKernel)) {
                 if (f_printcoinstake)
-                    LogPrintf("CreateCoinStake : kernel found\n");
-                std::vector<valtype> vSolutions;
-                scriptPubKeyKernel = pcoin->txout.scriptPubKey;
-                txnouttype whichType = Solver(scriptPubKeyKernel, vSolutions);
+                    LogPrintf("CreateCoinStake : failed unpack P2SH/P2WSH script for type=%s\n", GetTxnOutputType(whichType));
+                continue;  // unable to find corresponding nested p2sh script
+             }
+             // Re-solve nested P2SH/P2WSH script again
+             whichType = Solver(scriptPubKeyKernel, vSolutions);
                 if (f_printcoinstake)
-                    LogPrintf("CreateCoinStake : parsed kernel type=%s\n", GetTxnOutputType(whichType));
-
-                // On ScriptHash - unpack external P2SH layer, to extract script for future processing
-                if (whichType == TX_WITNESS_V0_SCRIPTHASH || whichType == TX_SCRIPTHASH) {
-                    uint160 hash;
-                    if(whichType == TX_SCRIPTHASH)
-                        hash = uint160(vSolutions[0]);
-                    else
-                        CRIPEMD160().Write(&vSolutions[0][0], vSolutions[0].size()).Finalize(hash.begin());
-                     CScriptID scriptID(hash);
-                     // Unpack p2sh and rewrite scriptPubKeyKernel
-                     if (!pwallet->GetCScript(scriptID, scriptPubKeyKernel)) {
-                        if (f_printcoinstake)
-                            LogPrintf("CreateCoinStake : failed unpack P2SH/P2WSH script for type=%s\n", GetTxnOutputType(whichType));
-                        break;  // unable to find corresponding nested p2sh script
-                     }
-                     // Re-solve nested P2SH/P2WSH script again
-                     whichType = Solver(scriptPubKeyKernel, vSolutions);
-                        if (f_printcoinstake)
-                            LogPrintf("CreateCoinStake : unpacked P2SH/P2WSH to type=%s\n", GetTxnOutputType(whichType));
-                } // P2SH/P2WSH
-
-                if (whichType == TX_PUBKEYHASH          || // was before
-                    whichType == TX_WITNESS_V0_KEYHASH     // OK on testnet
-                  ) { // pay to address type
-                    // convert to pay to public key type
-                    // we need natural key for sign/verify PoS block
-                    CKey key;
-                    if (!pwallet->GetKey(CKeyID(uint160(vSolutions[0])), key))
-                    {
-                        if (f_printcoinstake)
-                            LogPrintf("CreateCoinStake : failed to get key for kernel type=%s\n", GetTxnOutputType(whichType));
-                        break;  // unable to find corresponding public key
-                    }
-                    // same as: scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
-                    scriptPubKeyOut = GetScriptForRawPubKey(key.GetPubKey());
-                }
-                else
-                if(whichType == TX_PUBKEY) {
-                    // Copy as is,
-                    // output like:
-                    // "asm": "026c8805d86bce7a0dd40a0bb5164e071b835beadbccd30fad162130622f7a25be OP_CHECKSIG"
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
-                else {
-                    // We cannot run minting on TX_MULTISIG or such transaction, since this is
-                    // cannot be modified.
-                    // Also, other TX types are ignored
-                    if (f_printcoinstake)
-                        LogPrintf("CreateCoinStake : no support for kernel type=%d:%s\n", whichType, GetTxnOutputType(whichType));
-                    break;  // only support pay to public key and pay to address
-                }
-
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin->outpoint));
-                nCredit += pcoin->txout.nValue;
-                vtxPrev.push_back(tx);
+                    LogPrintf("CreateCoinStake : unpacked P2SH/P2WSH to type=%s\n", GetTxnOutputType(whichType));
+        } // P2SH/P2WSH
+
+        if (whichType == TX_PUBKEYHASH          || // was before
+            whichType == TX_WITNESS_V0_KEYHASH     // OK on testnet
+          ) { // pay to address type
+            // convert to pay to public key type
+            // we need natural key for sign/verify PoS block
+            CKey key;
+            if (!pwallet->GetKey(CKeyID(uint160(vSolutions[0])), key))
+            {
                 if (f_printcoinstake)
-                    LogPrintf("CreateCoinStake : added kernel type=%s\n", GetTxnOutputType(whichType));
-                fKernelFound = true;
-                break;
+                    LogPrintf("CreateCoinStake : failed to get key for kernel type=%s\n", GetTxnOutputType(whichType));
+                continue;  // unable to find corresponding public key
             }
+            // same as: scriptPubKeyOut << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+            scriptPubKeyOut = GetScriptForRawPubKey(key.GetPubKey());
         }
-        if (fKernelFound)
-            break; // if kernel is found stop searching
-        ++pcoin;
-    } // for pcoins
+        else
+        if(whichType == TX_PUBKEY) {
+            // Copy as is,
+            // output like:
+            // "asm": "026c8805d86bce7a0dd40a0bb5164e071b835beadbccd30fad162130622f7a25be OP_CHECKSIG"
+            scriptPubKeyOut = scriptPubKeyKernel;
+        }
+        else {
+            // We cannot run minting on TX_MULTISIG or such transaction, since this is
+            // cannot be modified.
+            // Also, other TX types are ignored
+            if (f_printcoinstake)
+                LogPrintf("CreateCoinStake : no support for kernel type=%d:%s\n", whichType, GetTxnOutputType(whichType));
+            continue;  // only support pay to public key and pay to address
+        }
+
+        txNew.nTime -= n;
+        CacheKernelInput(kernel.prevout, kernel.in); // Will be checked with the new block
+        txNew.vin.push_back(CTxIn(kernel.prevout));
+        nCredit += kernel.in.txout.nValue;
+        vtxPrev.push_back(kernel.txPrev);
+        if (f_printcoinstake)
+            LogPrintf("CreateCoinStake : added kernel type=%s\n", GetTxnOutputType(whichType));
+        pkernel = &kernel;
+        break;
+    } // for hits
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
         return false;
 
@@ -877,7 +1480,7 @@ bool CreateCoinStake(CWallet* pwallet, unsigned int nBits, int64_t nSearchInterv
                     || vout1_p2pk == nReward        // nSplitPos < 0 and all reward fit into p2pk
                     || vout1_p2pk > nCredit / 4     // Quart of the credit is already spent within QuantProtection
                     || nActualCredit < nPoWReward   // Too few credit - allow to grow
-                    || header_blocktime + nStakeSplitAge < txNew.nTime // age > 90days
+                    || pkernel->in.nTimeBlockFrom + nStakeSplitAge < txNew.nTime // age > 90days
               ) {
                 // No split, single output
                 if(nQuantProtection != 0) {
@@ -951,10 +1554,5 @@ bool CreateCoinStake(CWallet* pwallet, unsigned int nBits, int64_t nSearchInterv
     } // while(true)
 
     // Successfully generated coinstake
-    // Remove block reference from the cache
-    delete pbo->value.first;
-    pbo->value.first = NULL; // Set "temporary removed"
-    CacheBlockOffset.MarkDel(pbo);
-    prev_committed_txes = ~0; // Reload coinset next time, after stake
     return true;
 }
@@ -4,14 +4,19 @@
 #ifndef PPCOIN_KERNEL_H
 #define PPCOIN_KERNEL_H
 
+#include <amount.h>
+#include <arith_uint256.h>
+#include <primitives/block.h>
+#include <primitives/transaction.h>
+#include <uint256.h>
+
 #include <stdint.h>
 #include <memory>
+#include <utility>
+#include <vector>
 
-class CBlockHeader;
 class CBlockIndex;
-class COutPoint;
 class CValidationState;
-class uint256;
 class CWallet;
 class CMutableTransaction;
 
@@ -25,6 +30,14 @@ static const int MODIFIER_INTERVAL_RATIO = 3;
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexCurrent, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Keep the stake modifier cache in sync with the active chain; called with cs_main held
+// after the tip is changed
+void StakeModifierCacheConnect(const CBlockIndex* pindexNew);
+void StakeModifierCacheDisconnect(const CBlockIndex* pindexDelete);
+
+// Drop cached staked outputs, which may refer to a disconnected block; called with cs_main held
+void KernelInputCacheDisconnect();
+
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
 bool CheckProofOfStake(CValidationState& state, CBlockIndex* pindexPrev, const CTransactionRef& tx, unsigned int nBits, uint256& hashProofOfStake);
@@ -40,4 +53,79 @@ bool CheckStakeModifierCheckpoints(int nHeight, unsigned int nStakeModifierCheck
 
 bool CreateCoinStake(CWallet* pwallet, unsigned int nBits, int64_t nSearchInterval, CMutableTransaction &txNew);
 
+// Staking forecast of a wallet coin
+struct StakeCoinInfo {
+    COutPoint    prevout;
+    CAmount      nValue = 0;
+    unsigned int nTimeTxPrev = 0;
+    int64_t      nTimeMature = 0;       // Min stake age is reached
+    int64_t      nTimeFullWeight = 0;   // Max stake age is reached
+    bool         fLocked = false;       // Locked by lockunspent, does not stake
+    uint64_t     nWeight = 0;           // Coin-days at nTime
+    double       dProbability = 0;      // To mint within the horizon
+};
+
+// Staking forecast of a wallet at a tip
+struct StakeInfo {
+    int          nHeight = 0;
+    unsigned int nBits = 0;             // Next PoS target
+    int64_t      nTime = 0;
+    int64_t      nHorizon = 0;          // Seconds
+    uint64_t     nChanges = 0;          // Version of the wallet coins snapshot
+    uint64_t     nWeight = 0;
+    size_t       nMature = 0;
+    int64_t      nNextMature = 0;       // Earliest maturity of the coins not yet mature, 0 if none
+    double       dProbability = 0;      // To mint within the horizon
+    int64_t      nExpectedTime = -1;    // Seconds to mint at the current weight, -1 if no weight
+    std::vector<StakeCoinInfo> vCoins;
+};
+
+// Latest staking forecast over nHorizon seconds. The first call takes a snapshot;
+// after that, it is refreshed by UpdateStakeInfo on each block.
+std::shared_ptr<const StakeInfo> GetStakeInfo(CWallet* pwallet, int64_t nHorizon);
+
+// Refresh the staking forecast for the new tip, if it was requested; called without locks
+void UpdateStakeInfo(CWallet* pwallet);
+
+// Kernel checks and search, exposed for unit tests; modifier lookups are called with cs_main held
+bool GetLastStakeModifier(const CBlockIndex* pindex, uint64_t& nStakeModifier, int64_t& nModifierTime);
+bool GetKernelStakeModifierV05(CBlockIndex* pindexPrev, unsigned int nTimeTx, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime);
+bool GetKernelStakeModifierV03(CBlockIndex* pindexPrev, uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime);
+
+// Staked output, as used in the kernel hash and the coinstake signature check
+struct KernelInput {
+    uint256      hashBlockFrom;
+    unsigned int nTimeBlockFrom;
+    unsigned int nTxPrevOffset;  // Offset of txPrev from the block start
+    unsigned int nTimeTxPrev;
+    CTxOut       txout;
+
+    KernelInput() : nTimeBlockFrom(0), nTxPrevOffset(0), nTimeTxPrev(0) {}
+    KernelInput(const CBlockHeader& blockFrom, unsigned int nTxPrevOffsetIn, const CTransaction& txPrev, unsigned int n)
+        : hashBlockFrom(blockFrom.GetHash()), nTimeBlockFrom(blockFrom.GetBlockTime()), nTxPrevOffset(nTxPrevOffsetIn),
+          nTimeTxPrev(txPrev.nTime), txout(txPrev.vout[n]) {}
+    KernelInput(const uint256& hashBlockFromIn, unsigned int nTimeBlockFromIn, unsigned int nTxPrevOffsetIn, const CTransaction& txPrev, unsigned int n)
+        : hashBlockFrom(hashBlockFromIn), nTimeBlockFrom(nTimeBlockFromIn), nTxPrevOffset(nTxPrevOffsetIn),
+          nTimeTxPrev(txPrev.nTime), txout(txPrev.vout[n]) {}
+};
+
+// Kernel search for CreateCoinStake: each candidate is tried for timestamps nTime,
+// nTime - 1, ... V05 modifier depends on the timestamp only, so it is resolved in
+// advance for the whole window, and the scan needs neither cs_main nor cs_wallet.
+struct KernelCandidate {
+    COutPoint       prevout;
+    KernelInput     in;
+    CTransactionRef txPrev;
+};
+
+struct KernelSearch {
+    unsigned int  nTime;                                // Latest timestamp to try
+    arith_uint256 bnTargetPerCoinDay;
+    std::vector<std::pair<bool, uint64_t> > vModifier;  // Per timestamp offset: resolved, modifier
+};
+
+bool CheckStakeKernelHash(unsigned int nBits, CBlockIndex* pindexPrev, const KernelInput& in, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake);
+void ScanKernelRange(const KernelSearch& search, const std::vector<KernelCandidate>& vCandidates, size_t nBegin, size_t nEnd, std::vector<std::pair<size_t, unsigned int> >& vHits);
+void ScanKernels(const KernelSearch& search, const std::vector<KernelCandidate>& vCandidates, std::vector<std::pair<size_t, unsigned int> >& vHits);
+
 #endif // PPCOIN_KERNEL_H
@@ -9,6 +9,8 @@
 #include <chain.h>
 #include <chainparams.h>
 #include <coins.h>
+#include <crypto/common.h>
+#include <crypto/sha256.h>
 #include <consensus/consensus.h>
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
@@ -18,6 +20,7 @@
 #include <pow.h>
 #include <primitives/transaction.h>
 #include <script/standard.h>
+#include <streams.h>
 #include <timedata.h>
 #include <util/moneystr.h>
 #include <util/system.h>
@@ -122,31 +125,44 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     // ppcoin: if coinstake available add coinstake tx
     static int64_t nLastCoinStakeSearchTime = GetAdjustedTime();  // only initialized at startup
 
+    // attemp to find a coinstake; CreateCoinStake searches kernels without cs_main
+    CMutableTransaction txCoinStake;
+    bool fCoinStake = false;
+    const CBlockIndex* pindexStake = nullptr;
+    if (pwallet) {
+        int64_t nSearchTime = txCoinStake.nTime; // search to current time
+        if (nSearchTime > nLastCoinStakeSearchTime) {
+            unsigned int nBitsStake;
+            {
+                LOCK(cs_main);
+                pindexStake = ::ChainActive().Tip();
+                nBitsStake = GetNextTargetRequired(pindexStake, true, chainparams.GetConsensus());
+            }
+            fCoinStake = CreateCoinStake(pwallet, nBitsStake, nSearchTime-nLastCoinStakeSearchTime, txCoinStake);
+            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
+            nLastCoinStakeSearchTime = nSearchTime;
+        }
+    }
+
     LOCK(cs_main);
     CBlockIndex* pindexPrev = ::ChainActive().Tip();
     assert(pindexPrev != nullptr);
 
-    // attemp to find a coinstake
     if (pwallet) {
         *pfPoSCancel = true;
         pblock->nBits = GetNextTargetRequired(pindexPrev, true, chainparams.GetConsensus());
-        CMutableTransaction txCoinStake;
-        int64_t nSearchTime = txCoinStake.nTime; // search to current time
-        if (nSearchTime > nLastCoinStakeSearchTime) {
-            if (CreateCoinStake(pwallet, pblock->nBits, nSearchTime-nLastCoinStakeSearchTime, txCoinStake)) {
-                // make sure coinstake would meet timestamp protocol
-                if (txCoinStake.nTime >= std::max(pindexPrev->GetMedianTimePast()+1, pindexPrev->GetBlockTime() - nMaxClockDrift)) {
-                    // as it would be the same as the block timestamp
-                    coinbaseTx.vout[0].nValue = 0;
-                    coinbaseTx.vout[0].scriptPubKey.clear();
-                    coinbaseTx.nTime = txCoinStake.nTime;
-                    pblock->vtx.push_back(MakeTransactionRef(CTransaction(txCoinStake)));
-                    pblock->nFlags |= BLOCK_PROOF_OF_STAKE;
-                    *pfPoSCancel = false;
-                }
+        // Coinstake is valid only on the tip it was searched for
+        if (fCoinStake && pindexPrev == pindexStake) {
+            // make sure coinstake would meet timestamp protocol
+            if (txCoinStake.nTime >= std::max(pindexPrev->GetMedianTimePast()+1, pindexPrev->GetBlockTime() - nMaxClockDrift)) {
+                // as it would be the same as the block timestamp
+                coinbaseTx.vout[0].nValue = 0;
+                coinbaseTx.vout[0].scriptPubKey.clear();
+                coinbaseTx.nTime = txCoinStake.nTime;
+                pblock->vtx.push_back(MakeTransactionRef(CTransaction(txCoinStake)));
+                pblock->nFlags |= BLOCK_PROOF_OF_STAKE;
+                *pfPoSCancel = false;
             }
-            nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
-            nLastCoinStakeSearchTime = nSearchTime;
         }
         if (*pfPoSCancel)
             return nullptr; // emercoin: there is no point to continue if we failed to create coinstake
@@ -568,6 +584,19 @@ void BlockAssembler::addTxs()
     } //  while (!stack.empty())
 } // BlockAssembler::addTxs()
 
+// Put nExtraNonce into the coinbase and update the merkle root
+static void SetExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int nExtraNonce)
+{
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
+    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
+    pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
+    pblock->hashMyself.SetNull(); // Changed header, need reset cache!
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
     // Update nExtraNonce
@@ -578,14 +607,87 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
         hashPrevBlock = pblock->hashPrevBlock;
     }
     ++nExtraNonce;
-    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(*pblock->vtx[0]);
-    txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
-    assert(txCoinbase.vin[0].scriptSig.size() <= 100);
+    SetExtraNonce(pblock, pindexPrev, nExtraNonce);
+}
 
-    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
-    pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
-    pblock->hashMyself.SetNull(); // Changed header, need reset cache!
+// Nonces per SHA256D1Midstate call: one AVX2 8-way or two SSE4.1 4-way transforms
+static const int SCAN_LANES = 8;
+
+bool ScanHash(CBlockHeader* pblock, uint32_t nNonceEnd, const arith_uint256& hashTarget, uint64_t& nHashes)
+{
+    // The first 64 header bytes are the same for all nonces, and are hashed once into
+    // a midstate. The last 16 (end of merkle root, time, bits, nonce) are padded into
+    // a block per lane, and only the nonce is rewritten.
+    CDataStream ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << *pblock;
+    assert(ss.size() == 80);
+    uint32_t midstate[8];
+    SHA256Midstate(midstate, (const unsigned char*)ss.data(), 1);
+    unsigned char blocks[SCAN_LANES * 64];
+    unsigned char hashes[SCAN_LANES * 32];
+    memset(blocks, 0, sizeof(blocks));
+    for (int l = 0; l < SCAN_LANES; l++) {
+        memcpy(blocks + l * 64, ss.data() + 64, 16);
+        blocks[l * 64 + 16] = 0x80;
+        blocks[l * 64 + 62] = 0x02; // Message length, 640 bits
+        blocks[l * 64 + 63] = 0x80;
+    }
+
+    // Most significant word of the target, to skip full comparisons
+    uint32_t nTargetHigh = (hashTarget >> 224).GetLow64();
+    uint32_t nNonce = pblock->nNonce;
+    while (nNonce < nNonceEnd) {
+        int nLanes = std::min<uint32_t>(SCAN_LANES, nNonceEnd - nNonce);
+        for (int l = 0; l < nLanes; l++)
+            WriteLE32(blocks + l * 64 + 12, nNonce + l);
+        SHA256D1Midstate(hashes, midstate, blocks, nLanes);
+        for (int l = 0; l < nLanes; l++) {
+            if (ReadLE32(hashes + l * 32 + 28) > nTargetHigh)
+                continue;
+            uint256 hash;
+            memcpy(hash.begin(), hashes + l * 32, 32);
+            if (UintToArith256(hash) <= hashTarget) {
+                nHashes += l + 1;
+                pblock->nNonce = nNonce + l;
+                pblock->hashMyself.SetNull();
+                return true;
+            }
+        }
+        nHashes += nLanes;
+        nNonce += nLanes;
+    }
+    pblock->nNonce = nNonceEnd;
+    pblock->hashMyself.SetNull();
+    return false;
+}
+
+// Hash meter of the miners: hashes counted over periods of at least 4 seconds
+static CCriticalSection cs_hashmeter;
+static uint64_t nMeterHashes GUARDED_BY(cs_hashmeter) = 0;
+static int64_t nMeterStart GUARDED_BY(cs_hashmeter) = 0;
+static double dHashesPerSec GUARDED_BY(cs_hashmeter) = 0;
+
+void UpdateHashMeter(uint64_t nHashes)
+{
+    LOCK(cs_hashmeter);
+    int64_t nNow = GetTimeMillis();
+    if (nNow - nMeterStart > 8000) {
+        // Idle before, start over
+        nMeterStart = nNow;
+        nMeterHashes = 0;
+    }
+    nMeterHashes += nHashes;
+    if (nNow - nMeterStart >= 4000) {
+        dHashesPerSec = 1000.0 * nMeterHashes / (nNow - nMeterStart);
+        nMeterStart = nNow;
+        nMeterHashes = 0;
+    }
+}
+
+double GetHashesPerSec()
+{
+    LOCK(cs_hashmeter);
+    return GetTimeMillis() - nMeterStart > 8000 ? 0 : dHashesPerSec;
 }
 
 static bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
@@ -771,48 +873,22 @@ void ThreadStakeMinter(std::shared_ptr<CWallet> pwallet)
 // Internal miner
 //
 
-//
-// ScanHash scans nonces looking for a hash with at least some zero bits.
-// The nonce is usually preserved between calls, but periodically or if the
-// nonce is 0xffff0000 or above, the block is rebuilt and nNonce starts over at
-// zero.
-//
-bool static ScanHash(const CBlockHeader *pblock, uint32_t& nNonce, uint256 *phash)
-{
-    // Write the first 76 bytes of the block header to a double-SHA256 state.
-    CHash256 hasher;
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss << *pblock;
-    assert(ss.size() == 80);
-    hasher.Write((unsigned char*)&ss[0], 76);
-
-    while (true) {
-        nNonce++;
-
-        // Write the last 4 bytes of the block header (the nonce) to a copy of
-        // the double-SHA256 state, and compute the result.
-        CHash256(hasher).Write((unsigned char*)&nNonce, 4).Finalize((unsigned char*)phash);
-
-        // Return the nonce if the hash has at least some zero bits,
-        // caller will check if it has enough to reach the target
-        if (((uint16_t*)phash)[15] == 0)
-            return true;
-
-        // If nothing found after trying for a while, return -1
-        if ((nNonce & 0xfff) == 0)
-            return false;
-    }
-}
+// Nonces scanned between checks for a new tip or stop; the nonce is preserved between
+// the rounds, but if it is 0xffff0000 or above, the block is rebuilt
+static const uint32_t SCAN_ROUND = 0x40000;
 
 // Helper function from src/rpc/mining.cpp
 CScript BuildCoinbaseScript(const CTxDestination& dest, CWallet* const pwallet);
 
-void static EmercoinMiner(const CChainParams& chainparams)
+// Each of nThreads miners puts its own extranonces nThread + k * nThreads into the coinbase,
+// so the threads scan different headers over the whole nonce range
+void static EmercoinMiner(const CChainParams& chainparams, int nThread, int nThreads)
 {
     LogPrintf("EmercoinMiner started\n");
     util::ThreadRename("emercoin-miner");
 
     unsigned int nExtraNonce = 0;
+    uint256 hashPrevBlock;
 
     std::shared_ptr<CWallet> pwallet = GetWallets()[0];
     if(pwallet == NULL)
@@ -854,7 +930,11 @@ void static EmercoinMiner(const CChainParams& chainparams)
                 return;
             }
             CBlock *pblock = &pblocktemplate->block;
-            IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+            if (hashPrevBlock != pblock->hashPrevBlock) {
+                nExtraNonce = 0;
+                hashPrevBlock = pblock->hashPrevBlock;
+            }
+            SetExtraNonce(pblock, pindexPrev, ++nExtraNonce * nThreads + nThread);
 
             LogPrintf("Running EmercoinMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
                 ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
@@ -864,36 +944,36 @@ void static EmercoinMiner(const CChainParams& chainparams)
             //
             int64_t nStart = GetTime();
             arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
-            uint256 hash;
-            uint32_t nNonce = 0;
+            pblock->nNonce = 0;
             while (true) {
                 // Check if something found
-                if (ScanHash(pblock, nNonce, &hash))
+                uint64_t nHashes = 0;
+                bool fFound = ScanHash(pblock, std::min<uint64_t>((uint64_t)pblock->nNonce + SCAN_ROUND, 0xffff0000), hashTarget, nHashes);
+                UpdateHashMeter(nHashes);
+                if (fFound)
                 {
-                    if (UintToArith256(hash) <= hashTarget)
+                    // Found a solution
+                    uint256 hash = pblock->GetHash();
+                    assert(UintToArith256(hash) <= hashTarget);
                     {
-                        // Found a solution
-                        pblock->nNonce = nNonce;
-                        assert(hash == pblock->GetHash());
+                        LOCK2(cs_main, pwallet->cs_wallet);
+                        if (!SignBlock(*pblock, *pwallet))
                         {
-                            LOCK2(cs_main, pwallet->cs_wallet);
-                            if (!SignBlock(*pblock, *pwallet))
-                            {
-                                LogPrintf("PoWMiner(): failed to sign PoW block\n");
-                                continue;
-                            }
+                            LogPrintf("PoWMiner(): failed to sign PoW block\n");
+                            pblock->nNonce++;
+                            continue;
                         }
-                        LogPrintf("EmercoinMiner:\n");
-                        LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex(), hashTarget.GetHex());
-                        ProcessBlockFound(pblock, chainparams);
-                        reservedest.KeepDestination();
+                    }
+                    LogPrintf("EmercoinMiner:\n");
+                    LogPrintf("proof-of-work found  \n  hash: %s  \ntarget: %s\n", hash.GetHex(), hashTarget.GetHex());
+                    ProcessBlockFound(pblock, chainparams);
+                    reservedest.KeepDestination();
 
-                        // In regression test mode, stop mining after a block is found.
-                        if (chainparams.NetworkIDString() == "regtest")
-                            throw boost::thread_interrupted();
+                    // In regression test mode, stop mining after a block is found.
+                    if (chainparams.NetworkIDString() == "regtest")
+                        throw boost::thread_interrupted();
 
-                        break;
-                    }
+                    break;
                 }
 
                 // Check for stop or if block needs to be rebuilt
@@ -901,7 +981,7 @@ void static EmercoinMiner(const CChainParams& chainparams)
                 // Regtest mode doesn't require peers
                 if ((g_connman == nullptr || g_connman->GetNodeCount(CConnman::CONNECTIONS_ALL) == 0))
                     break;
-                if (nNonce >= 0xffff0000)
+                if (pblock->nNonce >= 0xffff0000)
                     break;
                 if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
                     break;
@@ -953,6 +1033,6 @@ void GenerateEmercoins(bool fGenerate, int nThreads, const CChainParams& chainpa
 
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&EmercoinMiner, boost::cref(chainparams)));
+        minerThreads->create_thread(boost::bind(&EmercoinMiner, boost::cref(chainparams), i, nThreads));
 }
 #endif
@@ -24,6 +24,7 @@
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 
+class arith_uint256;
 class CBlockIndex;
 class CChainParams;
 class CScript;
@@ -216,6 +217,14 @@ private:
 
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Scan nonces of the header from pblock->nNonce up to nNonceEnd (exclusive) for a hash not above
+ *  hashTarget, several nonces at once with the multi-way SHA256d from a midstate. Returns true
+ *  with pblock->nNonce set to the found one; nHashes is increased by the number of nonces tried. */
+bool ScanHash(CBlockHeader* pblock, uint32_t nNonceEnd, const arith_uint256& hashTarget, uint64_t& nHashes);
+/** Add hashes done by a miner to the hash meter */
+void UpdateHashMeter(uint64_t nHashes);
+/** Recent hash rate of the miners, 0 if idle */
+double GetHashesPerSec();
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
 
 void ThreadStakeMinter(std::shared_ptr<CWallet> pwallet);
@@ -10,6 +10,9 @@
 #include <wallet/coincontrol.h>
 #include <util/validation.h>
 #include <consensus/validation.h>
+#include <index/nameindex.h>
+#include <shutdown.h>
+#include <util/threadnames.h>
 
 #include <boost/format.hpp>
 #include <boost/xpressive/xpressive_dynamic.hpp>
@@ -20,6 +23,8 @@ using namespace std;
 map<CNameVal, set<COutPoint> > mapNamePending; // for pending tx
 std::unique_ptr<CNameDB> pNameDB;
 std::unique_ptr<CNameAddressDB> pNameAddressDB;
+std::unique_ptr<CNameValueCache> pNameValueCache;
+boost::signals2::signal<void (const CNameVal& name)> NotifyNameChanged;
 
 class CNamecoinHooks : public CHooks
 {
@@ -81,47 +86,32 @@ string encodeNameVal(const CNameVal& input, const string& format)
 }
 
 // Calculate at which block will expire.
-bool CalculateExpiresAt(CNameRecord& nameRec)
+static void CalculateExpiresAt(CNameHead& head, int op)
 {
-    if (nameRec.deleted()) {
-        nameRec.nExpiresAt = 0;
-        return true;
-    }
-
-    int64_t sum = 0;
-    for(unsigned int i = nameRec.nLastActiveChainIndex; i < nameRec.vNameOp.size(); i++) {
-        CTransactionRef tx;
-        if (!g_txindex || !g_txindex->FindTx(nameRec.vNameOp[i].txPos, tx))
-            return error("%s: could not read tx from disk", __func__);
-
-        NameTxInfo nti;
-        if (!DecodeNameOutput(tx, nameRec.vNameOp[i].nOut, nti))
-            return error("%s: %s is not name tx, this should never happen", __func__, tx->GetHash().GetHex());
-
-       sum += 175ULL * nti.nRentalDays; //days to blocks. 175 is average number of blocks per day
+    if (op == OP_NAME_DELETE) {
+        head.nExpiresAt = 0;
+        return;
     }
 
     //limit to INT_MAX value
-    sum += nameRec.vNameOp[nameRec.nLastActiveChainIndex].nHeight;
-    nameRec.nExpiresAt = sum > INT_MAX ? INT_MAX : sum;
-
-    return true;
+    int64_t sum = head.active.nHeight + 175LL * head.nActiveRentalDays; //days to blocks. 175 is average number of blocks per day
+    head.nExpiresAt = sum > INT_MAX ? INT_MAX : sum;
 }
 
 // Tests if name is active. You can optionaly specify at which height it is/was active.
 bool NameActive(const CNameVal& name, int currentBlockHeight = -1)
 {
-    CNameRecord nameRec;
-    if (!pNameDB->ReadName(name, nameRec))
+    CNameState state;
+    if (!pNameDB->ReadNameState(name, state))
         return false;
 
     if (currentBlockHeight < 0)
         currentBlockHeight = ::ChainActive().Height();
 
-    if (nameRec.deleted()) // last name op was name_delete
+    if (state.deleted()) // last name op was name_delete
         return false;
 
-    return currentBlockHeight <= nameRec.nExpiresAt;
+    return currentBlockHeight <= state.nExpiresAt;
 }
 
 // Returns minimum name operation fee rounded down to cents. Should be used during|before transaction creation.
@@ -155,37 +145,380 @@ CAmount GetNameOpFee(const CBlockIndex* pindex, const int nRentalDays, int op, c
     return txMinFee;
 }
 
-// scans nameindexV3 and return names with their last CNameOperation
+CNameCursor::CNameCursor(CNameDB& db, const CNameVal& start, Order order, const CNameVal& ns, int nHeight) :
+    db(db), order(order), ns(ns), pcursor(db.NewIterator()), fValid(false), nHeight(nHeight)
+{
+    switch (order) {
+    case BY_NAME:      pcursor->Seek(make_pair(DB_NAME_STATE, start)); break;
+    case BY_NAMESPACE: pcursor->Seek(make_pair(DB_NAME_BY_NS, make_pair(ns, start))); break;
+    case BY_EXPIRY:    pcursor->Seek(make_pair(DB_NAME_BY_EXPIRY, make_pair(CNameHeightKey(nHeight), start))); break;
+    case BY_UPDATE:    pcursor->Seek(make_pair(DB_NAME_BY_UPDATE, make_pair(CNameHeightKey(nHeight), start))); break;
+    }
+    ReadCurrent();
+}
+
+void CNameCursor::Next()
+{
+    pcursor->Next();
+    ReadCurrent();
+}
+
+void CNameCursor::ReadCurrent()
+{
+    if (order == BY_NAME) {
+        pair<char, CNameVal> key;
+        fValid = pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_NAME_STATE && pcursor->GetValue(head);
+        if (fValid)
+            name = std::move(key.second);
+        return;
+    }
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        if (order == BY_NAMESPACE) {
+            pair<char, pair<CNameVal, CNameVal> > key;
+            if (!pcursor->GetKey(key) || key.first != DB_NAME_BY_NS || key.second.first != ns)
+                break;
+            name = std::move(key.second.second);
+        } else {
+            pair<char, pair<CNameHeightKey, CNameVal> > key;
+            if (!pcursor->GetKey(key) || key.first != (order == BY_EXPIRY ? DB_NAME_BY_EXPIRY : DB_NAME_BY_UPDATE))
+                break;
+            nHeight = key.second.first.nHeight;
+            name = std::move(key.second.second);
+        }
+
+        // state is read outside of iterator snapshot - skip entries changed by a block connected meanwhile
+        if (!db.ReadNameState(name, state) || state.deleted())
+            continue;
+        if ((order == BY_EXPIRY && state.nExpiresAt != nHeight) || (order == BY_UPDATE && state.nHeight != nHeight))
+            continue;
+        fValid = true;
+        return;
+    }
+    fValid = false;
+}
+
+bool CNameCursor::GetState(CNameState& stateOut) const
+{
+    if (!fValid)
+        return false;
+    if (order != BY_NAME) {
+        stateOut = state;
+        return true;
+    }
+    return pcursor->GetValue(stateOut);
+}
+
+CNameVal CNameDB::GetNamespace(const CNameVal& name)
+{
+    for (size_t i = 0; i < name.size(); i++)
+        if (name[i] == ':' || name[i] == '/')
+            return CNameVal(name.begin(), name.begin() + i + 1);
+    return CNameVal();
+}
+
+void CNameDB::UpdateSecondaryKeys(CDBBatch& batch, const CNameVal& name, const CNameStateHead* pOld, const CNameStateHead* pNew)
+{
+    if (pOld && !pOld->deleted()) {
+        batch.Erase(make_pair(DB_NAME_BY_NS, make_pair(GetNamespace(name), name)));
+        batch.Erase(make_pair(DB_NAME_BY_EXPIRY, make_pair(CNameHeightKey(pOld->nExpiresAt), name)));
+        batch.Erase(make_pair(DB_NAME_BY_UPDATE, make_pair(CNameHeightKey(pOld->nHeight), name)));
+    }
+    if (pNew && !pNew->deleted()) {
+        batch.Write(make_pair(DB_NAME_BY_NS, make_pair(GetNamespace(name), name)), '\0');
+        batch.Write(make_pair(DB_NAME_BY_EXPIRY, make_pair(CNameHeightKey(pNew->nExpiresAt), name)), '\0');
+        batch.Write(make_pair(DB_NAME_BY_UPDATE, make_pair(CNameHeightKey(pNew->nHeight), name)), '\0');
+    }
+}
+
+// scans nameindexV3 and return names with their current state
 // if nMax == 0 - it will scan all names
-bool CNameDB::ScanNames(const CNameVal& name, unsigned int nMax,
-        vector<
-            pair<
-                CNameVal,
-                pair<CNameOperation, int>
-            >
-        > &nameScan)
+bool CNameDB::ScanNames(const CNameVal& name, unsigned int nMax, vector<pair<CNameVal, CNameState> > &nameScan)
+{
+    for (CNameCursor cursor(*this, name); cursor.Valid(); cursor.Next()) {
+        if (cursor.GetHead().deleted())
+            continue;
+
+        CNameState value;
+        if (!cursor.GetState(value))
+            return error("%s: failed to read value", __func__);
+        nameScan.push_back(make_pair(cursor.GetName(), value));
+        if (nMax > 0 && nameScan.size() >= nMax)
+            break;
+    }
+
+    return true;
+}
+
+bool CNameDB::ReadName(const CNameVal& name, CNameRecord& rec)
 {
+    CNameHead head;
+    if (!ReadNameHead(name, head))
+        return false;
+
+    rec.vNameOp.clear();
+    rec.vNameOp.reserve(head.nOps);
+    rec.nExpiresAt = head.nExpiresAt;
+    rec.nLastActiveChainIndex = 0;
+
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(name);
+    pcursor->Seek(make_pair(DB_NAME_OP, make_pair(name, head.first)));
     while (pcursor->Valid()) {
-        CNameVal key;
-        if (!pcursor->GetKey(key))
-            return error("%s: failed to read key", __func__);
+        pair<char, pair<CNameVal, CNameOpPos> > key;
+        if (!pcursor->GetKey(key) || key.first != DB_NAME_OP || key.second.first != name)
+            break;
 
-        CNameRecord value;
-        if (!pcursor->GetValue(value))
+        CNameOperation nameOp;
+        if (!pcursor->GetValue(nameOp))
             return error("%s: failed to read value", __func__);
 
+        if (key.second.second == head.active)
+            rec.nLastActiveChainIndex = rec.vNameOp.size();
+        rec.vNameOp.push_back(nameOp);
+
+        if (key.second.second == head.last)
+            break;
         pcursor->Next();
+    }
 
-        if (value.deleted() || value.vNameOp.empty())
-            continue;
-        nameScan.push_back(make_pair(key, make_pair(value.vNameOp.back(), value.nExpiresAt)));
+    if (rec.vNameOp.size() != head.nOps) {
+        LogPrintf("Nameindex is corrupt!");
+        return false;
+    }
+    return true;
+}
+
+bool CNameDB::ReadPrevNameOp(const CNameVal& name, const CNameOpPos& pos, CNameOpPos& prevPos, CNameOperation& prevOp)
+{
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_NAME_OP, make_pair(name, pos)));
+    if (!pcursor->Valid())
+        return false;
+    pcursor->Prev();
+    if (!pcursor->Valid())
+        return false;
+
+    pair<char, pair<CNameVal, CNameOpPos> > key;
+    if (!pcursor->GetKey(key) || key.first != DB_NAME_OP || key.second.first != name)
+        return false;
+
+    prevPos = key.second.second;
+    return pcursor->GetValue(prevOp);
+}
+
+bool CNameDB::PopNameOp(const CNameVal& name, const CNameOpPos& pos, const CNameHead& head, const CNameState& state)
+{
+    CNameStateHead oldState;
+    bool fOldState = Read(make_pair(DB_NAME_STATE, name), oldState);
+
+    CDBBatch batch(*this);
+    batch.Erase(make_pair(DB_NAME_OP, make_pair(name, pos)));
+    batch.Write(make_pair(DB_NAME_HEAD, name), head);
+    batch.Write(make_pair(DB_NAME_STATE, name), state);
+    UpdateSecondaryKeys(batch, name, fOldState ? &oldState : nullptr, &state);
+    return WriteBatch(batch);
+}
+
+bool CNameDB::EraseName(const CNameVal& name)
+{
+    CDBBatch batch(*this);
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_NAME_OP, make_pair(name, CNameOpPos())));
+    for (; pcursor->Valid(); pcursor->Next()) {
+        pair<char, pair<CNameVal, CNameOpPos> > key;
+        if (!pcursor->GetKey(key) || key.first != DB_NAME_OP || key.second.first != name)
+            break;
+        batch.Erase(key);
+    }
+    CNameStateHead oldState;
+    if (Read(make_pair(DB_NAME_STATE, name), oldState))
+        UpdateSecondaryKeys(batch, name, &oldState, nullptr);
+    batch.Erase(make_pair(DB_NAME_HEAD, name));
+    batch.Erase(make_pair(DB_NAME_STATE, name));
+    return WriteBatch(batch);
+}
+
+CNameIndexBatch::CNameIndexBatch(CNameDB& nameDB, CNameAddressDB* pAddressDB) :
+    nameDB(nameDB), pAddressDB(pAddressDB), batch(nameDB)
+{
+    if (pAddressDB)
+        batchAddress = MakeUnique<CDBBatch>(*pAddressDB);
+}
+
+bool CNameIndexBatch::ReadNameHead(const CNameVal& name, CNameHead& head)
+{
+    auto it = mapHead.find(name);
+    if (it != mapHead.end()) {
+        head = it->second;
+        return true;
+    }
+    return nameDB.ReadNameHead(name, head);
+}
+
+bool CNameIndexBatch::ReadNameState(const CNameVal& name, CNameState& state)
+{
+    auto it = mapState.find(name);
+    if (it != mapState.end()) {
+        state = it->second;
+        return true;
+    }
+    return nameDB.ReadNameState(name, state);
+}
+
+bool CNameIndexBatch::AppendNameOp(const CNameVal& name, CNameHead& head, const CNameOperation& nameOp, const CNameState& state, unsigned int nTrim)
+{
+    batch.Write(make_pair(DB_NAME_OP, make_pair(name, head.last)), nameOp);
+    std::vector<CNameOpPos>& vAppended = mapAppended[name];
+    vAppended.push_back(head.last);
+
+    if (nTrim > 0) {
+        // history is ordered by key, so oldest operations are a contiguous range starting at head.first:
+        // first the ones already in nameDB, then the ones appended in this block
+        bool fFirstFound = false;
+        std::unique_ptr<CDBIterator> pcursor(nameDB.NewIterator());
+        pcursor->Seek(make_pair(DB_NAME_OP, make_pair(name, head.first)));
+        for (; pcursor->Valid(); pcursor->Next()) {
+            pair<char, pair<CNameVal, CNameOpPos> > key;
+            if (!pcursor->GetKey(key) || key.first != DB_NAME_OP || key.second.first != name)
+                break;
+            if (nTrim == 0) {
+                head.first = key.second.second;
+                fFirstFound = true;
+                break;
+            }
+            batch.Erase(key);
+            head.nOps--;
+            nTrim--;
+        }
+        while (!fFirstFound && !vAppended.empty()) {
+            if (nTrim == 0) {
+                head.first = vAppended.front();
+                fFirstFound = true;
+                break;
+            }
+            batch.Erase(make_pair(DB_NAME_OP, make_pair(name, vAppended.front())));
+            vAppended.erase(vAppended.begin());
+            head.nOps--;
+            nTrim--;
+        }
+        if (!fFirstFound)
+            return error("%s: name history is shorter than expected", __func__);
+    }
+
+    CNameState oldState;
+    bool fOldState = ReadNameState(name, oldState);
+    CNameDB::UpdateSecondaryKeys(batch, name, fOldState ? &oldState : nullptr, &state);
+
+    mapHead[name] = head;
+    mapState[name] = state;
+    batch.Write(make_pair(DB_NAME_HEAD, name), head);
+    batch.Write(make_pair(DB_NAME_STATE, name), state);
+    return true;
+}
+
+void CNameAddressDB::UpdateName(CDBBatch& batch, const string& oldAddress, const CNameVal& name, const string& newAddress)
+{
+    if (oldAddress == newAddress)
+        return;
+    if (oldAddress != "")
+        batch.Erase(make_pair(DB_ADDRESS_NAME, make_pair(oldAddress, name)));
+    if (newAddress != "")
+        batch.Write(make_pair(DB_ADDRESS_NAME, make_pair(newAddress, name)), '\0');
+}
+
+bool CNameAddressDB::ScanAddress(const string& address, vector<CNameVal>& names)
+{
+    std::unique_ptr<CDBIterator> pcursor(NewIterator());
+    pcursor->Seek(make_pair(DB_ADDRESS_NAME, make_pair(address, CNameVal())));
+    for (; pcursor->Valid(); pcursor->Next()) {
+        pair<char, pair<string, CNameVal> > key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESS_NAME || key.second.first != address)
+            break;
+        names.push_back(std::move(key.second.second));
     }
+    return true;
+}
 
+bool CNameIndexBatch::Commit()
+{
+    // nameindexV3 and nameaddressV3 are separate databases: each one is written atomically
+    if (!nameDB.WriteBatch(batch))
+        return false;
+    if (batchAddress && !pAddressDB->WriteBatch(*batchAddress))
+        return false;
     return true;
 }
 
+uint64_t CNameValueCache::Generation()
+{
+    LOCK(cs);
+    return nGeneration;
+}
+
+bool CNameValueCache::Get(const CNameVal& name, int nHeight, string& value)
+{
+    LOCK(cs);
+    auto it = mapEntries.find(name);
+    if (it == mapEntries.end())
+        return false;
+
+    if (nHeight > it->second.nExpiresAt) {
+        EraseEntry(it); // name has expired
+        return false;
+    }
+
+    listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+    value = it->second.value;
+    return true;
+}
+
+void CNameValueCache::Put(const CNameVal& name, const string& value, int nExpiresAt, uint64_t nGen)
+{
+    size_t nSize = name.size() + value.size();
+    LOCK(cs);
+    if (nGen != nGeneration || nSize > nMaxBytes)
+        return; // name could be changed after value was read
+
+    auto it = mapEntries.find(name);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+
+    while (!listLRU.empty() && nBytes + nSize > nMaxBytes)
+        EraseEntry(mapEntries.find(listLRU.back()));
+
+    listLRU.push_front(name);
+    Entry& entry = mapEntries[name];
+    entry.value = value;
+    entry.nExpiresAt = nExpiresAt;
+    entry.itLRU = listLRU.begin();
+    nBytes += nSize;
+}
+
+void CNameValueCache::Erase(const CNameVal& name)
+{
+    LOCK(cs);
+    nGeneration++;
+    auto it = mapEntries.find(name);
+    if (it != mapEntries.end())
+        EraseEntry(it);
+}
+
+void CNameValueCache::Clear()
+{
+    LOCK(cs);
+    nGeneration++;
+    mapEntries.clear();
+    listLRU.clear();
+    nBytes = 0;
+}
+
+void CNameValueCache::EraseEntry(std::map<CNameVal, Entry>::iterator it)
+{
+    nBytes -= it->first.size() + it->second.value.size();
+    listLRU.erase(it->second.itLRU);
+    mapEntries.erase(it);
+}
+
 CHooks* InitHook()
 {
     return new CNamecoinHooks();
@@ -218,10 +551,10 @@ bool CNamecoinHooks::IsNameFeeEnough(const CTransactionRef& tx, const CAmount& t
 //returns first name operation. I.e. name_new from chain like name_new->name_update->name_update->...->name_update
 bool GetFirstTxOfName(const CNameVal& name, CTransactionRef& tx)
 {
-    CNameRecord nameRec;
-    if (!pNameDB->ReadName(name, nameRec) || nameRec.vNameOp.empty())
+    CNameHead head;
+    CNameOperation nameOp;
+    if (!pNameDB->ReadNameHead(name, head) || head.nOps == 0 || !pNameDB->ReadNameOp(name, head.active, nameOp))
         return false;
-    CNameOperation& nameOp = nameRec.vNameOp[nameRec.nLastActiveChainIndex];
 
     if (!g_txindex || !g_txindex->FindTx(nameOp.txPos, tx))
         return error("GetFirstTxOfName() : could not read tx from disk");
@@ -229,16 +562,15 @@ bool GetFirstTxOfName(const CNameVal& name, CTransactionRef& tx)
     return true;
 }
 
-bool GetLastTxOfName(const CNameVal& name, CTransactionRef& tx, CNameRecord& nameRec)
+bool GetLastTxOfName(const CNameVal& name, CTransactionRef& tx, CNameState& state)
 {
-    if (!pNameDB->ReadName(name, nameRec))
+    if (!pNameDB->ReadNameState(name, state))
         return false;
-    if (nameRec.deleted() || nameRec.vNameOp.empty())
+    if (state.deleted())
         return false;
 
-    CNameOperation& txPos = nameRec.vNameOp.back();
-
-    if (!g_txindex || !g_txindex->FindTx(txPos.txPos, tx))
+    uint256 hashBlock;
+    if (!g_txindex || !g_txindex->FindTx(state.txid, hashBlock, tx))
         return error("GetLastTxOfName() : could not read tx from disk");
     return true;
 }
@@ -321,34 +653,27 @@ UniValue sendtoname(const JSONRPCRequest& request)
 
 bool GetNameCurrentAddress(const CNameVal& name, CTxDestination& dest, string& error)
 {
-    if (!pNameDB->Exists(name)) {
+    CNameState state;
+    if (!pNameDB->ReadNameState(name, state)) {
         error = "Name not found";
         return false;
     }
 
-    CTransactionRef tx;
-    CNameRecord nameRec;
-    if (!GetLastTxOfName(name, tx, nameRec)) {
-        error = "Failed to read last name transaction";
+    if (state.deleted()) {
+        error = "Name has been deleted";
         return false;
     }
 
-    NameTxInfo nti;
-    if (!DecodeNameOutput(tx, nameRec.vNameOp.back().nOut, nti, true)) {
-        error = "Failed to decode last name transaction";
-        return false;
-    }
-
-    dest = DecodeDestination(nti.strAddress);
+    dest = DecodeDestination(state.address);
     if (!IsValidDestination(dest)) {
-        error = "Invalid address: 0" + nti.strAddress;
+        error = "Invalid address: 0" + state.address;
         return false;
     }
 
-    if (!NameActive(name)) {
+    if (::ChainActive().Height() > state.nExpiresAt) {
         stringstream ss;
         ss << "This name have expired. If you still wish to send money to it's last owner you can use this command:\n"
-           << "sendtoaddress " << nti.strAddress << " <your_amount> ";
+           << "sendtoaddress " << state.address << " <your_amount> ";
         error = ss.str();
         return false;
     }
@@ -356,6 +681,13 @@ bool GetNameCurrentAddress(const CNameVal& name, CTxDestination& dest, string& e
     return true;
 }
 
+// with -nameindexasync wait until name index has caught up with connected blocks
+static void SyncNameIndex()
+{
+    if (g_name_index)
+        g_name_index->BlockUntilSyncedToCurrentChain();
+}
+
 UniValue name_list(const JSONRPCRequest& request)
 {
     std::shared_ptr<CWallet> const wallet = GetWalletForJSONRPCRequest(request);
@@ -421,21 +753,21 @@ void GetNameList(const CNameVal& nameUniq, std::map<CNameVal, NameTxInfo> &mapNa
                 continue;
 
             CTransactionRef tx;
-            CNameRecord nameRec;
-            if (!GetLastTxOfName(ntiWallet.name, tx, nameRec))
+            CNameState state;
+            if (!GetLastTxOfName(ntiWallet.name, tx, state))
                 continue;
 
             NameTxInfo nti;
-            if (!DecodeNameOutput(tx, nameRec.vNameOp.back().nOut, nti, true, pwallet))
+            if (!DecodeNameOutput(tx, state.nOut, nti, true, pwallet))
                 continue;
 
             if (nameUniq.size() > 0 && nameUniq != nti.name)
                 continue;
 
-            if (!pNameDB->Exists(nti.name))
+            if (!pNameDB->ExistsName(nti.name))
                 continue;
 
-            nti.nExpiresAt = nameRec.nExpiresAt;
+            nti.nExpiresAt = state.nExpiresAt;
             mapNames[nti.name] = nti;
         }
     }
@@ -524,39 +856,30 @@ UniValue name_show(const JSONRPCRequest& request)
     if (::ChainstateActive().IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Emercoin is downloading blocks...");
 
+    SyncNameIndex();
+
     UniValue oName(UniValue::VOBJ);
     CNameVal name = nameValFromValue(request.params[0]);
     string outputType = request.params.size() > 1 ? request.params[1].get_str() : "";
     string sName = stringFromNameVal(name);
-    NameTxInfo nti;
+    CNameState state;
     {
         LOCK(cs_main);
-        CNameRecord nameRec;
-        if (!pNameDB->ReadName(name, nameRec))
+        if (!pNameDB->ReadNameState(name, state))
             throw JSONRPCError(RPC_WALLET_ERROR, "failed to read from name DB");
 
-        if (nameRec.vNameOp.size() < 1)
-            throw JSONRPCError(RPC_WALLET_ERROR, "no result returned");
-
-        CTransactionRef tx;
-        if (!g_txindex || !g_txindex->FindTx(nameRec.vNameOp.back().txPos, tx))
-            throw JSONRPCError(RPC_WALLET_ERROR, "failed to read from from disk");
-
-        if (!DecodeNameOutput(tx, nameRec.vNameOp.back().nOut, nti, true))
-            throw JSONRPCError(RPC_WALLET_ERROR, "failed to decode name");
-
         oName.pushKV("name", sName);
-        oName.pushKV("value", encodeNameVal(nti.value, outputType));
-        oName.pushKV("txid", tx->GetHash().GetHex());
-        oName.pushKV("address", nti.strAddress);
-        oName.pushKV("vout", (int)nti.nOut);
-        oName.pushKV("expires_in", nameRec.nExpiresAt - ::ChainActive().Height());
-        oName.pushKV("expires_at", nameRec.nExpiresAt);
-        oName.pushKV("time", (boost::int64_t)tx->nTime);
-        if (nameRec.deleted())
+        oName.pushKV("value", encodeNameVal(state.value, outputType));
+        oName.pushKV("txid", state.txid.GetHex());
+        oName.pushKV("address", state.address);
+        oName.pushKV("vout", (int)state.nOut);
+        oName.pushKV("expires_in", state.nExpiresAt - ::ChainActive().Height());
+        oName.pushKV("expires_at", state.nExpiresAt);
+        oName.pushKV("time", (boost::int64_t)state.nTime);
+        if (state.deleted())
             oName.pushKV("deleted", true);
         else
-            if (nameRec.nExpiresAt - ::ChainActive().Height() <= 0)
+            if (state.nExpiresAt - ::ChainActive().Height() <= 0)
                 oName.pushKV("expired", true);
     }
 
@@ -568,7 +891,7 @@ UniValue name_show(const JSONRPCRequest& request)
         if (!file.is_open())
             throw JSONRPCError(RPC_PARSE_ERROR, "Failed to open file. Check if you have permission to open it.");
 
-        file.write((const char*)&nti.value[0], nti.value.size());
+        file.write((const char*)state.value.data(), state.value.size());
         file.close();
     }
 
@@ -612,6 +935,8 @@ UniValue name_history(const JSONRPCRequest& request)
     if (::ChainstateActive().IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Emercoin is downloading blocks...");
 
+    SyncNameIndex();
+
     CNameVal name = nameValFromValue(request.params[0]);
     bool fFullHistory = request.params.size() > 1 ? request.params[1].get_bool() : false;
     string outputType = request.params.size() > 2 ? request.params[2].get_str() : "";
@@ -735,11 +1060,59 @@ bool mycompare2 (const UniValue& lhs, const UniValue& rhs)
 
     return lhs[pos].get_int() < rhs[pos].get_int();
 }
+
+// continuation cursor of name_filter and name_expiring is hex of the name to continue from,
+// prefixed with 4 bytes of key height when names are listed by height
+static void ParseNameCursor(const string& strCursor, bool fHeight, int& nHeight, CNameVal& name)
+{
+    if (!IsHex(strCursor) && !strCursor.empty())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid cursor");
+    name = ParseHex(strCursor);
+    if (!fHeight || name.empty())
+        return;
+    if (name.size() < 4)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "invalid cursor");
+    nHeight = ReadBE32(name.data());
+    name.erase(name.begin(), name.begin() + 4);
+}
+
+static string MakeNameCursor(const CNameCursor& cursor, bool fHeight)
+{
+    if (!cursor.Valid())
+        return "";
+    CNameVal pos;
+    if (fHeight) {
+        pos.resize(4);
+        WriteBE32(pos.data(), cursor.GetHeight());
+    }
+    pos.insert(pos.end(), cursor.GetName().begin(), cursor.GetName().end());
+    return HexStr(pos);
+}
+
+// namespace of names matched by regexp, if it starts with a literal namespace: "^dns:" -> "dns:"
+static bool GetRegexpNamespace(const string& strRegexp, CNameVal& ns)
+{
+    if (strRegexp.empty() || strRegexp[0] != '^' || strRegexp.find('|') != string::npos)
+        return false;
+    for (size_t i = 1; i < strRegexp.size(); i++) {
+        char c = strRegexp[i];
+        if (c == ':' || c == '/') {
+            if (i + 1 < strRegexp.size() && strchr("?*{", strRegexp[i + 1]))
+                return false;
+            ns = nameValFromString(strRegexp.substr(1, i));
+            return true;
+        }
+        if (!IsDigit(c) && !(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && c != '-' && c != '_')
+            return false;
+    }
+    return false;
+}
+
 UniValue name_filter(const JSONRPCRequest& request)
 {
-    if (request.fHelp || request.params.size() > 7)
+    if (request.fHelp || request.params.size() > 8)
         throw runtime_error(
-                "name_filter [regexp] [maxage=0] [from=0] [nb=0] [stat] [valuetype]\n"
+                "name_filter [regexp] [maxage=0] [from=0] [nb=0] [stat] [valuetype] [max-value-length=0] [cursor]\n"
                 "scan and filter names\n"
                 "[regexp] : apply [regexp] on names, empty means all names\n"
                 "[maxage] : look in last [maxage] blocks\n"
@@ -748,14 +1121,19 @@ UniValue name_filter(const JSONRPCRequest& request)
                 "[stat] : show some stats instead of results\n"
                 "[valuetype] : if \"hex\" or \"base64\" is specified then it will print value in corresponding format instead of string.\n"
                 "[max-value-length] : control how much of value is shown (0 = full value)\n"
+                "[cursor] : continue scan from cursor returned by previous call, \"\" starts from the first name.\n"
+                "           If specified, result is an object with \"names\" array and \"cursor\" for the next call, empty when scan is finished.\n"
                 "name_filter \"\" 5 # list names updated in last 5 blocks\n"
                 "name_filter \"^id/\" # list all names from the \"id\" namespace\n"
                 "name_filter \"^id/\" 0 0 0 stat # display stats (number of names) on active names from the \"id\" namespace\n"
+                "name_filter \"^id/\" 0 0 100 \"\" \"\" 0 \"\" # list first 100 names from the \"id\" namespace with continuation cursor\n"
                 );
 
     if (::ChainstateActive().IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Emercoin is downloading blocks...");
 
+    SyncNameIndex();
+
     int nCountFrom = 0;
     int nCountNb = 0;
 
@@ -766,38 +1144,49 @@ UniValue name_filter(const JSONRPCRequest& request)
     bool fStat        = request.params.size() > 4 ? (request.params[4].get_str() == "stat" ? true : false) : false;
     string outputType = request.params.size() > 5 ? request.params[5].get_str() : "";
     int nMaxShownValue= request.params.size() > 6 ? request.params[6].get_int() : 0;
+    bool fCursor      = request.params.size() > 7 && !request.params[7].isNull();
 
-    vector<UniValue> oRes;
-
-    CNameVal name;
-    vector<pair<CNameVal, pair<CNameOperation,int> > > nameScan;
+    int nHeight;
     {
         LOCK(cs_main);
-        if (!pNameDB->ScanNames(name, 0, nameScan))
-            throw JSONRPCError(RPC_WALLET_ERROR, "scan failed");
+        nHeight = ::ChainActive().Height();
     }
 
+    // range scan the narrowest index: names updated in last maxage blocks (a name is updated at or after
+    // its registration), names of namespace from "^ns:" regexp, or all names
+    CNameVal ns;
+    CNameCursor::Order order = CNameCursor::BY_NAME;
+    if (nMaxAge > 0)
+        order = CNameCursor::BY_UPDATE;
+    else if (GetRegexpNamespace(strRegexp, ns))
+        order = CNameCursor::BY_NAMESPACE;
+    bool fByHeight = order == CNameCursor::BY_UPDATE;
+
+    int nStartHeight = std::max(0, nHeight - nMaxAge + 1);
+    CNameVal start;
+    if (fCursor)
+        ParseNameCursor(request.params[7].get_str(), fByHeight, nStartHeight, start);
+
     // compile regex once
     using namespace boost::xpressive;
     smatch nameparts;
     sregex cregex = sregex::compile(strRegexp);
 
-    for (const auto& pairScan : nameScan) {
-        string name = stringFromNameVal(pairScan.first);
-
-        // regexp
-        if(strRegexp != "" && !regex_search(name, nameparts, cregex))
+    // names are streamed from nameindex, filters are applied to name and state head before value is decoded
+    vector<UniValue> oRes;
+    CNameCursor cursor(*pNameDB, start, order, ns, nStartHeight);
+    for (; cursor.Valid(); cursor.Next()) {
+        const CNameStateHead& head = cursor.GetHead();
+        if (head.deleted())
             continue;
 
-        CNameOperation txName = pairScan.second.first;
-
-        CNameRecord nameRec;
-        if (!pNameDB->ReadName(pairScan.first, nameRec))
+        // max age
+        if(nMaxAge != 0 && nHeight - head.nRegisteredAt >= nMaxAge)
             continue;
 
-        // max age
-        int nHeight = nameRec.vNameOp[nameRec.nLastActiveChainIndex].nHeight;
-        if(nMaxAge != 0 && ::ChainActive().Height() - nHeight >= nMaxAge)
+        // regexp
+        string name = stringFromNameVal(cursor.GetName());
+        if(strRegexp != "" && !regex_search(name, nameparts, cregex))
             continue;
 
         // from limits
@@ -805,39 +1194,52 @@ UniValue name_filter(const JSONRPCRequest& request)
         if(nCountFrom < nFrom + 1)
             continue;
 
-        UniValue oName(UniValue::VOBJ);
         if (!fStat) {
+            CNameState state;
+            if (!cursor.GetState(state))
+                throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read from name DB");
+
+            UniValue oName(UniValue::VOBJ);
             oName.pushKV("name", name);
-            oName.pushKV("value", limitString(encodeNameVal(txName.value, outputType), nMaxShownValue));
-            oName.pushKV("registered_at", nHeight); // pos = 2 in comparison function (above name_filter)
-            int nExpiresIn = nameRec.nExpiresAt - ::ChainActive().Height();
+            oName.pushKV("value", limitString(encodeNameVal(state.value, outputType), nMaxShownValue));
+            oName.pushKV("registered_at", state.nRegisteredAt); // pos = 2 in comparison function (above name_filter)
+            int nExpiresIn = state.nExpiresAt - nHeight;
             oName.pushKV("expires_in", nExpiresIn);
             if (nExpiresIn <= 0)
                 oName.pushKV("expired", true);
+            oRes.push_back(oName);
         }
-        oRes.push_back(oName);
 
         nCountNb++;
         // nb limits
-        if(nNb > 0 && nCountNb >= nNb)
+        if(nNb > 0 && nCountNb >= nNb) {
+            cursor.Next();
             break;
+        }
     }
 
-    UniValue oRes2(UniValue::VARR);
-    if (!fStat) {
-        std::sort(oRes.begin(), oRes.end(), mycompare2); //sort by nHeight
-        for (unsigned int idx = 0; idx < oRes.size(); idx++) {
-            const UniValue& res = oRes[idx];
-            oRes2.push_back(res);
-        }
-    } else {
+    if (fStat) {
         UniValue oStat(UniValue::VOBJ);
-        oStat.pushKV("blocks",    ::ChainActive().Height());
-        oStat.pushKV("count",     (int)oRes2.size());
+        oStat.pushKV("blocks",    nHeight);
+        oStat.pushKV("count",     nCountNb);
         //oStat.pushKV("sha256sum", SHA256(oRes), true);
         return oStat;
     }
 
+    UniValue oRes2(UniValue::VARR);
+    std::sort(oRes.begin(), oRes.end(), mycompare2); //sort by nHeight
+    for (unsigned int idx = 0; idx < oRes.size(); idx++) {
+        const UniValue& res = oRes[idx];
+        oRes2.push_back(res);
+    }
+
+    if (fCursor) {
+        UniValue oPage(UniValue::VOBJ);
+        oPage.pushKV("names", oRes2);
+        oPage.pushKV("cursor", MakeNameCursor(cursor, fByHeight));
+        return oPage;
+    }
+
     return oRes2;
 }
 
@@ -854,37 +1256,103 @@ UniValue name_scan(const JSONRPCRequest& request)
     if (::ChainstateActive().IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Emercoin is downloading blocks...");
 
+    SyncNameIndex();
+
     CNameVal name      = request.params.size() > 0 ? nameValFromValue(request.params[0]) : CNameVal();
     int nMax           = request.params.size() > 1 ? request.params[1].get_int() : 500;
     int nMaxShownValue = request.params.size() > 2 ? request.params[2].get_int() : 0;
     string outputType  = request.params.size() > 3 ? request.params[3].get_str() : "";
 
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = ::ChainActive().Height();
+    }
+
     UniValue oRes(UniValue::VARR);
+    for (CNameCursor cursor(*pNameDB, name); cursor.Valid(); cursor.Next()) {
+        if (cursor.GetHead().deleted())
+            continue;
+
+        CNameState state;
+        if (!cursor.GetState(state))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read from name DB");
+
+        UniValue oName(UniValue::VOBJ);
+        oName.pushKV("name", stringFromNameVal(cursor.GetName()));
+        oName.pushKV("value", limitString(encodeNameVal(state.value, outputType), nMaxShownValue));
+        oName.pushKV("expires_in", state.nExpiresAt - nHeight);
+        if (state.nExpiresAt - nHeight <= 0)
+            oName.pushKV("expired", true);
 
-    vector<pair<CNameVal, pair<CNameOperation,int> > > nameScan;
+        oRes.push_back(oName);
+        if (nMax > 0 && (int)oRes.size() >= nMax)
+            break;
+    }
+
+    return oRes;
+}
+
+UniValue name_expiring(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 3)
+        throw runtime_error(
+                "name_expiring [blocks=1000] [max-returned=500] [cursor]\n"
+                "List active names which will expire in next [blocks] blocks, soonest first\n"
+                "[max-returned] : maximum number of names returned, 0 means all\n"
+                "[cursor] : continue scan from cursor returned by previous call, \"\" starts from the beginning.\n"
+                "           If specified, result is an object with \"names\" array and \"cursor\" for the next call, empty when scan is finished.\n"
+                );
+
+    if (::ChainstateActive().IsInitialBlockDownload())
+        throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Emercoin is downloading blocks...");
+
+    SyncNameIndex();
+
+    int nBlocks  = request.params.size() > 0 ? request.params[0].get_int() : 1000;
+    int nMax     = request.params.size() > 1 ? request.params[1].get_int() : 500;
+    bool fCursor = request.params.size() > 2 && !request.params[2].isNull();
+    if (nBlocks < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "blocks must be non-negative");
+
+    int nHeight;
     {
         LOCK(cs_main);
-        if (!pNameDB->ScanNames(name, nMax, nameScan))
-            throw JSONRPCError(RPC_WALLET_ERROR, "scan failed");
+        nHeight = ::ChainActive().Height();
     }
 
-    for (const auto& pairScan : nameScan) {
-        UniValue oName(UniValue::VOBJ);
-        string name = stringFromNameVal(pairScan.first);
-        oName.pushKV("name", name);
+    // name is active while its expiration height is not reached
+    int nStartHeight = nHeight + 1;
+    CNameVal start;
+    if (fCursor)
+        ParseNameCursor(request.params[2].get_str(), true, nStartHeight, start);
+    int64_t nEndHeight = (int64_t)nHeight + nBlocks;
 
-        CNameOperation txName = pairScan.second.first;
-        int nExpiresAt    = pairScan.second.second;
-        CNameVal value = txName.value;
+    UniValue oRes(UniValue::VARR);
+    CNameCursor cursor(*pNameDB, start, CNameCursor::BY_EXPIRY, CNameVal(), nStartHeight);
+    for (; cursor.Valid() && cursor.GetHeight() <= nEndHeight; cursor.Next()) {
+        if (nMax > 0 && (int)oRes.size() >= nMax)
+            break;
 
-        oName.pushKV("value", limitString(encodeNameVal(value, outputType), nMaxShownValue));
-        oName.pushKV("expires_in", nExpiresAt - ::ChainActive().Height());
-        if (nExpiresAt - ::ChainActive().Height() <= 0)
-            oName.pushKV("expired", true);
+        CNameState state;
+        if (!cursor.GetState(state))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read from name DB");
 
+        UniValue oName(UniValue::VOBJ);
+        oName.pushKV("name", stringFromNameVal(cursor.GetName()));
+        oName.pushKV("address", state.address);
+        oName.pushKV("expires_at", state.nExpiresAt);
+        oName.pushKV("expires_in", state.nExpiresAt - nHeight);
         oRes.push_back(oName);
     }
 
+    if (fCursor) {
+        UniValue oPage(UniValue::VOBJ);
+        oPage.pushKV("names", oRes);
+        oPage.pushKV("cursor", cursor.Valid() && cursor.GetHeight() <= nEndHeight ? MakeNameCursor(cursor, true) : "");
+        return oPage;
+    }
+
     return oRes;
 }
 
@@ -904,45 +1372,45 @@ UniValue name_scan_address(const JSONRPCRequest& request)
     if (::ChainstateActive().IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Emercoin is downloading blocks...");
 
+    SyncNameIndex();
+
     string address     = request.params.size() > 0 ? request.params[0].get_str() : "";
     int nMaxShownValue = request.params.size() > 1 ? request.params[1].get_int() : 0;
     string outputType  = request.params.size() > 2 ? request.params[2].get_str() : "";
 
-    LOCK(cs_main);
-    UniValue oRes(UniValue::VARR);
+    int nHeight;
+    {
+        LOCK(cs_main);
+        nHeight = ::ChainActive().Height();
+    }
 
-    set<CNameVal> names;
-    if (!pNameAddressDB->Read(address, names))
+    vector<CNameVal> names;
+    if (!pNameAddressDB->ScanAddress(address, names))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read from name address DB");
+    if (names.empty())
         throw JSONRPCError(RPC_WALLET_ERROR, "found nothing");
 
+    UniValue oRes(UniValue::VARR);
     for (const auto& name : names) {
-        UniValue oName(UniValue::VOBJ);
-
-        CNameRecord nameRec;
-        if (!pNameDB->ReadName(name, nameRec))
+        // current state is kept only in nameindex
+        CNameState state;
+        if (!pNameDB->ReadNameState(name, state))
             throw JSONRPCError(RPC_DATABASE_ERROR, "failed to read from name DB");
-
-        CTransactionRef tx;
-        if (!g_txindex || !g_txindex->FindTx(nameRec.vNameOp.back().txPos, tx))
-            throw JSONRPCError(RPC_WALLET_ERROR, "failed to read from from disk");
-
-        NameTxInfo nti;
-        if (!DecodeNameOutput(tx, nameRec.vNameOp.back().nOut, nti))
-            throw JSONRPCError(RPC_WALLET_ERROR, "failed to decode name");
+        UniValue oName(UniValue::VOBJ);
 
         oName.pushKV("name", stringFromNameVal(name));
-        oName.pushKV("value", limitString(encodeNameVal(nti.value, outputType), nMaxShownValue));
-        oName.pushKV("txid", tx->GetHash().GetHex());
-        oName.pushKV("nOut", (int)nti.nOut);
+        oName.pushKV("value", limitString(encodeNameVal(state.value, outputType), nMaxShownValue));
+        oName.pushKV("txid", state.txid.GetHex());
+        oName.pushKV("nOut", (int)state.nOut);
         // We do not use DecodeNameScript here, and address always is empty
         //oName.pushKV("address", nti.strAddress);
-        oName.pushKV("expires_in", nameRec.nExpiresAt - ::ChainActive().Height());
-        oName.pushKV("expires_at", nameRec.nExpiresAt);
-        oName.pushKV("time", (boost::int64_t)tx->nTime);
-        if (nameRec.deleted())
+        oName.pushKV("expires_in", state.nExpiresAt - nHeight);
+        oName.pushKV("expires_at", state.nExpiresAt);
+        oName.pushKV("time", (boost::int64_t)state.nTime);
+        if (state.deleted())
             oName.pushKV("deleted", true);
         else
-            if (nameRec.nExpiresAt - ::ChainActive().Height() <= 0)
+            if (state.nExpiresAt - nHeight <= 0)
                 oName.pushKV("expired", true);
 
         oRes.push_back(oName);
@@ -1350,12 +1818,12 @@ NameTxReturn name_operation(UniValue names, CWallet* pwallet) {
         if (op != OP_NAME_NEW) {
             // Fetch previous TX output and attach to this TX as input
             CTransactionRef prevTx;
-            CNameRecord nameRec;
-            if (!GetLastTxOfName(name, prevTx, nameRec)) {
+            CNameState prevState;
+            if (!GetLastTxOfName(name, prevTx, prevState)) {
                 ret.err_msg = "could not find prev txIn with this name";
                 return ret;
             }
-            int prevTxnOut = nameRec.vNameOp.back().nOut;
+            int prevTxnOut = prevState.nOut;
             NameTxInfo prev_nti;
             if (!DecodeNameOutput(prevTx, prevTxnOut, prev_nti, true, pwallet)) {
                 ret.err_msg = "failed to decode txIn UTXO";
@@ -1469,66 +1937,185 @@ NameTxReturn name_operation(UniValue names, CWallet* pwallet) {
     return ret;
 } // name_operation
 
+static bool ApplyNameOps(const CBlockIndex* pindex, const vector<nameCheckResult> &vName, CNameIndexBatch& batch);
+
+// name transactions of a block, prepared by reindexNameIndex() readers
+struct NameReindexBlock
+{
+    bool fRead = false;
+    bool fError = false;
+    std::vector<std::tuple<CTransactionRef, CDiskTxPos, CAmount> > vNameTx; // tx, position in block file, fee
+};
+
+// Reads block from disk, keeps only name transactions and calculates their positions and fees
+static bool ReadNameReindexBlock(const CBlockIndex* pindex, NameReindexBlock& result)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
+        return error("%s: *** ReadBlockFromDisk failed at %d, hash=%s", __func__, pindex->nHeight, pindex->GetBlockHash().ToString());
+
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size())); // start position
+    for (const auto& tx : block.vtx) {
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        if (tx->IsCoinStake() || tx->IsCoinBase() || tx->nVersion != NAMECOIN_TX_VERSION) {
+            pos.nTxOffset += nTxSize;  // set next tx position
+            continue;
+        }
+
+        // calculate tx fee
+        CAmount input = 0;
+        for (const auto& txin : tx->vin) {
+            if (txin.prevout.hash != randpaytx) {
+                CTransactionRef txPrev;
+                uint256 hashBlock;
+                if (!g_txindex->FindTx(txin.prevout.hash, hashBlock, txPrev))
+                    return error("%s: prev transaction not found", __func__);
+
+                input += txPrev->vout[txin.prevout.n].nValue;
+            }
+        }
+        result.vNameTx.emplace_back(tx, pos, input - tx->GetValueOut());
+        pos.nTxOffset += nTxSize;  // set next tx position
+    }
+    return true;
+}
+
+// Rebuilds nameindex from the active chain. Blocks are read, filtered and their fees calculated
+// by parallel readers; a single applier connects name operations in chain order, one batch per block.
+// Hash of last applied block is written with each batch, so interrupted rebuild is resumed,
+// if that block is still in the active chain.
 bool reindexNameIndex()
 {
     if (!g_txindex)
         return error("createNameIndexes() : transaction index not available");
 
+    int nResumeHeight = -1;
+    uint256 hashResume;
+    if (!pNameDB->ReadReindexBlock(hashResume)) {
+        // fresh index - mark it as unfinished
+        if (!pNameDB->WriteVersion() || !pNameDB->WriteReindexBlock(uint256()))
+            return error("createNameIndexes() : failed to write to name DB");
+    } else if (!hashResume.IsNull()) {
+        LOCK(cs_main);
+        const CBlockIndex* pindexResume = LookupBlockIndex(hashResume);
+        if (!pindexResume || !::ChainActive().Contains(pindexResume))
+            return error("createNameIndexes() : resume block %s is not in active chain", hashResume.ToString());
+        nResumeHeight = pindexResume->nHeight;
+        LogPrintf("Resuming name index creation after block %d\n", nResumeHeight);
+    }
+
     LogPrintf("Scanning blockchain for names to create fast index...\n");
-    LOCK(cs_main);
-    CCoinsViewCache view(&::ChainstateActive().CoinsTip());
-    int maxHeight = ::ChainActive().Height();
-    if (maxHeight <= 0)
-        return true;
+    std::vector<const CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+        for (int nHeight = nResumeHeight + 1; nHeight <= ::ChainActive().Height(); nHeight++)
+            vBlocks.push_back(::ChainActive()[nHeight]);
+    }
+    if (vBlocks.empty())
+        return pNameDB->EraseReindexBlock();
+
+    // readers may run ahead of the applier by at most nWindow blocks
+    const int nThreads = std::max(1, std::min(GetNumCores(), 8));
+    const size_t nWindow = 64 * nThreads;
+    std::vector<NameReindexBlock> vRead(nWindow);
+    Mutex csRead;
+    std::condition_variable condRead;
+    size_t nNextRead = 0;
+    size_t nTaken = 0;      // number of blocks taken by the applier
+    bool fStop = false;
+
+    auto reader = [&]() {
+        util::ThreadRename("namereindex");
+        while (true) {
+            size_t i;
+            {
+                WAIT_LOCK(csRead, lock);
+                condRead.wait(lock, [&] { return fStop || nNextRead >= vBlocks.size() || nNextRead < nTaken + nWindow; });
+                if (fStop || nNextRead >= vBlocks.size())
+                    return;
+                i = nNextRead++;
+            }
+            NameReindexBlock result;
+            result.fError = !ReadNameReindexBlock(vBlocks[i], result);
+            result.fRead = true;
+            {
+                LOCK(csRead);
+                vRead[i % nWindow] = std::move(result);
+            }
+            condRead.notify_all();
+        }
+    };
+    std::vector<std::thread> vReaders;
+    for (int i = 0; i < nThreads; i++)
+        vReaders.emplace_back(reader);
+
+    bool ret = true;
     int reportDone = 0;
-    for (int nHeight=0; nHeight<=maxHeight; nHeight++) {
-        int percentageDone = (100*nHeight / maxHeight);
+    for (size_t nNextApply = 0; nNextApply < vBlocks.size(); nNextApply++) {
+        const CBlockIndex* pindex = vBlocks[nNextApply];
+        NameReindexBlock block;
+        {
+            WAIT_LOCK(csRead, lock);
+            NameReindexBlock& slot = vRead[nNextApply % nWindow];
+            condRead.wait(lock, [&] { return slot.fRead; });
+            block = std::move(slot);
+            slot = NameReindexBlock();
+            nTaken = nNextApply + 1;
+        }
+        condRead.notify_all();
+
+        if (block.fError || ShutdownRequested()) {
+            ret = false;
+            break;
+        }
+
+        int percentageDone = (100 * (nNextApply + 1) / vBlocks.size());
         if (reportDone < percentageDone/10) {
             // report every 10% step
             LogPrintf("[%d%%]...", percentageDone);
             reportDone = percentageDone/10;
         }
-        if (nHeight % 10 == 0)
+        if (pindex->nHeight % 10 == 0)
             uiInterface.ShowProgress("Creating name index (do not close app!)...", percentageDone, false);
 
-        CBlockIndex* pindex = ::ChainActive()[nHeight];
-        CBlock block;
-        if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus()))
-            return error("%s: *** ReadBlockFromDisk failed at %d, hash=%s", __func__, pindex->nHeight, pindex->GetBlockHash().ToString());
-
         // collect name tx from block
         vector<nameCheckResult> vName;
-        CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size())); // start position
-        for (unsigned int i=0; i<block.vtx.size(); i++) {
-            const CTransactionRef& tx = block.vtx[i];
-            if (tx->IsCoinStake() || tx->IsCoinBase()) {
-                pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);  // set next tx position
-                continue;
+        for (const auto& nameTx : block.vNameTx)
+            CheckNameTx(std::get<0>(nameTx), pindex, vName, std::get<1>(nameTx), std::get<2>(nameTx)); // collect valid names from tx to vName
+
+        // execute name operations, if any, together with new resume point
+        if (!vName.empty()) {
+            CNameIndexBatch batch(*pNameDB, nullptr);
+            if (!ApplyNameOps(pindex, vName, batch)) {
+                ret = false;
+                break;
             }
-
-            // calculate tx fee
-            CAmount input = 0;
-            for (const auto& txin : tx->vin) {
-                if (txin.prevout.hash != randpaytx) {
-                    CTransactionRef txPrev;
-                    uint256 hashBlock = uint256();
-                    if (!GetTransaction(txin.prevout.hash, txPrev, Params().GetConsensus(), hashBlock))
-                        return error("createNameIndexes() : prev transaction not found");
-
-                    input += txPrev->vout[txin.prevout.n].nValue;
-                }
+            batch.WriteReindexBlock(pindex->GetBlockHash());
+            if (!batch.Commit()) {
+                ret = error("%s: failed to write name indexes for block %d", __func__, pindex->nHeight);
+                break;
             }
-            CAmount fee = input - tx->GetValueOut();
+        } else if (pindex->nHeight % 1000 == 0)
+            pNameDB->WriteReindexBlock(pindex->GetBlockHash());
+    }
 
-            CheckNameTx(tx, pindex, vName, pos, fee);                           // collect valid names from tx to vName
-            pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);  // set next tx position
-        }
+    {
+        LOCK(csRead);
+        fStop = true;
+    }
+    condRead.notify_all();
+    for (auto& t : vReaders)
+        t.join();
+    uiInterface.ShowProgress("", 100, false);
 
-        // execute name operations, if any
-        if (!vName.empty())
-            hooks->ConnectBlock(pindex, vName);
+    if (!ret) {
+        LogPrintf("Name index creation interrupted, it will be resumed on next start\n");
+        return false;
     }
-    return true;
+
+    if (pNameValueCache)
+        pNameValueCache->Clear();
+    return pNameDB->EraseReindexBlock();
 }
 
 bool reindexNameAddressIndex()
@@ -1536,7 +2123,7 @@ bool reindexNameAddressIndex()
     LogPrintf("Scanning blockchain for names to create secondary (address->name) index...\n");
     LOCK(cs_main);
 
-    vector<pair<CNameVal, pair<CNameOperation,int> > > nameScan;
+    vector<pair<CNameVal, CNameState> > nameScan;
     if (!pNameDB->ScanNames(CNameVal(), 0, nameScan))
         return error("createNameAddressFile() : scan failed");
 
@@ -1544,6 +2131,7 @@ bool reindexNameAddressIndex()
     if (maxHeight <= 0)
         return true;
     int reportDone = 0;
+    CDBBatch batch(*pNameAddressDB);
     for (int nHeight=0; nHeight<=maxHeight; nHeight++) {
         int percentageDone = (100*nHeight / maxHeight);
         if (reportDone < percentageDone/10) {
@@ -1555,20 +2143,17 @@ bool reindexNameAddressIndex()
 
 
         const CNameVal& name = nameScan[nHeight].first;
-        const CNameOperation& nameOp = nameScan[nHeight].second.first;
-
-        CTransactionRef tx;
-        if (!g_txindex || !g_txindex->FindTx(nameOp.txPos, tx))
-            return error("createNameAddressFile() : could not read tx from disk - your blockchain or nameindexV3 are probably corrupt");
-
-        NameTxInfo nti;
-        if (!DecodeNameOutput(tx, nameOp.nOut, nti, true))
-            return error("createNameAddressFile() : failed to decode name - your blockchain or nameindexV3 are probably corrupt");
-
-        if (nti.strAddress != "" && nti.op != OP_NAME_DELETE)
-            pNameAddressDB->WriteSingleName(nti.strAddress, name);
+        const CNameState& state = nameScan[nHeight].second;
+
+        if (state.address != "" && !state.deleted())
+            CNameAddressDB::UpdateName(batch, "", name, state.address);
+        if (batch.SizeEstimate() > (16 << 20)) {
+            if (!pNameAddressDB->WriteBatch(batch))
+                return error("%s: failed to write to name address DB", __func__);
+            batch.Clear();
+        }
     }
-    return true;
+    return pNameAddressDB->WriteBatch(batch);
 }
 
 bool CNamecoinHooks::CheckPendingNames(const CTransactionRef& tx)
@@ -1613,22 +2198,11 @@ static bool CheckName(const NameTxInfo& nti, const CTransactionRef& tx, int nHei
     const char *errtxt = NULL;
 
     //check if last known tx on this name matches any of inputs of this tx
-    CNameRecord nameRec;
+    CNameState prevState;
     bool found = false;
-    NameTxInfo prev_nti;
-    if (pNameDB->ReadName(name, nameRec) && !nameRec.vNameOp.empty() && !nameRec.deleted()) {
-        CTransactionRef lastKnownNameTx;
-        if (!g_txindex || !g_txindex->FindTx(nameRec.vNameOp.back().txPos, lastKnownNameTx)) {
-            errtxt = "failed to read last name tx";
-            goto reterr;
-        }
-        uint256 lasthash = lastKnownNameTx->GetHash();
-        if (!DecodeNameOutput(lastKnownNameTx, nameRec.vNameOp.back().nOut, prev_nti, true)) {
-            errtxt = "failed to decode existing previous name tx. Your blockchain or nameindexV3 may be corrupt";
-            goto reterr;
-        }
+    if (pNameDB->ReadNameState(name, prevState) && !prevState.deleted()) {
         for (const auto &in : tx->vin) // this scans all scripts of tx.vin
-            if(in.prevout.n == prev_nti.nOut && in.prevout.hash == lasthash) {
+            if(in.prevout.n == prevState.nOut && in.prevout.hash == prevState.txid) {
                 found = true;
                 break;
             }
@@ -1649,16 +2223,11 @@ static bool CheckName(const NameTxInfo& nti, const CTransactionRef& tx, int nHei
         }
         case OP_NAME_UPDATE:
         {
-            if (!found || (prev_nti.op != OP_NAME_NEW && prev_nti.op != OP_NAME_UPDATE)) {
+            if (!found || (prevState.op != OP_NAME_NEW && prevState.op != OP_NAME_UPDATE)) {
                 errtxt = "name_update without previous new or update tx";
                 goto reterr;
             }
 
-            if (prev_nti.name != name) {
-                errtxt = "name_update name mismatch";
-                goto reterr;
-            }
-
             if (!NameActive(name, nHeight)) {
                 errtxt = "name_update on an expired name";
                 goto reterr;
@@ -1667,16 +2236,11 @@ static bool CheckName(const NameTxInfo& nti, const CTransactionRef& tx, int nHei
         }
         case OP_NAME_DELETE:
         {
-            if (!found || (prev_nti.op != OP_NAME_NEW && prev_nti.op != OP_NAME_UPDATE)) {
+            if (!found || (prevState.op != OP_NAME_NEW && prevState.op != OP_NAME_UPDATE)) {
                 errtxt = "name_delete without previous new or update tx";
                 goto reterr;
             }
 
-            if (prev_nti.name != name) {
-                errtxt = "name_delete name mismatch";
-                goto reterr;
-            }
-
             if (!NameActive(name, nHeight)) {
                 errtxt = "name_delete on expired name";
                 goto reterr;
@@ -1697,8 +2261,9 @@ static bool CheckName(const NameTxInfo& nti, const CTransactionRef& tx, int nHei
     nameResult.nameOp.value = nti.value;
     nameResult.nameOp.txPos = pos;
     nameResult.nameOp.nOut = nti.nOut;
+    nameResult.nameOp.nRentalDays = nti.nRentalDays;
     nameResult.address = (nti.op != OP_NAME_DELETE) ? nti.strAddress : "";                 // we are not interested in address of deleted name
-    nameResult.prev_address = (prev_nti.op != OP_NAME_DELETE) ? prev_nti.strAddress : "";  // same
+    nameResult.prev_address = prevState.address;  // empty for deleted name
 
     return true;
 
@@ -1763,60 +2328,92 @@ bool DisconnectNameTx(const CTransactionRef& tx, bool fMultiName)
 
     for (const auto& nti : vnti) {
         DisconnectNameOutput(tx, nti);
+        // drop cached value only after the rollback is visible in nameindex
+        if (pNameValueCache)
+            pNameValueCache->Erase(nti.name);
+        NotifyNameChanged(nti.name);
     }
     return true;
 }
 
+// Fills name state from the last operation of name
+static void MakeNameState(CNameState& state, const CNameHead& head, const CNameOperation& lastOp, const uint256& txid, uint32_t nTime, const string& address)
+{
+    state.value = lastOp.value;
+    state.address = address;
+    state.txid = txid;
+    state.nOut = lastOp.nOut;
+    state.nHeight = lastOp.nHeight;
+    state.nRegisteredAt = head.active.nHeight;
+    state.nExpiresAt = head.nExpiresAt;
+    state.op = lastOp.op;
+    state.nTime = nTime;
+}
+
 bool DisconnectNameOutput(const CTransactionRef& tx, const NameTxInfo& nti)
 {
-    CNameRecord nameRec;
-    if (!pNameDB->ReadName(nti.name, nameRec)) {
+    CNameHead head;
+    if (!pNameDB->ReadNameHead(nti.name, head)) {
         LogPrintf("%s: failed to read from name DB, skipping...", __func__);
         return false;
     }
 
-    // vNameOp might be empty if we pruned expired transactions.  However, it should normally still not
+    // history might be empty if we pruned expired transactions.  However, it should normally still not
     // be empty, since a reorg cannot go that far back.  Be safe anyway and do not try to pop if empty.
-    if (nameRec.vNameOp.empty())
-        return pNameDB->Erase(nti.name); // delete empty record
-
-    CDiskTxPos postx;
-    if (!g_txindex || !g_txindex->FindTxPosition(tx->GetHash(), postx))
-        return error("%s: tx index not found", __func__);  // tx index not found
-
-    // check if tx pos matches any known pos in name history (it should only match last tx)
-    if (postx != nameRec.vNameOp.back().txPos) {
-        bool found = false;
-        if (nameRec.vNameOp.size() > 1) {
-            for (int i = nameRec.vNameOp.size() - 2; i >= 0; i--) {
-                if (found == true)
-                    break;
-                if (postx == nameRec.vNameOp[i].txPos)
-                    found = true;
-            }
-        }
-        assert(!found);
+    if (head.nOps == 0)
+        return pNameDB->EraseName(nti.name); // delete empty record
+
+    CNameOperation lastOp;
+    CNameState lastState;
+    if (!pNameDB->ReadNameOp(nti.name, head.last, lastOp) || !pNameDB->ReadNameState(nti.name, lastState))
+        return error("%s: failed to read last name operation", __func__);
+
+    // only last tx in name history can be disconnected
+    if (lastState.txid != tx->GetHash() || lastState.nOut != nti.nOut) {
         LogPrintf("%s: did not find any name tx to disconnect, skipping...", __func__);
         return false;
     }
 
-    // remove tx
-    nameRec.vNameOp.pop_back();
+    CNameState state;
+    if (head.nOps == 1) {
+        if (!pNameDB->EraseName(nti.name)) // delete empty record
+            return error("%s: failed to erase from name DB", __func__);
+    } else {
+        // remove tx
+        CNameOpPos pos = head.last;
+        CNameOperation prevOp;
+        if (!pNameDB->ReadPrevNameOp(nti.name, pos, head.last, prevOp))
+            return error("%s: failed to read previous name operation", __func__);
+        head.nOps--;
+
+        if (lastOp.op == OP_NAME_NEW || head.nActiveOps <= 1) {
+            // we have deleted name_new - walk back to the start of previous active chain
+            CNameOpPos p = head.last;
+            CNameOperation o = prevOp;
+            head.active = p;
+            head.nActiveOps = 1;
+            head.nActiveRentalDays = o.nRentalDays;
+            while (o.op != OP_NAME_NEW && pNameDB->ReadPrevNameOp(nti.name, p, p, o)) {
+                head.active = p;
+                head.nActiveOps++;
+                head.nActiveRentalDays += o.nRentalDays;
+            }
+        } else {
+            head.nActiveOps--;
+            head.nActiveRentalDays -= lastOp.nRentalDays;
+        }
+        CalculateExpiresAt(head, prevOp.op);
 
-    if (nameRec.vNameOp.size() == 0 && !pNameDB->Erase(nti.name)) // delete empty record
-        return error("%s: failed to erase from name DB", __func__);
-    else {
-        // if we have deleted name_new - recalculate Last Active Chain Index
-        if (nti.op == OP_NAME_NEW)
-            for (int i = nameRec.vNameOp.size() - 1; i >= 0; i--)
-                if (nameRec.vNameOp[i].op == OP_NAME_NEW) {
-                    nameRec.nLastActiveChainIndex = i;
-                    break;
-                }
+        // restore state from previous name operation; read from block file, so -nameindexasync does not need txindex
+        CTransactionRef prevTx;
+        if (!TxIndex::FindTx(prevOp.txPos, prevTx))
+            return error("%s: could not read tx from disk", __func__);
+        NameTxInfo prev_nti;
+        if (!DecodeNameOutput(prevTx, prevOp.nOut, prev_nti, true))
+            return error("%s: failed to decode name tx", __func__);
+        MakeNameState(state, head, prevOp, prevTx->GetHash(), prevTx->nTime, prevOp.op != OP_NAME_DELETE ? prev_nti.strAddress : "");
 
-        if (!CalculateExpiresAt(nameRec))
-            return error("%s: failed to calculate expiration time before writing to name DB", __func__);
-        if (!pNameDB->Write(nti.name, nameRec))
+        if (!pNameDB->PopNameOp(nti.name, pos, head, state))
             return error("%s: failed to write to name DB", __func__);
     }
 
@@ -1824,17 +2421,7 @@ bool DisconnectNameOutput(const CTransactionRef& tx, const NameTxInfo& nti)
     // delete name from old address and add it to new address
     if (fNameAddressIndex) {
         string oldAddress = (nti.op != OP_NAME_DELETE) ? nti.strAddress : "";
-        string newAddress = "";
-        if (!nameRec.vNameOp.empty() && !nameRec.deleted()) {
-            CTransactionRef prevTx;
-            if (!g_txindex || !g_txindex->FindTx(nameRec.vNameOp.back().txPos, prevTx))
-                return error("%s: could not read tx from disk", __func__);
-            NameTxInfo prev_nti;
-            if (!DecodeNameOutput(prevTx, nameRec.vNameOp.back().nOut, prev_nti, true))
-                return error("%s: failed to decode name tx", __func__);
-            newAddress = prev_nti.strAddress;
-        }
-        if (!pNameAddressDB->MoveName(oldAddress, newAddress, nti.name))
+        if (!pNameAddressDB->UpdateName(oldAddress, nti.name, state.address))
             return error("%s: failed to move name in nameaddress.dat", __func__);
     }
 
@@ -1869,11 +2456,9 @@ bool CNamecoinHooks::ExtractAddress(const CScript& script, string& address)
 
 // Executes name operations in vName and writes result to nameindexV3.
 // NOTE: the block should already be written to blockchain by now - otherwise this may fail.
-bool CNamecoinHooks::ConnectBlock(CBlockIndex* pindex, const vector<nameCheckResult> &vName)
+// Adds name operations of a block to the batch
+static bool ApplyNameOps(const CBlockIndex* pindex, const vector<nameCheckResult> &vName, CNameIndexBatch& batch)
 {
-    if (vName.empty())
-        return true;
-
     // All of these name ops should succed. If there is an error - nameindexV3 is probably corrupt.
     set<CNameVal> sNameNew;
 
@@ -1889,40 +2474,48 @@ bool CNamecoinHooks::ConnectBlock(CBlockIndex* pindex, const vector<nameCheckRes
             }
         }
 
-        CNameRecord nameRec;
-        if (pNameDB->Exists(i.name) && !pNameDB->ReadName(i.name, nameRec))
+        CNameHead head;
+        CNameState prevState;
+        if (batch.ReadNameState(i.name, prevState) && !batch.ReadNameHead(i.name, head))
             return error("%s: failed to read from name DB", __func__);
 
         // only first name_new for same name in same block will get written
         if (i.op == OP_NAME_NEW && sNameNew.count(i.name))
             continue;
 
-        nameRec.vNameOp.push_back(i.nameOp); // add
+        // save name op
+        CNameOperation nameOp = i.nameOp;
+        nameOp.op = i.op;
+
+        // add - only a single key is written, previous history is not touched
+        CNameOpPos pos(nameOp.nHeight, head.nNextSeq++);
+        if (head.nOps == 0)
+            head.first = head.active = pos;
+        head.last = pos;
+        head.nOps++;
 
         // if starting new chain - save position of where it starts
-        if (i.op == OP_NAME_NEW)
-            nameRec.nLastActiveChainIndex = nameRec.vNameOp.size()-1;
+        if (i.op == OP_NAME_NEW) {
+            head.active = pos;
+            head.nActiveOps = 0;
+            head.nActiveRentalDays = 0;
+        }
+        head.nActiveOps++;
+        head.nActiveRentalDays += nameOp.nRentalDays;
 
         // limit to 1000 tx per name or a full single chain - whichever is larger
-        static size_t maxSize = 0;
+        static unsigned int maxSize = 0;
         if (maxSize == 0)
             maxSize = gArgs.GetArg("-nameindexchainsize", NAMEINDEX_CHAIN_SIZE);
 
-        if (nameRec.vNameOp.size() > maxSize &&
-            nameRec.vNameOp.size() - nameRec.nLastActiveChainIndex + 1 <= maxSize)
-        {
-            int d = nameRec.vNameOp.size() - maxSize; // number of elements to delete
-            nameRec.vNameOp.erase(nameRec.vNameOp.begin(), nameRec.vNameOp.begin() + d);
-            nameRec.nLastActiveChainIndex -= d; // move last index backwards by d elements
-            assert(nameRec.nLastActiveChainIndex >= 0);
-        }
-
-        // save name op
-        nameRec.vNameOp.back().op = i.op;
+        unsigned int nTrim = 0; // number of elements to delete
+        if (head.nOps > maxSize && head.nActiveOps + 1 <= maxSize)
+            nTrim = head.nOps - maxSize;
 
-        if (!CalculateExpiresAt(nameRec))
-            return error("%s: failed to calculate expiration time before writing to name DB for %s", __func__, i.hash.GetHex());
-        if (!pNameDB->Write(i.name, nameRec))
+        CalculateExpiresAt(head, i.op);
+        CNameState state;
+        MakeNameState(state, head, nameOp, i.hash, i.nTime, i.address);
+        if (!batch.AppendNameOp(i.name, head, nameOp, state, nTrim))
             return error("%s: failed to write to name DB", __func__);
         if (i.op == OP_NAME_NEW)
             sNameNew.insert(i.name);
@@ -1930,11 +2523,39 @@ bool CNamecoinHooks::ConnectBlock(CBlockIndex* pindex, const vector<nameCheckRes
 
 
         // update (address->name) index
-        // delete name from old address and add it to new address
-        // note: addresses are set inside hooks->CheckInputs()
-        if (fNameAddressIndex)
-            if (!pNameAddressDB->MoveName(i.prev_address, i.address, i.name))
-                return error("%s: failed to move name in nameaddress.dat", __func__);
+        // move name from old address to new address
+        // note: addresses are set inside hooks->CheckInputs(), previous address is taken from
+        //       the overlay if name was already changed in this block
+        batch.UpdateAddress(prevState.address, i.name, state.address);
+    }
+
+    return true;
+}
+
+bool CNamecoinHooks::ConnectBlock(CBlockIndex* pindex, const vector<nameCheckResult> &vName)
+{
+    if (vName.empty())
+        return true;
+
+    return ConnectNameBlock(pindex, vName);
+}
+
+bool ConnectNameBlock(const CBlockIndex* pindex, const vector<nameCheckResult> &vName, const CBlockLocator* pLocator)
+{
+    CNameIndexBatch batch(*pNameDB, fNameAddressIndex ? pNameAddressDB.get() : nullptr);
+    if (!ApplyNameOps(pindex, vName, batch))
+        return false;
+    if (pLocator)
+        batch.WriteBestBlock(*pLocator);
+
+    if (!batch.Commit())
+        return error("%s: failed to write name indexes for block %d", __func__, pindex->nHeight);
+
+    // drop cached values only after new ones are visible in nameindex
+    for (const auto& i : vName) {
+        if (pNameValueCache)
+            pNameValueCache->Erase(i.name);
+        NotifyNameChanged(i.name);
     }
 
     return true;
@@ -1943,37 +2564,37 @@ bool CNamecoinHooks::ConnectBlock(CBlockIndex* pindex, const vector<nameCheckRes
 bool CNamecoinHooks::getNameValue(const string& sName, string& sValue)
 {
     CNameVal name = nameValFromString(sName);
-    if (!pNameDB->Exists(name))
-        return false;
+    uint64_t nGen = 0;
+    if (pNameValueCache) {
+        if (pNameValueCache->Get(name, ::ChainActive().Height(), sValue))
+            return true;
+        nGen = pNameValueCache->Generation();
+    }
 
-    CTransactionRef tx;
-    CNameRecord nameRec;
-    if (!GetLastTxOfName(name, tx, nameRec))
-        return false;
-    NameTxInfo nti;
-    if (!DecodeNameOutput(tx, nameRec.vNameOp.back().nOut, nti, true))
+    // single nameindex read, no transaction from block files is needed
+    CNameState state;
+    if (!pNameDB->ReadNameState(name, state))
         return false;
 
-    if (!NameActive(name))
+    if (state.deleted() || ::ChainActive().Height() > state.nExpiresAt)
         return false;
 
-    sValue = stringFromNameVal(nti.value);
+    sValue = stringFromNameVal(state.value);
+    if (pNameValueCache)
+        pNameValueCache->Put(name, sValue, state.nExpiresAt, nGen);
 
     return true;
 }
 
 bool GetNameValue(const CNameVal& name, CNameVal& value)
 {
-    CNameRecord nameRec;
-
-    if (!NameActive(name))
+    CNameState state;
+    if (!pNameDB->ReadNameState(name, state))
         return false;
-    if (!pNameDB->ReadName(name, nameRec))
-        return false;
-    if (nameRec.vNameOp.empty())
+    if (state.deleted() || ::ChainActive().Height() > state.nExpiresAt)
         return false;
 
-    value = nameRec.vNameOp.back().value;
+    value = state.value;
     return true;
 }
 
@@ -1984,22 +2605,26 @@ bool CNameDB::DumpToTextFile()
         return false;
 
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(CNameVal());
+    pcursor->Seek(make_pair(DB_NAME_HEAD, CNameVal()));
     while (pcursor->Valid()) {
-        CNameVal key;
-        if (!pcursor->GetKey(key))
-            return error("%s: failed to read key", __func__);
+        pair<char, CNameVal> key;
+        if (!pcursor->GetKey(key) || key.first != DB_NAME_HEAD)
+            break;
 
-        CNameRecord value;
-        if (!pcursor->GetValue(value))
+        CNameHead head;
+        if (!pcursor->GetValue(head))
             return error("%s: failed to read value", __func__);
 
         pcursor->Next();
 
-        if (!value.vNameOp.empty())
+        if (head.nOps != 0)
             continue;
 
-        myfile << "name =  " << stringFromNameVal(key) << "\n";
+        CNameRecord value;
+        if (!ReadName(key.second, value))
+            return error("%s: failed to read name history", __func__);
+
+        myfile << "name =  " << stringFromNameVal(key.second) << "\n";
         myfile << "nExpiresAt " << value.nExpiresAt << "\n";
         myfile << "nLastActiveChainIndex " << value.nLastActiveChainIndex << "\n";
         myfile << "vNameOp:\n";
@@ -2044,17 +2669,22 @@ struct NameIndexStats
 bool CNameDB::GetNameIndexStats(NameIndexStats &stats)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek(CNameVal());
+    pcursor->Seek(make_pair(DB_NAME_HEAD, CNameVal()));
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     while (pcursor->Valid()) {
-        CNameVal key;
-        if (!pcursor->GetKey(key))
-            return error("%s: failed to read key", __func__);
+        pair<char, CNameVal> k;
+        if (!pcursor->GetKey(k) || k.first != DB_NAME_HEAD)
+            break;
+        const CNameVal& key = k.second;
 
-        CNameRecord value;
-        if (!pcursor->GetValue(value))
+        CNameHead head;
+        if (!pcursor->GetValue(head))
             return error("%s: failed to read value", __func__);
 
+        CNameRecord value;
+        if (!ReadName(key, value))
+            return error("%s: failed to read name history", __func__);
+
         ss << key;
         ss << value.nExpiresAt;
         ss << value.nLastActiveChainIndex;
@@ -2065,7 +2695,9 @@ bool CNameDB::GetNameIndexStats(NameIndexStats &stats)
         }
         stats.nRecordsName += 1;
         stats.nSerializedSizeName += ::GetSerializeSize(key, SER_NETWORK, PROTOCOL_VERSION);
-        stats.nSerializedSizeName += ::GetSerializeSize(value, SER_NETWORK, PROTOCOL_VERSION);
+        stats.nSerializedSizeName += ::GetSerializeSize(head, SER_NETWORK, PROTOCOL_VERSION);
+        for (const auto& nameOp : value.vNameOp)
+            stats.nSerializedSizeName += ::GetSerializeSize(nameOp, SER_NETWORK, PROTOCOL_VERSION) + ::GetSerializeSize(head.last, SER_NETWORK, PROTOCOL_VERSION);
 
         pcursor->Next();
     }
@@ -2078,20 +2710,23 @@ bool CNameDB::GetNameIndexStats(NameIndexStats &stats)
 bool CNameAddressDB::GetNameAddressIndexStats(NameIndexStats &stats)
 {
     std::unique_ptr<CDBIterator> pcursor(NewIterator());
-    pcursor->Seek("");
+    pcursor->Seek(DB_ADDRESS_NAME);
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    std::string lastAddress;
     while (pcursor->Valid()) {
-        std::string key;
-        if (!pcursor->GetKey(key))
-            return error("%s: failed to read key", __func__);
+        pair<char, pair<string, CNameVal> > key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESS_NAME)
+            break;
 
-        std::set<CNameVal> value;
+        char value;
         if (!pcursor->GetValue(value))
             return error("%s: failed to read value", __func__);
 
-        ss << key;
-        ss << value;
-        stats.nRecordsAddress += 1;
+        ss << key.second;
+        if (key.second.first != lastAddress) { // count addresses
+            stats.nRecordsAddress += 1;
+            lastAddress = key.second.first;
+        }
         stats.nSerializedSizeAddress += ::GetSerializeSize(key, SER_NETWORK, PROTOCOL_VERSION);
         stats.nSerializedSizeAddress += ::GetSerializeSize(value, SER_NETWORK, PROTOCOL_VERSION);
 
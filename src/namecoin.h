@@ -8,12 +8,19 @@
 #include <fs.h>
 #include <index/txindex.h>
 #include <script/standard.h>
+#include <sync.h>
+
+#include <list>
+
+#include <boost/signals2/signal.hpp>
 
 class CWallet;
 class UniValue;
 struct NameIndexStats;
 
 static const unsigned int NAMEINDEX_CHAIN_SIZE = 1000;
+static const unsigned int NAMEVALUE_CACHE_SIZE = 16; // MiB
+static const int NAMEINDEX_VERSION = 6; // bump on nameindex or nameaddress layout change - both indexes will be rebuilt
 static const int RELEASE_HEIGHT = 1<<16;
 
 // a single operation with name
@@ -24,12 +31,13 @@ public:
     uint32_t nOut;
     int32_t nHeight;
     int32_t op;
+    int32_t nRentalDays;
     CNameVal value;
 
-    CNameOperation() : nOut(0), nHeight(0), op(0) {}
+    CNameOperation() : nOut(0), nHeight(0), op(0), nRentalDays(0) {}
 
     CNameOperation(CDiskTxPos txPos, int32_t nHeight, CNameVal value) :
-        txPos(txPos), nHeight(nHeight), value(value) {}
+        txPos(txPos), nHeight(nHeight), op(0), nRentalDays(0), value(value) {}
 
     ADD_SERIALIZE_METHODS;
 
@@ -39,11 +47,89 @@ public:
         READWRITE(nOut);
         READWRITE(nHeight);
         READWRITE(op);
+        READWRITE(nRentalDays);
         READWRITE(value);
     }
 };
 
-// all operations and other data with name
+// position of name operation in name history. Serialized big-endian, so
+// operations of a name are sorted by height and sequence number in nameindex
+class CNameOpPos
+{
+public:
+    int32_t nHeight;
+    uint32_t nSeq;          // per-name counter, never reused
+
+    CNameOpPos() : nHeight(0), nSeq(0) {}
+    CNameOpPos(int32_t nHeight, uint32_t nSeq) : nHeight(nHeight), nSeq(nSeq) {}
+
+    friend bool operator==(const CNameOpPos& a, const CNameOpPos& b) { return a.nHeight == b.nHeight && a.nSeq == b.nSeq; }
+    friend bool operator!=(const CNameOpPos& a, const CNameOpPos& b) { return !(a == b); }
+
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        ser_writedata32be(s, nHeight);
+        ser_writedata32be(s, nSeq);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        nHeight = ser_readdata32be(s);
+        nSeq = ser_readdata32be(s);
+    }
+};
+
+// height in secondary nameindex keys. Serialized big-endian, so keys are sorted by height
+class CNameHeightKey
+{
+public:
+    int32_t nHeight;
+
+    CNameHeightKey() : nHeight(0) {}
+    explicit CNameHeightKey(int32_t nHeight) : nHeight(nHeight) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const {
+        ser_writedata32be(s, nHeight);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        nHeight = ser_readdata32be(s);
+    }
+};
+
+// small per-name record, which points into name history
+class CNameHead
+{
+public:
+    CNameOpPos first;           // oldest operation still kept in history
+    CNameOpPos last;            // last operation
+    CNameOpPos active;          // first tx in last active chain of name_new -> name_update -> name_update -> ....
+    uint32_t nNextSeq;
+    uint32_t nOps;              // operations kept in history
+    uint32_t nActiveOps;        // operations in last active chain
+    int32_t nActiveRentalDays;  // sum of rental days in last active chain
+    int32_t nExpiresAt;
+
+    CNameHead() : nNextSeq(0), nOps(0), nActiveOps(0), nActiveRentalDays(0), nExpiresAt(0) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(first);
+        READWRITE(last);
+        READWRITE(active);
+        READWRITE(nNextSeq);
+        READWRITE(nOps);
+        READWRITE(nActiveOps);
+        READWRITE(nActiveRentalDays);
+        READWRITE(nExpiresAt);
+    }
+};
+
+// all operations and other data with name, assembled from nameindex by CNameDB::ReadName
 class CNameRecord
 {
 public:
@@ -58,53 +144,167 @@ public:
             return vNameOp.back().op == OP_NAME_DELETE;
         else return true;
     }
+};
+
+// current state of a name - all what is needed to answer value/owner queries
+// without reading name transaction from the block files
+// fixed-size part of name state, serialized first - scans can decode it without value
+class CNameStateHead
+{
+public:
+    uint256 txid;           // last name operation
+    uint32_t nOut;
+    int32_t nHeight;        // height of last operation
+    int32_t nRegisteredAt;  // height of name_new, which started last active chain
+    int32_t nExpiresAt;
+    int32_t op;
+    uint32_t nTime;         // time of last name transaction
+
+    CNameStateHead() : nOut(0), nHeight(0), nRegisteredAt(0), nExpiresAt(0), op(0), nTime(0) {}
+    bool deleted() const { return op == OP_NAME_DELETE; }
 
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action) {
-        READWRITE(vNameOp);
+        READWRITE(txid);
+        READWRITE(nOut);
+        READWRITE(nHeight);
+        READWRITE(nRegisteredAt);
         READWRITE(nExpiresAt);
-        READWRITE(nLastActiveChainIndex);
+        READWRITE(op);
+        READWRITE(nTime);
     }
 };
 
-// key = CNameVal, value = CNameRecord
-class CNameDB : public CDBWrapper
+class CNameState : public CNameStateHead
 {
 public:
-    CNameDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false) : CDBWrapper(GetDataDir() / "indexes" / "nameindexV3", nCacheSize, fMemory, fWipe) {
-    }
-
-    bool ReadName(const CNameVal& name, CNameRecord& rec) {
-        bool ret = Read(name, rec);
-        if(ret) {
-            int s = rec.vNameOp.size();
-            // check if array index is out of array bounds
-            if (s > 0 && rec.nLastActiveChainIndex >= s) {
-                LogPrintf("Nameindex is corrupt!");
-                ret = false;
-            }
-        }
-        return ret;
-    }
-
-    bool ScanNames(const CNameVal& name, unsigned int nMax,
-            std::vector<
-                std::pair<
-                    CNameVal,
-                    std::pair<CNameOperation, int>
-                >
-            > &nameScan);
+    std::string address;    // owner address; empty for deleted name
+    CNameVal value;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITEAS(CNameStateHead, *this);
+        READWRITE(address);
+        READWRITE(value);
+    }
+};
+
+// nameindex layout:
+//   DB_NAME_HEAD  + name       -> CNameHead, position of first/last/active operations
+//   DB_NAME_OP    + name + pos -> CNameOperation, one key per operation in name history
+//   DB_NAME_STATE + name       -> CNameState, current state for fast lookups
+//   DB_NAME_BY_NS     + namespace + name -> empty, secondary indexes over names which are not deleted
+//   DB_NAME_BY_EXPIRY + nExpiresAt + name
+//   DB_NAME_BY_UPDATE + nHeight of last operation + name
+//   DB_NAME_VERSION            -> NAMEINDEX_VERSION
+//   DB_NAME_REINDEX            -> hash of last block applied by unfinished reindexNameIndex(), null if none yet
+static const char DB_NAME_HEAD    = 'h';
+static const char DB_NAME_OP      = 'o';
+static const char DB_NAME_STATE   = 's';
+static const char DB_NAME_BY_NS     = 'n';
+static const char DB_NAME_BY_EXPIRY = 'e';
+static const char DB_NAME_BY_UPDATE = 'u';
+static const char DB_NAME_VERSION = 'V';
+static const char DB_NAME_REINDEX = 'R';
+
+// BaseIndex::DB keeps block locator of NameIndex, when running with -nameindexasync
+class CNameDB : public BaseIndex::DB
+{
+public:
+    CNameDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false) : BaseIndex::DB(GetDataDir() / "indexes" / "nameindexV3", nCacheSize, fMemory, fWipe) {
+    }
+
+    // reads full name history - use only when all operations are needed
+    bool ReadName(const CNameVal& name, CNameRecord& rec);
+
+    bool ExistsName(const CNameVal& name) {
+        return Exists(std::make_pair(DB_NAME_HEAD, name));
+    }
+
+    bool ReadNameHead(const CNameVal& name, CNameHead& head) {
+        return Read(std::make_pair(DB_NAME_HEAD, name), head);
+    }
+
+    bool ReadNameOp(const CNameVal& name, const CNameOpPos& pos, CNameOperation& nameOp) {
+        return Read(std::make_pair(DB_NAME_OP, std::make_pair(name, pos)), nameOp);
+    }
+
+    // reads operation which precedes pos in name history
+    bool ReadPrevNameOp(const CNameVal& name, const CNameOpPos& pos, CNameOpPos& prevPos, CNameOperation& prevOp);
+
+    bool ReadNameState(const CNameVal& name, CNameState& state) {
+        return Read(std::make_pair(DB_NAME_STATE, name), state);
+    }
+
+    // all writes below are atomic, name operations of connected blocks are written by CNameIndexBatch
+    // removes last operation at pos, head and state must already point to previous operation
+    bool PopNameOp(const CNameVal& name, const CNameOpPos& pos, const CNameHead& head, const CNameState& state);
+    bool EraseName(const CNameVal& name);
+    // replaces secondary index keys of name in old state with the ones of new state, either may be null
+    static void UpdateSecondaryKeys(CDBBatch& batch, const CNameVal& name, const CNameStateHead* pOld, const CNameStateHead* pNew);
+
+    bool ReadVersion(int& nVersion) { return Read(DB_NAME_VERSION, nVersion); }
+    bool WriteVersion() { return Write(DB_NAME_VERSION, NAMEINDEX_VERSION); }
+
+    bool ReadReindexBlock(uint256& hash) { return Read(DB_NAME_REINDEX, hash); }
+    bool WriteReindexBlock(const uint256& hash) { return Write(DB_NAME_REINDEX, hash); }
+    bool EraseReindexBlock() { return Erase(DB_NAME_REINDEX, true); }
+
+    // the part of name up to and including first ':' or '/', empty if there is none
+    static CNameVal GetNamespace(const CNameVal& name);
+
+    bool ScanNames(const CNameVal& name, unsigned int nMax, std::vector<std::pair<CNameVal, CNameState> > &nameScan);
     bool DumpToTextFile();
     bool GetNameIndexStats(NameIndexStats &stats);
 };
 
+// Streaming iterator over current name states. By default names are listed in name order, starting at a given name.
+// Secondary orders list only names which are not deleted:
+//   BY_NAMESPACE - names of namespace ns in name order
+//   BY_EXPIRY    - by expiration height, starting at (nHeight, start)
+//   BY_UPDATE    - by height of last operation, starting at (nHeight, start)
+// In name order only CNameStateHead is decoded while iterating; address and value are decoded by GetState()
+// on demand. Secondary orders read each state by point lookup. No locks are needed while scanning.
+class CNameCursor
+{
+public:
+    enum Order { BY_NAME, BY_NAMESPACE, BY_EXPIRY, BY_UPDATE };
+
+    CNameCursor(CNameDB& db, const CNameVal& start, Order order = BY_NAME, const CNameVal& ns = CNameVal(), int nHeight = 0);
+
+    bool Valid() const { return fValid; }
+    void Next();
+
+    const CNameVal& GetName() const { return name; }
+    int GetHeight() const { return nHeight; } // key height in BY_EXPIRY and BY_UPDATE orders
+    const CNameStateHead& GetHead() const { return order == BY_NAME ? head : state; }
+    bool GetState(CNameState& state) const;
+
+private:
+    void ReadCurrent();
+
+    CNameDB& db;
+    Order order;
+    CNameVal ns;
+    std::unique_ptr<CDBIterator> pcursor;
+    bool fValid;
+    CNameVal name;
+    int nHeight;
+    CNameStateHead head;
+    CNameState state;
+};
 
 
-// key = string, value = std::set<CNameVal>
+
+// nameaddress layout:
+//   DB_ADDRESS_NAME + address + name -> empty, names of an address are listed in name order, their state is read from nameindex
 // names listed here maybe expired
 // names that have OP_NAME_DELETE as their last operation are not listed here
+static const char DB_ADDRESS_NAME = 'a';
 
 class CNameAddressDB : public CDBWrapper
 {
@@ -112,39 +312,93 @@ public:
     CNameAddressDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false) : CDBWrapper(GetDataDir() / "indexes" / "nameaddressV3", nCacheSize, fMemory, fWipe) {
     }
 
-    // this will fail if you try to add a name that already exist
-    bool WriteSingleName(const std::string& address, const CNameVal& name) {
-        std::set<CNameVal> names;
-        Read(address, names); // note: address will not exist if this is the first time we are writting it
-        return names.insert(name).second && Write(address, names);
+    // moves name from old address to new one (empty for deleted name), nothing is written if address is not changed
+    static void UpdateName(CDBBatch& batch, const std::string& oldAddress, const CNameVal& name, const std::string& newAddress);
+    bool UpdateName(const std::string& oldAddress, const CNameVal& name, const std::string& newAddress) {
+        CDBBatch batch(*this);
+        UpdateName(batch, oldAddress, name, newAddress);
+        return WriteBatch(batch);
     }
 
-    // this will fail if you try to erase a name that does not exist
-    bool EraseSingleName(const std::string& address, const CNameVal& name) {
-        std::set<CNameVal> names;
-        if (Read(address, names)) // note: address should always exist, because we are trying to erase name from existing record
-            return names.erase(name) && Write(address, names);
-        return false;
-    }
+    // lists names of address, in name order
+    bool ScanAddress(const std::string& address, std::vector<CNameVal>& names);
+    bool GetNameAddressIndexStats(NameIndexStats &stats);
+};
+
+// Collects all nameindex and nameaddress mutations of a single block, so each database
+// gets one atomic write in Commit(). Heads and states changed earlier in
+// the same block are read from the overlay, so several operations on a name see each other.
+class CNameIndexBatch
+{
+public:
+    CNameIndexBatch(CNameDB& nameDB, CNameAddressDB* pAddressDB);
 
-    // removes name from old address and adds it to new address
-    bool MoveName(const std::string& oldAddress, const std::string& newAddress, const CNameVal& name) {
-        if (newAddress == oldAddress) // nothing to do
-            return true;
+    bool ReadNameHead(const CNameVal& name, CNameHead& head);
+    bool ReadNameState(const CNameVal& name, CNameState& state);
 
-        bool ret = true;
-        if (oldAddress != "")
-            ret = ret && EraseSingleName(oldAddress, name);
-        if (newAddress != "")
-            ret = ret && WriteSingleName(newAddress, name);
-        return ret;
+    // adds nameOp at head.last and removes nTrim oldest operations from history (head.first is moved)
+    bool AppendNameOp(const CNameVal& name, CNameHead& head, const CNameOperation& nameOp, const CNameState& state, unsigned int nTrim);
+    // moves name from old address to new one
+    void UpdateAddress(const std::string& oldAddress, const CNameVal& name, const std::string& newAddress) {
+        if (batchAddress)
+            CNameAddressDB::UpdateName(*batchAddress, oldAddress, name, newAddress);
     }
-    bool GetNameAddressIndexStats(NameIndexStats &stats);
+    // resume point of reindexNameIndex(), written atomically with the block
+    void WriteReindexBlock(const uint256& hash) { batch.Write(DB_NAME_REINDEX, hash); }
+    // block locator of NameIndex, written atomically with the block
+    void WriteBestBlock(const CBlockLocator& locator) { nameDB.WriteBestBlock(batch, locator); }
+
+    bool Commit();
+
+private:
+    CNameDB& nameDB;
+    CNameAddressDB* pAddressDB;
+    CDBBatch batch;
+    std::unique_ptr<CDBBatch> batchAddress;
+    std::map<CNameVal, CNameHead> mapHead;
+    std::map<CNameVal, CNameState> mapState;
+    std::map<CNameVal, std::vector<CNameOpPos> > mapAppended; // operations written in this block, not yet in nameDB
+};
+
+// Bounded LRU cache of active name values for getNameValue(), so hot DNS/ENUM names
+// are served without nameindex and block file reads. Entry is dropped when its name
+// is touched by ConnectBlock or DisconnectNameOutput; expiration is checked on read.
+class CNameValueCache
+{
+public:
+    explicit CNameValueCache(size_t nMaxBytes) : nGeneration(0), nBytes(0), nMaxBytes(nMaxBytes) {}
+
+    // Returns current generation; pass it to Put() to skip values read before invalidation
+    uint64_t Generation();
+    bool Get(const CNameVal& name, int nHeight, std::string& value);
+    void Put(const CNameVal& name, const std::string& value, int nExpiresAt, uint64_t nGen);
+    void Erase(const CNameVal& name);
+    void Clear();
+
+private:
+    struct Entry
+    {
+        std::string value;
+        int nExpiresAt;
+        std::list<CNameVal>::iterator itLRU;
+    };
+
+    void EraseEntry(std::map<CNameVal, Entry>::iterator it) EXCLUSIVE_LOCKS_REQUIRED(cs);
+
+    Mutex cs;
+    std::map<CNameVal, Entry> mapEntries GUARDED_BY(cs);
+    std::list<CNameVal> listLRU GUARDED_BY(cs); // front = most recently used
+    uint64_t nGeneration GUARDED_BY(cs);
+    size_t nBytes GUARDED_BY(cs);
+    const size_t nMaxBytes;
 };
 
 extern std::map<CNameVal, std::set<COutPoint> > mapNamePending;
 extern std::unique_ptr<CNameDB> pNameDB;
 extern std::unique_ptr<CNameAddressDB> pNameAddressDB;
+extern std::unique_ptr<CNameValueCache> pNameValueCache;
+// fired for each name changed by connected or disconnected block, after nameindex is updated
+extern boost::signals2::signal<void (const CNameVal& name)> NotifyNameChanged;
 
 bool GetNameCurrentAddress(const CNameVal& name, CTxDestination& dest, std::string& error);
 CNameVal nameValFromString(const std::string& str);
@@ -181,6 +435,8 @@ struct nameCheckResult
 };
 
 bool CheckNameTx(const CTransactionRef& tx, const CBlockIndex* pindexBlock, vector<nameCheckResult> &vName, const CDiskTxPos& pos, const CAmount& txFee);
+// writes name operations of a block to name indexes in one batch, optionally with NameIndex locator
+bool ConnectNameBlock(const CBlockIndex* pindex, const vector<nameCheckResult> &vName, const CBlockLocator* pLocator = nullptr);
 bool DisconnectNameTx(const CTransactionRef& tx, bool fMultiName);
 bool DisconnectNameOutput(const CTransactionRef& tx, const NameTxInfo& nti);
 
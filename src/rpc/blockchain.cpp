@@ -2201,6 +2201,7 @@ static UniValue getblockfilter(const JSONRPCRequest& request)
     return ret;
 }
 
+extern UniValue name_expiring(const JSONRPCRequest& request);
 extern UniValue name_filter(const JSONRPCRequest& request);
 extern UniValue name_history(const JSONRPCRequest& request);
 extern UniValue name_indexinfo(const JSONRPCRequest& request);
@@ -2256,7 +2257,8 @@ static const CRPCCommand commands[] =
     { "hidden",             "syncwithvalidationinterfacequeue", &syncwithvalidationinterfacequeue, {} },
 
     // emercoin commands
-    { "blockchain",         "name_filter",            &name_filter,            {"regexp","maxage","from","nb","stat","valuetype"} },
+    { "blockchain",         "name_expiring",          &name_expiring,          {"blocks","max-returned","cursor"} },
+    { "blockchain",         "name_filter",            &name_filter,            {"regexp","maxage","from","nb","stat","valuetype","max-value-length","cursor"} },
     { "blockchain",         "name_history",           &name_history,           {"name","fullhistory","valuetype"} },
     { "blockchain",         "name_indexinfo",         &name_indexinfo,         {} },
     { "blockchain",         "name_mempool",           &name_mempool,           {"valuetype"} },
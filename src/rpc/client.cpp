@@ -185,6 +185,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendalert", 6, "cancelupto"},
     { "reservebalance", 0, "reserve" },
     { "reservebalance", 1, "amount" },
+    { "getstakinginfo", 0, "horizon" },
+    { "getstakinginfo", 1, "verbose" },
 
     // emercoin:
     { "name_new", 2, "days" },
@@ -193,6 +195,8 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "name_scan", 1, "max-returned" },
     { "name_scan", 2, "max-value-length" },
     { "name_scan_address", 1, "max-value-length" },
+    { "name_expiring", 0, "blocks" },
+    { "name_expiring", 1, "max-returned" },
     { "name_filter", 1, "maxage" },
     { "name_filter", 2, "from" },
     { "name_filter", 3, "nb" },
@@ -125,9 +125,17 @@ static UniValue generateBlocks(const CScript& coinbase_script, int nGenerate, ui
             LOCK(cs_main);
             IncrementExtraNonce(pblock, ::ChainActive().Tip(), nExtraNonce);
         }
-        while (nMaxTries > 0 && pblock->nNonce < std::numeric_limits<uint32_t>::max() && !CheckProofOfWork(pblock->GetHash(), pblock->nBits, Params().GetConsensus()) && !ShutdownRequested()) {
-            ++pblock->nNonce;
-            --nMaxTries;
+        arith_uint256 hashTarget = arith_uint256().SetCompact(pblock->nBits);
+        while (nMaxTries > 0 && pblock->nNonce < std::numeric_limits<uint32_t>::max() && !ShutdownRequested()) {
+            uint64_t nHashes = 0;
+            uint32_t nNonceEnd = std::min<uint64_t>((uint64_t)pblock->nNonce + std::min<uint64_t>(nMaxTries, 0x10000), std::numeric_limits<uint32_t>::max());
+            bool fFound = ScanHash(pblock, nNonceEnd, hashTarget, nHashes);
+            nMaxTries -= nHashes;
+            if (fFound) {
+                if (CheckProofOfWork(pblock->GetHash(), pblock->nBits, Params().GetConsensus()))
+                    break;
+                ++pblock->nNonce;
+            }
         }
         if (nMaxTries == 0 || ShutdownRequested()) {
             break;
@@ -258,6 +266,7 @@ static UniValue getmininginfo(const JSONRPCRequest& request)
                     "  \"currentblocktx\": nnn,     (numeric, optional) The number of block transactions of the last assembled block (only present if a block was ever assembled)\n"
                     "  \"difficulty\": xxx.xxxxx    (numeric) The current difficulty\n"
                     "  \"networkhashps\": nnn,      (numeric) The network hashes per second\n"
+                    "  \"hashespersec\": nnn,       (numeric) The hashes per second of the built-in miner, 0 if not mining\n"
                     "  \"pooledtx\": n              (numeric) The size of the mempool\n"
                     "  \"chain\": \"xxxx\",           (string) current network name as defined in BIP70 (main, test, regtest)\n"
                     "  \"warnings\": \"...\"          (string) any network and blockchain warnings\n"
@@ -277,6 +286,7 @@ static UniValue getmininginfo(const JSONRPCRequest& request)
     if (BlockAssembler::m_last_block_num_txs) obj.pushKV("currentblocktx", *BlockAssembler::m_last_block_num_txs);
     obj.pushKV("difficulty",       (double)GetDifficulty(::ChainActive().Tip()));
     obj.pushKV("networkhashps",    getnetworkhashps(request));
+    obj.pushKV("hashespersec",     GetHashesPerSec());
     obj.pushKV("pooledtx",         (uint64_t)mempool.size());
     obj.pushKV("chain",            Params().NetworkIDString());
     obj.pushKV("warnings",         GetWarnings("statusbar"));
@@ -24,6 +24,7 @@
 #include <warnings.h>
 
 #include <checkpoints.h>
+#include <emcdns.h>
 
 #include <univalue.h>
 
@@ -776,6 +777,148 @@ UniValue getcheckpoint(const JSONRPCRequest& request)
 }
 
 // clang-format off
+// emercoin: emcdns counters, for tuning -dapsize/-daptreshold and cache
+static UniValue getemcdnsinfo(const JSONRPCRequest& request)
+{
+    RPCHelpMan{"getemcdnsinfo",
+    "\nReturns emcdns query statistics since start. Same data is served in Prometheus format at /metrics, if -emcdnsmetrics.\n",
+    {},
+    RPCResult{
+        "{\n"
+        "  \"uptime\": n,                 (numeric) Seconds since emcdns start\n"
+        "  \"queries_udp\": n,            (numeric) Received UDP queries\n"
+        "  \"queries_tcp\": n,            (numeric) Received TCP queries\n"
+        "  \"qps\": x.x,                  (numeric) Average queries per second\n"
+        "  \"qtypes\": {\"A\": n, ...},     (object) Handled questions by QTYPE\n"
+        "  \"rcodes\": {\"NOERROR\": n, ...}, (object) Sent answers by RCODE\n"
+        "  \"truncated\": n,              (numeric) UDP answers truncated to client's payload size\n"
+        "  \"filtered\": n,               (numeric) Name lookups skipped, since names filter has no such name\n"
+        "  \"dap\": {\n"
+        "    \"size\": n,                 (numeric) DAP table cells, 0 = DAP is disabled\n"
+        "    \"treshold\": n,             (numeric) -daptreshold\n"
+        "    \"used\": n,                 (numeric) Cells, which are warm now\n"
+        "    \"hot\": n,                  (numeric) Cells over treshold now\n"
+        "    \"dropped_ip\": n,           (numeric) Queries dropped, since client IP is hot\n"
+        "    \"dropped_domain\": n,       (numeric) Queries dropped, since requested domain is hot\n"
+        "  },\n"
+        "  \"cache\": {\n"
+        "    \"hits\": n,                 (numeric) Answers served from cache\n"
+        "    \"misses\": n,               (numeric) Cacheable questions not found in cache\n"
+        "    \"hit_ratio\": x.x           (numeric) hits / (hits + misses)\n"
+        "  },\n"
+        "  \"latency_us\": {\n"
+        "    \"avg\": n,                  (numeric) Average time to make an answer, usecs\n"
+        "    \"p50\": n, \"p90\": n, \"p99\": n, \"p999\": n  (numeric) Percentiles, upper bound of power of 2 bucket\n"
+        "  }\n"
+        "}\n"
+    },
+    RPCExamples{
+        HelpExampleCli("getemcdnsinfo", "") + HelpExampleRpc("getemcdnsinfo", "")
+    },
+    }.Check(request);
+
+    if (!emcdns)
+        throw JSONRPCError(RPC_MISC_ERROR, "emcdns is not running, use -emcdns");
+
+    EmcDnsStats st;
+    uint64_t dap_used, dap_hot;
+    emcdns->GetStats(st, dap_used, dap_hot);
+    int64_t uptime = emcdns->Uptime();
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("uptime", uptime);
+    result.pushKV("queries_udp", (uint64_t)st.udp);
+    result.pushKV("queries_tcp", (uint64_t)st.tcp);
+    result.pushKV("qps", uptime > 0 ? (double)st.Queries() / uptime : 0.0);
+
+    UniValue qtypes(UniValue::VOBJ);
+    for (int i = 0; i < EmcDnsStats::QT_QTY; i++)
+        if (st.qtype[i])
+            qtypes.pushKV(EmcDnsStats::QTypeName(i), (uint64_t)st.qtype[i]);
+    result.pushKV("qtypes", qtypes);
+
+    static const char* rcode_names[] = {"NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"};
+    UniValue rcodes(UniValue::VOBJ);
+    for (int i = 0; i < 16; i++)
+        if (st.rcode[i])
+            rcodes.pushKV(i < (int)ARRAYLEN(rcode_names) ? rcode_names[i] : std::to_string(i), (uint64_t)st.rcode[i]);
+    result.pushKV("rcodes", rcodes);
+    result.pushKV("truncated", (uint64_t)st.truncated);
+    result.pushKV("filtered", (uint64_t)st.filtered);
+
+    UniValue dap(UniValue::VOBJ);
+    dap.pushKV("size", (uint64_t)emcdns->DapSize());
+    dap.pushKV("treshold", (uint64_t)emcdns->DapTreshold());
+    dap.pushKV("used", dap_used);
+    dap.pushKV("hot", dap_hot);
+    dap.pushKV("dropped_ip", (uint64_t)st.dap_ip);
+    dap.pushKV("dropped_domain", (uint64_t)st.dap_domain);
+    result.pushKV("dap", dap);
+
+    uint64_t lookups = st.cache_hit + st.cache_miss;
+    UniValue cache(UniValue::VOBJ);
+    cache.pushKV("hits", (uint64_t)st.cache_hit);
+    cache.pushKV("misses", (uint64_t)st.cache_miss);
+    cache.pushKV("hit_ratio", lookups ? (double)st.cache_hit / lookups : 0.0);
+    result.pushKV("cache", cache);
+
+    uint64_t answered = 0;
+    for (const auto& c : st.latency)
+        answered += c;
+    UniValue latency(UniValue::VOBJ);
+    latency.pushKV("avg", answered ? st.latency_sum / answered : 0);
+    latency.pushKV("p50", st.LatencyPercentile(50));
+    latency.pushKV("p90", st.LatencyPercentile(90));
+    latency.pushKV("p99", st.LatencyPercentile(99));
+    latency.pushKV("p999", st.LatencyPercentile(99.9));
+    result.pushKV("latency_us", latency);
+
+    return result;
+}
+
+// emercoin: apply changed -emcdnslocalcf file or allowed TLD list without restart
+static UniValue reloademcdns(const JSONRPCRequest& request)
+{
+    RPCHelpMan{"reloademcdns",
+    "\nRe-reads emcdns local names file (-emcdnslocalcf) and rebuilds allowed TLD-suffixes table.\n"
+    "Queries are served with old tables until new ones are ready. Answers cache is cleared.\n",
+    {
+        {"allowed", RPCArg::Type::STR, /* default */ "current list", "New allowed TLD-suffixes, in the -emcdnsallowed format"},
+    },
+    RPCResult{
+        "{\n"
+        "  \"allowed\": n,     (numeric) Allowed TLD-suffixes loaded\n"
+        "  \"local\": n        (numeric) Local names loaded\n"
+        "}\n"
+    },
+    RPCExamples{
+        HelpExampleCli("reloademcdns", "") + HelpExampleCli("reloademcdns", "\".coin|.emc|.lib|.bazar\"")
+        + HelpExampleRpc("reloademcdns", "")
+    },
+    }.Check(request);
+
+    if (!emcdns)
+        throw JSONRPCError(RPC_MISC_ERROR, "emcdns is not running, use -emcdns");
+
+    std::string allowed;
+    if (!request.params[0].isNull())
+        allowed = request.params[0].get_str();
+
+    std::shared_ptr<const EmcDnsTables> tables;
+    try {
+        tables = emcdns->Reload(request.params[0].isNull() ? nullptr : &allowed);
+    } catch (const std::invalid_argument& e) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, e.what());
+    } catch (const std::runtime_error& e) {
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, e.what());
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("allowed", tables->allowed_qty);
+    result.pushKV("local", tables->local_qty);
+    return result;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -795,6 +938,8 @@ static const CRPCCommand commands[] =
 
     // emercoin command
     { "network",            "getcheckpoint",          &getcheckpoint,          {} },
+    { "network",            "getemcdnsinfo",          &getemcdnsinfo,          {} },
+    { "network",            "reloademcdns",           &reloademcdns,           {"allowed"} },
 };
 // clang-format on
 
@@ -749,4 +749,40 @@ BOOST_AUTO_TEST_CASE(sha256d64)
     }
 }
 
+BOOST_AUTO_TEST_CASE(sha256d1)
+{
+    for (int i = 0; i <= 32; ++i) {
+        // Messages share 0..2 leading blocks, and end with up to 55 bytes, padded into one block
+        int prefix = i % 3;
+        unsigned char lead[64 * 2];
+        unsigned char in[64 * 32];
+        unsigned char out1[32 * 32], out2[32 * 32];
+        for (int j = 0; j < 64 * prefix; ++j) {
+            lead[j] = InsecureRandBits(8);
+        }
+        memset(in, 0, sizeof(in));
+        for (int j = 0; j < i; ++j) {
+            unsigned char* block = in + 64 * j;
+            int len = InsecureRandRange(56);
+            for (int k = 0; k < len; ++k) {
+                block[k] = InsecureRandBits(8);
+            }
+            CHash256().Write(lead, 64 * prefix).Write(block, len).Finalize(out1 + 32 * j);
+            uint64_t bits = (64 * prefix + len) * 8;
+            block[len] = 0x80;
+            for (int k = 0; k < 8; ++k) {
+                block[63 - k] = bits >> (8 * k);
+            }
+        }
+        uint32_t midstate[8];
+        SHA256Midstate(midstate, lead, prefix);
+        SHA256D1Midstate(out2, midstate, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+        if (prefix == 0) {
+            SHA256D1(out2, in, i);
+            BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,247 @@
+// Copyright (c) 2019 The Emercoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chain.h>
+#include <chainparams.h>
+#include <kernel.h>
+#include <sync.h>
+#include <util/system.h>
+#include <validation.h>
+#include <test/setup_common.h>
+
+#include <deque>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+struct KernelTestingSetup : public TestingSetup {
+    KernelTestingSetup() : TestingSetup(CBaseChainParams::REGTEST) {}
+};
+
+// Block index entries which are not in mapBlockIndex; hashes and entries keep their addresses
+struct TestChain {
+    std::deque<uint256> hashes;
+    std::deque<CBlockIndex> blocks;
+};
+
+// Appends nBlocks on top of pindexPrev (or a new root) about 10 minutes apart, with
+// up to an hour of jitter either way, so block times are not monotonic. A quarter of
+// blocks generate a stake modifier; the root always does.
+CBlockIndex* ExtendChain(TestChain& chain, CBlockIndex* pindexPrev, int nBlocks, int64_t nTime)
+{
+    for (int i = 0; i < nBlocks; i++) {
+        chain.hashes.push_back(InsecureRand256());
+        chain.blocks.emplace_back();
+        CBlockIndex& block = chain.blocks.back();
+        block.phashBlock = &chain.hashes.back();
+        block.pprev = pindexPrev;
+        block.nHeight = pindexPrev? pindexPrev->nHeight + 1 : 0;
+        nTime += 10 * 60;
+        block.nTime = nTime - 60 * 60 + InsecureRandRange(2 * 60 * 60);
+        bool fGenerated = pindexPrev == nullptr || InsecureRandBits(2) == 0;
+        block.SetStakeModifier(fGenerated? InsecureRandBits(64) : pindexPrev->nStakeModifier, fGenerated);
+        block.BuildSkip();
+        pindexPrev = &block;
+    }
+    return pindexPrev;
+}
+
+// Copies blocks of chain on top of pindexPrev, with the same hashes, times and modifiers
+CBlockIndex* CopyChain(TestChain& copy, const TestChain& chain, CBlockIndex* pindexPrev)
+{
+    for (const CBlockIndex& block : chain.blocks) {
+        copy.blocks.push_back(block);
+        CBlockIndex& c = copy.blocks.back();
+        c.pprev = pindexPrev;
+        c.BuildSkip();
+        pindexPrev = &c;
+    }
+    return pindexPrev;
+}
+
+// Blocks of test chains in mapBlockIndex, for lookups by hash; on exit, they are removed
+// and the active chain is reset to genesis. Called with cs_main held.
+struct BlockIndexGuard {
+    CBlockIndex* pindexGenesis;
+    std::vector<uint256> vHash;
+
+    BlockIndexGuard() : pindexGenesis(::ChainActive().Genesis()) {}
+    ~BlockIndexGuard() {
+        for (const uint256& hash : vHash)
+            ::BlockIndex().erase(hash);
+        ::ChainActive().SetTip(pindexGenesis);
+    }
+    void Add(TestChain& chain) {
+        for (CBlockIndex& block : chain.blocks) {
+            ::BlockIndex()[block.GetBlockHash()] = &block;
+            vHash.push_back(block.GetBlockHash());
+        }
+    }
+};
+
+// Modifier lookups along the active chain, which are served by the stake modifier cache, give
+// the same results as along pindexWalk, a copy of the active chain outside of it, which walk blocks
+void CheckModifierLookups(const CBlockIndex* pindexWalk)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    CBlockIndex* pindexTip = ::ChainActive().Tip();
+    BOOST_REQUIRE_EQUAL(pindexWalk->nHeight, pindexTip->nHeight);
+    std::vector<CBlockIndex*> vWalk(pindexTip->nHeight + 1);
+    for (const CBlockIndex* pindex = pindexWalk; pindex; pindex = pindex->pprev)
+        vWalk[pindex->nHeight] = const_cast<CBlockIndex*>(pindex);
+
+    for (int h = 1; h <= pindexTip->nHeight; h++) {
+        CBlockIndex* pindexActive = ::ChainActive()[h];
+        BOOST_REQUIRE(!::ChainActive().Contains(vWalk[h]));
+
+        uint64_t nModifier1 = 0, nModifier2 = 0;
+        int64_t nTime1 = 0, nTime2 = 0;
+        int nHeight1 = 0, nHeight2 = 0;
+        BOOST_CHECK_EQUAL(GetLastStakeModifier(pindexActive, nModifier1, nTime1), GetLastStakeModifier(vWalk[h], nModifier2, nTime2));
+        BOOST_CHECK_EQUAL(nModifier1, nModifier2);
+        BOOST_CHECK_EQUAL(nTime1, nTime2);
+
+        // V05: from the selection interval before the block time, up to min age after it
+        unsigned int nTimeTx = pindexActive->GetBlockTime() - 4 * 60 * 60 + InsecureRandRange(params.nStakeMinAge);
+        bool fFound = GetKernelStakeModifierV05(pindexActive, nTimeTx, nModifier1, nHeight1, nTime1);
+        BOOST_CHECK_EQUAL(fFound, GetKernelStakeModifierV05(vWalk[h], nTimeTx, nModifier2, nHeight2, nTime2));
+        if (fFound) {
+            BOOST_CHECK_EQUAL(nModifier1, nModifier2);
+            BOOST_CHECK_EQUAL(nHeight1, nHeight2);
+            BOOST_CHECK_EQUAL(nTime1, nTime2);
+        }
+
+        // V03: forward from the block up to the tip
+        fFound = GetKernelStakeModifierV03(pindexTip, pindexActive->GetBlockHash(), nModifier1, nHeight1, nTime1);
+        BOOST_CHECK_EQUAL(fFound, GetKernelStakeModifierV03(vWalk.back(), pindexActive->GetBlockHash(), nModifier2, nHeight2, nTime2));
+        if (fFound) {
+            BOOST_CHECK_EQUAL(nModifier1, nModifier2);
+            BOOST_CHECK_EQUAL(nHeight1, nHeight2);
+            BOOST_CHECK_EQUAL(nTime1, nTime2);
+        }
+    }
+}
+
+// Protocol V05 timestamps
+const int64_t TEST_TIME_START = 1600000000;
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(kernel_tests, KernelTestingSetup)
+
+// Batched scan of CreateCoinStake, single and multi-threaded, finds the same kernels
+// as CheckStakeKernelHash for each candidate and timestamp in turn
+BOOST_AUTO_TEST_CASE(scan_kernels)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    gArgs.ForceSetArg("-stakethreads", "4");
+
+    LOCK(cs_main);
+    TestChain chain;
+    CBlockIndex* pindexPrev = ExtendChain(chain, nullptr, 600, TEST_TIME_START);
+    const unsigned int nBits = 0x1e00ffff;
+    const unsigned int nSearchCount = 60;
+
+    size_t nHitsTotal = 0;
+    for (int round = 0; round < 8; round++) {
+        // Some rounds are too far from pindexPrev to resolve modifiers for all timestamps
+        KernelSearch search;
+        search.nTime = pindexPrev->GetBlockTime() + InsecureRandRange(params.nStakeMinAge);
+        search.bnTargetPerCoinDay.SetCompact(nBits);
+        search.vModifier.resize(nSearchCount);
+        for (unsigned int n = 0; n < nSearchCount; n++) {
+            int nStakeModifierHeight;
+            int64_t nStakeModifierTime;
+            search.vModifier[n].first = GetKernelStakeModifierV05(pindexPrev, search.nTime - n, search.vModifier[n].second, nStakeModifierHeight, nStakeModifierTime);
+        }
+
+        // Enough candidates for the threaded scan; some are too young, or newer than the timestamps
+        std::vector<KernelCandidate> vCandidates(1000);
+        for (KernelCandidate& c : vCandidates) {
+            c.prevout = COutPoint(InsecureRand256(), InsecureRandRange(4));
+            c.in.hashBlockFrom = InsecureRand256();
+            c.in.nTimeBlockFrom = search.nTime + nSearchCount - InsecureRandRange(params.nStakeMaxAge + params.nStakeMinAge);
+            c.in.nTxPrevOffset = 80 + InsecureRandRange(100000);
+            c.in.nTimeTxPrev = c.in.nTimeBlockFrom - InsecureRandRange(2 * 60 * 60);
+            c.in.txout.nValue = 1 + InsecureRandRange(10000 * COIN);
+        }
+
+        std::vector<std::pair<size_t, unsigned int> > vExpected;
+        for (size_t i = 0; i < vCandidates.size(); i++)
+            for (unsigned int n = 0; n < nSearchCount; n++) {
+                uint256 hashProofOfStake;
+                if (CheckStakeKernelHash(nBits, pindexPrev, vCandidates[i].in, vCandidates[i].prevout, search.nTime - n, hashProofOfStake)) {
+                    vExpected.emplace_back(i, n);
+                    break;
+                }
+            }
+
+        std::vector<std::pair<size_t, unsigned int> > vHits;
+        ScanKernelRange(search, vCandidates, 0, vCandidates.size(), vHits);
+        BOOST_CHECK(vHits == vExpected);
+
+        // Chunks of the range, as worker threads take them
+        vHits.clear();
+        for (size_t nBegin = 0; nBegin < vCandidates.size(); nBegin += 37)
+            ScanKernelRange(search, vCandidates, nBegin, std::min(nBegin + 37, vCandidates.size()), vHits);
+        BOOST_CHECK(vHits == vExpected);
+
+        vHits.clear();
+        ScanKernels(search, vCandidates, vHits);
+        BOOST_CHECK(vHits == vExpected);
+
+        nHitsTotal += vExpected.size();
+    }
+    BOOST_CHECK(nHitsTotal > 0);
+}
+
+// Stake modifier cache gives the same modifiers as block index walks, with block times out
+// of order, as blocks are connected one by one, disconnected, and replaced by another branch
+BOOST_AUTO_TEST_CASE(stake_modifier_cache)
+{
+    LOCK(cs_main);
+    TestChain chain, fork, chainWalk, forkWalk;
+    BlockIndexGuard guard;
+    CBlockIndex* pindexGenesis = ::ChainActive().Genesis();
+    CBlockIndex* pindexTip = ExtendChain(chain, pindexGenesis, 400, TEST_TIME_START);
+    CBlockIndex* pindexWalk = CopyChain(chainWalk, chain, pindexGenesis);
+    guard.Add(chain);
+
+    // Cache is built on the first lookup, then follows connected blocks
+    ::ChainActive().SetTip(pindexTip->GetAncestor(200));
+    CheckModifierLookups(pindexWalk->GetAncestor(200));
+    for (int h = 201; h <= pindexTip->nHeight; h++) {
+        ::ChainActive().SetTip(pindexTip->GetAncestor(h));
+        StakeModifierCacheConnect(pindexTip->GetAncestor(h));
+    }
+    CheckModifierLookups(pindexWalk);
+
+    // Disconnect to height 350 and connect the same blocks again
+    for (int h = pindexTip->nHeight; h > 350; h--) {
+        ::ChainActive().SetTip(pindexTip->GetAncestor(h - 1));
+        StakeModifierCacheDisconnect(pindexTip->GetAncestor(h));
+    }
+    CheckModifierLookups(pindexWalk->GetAncestor(350));
+    for (int h = 351; h <= pindexTip->nHeight; h++) {
+        ::ChainActive().SetTip(pindexTip->GetAncestor(h));
+        StakeModifierCacheConnect(pindexTip->GetAncestor(h));
+    }
+    CheckModifierLookups(pindexWalk);
+
+    // Reorganize to a longer branch from height 300
+    CBlockIndex* pindexFork = ExtendChain(fork, pindexTip->GetAncestor(300), 150, pindexTip->GetAncestor(300)->GetBlockTime());
+    CBlockIndex* pindexForkWalk = CopyChain(forkWalk, fork, pindexWalk->GetAncestor(300));
+    guard.Add(fork);
+    for (int h = pindexTip->nHeight; h > 300; h--) {
+        ::ChainActive().SetTip(pindexTip->GetAncestor(h - 1));
+        StakeModifierCacheDisconnect(pindexTip->GetAncestor(h));
+    }
+    for (int h = 301; h <= pindexFork->nHeight; h++) {
+        ::ChainActive().SetTip(pindexFork->GetAncestor(h));
+        StakeModifierCacheConnect(pindexFork->GetAncestor(h));
+    }
+    CheckModifierLookups(pindexForkWalk);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,303 @@
+// Copyright (c) 2019 The Emercoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chain.h>
+#include <hash.h>
+#include <key.h>
+#include <key_io.h>
+#include <namecoin.h>
+#include <streams.h>
+#include <validation.h>
+#include <test/setup_common.h>
+
+#include <map>
+#include <set>
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+// Name operations are only kept in history up to this size, unless the active chain is longer.
+// Read once by ApplyNameOps, so every test case of the suite sets it.
+const unsigned int TEST_CHAIN_SIZE = 3;
+
+struct NameIndexTestingSetup : public BasicTestingSetup {
+    NameIndexTestingSetup() {
+        gArgs.ForceSetArg("-nameindexchainsize", std::to_string(TEST_CHAIN_SIZE));
+        pNameDB = MakeUnique<CNameDB>(1 << 20, true, true);
+        pNameAddressDB = MakeUnique<CNameAddressDB>(1 << 20, true, true);
+        fNameAddressIndex = true;
+        nTxPos = 0;
+    }
+    ~NameIndexTestingSetup() {
+        fNameAddressIndex = false;
+        pNameAddressDB.reset();
+        pNameDB.reset();
+    }
+
+    unsigned int nTxPos;
+
+    // Name transaction in block file, as DisconnectNameOutput reads the previous operation from there
+    CTransactionRef MakeNameTx(int op, const std::string& name, const std::string& value, int nRentalDays, const CTxDestination& dest, CDiskTxPos& pos)
+    {
+        CMutableTransaction mtx;
+        mtx.nVersion = NAMECOIN_TX_VERSION;
+        mtx.nTime = GetTime();
+        mtx.vin.emplace_back(COutPoint(InsecureRand256(), 0));
+        CScript script;
+        if (op == OP_NAME_DELETE)
+            script << op << OP_DROP << toCNameVal(name) << OP_DROP;
+        else
+            script << op << OP_DROP << toCNameVal(name) << CScriptNum(nRentalDays).getvch() << OP_2DROP << toCNameVal(value) << OP_DROP;
+        script += GetScriptForDestination(dest);
+        mtx.vout.emplace_back(COIN, script);
+        CTransactionRef tx = MakeTransactionRef(mtx);
+
+        // Same layout as in a block: header, then transactions
+        pos = CDiskTxPos(FlatFilePos(0, nTxPos), 0);
+        CAutoFile file(OpenBlockFile(pos), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!file.IsNull());
+        file << CBlockHeader() << *tx;
+        nTxPos = ftell(file.Get());
+        return tx;
+    }
+};
+
+struct NameOp {
+    int op;
+    std::string name;
+    std::string value;
+    int nRentalDays;
+    CTxDestination dest;
+};
+
+// Connects name operations as a block at nHeight, like CheckNameTx and ConnectBlock do; returns the transactions
+std::vector<CTransactionRef> ConnectNames(NameIndexTestingSetup& setup, int nHeight, const std::vector<NameOp>& vOps)
+{
+    CBlockIndex index;
+    index.nHeight = nHeight;
+    std::vector<CTransactionRef> vtx;
+    std::vector<nameCheckResult> vName;
+    for (const NameOp& o : vOps) {
+        nameCheckResult r;
+        CTransactionRef tx = setup.MakeNameTx(o.op, o.name, o.value, o.nRentalDays, o.dest, r.nameOp.txPos);
+        r.nTime = tx->nTime;
+        r.name = toCNameVal(o.name);
+        r.op = o.op;
+        r.hash = tx->GetHash();
+        r.nameOp.nHeight = nHeight;
+        r.nameOp.value = toCNameVal(o.value);
+        r.nameOp.nOut = 0;
+        r.nameOp.nRentalDays = o.nRentalDays;
+        r.address = o.op != OP_NAME_DELETE ? EncodeDestination(o.dest) : "";
+        vName.push_back(r);
+        vtx.push_back(tx);
+    }
+    BOOST_REQUIRE(ConnectNameBlock(&index, vName));
+    return vtx;
+}
+
+// Disconnects transactions of a block, last first
+void DisconnectNames(const std::vector<CTransactionRef>& vtx)
+{
+    for (auto it = vtx.rbegin(); it != vtx.rend(); ++it)
+        BOOST_REQUIRE(DisconnectNameTx(*it, false));
+}
+
+// Everything of nameindex and nameaddress which does not depend on how the names got there
+struct NameIndexContents {
+    std::map<CNameVal, CNameState> mapState;
+    std::map<CNameVal, std::vector<CNameOperation> > mapHistory;
+
+    std::set<std::pair<CNameVal, CNameVal> > setByNamespace;
+    std::set<std::pair<int, CNameVal> > setByExpiry;
+    std::set<std::pair<int, CNameVal> > setByUpdate;
+    std::set<std::pair<std::string, CNameVal> > setByAddress;
+};
+
+// Reads both databases, checking that the history of each name matches its head, and
+// that secondary keys of nameindex and nameaddress are exactly the ones of name states
+NameIndexContents ReadNameIndex()
+{
+    NameIndexContents c;
+    std::set<std::pair<CNameVal, CNameVal> > setByNamespace;
+    std::set<std::pair<int, CNameVal> > setByExpiry;
+    std::set<std::pair<int, CNameVal> > setByUpdate;
+    std::map<CNameVal, unsigned int> mapOps;
+
+    std::unique_ptr<CDBIterator> pcursor(pNameDB->NewIterator());
+    for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+        char type;
+        BOOST_REQUIRE(pcursor->GetKey(type));
+        if (type == DB_NAME_STATE) {
+            std::pair<char, CNameVal> key;
+            CNameState state;
+            BOOST_REQUIRE(pcursor->GetKey(key) && pcursor->GetValue(state));
+            c.mapState[key.second] = state;
+        } else if (type == DB_NAME_OP) {
+            std::pair<char, std::pair<CNameVal, CNameOpPos> > key;
+            BOOST_REQUIRE(pcursor->GetKey(key));
+            mapOps[key.second.first]++;
+        } else if (type == DB_NAME_BY_NS) {
+            std::pair<char, std::pair<CNameVal, CNameVal> > key;
+            BOOST_REQUIRE(pcursor->GetKey(key));
+            setByNamespace.insert(key.second);
+        } else if (type == DB_NAME_BY_EXPIRY || type == DB_NAME_BY_UPDATE) {
+            std::pair<char, std::pair<CNameHeightKey, CNameVal> > key;
+            BOOST_REQUIRE(pcursor->GetKey(key));
+            (type == DB_NAME_BY_EXPIRY ? setByExpiry : setByUpdate).insert(std::make_pair(key.second.first.nHeight, key.second.second));
+        }
+    }
+
+    for (const auto& item : c.mapState) {
+        const CNameVal& name = item.first;
+        const CNameState& state = item.second;
+        CNameHead head;
+        BOOST_REQUIRE(pNameDB->ReadNameHead(name, head));
+        BOOST_CHECK_EQUAL(mapOps[name], head.nOps);
+        BOOST_CHECK_EQUAL(head.nExpiresAt, state.nExpiresAt);
+        BOOST_CHECK_EQUAL(head.active.nHeight, state.nRegisteredAt);
+        CNameRecord rec;
+        BOOST_REQUIRE(pNameDB->ReadName(name, rec));
+        BOOST_REQUIRE(!rec.vNameOp.empty());
+        BOOST_CHECK(rec.vNameOp.back().value == state.value);
+        BOOST_CHECK_EQUAL(rec.vNameOp.back().nHeight, state.nHeight);
+        BOOST_CHECK_EQUAL(rec.vNameOp.back().op, state.op);
+        c.mapHistory[name] = rec.vNameOp;
+
+        if (state.deleted()) {
+            BOOST_CHECK(state.address.empty());
+            continue;
+        }
+        c.setByNamespace.emplace(CNameDB::GetNamespace(name), name);
+        c.setByExpiry.emplace(state.nExpiresAt, name);
+        c.setByUpdate.emplace(state.nHeight, name);
+        c.setByAddress.emplace(state.address, name);
+    }
+    BOOST_CHECK(setByNamespace == c.setByNamespace);
+    BOOST_CHECK(setByExpiry == c.setByExpiry);
+    BOOST_CHECK(setByUpdate == c.setByUpdate);
+
+    std::set<std::pair<std::string, CNameVal> > setByAddress;
+    pcursor.reset(pNameAddressDB->NewIterator());
+    for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+        std::pair<char, std::pair<std::string, CNameVal> > key;
+        BOOST_REQUIRE(pcursor->GetKey(key));
+        BOOST_REQUIRE_EQUAL(key.first, DB_ADDRESS_NAME);
+        setByAddress.insert(key.second);
+    }
+    BOOST_CHECK(setByAddress == c.setByAddress);
+    return c;
+}
+
+void CheckSameNames(const NameIndexContents& a, const NameIndexContents& b)
+{
+    BOOST_CHECK_EQUAL(a.mapState.size(), b.mapState.size());
+    for (const auto& item : a.mapState) {
+        auto it = b.mapState.find(item.first);
+        BOOST_REQUIRE(it != b.mapState.end());
+        BOOST_CHECK(SerializeHash(item.second) == SerializeHash(it->second));
+    }
+    BOOST_CHECK(a.setByAddress == b.setByAddress);
+    BOOST_CHECK(a.setByExpiry == b.setByExpiry);
+    BOOST_CHECK(a.setByUpdate == b.setByUpdate);
+}
+
+CTxDestination RandomDestination()
+{
+    CKey key;
+    key.MakeNewKey(true);
+    return PKHash(key.GetPubKey());
+}
+} // namespace
+
+BOOST_FIXTURE_TEST_SUITE(nameindex_tests, NameIndexTestingSetup)
+
+// Name operations are appended with states and secondary keys in sync, and disconnecting
+// blocks in reverse order restores name states, histories and both indexes
+BOOST_AUTO_TEST_CASE(nameindex_connect_disconnect)
+{
+    CTxDestination addrA = RandomDestination(), addrB = RandomDestination();
+    std::vector<std::vector<NameOp> > vBlocks = {
+        {{OP_NAME_NEW, "dns:a", "v1", 30, addrA}, {OP_NAME_NEW, "b", "v1", 10, addrA}},
+        {{OP_NAME_UPDATE, "dns:a", "v2", 5, addrB}},
+        // several operations on a name in one block see each other through the batch overlay
+        {{OP_NAME_UPDATE, "b", "v2", 0, addrB}, {OP_NAME_DELETE, "b", "", 0, addrB}, {OP_NAME_NEW, "dns:c", "v1", 1, addrB}},
+        {{OP_NAME_DELETE, "dns:a", "", 0, addrB}},
+    };
+
+    std::vector<NameIndexContents> vBefore;
+    std::vector<std::vector<CTransactionRef> > vBlockTx;
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        vBefore.push_back(ReadNameIndex());
+        vBlockTx.push_back(ConnectNames(*this, 100 + i, vBlocks[i]));
+    }
+
+    NameIndexContents c = ReadNameIndex();
+    BOOST_CHECK_EQUAL(c.mapState.size(), 3U);
+    BOOST_CHECK(c.mapState[toCNameVal("dns:a")].deleted());
+    BOOST_CHECK(c.mapState[toCNameVal("b")].deleted());
+    BOOST_CHECK_EQUAL(c.mapHistory[toCNameVal("dns:a")].size(), 3U);
+    BOOST_CHECK_EQUAL(c.mapHistory[toCNameVal("b")].size(), 3U);
+    const CNameState& state = c.mapState[toCNameVal("dns:c")];
+    BOOST_CHECK(state.value == toCNameVal("v1"));
+    BOOST_CHECK_EQUAL(state.address, EncodeDestination(addrB));
+    BOOST_CHECK_EQUAL(state.nExpiresAt, 102 + 175);
+    BOOST_CHECK(c.setByNamespace == (std::set<std::pair<CNameVal, CNameVal> >{{toCNameVal("dns:"), toCNameVal("dns:c")}}));
+
+    std::vector<CNameVal> names;
+    BOOST_CHECK(pNameAddressDB->ScanAddress(EncodeDestination(addrA), names) && names.empty());
+    BOOST_CHECK(pNameAddressDB->ScanAddress(EncodeDestination(addrB), names) && names == std::vector<CNameVal>{toCNameVal("dns:c")});
+
+    for (size_t i = vBlocks.size(); i-- > 0; ) {
+        DisconnectNames(vBlockTx[i]);
+        NameIndexContents after = ReadNameIndex();
+        CheckSameNames(after, vBefore[i]);
+        for (const auto& item : vBefore[i].mapHistory)
+            BOOST_CHECK_EQUAL(after.mapHistory[item.first].size(), item.second.size());
+    }
+    BOOST_CHECK(ReadNameIndex().mapState.empty());
+}
+
+// History is trimmed to the chain size from the oldest operation, unless the active chain
+// is longer, and disconnecting the last operation restores the state before it
+BOOST_AUTO_TEST_CASE(nameindex_trim)
+{
+    CTxDestination addr = RandomDestination();
+    const CNameVal name = toCNameVal("trim");
+    int nHeight = 200;
+    ConnectNames(*this, nHeight++, {{OP_NAME_NEW, "trim", "v1", 1, addr}});
+    ConnectNames(*this, nHeight++, {{OP_NAME_UPDATE, "trim", "v2", 1, addr}});
+    ConnectNames(*this, nHeight++, {{OP_NAME_DELETE, "trim", "", 0, addr}});
+    BOOST_CHECK_EQUAL(ReadNameIndex().mapHistory[name].size(), TEST_CHAIN_SIZE);
+
+    // new active chain: the oldest operation is dropped
+    ConnectNames(*this, nHeight++, {{OP_NAME_NEW, "trim", "v3", 1, addr}});
+    NameIndexContents before = ReadNameIndex();
+    std::vector<CNameOperation> vHistory = before.mapHistory[name];
+    BOOST_REQUIRE_EQUAL(vHistory.size(), TEST_CHAIN_SIZE);
+    BOOST_CHECK(vHistory.front().value == toCNameVal("v2"));
+    BOOST_CHECK(vHistory.back().value == toCNameVal("v3"));
+
+    std::vector<CTransactionRef> vtx4 = ConnectNames(*this, nHeight++, {{OP_NAME_UPDATE, "trim", "v4", 1, addr}});
+    NameIndexContents c = ReadNameIndex();
+    BOOST_REQUIRE_EQUAL(c.mapHistory[name].size(), TEST_CHAIN_SIZE);
+    BOOST_CHECK_EQUAL(c.mapHistory[name].front().op, OP_NAME_DELETE);
+    BOOST_CHECK_EQUAL(c.mapState[name].nExpiresAt, 203 + 2 * 175);
+
+    // active chain is not trimmed
+    std::vector<CTransactionRef> vtx5 = ConnectNames(*this, nHeight++, {{OP_NAME_UPDATE, "trim", "v5", 1, addr}});
+    c = ReadNameIndex();
+    BOOST_CHECK_EQUAL(c.mapHistory[name].size(), TEST_CHAIN_SIZE + 1);
+    BOOST_CHECK_EQUAL(c.mapState[name].nRegisteredAt, 203);
+
+    // the state is restored, trimmed operations are not
+    DisconnectNames(vtx5);
+    DisconnectNames(vtx4);
+    c = ReadNameIndex();
+    CheckSameNames(c, before);
+    BOOST_CHECK_EQUAL(c.mapHistory[name].size(), TEST_CHAIN_SIZE - 1);
+    BOOST_CHECK_EQUAL(c.mapHistory[name].front().op, OP_NAME_DELETE);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 #include <coins.h>
 #include <core_io.h>
 #include <init.h>
+#include <kernel.h>
 #include <key_io.h>
 #include <node/transaction.h>
 #include <outputtype.h>
@@ -4138,6 +4139,92 @@ UniValue reservebalance(const JSONRPCRequest& request)
     return result;
 }
 
+// emercoin: staking forecast of the wallet coins
+UniValue getstakinginfo(const JSONRPCRequest& request)
+{
+    std::shared_ptr<CWallet> const wallet = GetWalletForJSONRPCRequest(request);
+    CWallet* const pwallet = wallet.get();
+
+    if (!EnsureWalletIsAvailable(pwallet, request.fHelp)) {
+        return NullUniValue;
+    }
+
+    RPCHelpMan{"getstakinginfo",
+        "\nReturns staking forecast of the wallet: weight, maturity and probability to mint of the coins.\n"
+        "The forecast is kept up to date in background on each new block after the first call.\n",
+        {
+            {"horizon", RPCArg::Type::NUM, /* default */ "1440", "forecast period, in minutes"},
+            {"verbose", RPCArg::Type::BOOL, /* default */ "false", "include the list of coins"},
+        },
+        RPCResult{
+            "{\n"
+            "  \"height\": nnn,             (numeric) the block height of the forecast\n"
+            "  \"time\": ttt,               (numeric) the time of the forecast\n"
+            "  \"bits\": \"xxxxxxxx\",        (string) the next proof-of-stake target\n"
+            "  \"horizon\": nnn,            (numeric) forecast period, in minutes\n"
+            "  \"coins\": nnn,              (numeric) number of mintable coins\n"
+            "  \"maturecoins\": nnn,        (numeric) number of coins over the minimal stake age\n"
+            "  \"nextmature\": ttt,         (numeric) time when the next coin becomes mature, 0 if none\n"
+            "  \"weight\": nnn,             (numeric) the total weight, in coin-days\n"
+            "  \"probability\": x.xxx,      (numeric) probability to mint within the horizon\n"
+            "  \"expectedtime\": nnn,       (numeric) expected time to mint at the current weight, in seconds; -1 if no weight\n"
+            "  \"utxos\": [                 (array, verbose only)\n"
+            "    {\n"
+            "      \"txid\": \"txid\",        (string) the transaction id\n"
+            "      \"vout\": n,             (numeric) the vout value\n"
+            "      \"amount\": x.xxx,       (numeric) the amount in " + CURRENCY_UNIT + "\n"
+            "      \"maturetime\": ttt,     (numeric) time when the minimal stake age is reached\n"
+            "      \"fullweighttime\": ttt, (numeric) time when the maximal stake age is reached\n"
+            "      \"weight\": nnn,         (numeric) the weight, in coin-days\n"
+            "      \"probability\": x.xxx,  (numeric) probability to mint within the horizon\n"
+            "      \"locked\": true|false   (boolean) locked by lockunspent\n"
+            "    }\n"
+            "    ,...\n"
+            "  ]\n"
+            "}\n"
+        },
+        RPCExamples{ HelpExampleCli("getstakinginfo", "") +
+                     HelpExampleCli("getstakinginfo", "60 true") +
+                     HelpExampleRpc("getstakinginfo", "60, true")},
+    }.Check(request);
+
+    int64_t nHorizon = request.params[0].isNull() ? 1440 : request.params[0].get_int64();
+    if (nHorizon <= 0 || nHorizon > 365 * 24 * 60)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "horizon is out of range");
+    bool fVerbose = request.params[1].isNull() ? false : request.params[1].get_bool();
+
+    std::shared_ptr<const StakeInfo> pinfo = GetStakeInfo(pwallet, nHorizon * 60);
+
+    UniValue result(UniValue::VOBJ);
+    result.pushKV("height", pinfo->nHeight);
+    result.pushKV("time", pinfo->nTime);
+    result.pushKV("bits", strprintf("%08x", pinfo->nBits));
+    result.pushKV("horizon", nHorizon);
+    result.pushKV("coins", (uint64_t)pinfo->vCoins.size());
+    result.pushKV("maturecoins", (uint64_t)pinfo->nMature);
+    result.pushKV("nextmature", pinfo->nNextMature);
+    result.pushKV("weight", pinfo->nWeight);
+    result.pushKV("probability", pinfo->dProbability);
+    result.pushKV("expectedtime", pinfo->nExpectedTime);
+    if (fVerbose) {
+        UniValue utxos(UniValue::VARR);
+        for (const StakeCoinInfo& coin : pinfo->vCoins) {
+            UniValue entry(UniValue::VOBJ);
+            entry.pushKV("txid", coin.prevout.hash.GetHex());
+            entry.pushKV("vout", (int)coin.prevout.n);
+            entry.pushKV("amount", ValueFromAmount(coin.nValue));
+            entry.pushKV("maturetime", coin.nTimeMature);
+            entry.pushKV("fullweighttime", coin.nTimeFullWeight);
+            entry.pushKV("weight", coin.nWeight);
+            entry.pushKV("probability", coin.dProbability);
+            entry.pushKV("locked", coin.fLocked);
+            utxos.push_back(entry);
+        }
+        result.pushKV("utxos", utxos);
+    }
+    return result;
+}
+
 UniValue abortrescan(const JSONRPCRequest& request); // in rpcdump.cpp
 UniValue dumpprivkey(const JSONRPCRequest& request); // in rpcdump.cpp
 UniValue importprivkey(const JSONRPCRequest& request);
@@ -4211,6 +4298,7 @@ static const CRPCCommand commands[] =
 
     // emercoin commands
     { "wallet",             "makekeypair",                      &makekeypair,                   {"prefix"} },
+    { "wallet",             "getstakinginfo",                   &getstakinginfo,                {"horizon", "verbose"} },
     { "wallet",             "reservebalance",                   &reservebalance,                {"reserve", "amount"} },
 };
 // clang-format on
@@ -1468,6 +1468,7 @@ void CWallet::BlockDisconnected(const CBlock& block) {
 void CWallet::UpdatedBlockTip()
 {
     m_best_block_time = GetTime();
+    UpdateStakeInfo(this);
 }
 
 
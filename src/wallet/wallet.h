@@ -104,6 +104,7 @@ class CWalletTx;
 struct FeeCalculation;
 enum class FeeEstimateMode;
 class ReserveDestination;
+class StakeCache;
 
 /** (client) version numbers for particular wallet features */
 enum WalletFeature
@@ -961,6 +962,7 @@ public:
     int64_t nOrderPosNext GUARDED_BY(cs_wallet) = 0;
     uint64_t nAccountingEntryNumber = 0;
     uint32_t m_nCommitCnt = 0; // Committed TXes through this wallet during current run
+    std::shared_ptr<StakeCache> m_stake_cache; // Staking coins, created by CreateCoinStake; guarded by cs_wallet
 
     std::map<CTxDestination, CAddressBookData> mapAddressBook GUARDED_BY(cs_wallet);
 